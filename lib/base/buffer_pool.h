@@ -0,0 +1,54 @@
+#pragma once
+
+#include "base/assert.h"
+#include "base/defs.h"
+
+#include <vector>
+
+namespace base {
+  // thread local pool of power of 2 sized byte buffers, from kMinSize to kMaxSize.
+  // used for temporary buffers whose size varies by traffic (eg. TcpSession's read buffer),
+  // so that growing/shrinking them does not hit malloc for each event.
+  class BufferPool {
+  public:
+    static constexpr size_t kMinShift = 12; // 4KB
+    static constexpr size_t kMaxShift = 18; // 256KB
+    static constexpr size_t kMinSize = 1 << kMinShift;
+    static constexpr size_t kMaxSize = 1 << kMaxShift;
+    static constexpr size_t kMaxFreeBuffers = 16; // for each size class
+  public:
+    // sz should be power of 2 between kMinSize and kMaxSize
+    static inline char *Alloc(size_t sz) {
+      auto &fl = free_lists_[Class(sz)];
+      if (fl.empty()) {
+        return new char[sz];
+      }
+      auto p = fl.back();
+      fl.pop_back();
+      return p;
+    }
+    static inline void Free(char *p, size_t sz) {
+      auto &fl = free_lists_[Class(sz)];
+      if (fl.size() >= kMaxFreeBuffers) {
+        delete []p;
+        return;
+      }
+      fl.push_back(p);
+    }
+  protected:
+    static inline size_t Class(size_t sz) {
+      ASSERT(sz >= kMinSize && sz <= kMaxSize && (sz & (sz - 1)) == 0);
+      return __builtin_ctzll(sz) - kMinShift;
+    }
+    struct FreeLists {
+      std::vector<char *> lists[kMaxShift - kMinShift + 1];
+      ~FreeLists() {
+        for (auto &fl : lists) {
+          for (auto p : fl) { delete []p; }
+        }
+      }
+      inline std::vector<char *> &operator[](size_t i) { return lists[i]; }
+    };
+    static inline thread_local FreeLists free_lists_;
+  };
+}
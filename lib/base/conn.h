@@ -13,5 +13,8 @@ namespace base {
     virtual void Close(Stream &) = 0;
     virtual int Send(Stream &, const char *, size_t, bool) = 0;
     virtual std::shared_ptr<Stream> OpenStream(const Stream::Config &) = 0;
+    // stream started to coalesce messages or FEC group. connection should call Stream::Flush at the end of
+    // current loop iteration. flushing here synchronously defeats coalescing (and emits FEC parity per message)
+    virtual void ScheduleFlush(Stream &s) = 0;
   };
 } // namespace qrpc
\ No newline at end of file
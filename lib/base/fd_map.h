@@ -0,0 +1,78 @@
+#pragma once
+
+#include "base/defs.h"
+#include "base/syscall.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace base {
+  // dense fd-indexed table. kernel allocates lowest available fd, so vector indexed by fd stays compact
+  // and lookup/insert/erase are O(1) without allocation once grown.
+  // iteration skips empty slot and is safe against erase of any entry (including current one) during iteration,
+  // which is required by SessionFactory::CheckSessionTimeout/FinSessions.
+  template <class T>
+  class FdMap {
+  public:
+    class iterator {
+    public:
+      iterator(const FdMap *m, Fd fd) : map_(m), kv_(fd, nullptr) { Skip(); }
+      inline bool operator==(const iterator &rhs) const { return kv_.first == rhs.kv_.first; }
+      inline bool operator!=(const iterator &rhs) const { return kv_.first != rhs.kv_.first; }
+      inline const std::pair<Fd, T*> &operator*() const { return kv_; }
+      inline const std::pair<Fd, T*> *operator->() const { return &kv_; }
+      inline iterator &operator++() { kv_.first++; Skip(); return *this; }
+      inline iterator operator++(int) { auto it = *this; ++(*this); return it; }
+    protected:
+      inline void Skip() {
+        auto &slots = map_->slots_;
+        while (kv_.first < (Fd)slots.size() && slots[kv_.first] == nullptr) {
+          kv_.first++;
+        }
+        if (kv_.first >= (Fd)slots.size()) {
+          kv_ = { map_->end_fd(), nullptr };
+        } else {
+          kv_.second = slots[kv_.first];
+        }
+      }
+    protected:
+      const FdMap *map_;
+      std::pair<Fd, T*> kv_;
+    };
+  public:
+    FdMap() {}
+    FdMap(FdMap &&rhs) : slots_(std::move(rhs.slots_)), size_(rhs.size_) { rhs.size_ = 0; }
+    inline size_t size() const { return size_; }
+    inline bool empty() const { return size_ == 0; }
+    inline iterator begin() const { return iterator(this, 0); }
+    inline iterator end() const { return iterator(this, end_fd()); }
+    inline T *find(Fd fd) const {
+      return (fd >= 0 && fd < (Fd)slots_.size()) ? slots_[fd] : nullptr;
+    }
+    inline void set(Fd fd, T *v) {
+      ASSERT(fd >= 0 && v != nullptr);
+      if (fd >= (Fd)slots_.size()) {
+        // grow geometrically to reduce reallocation on connection storm
+        slots_.resize(std::max((size_t)fd + 1, slots_.size() * 2), nullptr);
+      }
+      if (slots_[fd] == nullptr) {
+        size_++;
+      }
+      slots_[fd] = v;
+    }
+    inline void erase(Fd fd) {
+      if (fd >= 0 && fd < (Fd)slots_.size() && slots_[fd] != nullptr) {
+        slots_[fd] = nullptr;
+        size_--;
+      }
+    }
+  protected:
+    // end iterator is fixed sentinel so that growing slots_ during iteration does not break comparison
+    static constexpr Fd end_fd() { return std::numeric_limits<Fd>::max(); }
+  protected:
+    std::vector<T*> slots_;
+    size_t size_{0};
+  };
+}
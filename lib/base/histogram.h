@@ -0,0 +1,77 @@
+#pragma once
+
+#include "base/defs.h"
+#include "json.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace base {
+  using json = nlohmann::json;
+  // fixed size log-linear histogram for latency like values. each power of 2 range is divided into
+  // kSubBuckets linear buckets, so relative error is at most 1/kSubBuckets. recording is O(1) and never allocates.
+  class Histogram {
+  public:
+    static constexpr int kSubBucketBits = 3;
+    static constexpr int kSubBuckets = 1 << kSubBucketBits;
+    static constexpr int kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+  public:
+    Histogram() { Reset(); }
+    inline void Record(uint64_t v) {
+      counts_[Index(v)]++;
+      count_++;
+      sum_ += v;
+      min_ = std::min(min_, v);
+      max_ = std::max(max_, v);
+    }
+    inline void Reset() {
+      std::fill(counts_, counts_ + kBuckets, 0);
+      count_ = sum_ = max_ = 0;
+      min_ = UINT64_MAX;
+    }
+    inline uint64_t count() const { return count_; }
+    inline uint64_t min() const { return count_ > 0 ? min_ : 0; }
+    inline uint64_t max() const { return max_; }
+    inline uint64_t mean() const { return count_ > 0 ? sum_ / count_ : 0; }
+    // returns upper bound of the bucket that contains p-th percentile (0 < p <= 100)
+    uint64_t Percentile(double p) const {
+      if (count_ == 0) {
+        return 0;
+      }
+      uint64_t target = std::max<uint64_t>(1, (uint64_t)(count_ * p / 100.0 + 0.5)), acc = 0;
+      for (int i = 0; i < kBuckets; i++) {
+        if ((acc += counts_[i]) >= target) {
+          return std::min(UpperBound(i), max_);
+        }
+      }
+      return max_;
+    }
+    json ToJson() const {
+      return {
+        {"count",count()},{"min",min()},{"mean",mean()},{"max",max()},
+        {"p50",Percentile(50)},{"p90",Percentile(90)},{"p99",Percentile(99)},{"p999",Percentile(99.9)},
+      };
+    }
+  protected:
+    static inline int Index(uint64_t v) {
+      if (v < kSubBuckets) {
+        return (int)v;
+      }
+      // msb is at least kSubBucketBits here
+      int msb = 63 - __builtin_clzll(v);
+      int shift = msb - kSubBucketBits;
+      return ((shift + 1) << kSubBucketBits) + (int)((v >> shift) & (kSubBuckets - 1));
+    }
+    static inline uint64_t UpperBound(int idx) {
+      if (idx < kSubBuckets) {
+        return idx;
+      }
+      int shift = (idx >> kSubBucketBits) - 1;
+      uint64_t base = ((uint64_t)(kSubBuckets + (idx & (kSubBuckets - 1)))) << shift;
+      return base + ((1ULL << shift) - 1);
+    }
+  protected:
+    uint64_t counts_[kBuckets];
+    uint64_t count_, sum_, min_, max_;
+  };
+}
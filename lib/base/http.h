@@ -197,6 +197,19 @@ namespace base {
                 h, hsz, body, bsz
             );
         }
+        // body is shared with kernel and sent by MSG_ZEROCOPY if it is large enough
+        // (see TcpSessionFactory::Config::zerocopy_threshold). body is kept alive until kernel completes sending it
+        int Respond(http_result_code_t rc, Header *h, size_t hsz, std::shared_ptr<const char[]> body, size_t bsz) {
+            char buffer[256];
+            int r;
+            if ((r = WriteCommon(
+                buffer, snprintf(buffer, sizeof(buffer), "HTTP/1.1 %d\r\n", rc),
+                h, hsz, nullptr, 0
+            )) < 0) {
+                return r;
+            }
+            return WriteZeroCopy(body.get(), bsz, [body]() {});
+        }
         inline int WriteCommon(const char *first_line, size_t first_line_size,
             Header *h, size_t hsz, const char *body, size_t bsz) {
             // +2 for status line and body
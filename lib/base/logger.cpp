@@ -1,5 +1,12 @@
 #include "base/logger.h"
+#include "base/spsc.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <vector>
 #include <moodycamel/concurrentqueue.h>
 #if defined(NO_LOG_WRITE_CALLBACK)
 #include <iostream>
@@ -59,6 +66,231 @@ namespace logger {
   }
 #endif
 
+  // async backend
+  // json record, or format record if formatter is set
+  struct Entry {
+    json j;
+    format_record f;
+  };
+  static void write_format_record(const format_record &r) {
+    char buffer[4096];
+    r.formatter(r, buffer, sizeof(buffer));
+    json j = buffer;
+    if (r.suppressed > 0 || r.lv >= level::debug) {
+      j = {
+        {"ev", std::move(j)},
+      };
+    }
+    if (r.suppressed > 0) {
+      j["_suppressed"] = r.suppressed;
+    }
+    if (r.lv >= level::debug) {
+      fill_props(r.lv, r.sec, r.nsec, j);
+      j["_at"] = std::string(r.file) + ":" + std::to_string(r.line);
+      j["_fn"] = r.func;
+    }
+    write(j);
+  }
+  struct Ring {
+    Ring(size_t size) : queue(size) {}
+    SpscQueue<Entry> queue;
+    std::atomic<bool> orphaned{false}; // owner thread exited
+    std::atomic<uint64_t> dropped{0};
+    uint64_t reported{0}; // only touched by background thread
+  };
+  struct RingHolder {
+    Ring *ring{nullptr};
+    // background thread deletes the ring after writing remaining records
+    ~RingHolder() { if (ring != nullptr) { ring->orphaned.store(true, std::memory_order_release); } }
+  };
+  class AsyncWriter {
+  public:
+    // records are written as soon as the writer is woken up. the timeout only bounds
+    // how long rings of exited threads and dropped counts stay unprocessed while idle
+    static constexpr auto kIdleTimeout = std::chrono::milliseconds(100);
+    ~AsyncWriter() { Stop(); }
+    void Start() {
+      std::lock_guard<std::mutex> lock(mtx_);
+      if (thread_.joinable()) {
+        return;
+      }
+      alive_ = true;
+      thread_ = std::thread([this]() { Run(); });
+    }
+    void Stop() {
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!thread_.joinable()) {
+          return;
+        }
+        alive_ = false;
+      }
+      cv_.notify_one();
+      thread_.join();
+    }
+    Ring *Register(size_t size) {
+      auto r = new Ring(size);
+      std::lock_guard<std::mutex> lock(mtx_);
+      rings_.push_back(r);
+      return r;
+    }
+    // called by logging threads after a record is pushed. only the first call after the writer
+    // went to sleep takes the lock, so that logging threads do not contend while the writer is busy
+    inline void Wake() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!sleeping_.load(std::memory_order_relaxed) || !sleeping_.exchange(false)) {
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        woken_ = true;
+      }
+      cv_.notify_one();
+    }
+    uint64_t dropped() {
+      uint64_t total = 0;
+      std::lock_guard<std::mutex> lock(mtx_);
+      for (auto r : rings_) {
+        total += r->dropped.load(std::memory_order_relaxed);
+      }
+      return total + dropped_of_exited_;
+    }
+  protected:
+    void Run() {
+      std::vector<Ring *> rings, exited;
+      while (true) {
+        bool alive;
+        {
+          std::lock_guard<std::mutex> lock(mtx_);
+          alive = alive_;
+          rings = rings_;
+        }
+        // records are serialized and written without mtx_, so that Register() on other threads is not blocked by I/O.
+        // rings are only deleted by this thread, so the snapshot stays valid
+        size_t n = 0;
+        for (auto r : rings) {
+          // check orphaned before draining, so that records pushed before exit are not lost
+          bool orphaned = r->orphaned.load(std::memory_order_acquire);
+          Entry e;
+          while (r->queue.pop(e)) {
+            if (e.f.formatter != nullptr) {
+              write_format_record(e.f);
+            } else {
+              write(e.j);
+            }
+            n++;
+          }
+          auto dropped = r->dropped.load(std::memory_order_relaxed);
+          if (dropped > r->reported) {
+            json w = {{"ev","log records dropped"},{"count",dropped - r->reported}};
+            fill_props(level::warn, w);
+            write(w);
+            r->reported = dropped;
+          }
+          if (orphaned) {
+            exited.push_back(r);
+          }
+        }
+        if (!exited.empty()) {
+          std::lock_guard<std::mutex> lock(mtx_);
+          for (auto r : exited) {
+            dropped_of_exited_ += r->dropped.load(std::memory_order_relaxed);
+            rings_.erase(std::find(rings_.begin(), rings_.end(), r));
+            delete r;
+          }
+          exited.clear();
+        }
+        if (!alive) {
+          break;
+        }
+        if (n == 0) {
+          Sleep();
+        }
+      }
+    }
+    void Sleep() {
+      std::unique_lock<std::mutex> lock(mtx_);
+      sleeping_.store(true);
+      // pairs with the fence in Wake(). record pushed before logging thread sees sleeping_ is found here
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      for (auto r : rings_) {
+        if (r->queue.size() > 0) {
+          sleeping_.store(false);
+          return;
+        }
+      }
+      cv_.wait_for(lock, kIdleTimeout, [this]() { return woken_ || !alive_; });
+      woken_ = false;
+      sleeping_.store(false);
+    }
+  protected:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::thread thread_;
+    std::vector<Ring *> rings_;
+    uint64_t dropped_of_exited_{0};
+    bool alive_{false}, woken_{false};
+    std::atomic<bool> sleeping_{false};
+  };
+  static AsyncWriter async_writer_;
+  std::atomic<bool> async_{false};
+  static bool async_drop_on_full_ = false;
+  static size_t async_ring_size_ = 0;
+  static thread_local RingHolder ring_holder_;
+  static inline Ring *ring() {
+    if (ring_holder_.ring == nullptr) {
+      ring_holder_.ring = async_writer_.Register(async_ring_size_);
+    }
+    return ring_holder_.ring;
+  }
+  void configure_async(size_t ring_size, bool drop_on_full) {
+    async_ring_size_ = ring_size;
+    async_drop_on_full_ = drop_on_full;
+    async_writer_.Start();
+    async_.store(true, std::memory_order_release);
+  }
+  void shutdown_async() {
+    async_.store(false, std::memory_order_release);
+    async_writer_.Stop();
+  }
+  uint64_t dropped() { return async_writer_.dropped(); }
+
+  void write(json &&j) {
+    if (is_async()) {
+      auto r = ring();
+      Entry e;
+      e.j = std::move(j);
+      if (r->queue.push(std::move(e))) {
+        async_writer_.Wake();
+        return;
+      }
+      // push does not move from e on failure
+      j = std::move(e.j);
+      r->dropped.fetch_add(1, std::memory_order_relaxed);
+      if (async_drop_on_full_) {
+        return;
+      }
+      // fallback to synchronous write. order of records might be changed
+    }
+    write(static_cast<const json &>(j));
+  }
+
+  void write(format_record &&f) {
+    auto r = ring();
+    Entry e;
+    e.f = f;
+    if (r->queue.push(std::move(e))) {
+      async_writer_.Wake();
+      return;
+    }
+    r->dropped.fetch_add(1, std::memory_order_relaxed);
+    if (async_drop_on_full_) {
+      return;
+    }
+    // fallback to synchronous write. order of records might be changed
+    write_format_record(f);
+  }
+
   void write(const json &j) {
     mtx_.lock();
 #if defined(NO_LOG_WRITE_CALLBACK)
@@ -74,6 +306,21 @@ namespace logger {
     mtx_.unlock();
   }
 
+  // filters are destroyed on thread exit without unlinking, but the list is never walked after that
+  static thread_local Filter *filters_ = nullptr;
+  void Filter::link() {
+    next_ = filters_;
+    filters_ = this;
+  }
+  void report_suppressed() {
+    for (auto f = filters_; f != nullptr; f = f->next()) {
+      auto n = f->TakeSuppressed();
+      if (n > 0 && is_enabled(f->lv())) {
+        log(f->lv(), f->file(), f->line(), f->func(), 0, {{"ev","log records suppressed"},{"_suppressed",n}});
+      }
+    }
+  }
+
   thread_local char buffer[64 + 1];
   static constexpr char hex[] = "0123456789abcdef";
   const char *hexdump(const void *p, size_t len) {
@@ -5,6 +5,11 @@
 #include "base/timespec.h"
 #include "base/macros.h"
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <tuple>
+#include <type_traits>
 
 namespace base {
 using json = nlohmann::json;
@@ -24,25 +29,155 @@ namespace logger {
   //non inline methods
   extern const std::string log_level_descs_[static_cast<size_t>(level::max)];
   extern level log_level_;
+  extern std::atomic<bool> async_;
   typedef void (*writer_cb_t)(const char *, size_t);
   void configure(writer_cb_t cb, const std::string &ns, bool manual_flush, level llv);
+  // enable asynchronous backend. each thread pushes log records to its own lock-free ring,
+  // and background thread serializes and writes them. if ring is full, record is dropped when drop_on_full is true,
+  // otherwise written synchronously. dropped count is reported as a log record by background thread.
+  void configure_async(size_t ring_size, bool drop_on_full);
+  // stop background thread after writing all queued records
+  void shutdown_async();
+  uint64_t dropped();
   const std::string &ns();
   void write(const json &j);
+  // j might be moved to the ring of async backend
+  void write(json &&j);
   void flush();
   const char *hexdump(const void *p, size_t len);
   inline bool is_enabled(level lv) { return lv >= log_level_; }
+  inline bool is_async() { return async_.load(std::memory_order_relaxed); }
 
-  // common log properties
-  inline void fill_props(level lv, json &j) {
-    //fill default properties
+  // compact record of printf style log for async backend. calling thread only copies the arguments
+  // (and contents of string arguments), then background thread formats it and builds json record.
+  // formatter is instantiated for each argument types, and works as format id of the record.
+  // fmt, file and func are not copied, so they should be string literals (as log macros give)
+  struct format_record {
+    static constexpr size_t kArgsSize = 192;
+    typedef void (*formatter_t)(const format_record &, char *, size_t);
+    formatter_t formatter{nullptr};
+    level lv;
+    int line;
+    const char *file, *func, *fmt;
     long sec, nsec;
-    clock::now(sec, nsec);
+    uint64_t suppressed;
+    alignas(8) char args[kArgsSize];
+  };
+  // push r to the ring of async backend. if the ring is full, r is dropped or written synchronously
+  void write(format_record &&r);
+  namespace detail {
+    // packs printf arguments into format_record::args, in order
+    template<class T> struct format_arg {
+      static_assert(std::is_trivially_copyable<T>::value, "printf style log argument should be trivially copyable");
+      static inline bool store(char *p, size_t &ofs, T v) {
+        ofs = (ofs + alignof(T) - 1) & ~(alignof(T) - 1);
+        if ((ofs + sizeof(T)) > format_record::kArgsSize) {
+          return false;
+        }
+        memcpy(p + ofs, &v, sizeof(T));
+        ofs += sizeof(T);
+        return true;
+      }
+      static inline T load(const char *p, size_t &ofs) {
+        T v;
+        ofs = (ofs + alignof(T) - 1) & ~(alignof(T) - 1);
+        memcpy(&v, p + ofs, sizeof(T));
+        ofs += sizeof(T);
+        return v;
+      }
+    };
+    // string argument may be freed after log call, so its content is copied with 2 byte length
+    template<> struct format_arg<const char *> {
+      static constexpr uint16_t kNull = 0xffff;
+      static inline bool store(char *p, size_t &ofs, const char *v) {
+        auto room = format_record::kArgsSize - std::min(ofs + sizeof(uint16_t), format_record::kArgsSize);
+        size_t len = v == nullptr ? 0 : strnlen(v, room);
+        if (len >= room) {
+          return false;
+        }
+        uint16_t h = v == nullptr ? kNull : static_cast<uint16_t>(len);
+        memcpy(p + ofs, &h, sizeof(h));
+        ofs += sizeof(h);
+        if (v != nullptr) {
+          memcpy(p + ofs, v, len + 1);
+          ofs += len + 1;
+        }
+        return true;
+      }
+      static inline const char *load(const char *p, size_t &ofs) {
+        uint16_t h;
+        memcpy(&h, p + ofs, sizeof(h));
+        ofs += sizeof(h);
+        if (h == kNull) {
+          return nullptr;
+        }
+        auto v = p + ofs;
+        ofs += h + 1;
+        return v;
+      }
+    };
+    template<> struct format_arg<char *> : public format_arg<const char *> {};
+    template<class... Args>
+    void format(const format_record &r, char *buf, size_t sz) {
+      size_t ofs = 0;
+      // braced initialization loads arguments in the order they are packed
+      std::tuple<decltype(format_arg<Args>::load(r.args, ofs))...> a{format_arg<Args>::load(r.args, ofs)...};
+      std::apply([&r, buf, sz](auto... v) {
+        DISABLE_FORMAT_SECURITY_WARNING_PUSH
+        snprintf(buf, sz, r.fmt, v...);
+        DISABLE_FORMAT_SECURITY_WARNING_POP
+      }, a);
+    }
+  }
+  // true if fmt is string literal, which can be referred by format_record after the log call
+  template<class F>
+  constexpr bool is_literal_format() {
+    typedef std::remove_reference_t<F> T;
+    return std::is_array<T>::value && std::is_const<std::remove_extent_t<T>>::value;
+  }
+  // returns false if async backend is disabled or arguments do not fit in format_record. then caller formats it.
+  // formats with '*' are not captured, because "%.*s" argument is not necessarily null terminated
+  template<class... Args>
+  inline bool write_format(
+    level lv, const char *file, int line, const char *func, uint64_t suppressed,
+    const char *fmt, const Args... args
+  ) {
+    if (!is_async() || (sizeof...(Args) > 0 && strchr(fmt, '*') != nullptr)) {
+      return false;
+    }
+    format_record r;
+    size_t ofs = 0;
+    bool packed = true;
+    ((packed = packed && detail::format_arg<Args>::store(r.args, ofs, args)), ...);
+    if (!packed) {
+      return false;
+    }
+    r.formatter = detail::format<Args...>;
+    r.lv = lv;
+    r.line = line;
+    r.file = file;
+    r.func = func;
+    r.fmt = fmt;
+    r.suppressed = suppressed;
+    clock::now(r.sec, r.nsec);
+    write(std::move(r));
+    return true;
+  }
+
+  // common log properties
+  inline void fill_props(level lv, long sec, long nsec, json &j) {
     char tsbuff[32];
     snprintf(tsbuff, sizeof(tsbuff), "%ld.%09ld", sec, nsec);
     j["__ts"] = tsbuff; //((double)sec) + (((double)nsec) / (1000 * 1000 * 1000));
     j["__lv"] = log_level_descs_[static_cast<size_t>(lv)];
     j["__ns"] = ns();
   }
+  inline void fill_props(level lv, json &j) {
+    //fill default properties
+    long sec, nsec;
+    clock::now(sec, nsec);
+    fill_props(lv, sec, nsec, j);
+  }
 
   inline void fill_props(
     level lv,
@@ -60,54 +195,53 @@ namespace logger {
   }
 
   //log variadic funcs
-  inline void log(level lv, const json &j) {
+  //record is taken by value, because default properties are added to it and it is moved to the writer.
+  //records written as braced initializer are constructed in place, so no copy is made for them.
+  inline void log(level lv, json j) {
     ASSERT(j.is_object() || j.is_string());
     if (!is_enabled(lv)) {
       return;
     }
     if (lv >= level::debug) {
-      json &mj = const_cast<json &>(j);
       if (j.is_string()) {
-        mj = {
-          {"ev", j},
+        j = {
+          {"ev", std::move(j)},
         };
       }
       //fill default properties
-      fill_props(lv, mj);
-      write(mj);
-    } else {
-      write(j);
+      fill_props(lv, j);
     }
+    write(std::move(j));
   }
 
   inline void log(
     level lv, const std::string &file, int line, const std::string &func, uint64_t trace_id,
-    const json &j
+    json j
   ) {
     ASSERT(j.is_object() || j.is_string());
     if (!is_enabled(lv)) {
       return;
     }
     if (lv >= level::debug) {
-      json &mj = const_cast<json &>(j);
       if (j.is_string()) {
-        mj = {
-          {"ev", j},
+        j = {
+          {"ev", std::move(j)},
         };
       }
       //fill default properties
-      fill_props(lv, file, line, func, trace_id, mj);
-      write(mj);
-    } else {
-      write(j);
+      fill_props(lv, file, line, func, trace_id, j);
     }
+    write(std::move(j));
   }
 
-  template<class... Args>
+  template<class F, class... Args>
   inline void tracef(
-    level lv, const std::string &file, int line, const std::string &func, uint64_t trace_id,
-    const char *fmt, const Args... args
+    level lv, const char *file, int line, const char *func, uint64_t trace_id,
+    F &&fmt, const Args... args
   ) {
+      if (is_literal_format<F>() && trace_id == 0 && write_format(lv, file, line, func, 0, fmt, args...)) {
+        return;
+      }
       char buffer[4096];
       DISABLE_FORMAT_SECURITY_WARNING_PUSH
       snprintf(buffer, sizeof(buffer), fmt, args...);
@@ -117,9 +251,9 @@ namespace logger {
 
   inline void trace(
     level lv, const std::string &file, int line, const std::string &func, uint64_t trace_id,
-    const json &j
+    json j
   ) {
-      log(lv, file, line, func, trace_id, j);
+      log(lv, file, line, func, trace_id, std::move(j));
   }
 
   template<class... Args>
@@ -134,26 +268,152 @@ namespace logger {
   }
 
   //short hands for each severity
-  inline void debug(const json &j) { log(level::debug, j); }
-  inline void info(const json &j) { log(level::info, j); }
-  inline void warn(const json &j) { log(level::warn, j); }
-  inline void error(const json &j) { log(level::error, j); }
-  inline void fatal(const json &j) { log(level::fatal, j); }
-  inline void report(const json &j) { log(level::report, j); }
-  [[noreturn]] inline void die(const json &j, int exit_code = 1) {
-    fatal(j);
+  inline void debug(json j) { log(level::debug, std::move(j)); }
+  inline void info(json j) { log(level::info, std::move(j)); }
+  inline void warn(json j) { log(level::warn, std::move(j)); }
+  inline void error(json j) { log(level::error, std::move(j)); }
+  inline void fatal(json j) { log(level::fatal, std::move(j)); }
+  inline void report(json j) { log(level::report, std::move(j)); }
+  [[noreturn]] inline void die(json j, int exit_code = 1) {
+    fatal(std::move(j));
     ASSERT(false);
     exit(exit_code);
   }
+
+  // state of filtered call site. records suppressed since last emitted one are reported with next emitted record
+  // as "_suppressed", or by report_suppressed() if the site does not log again.
+  // filters are thread local, and linked to the list of the thread on first use.
+  class Filter {
+  public:
+    inline void Bind(level lv, const char *file, int line, const char *func) {
+      if (UNLIKELY(file_ == nullptr)) {
+        lv_ = lv;
+        file_ = file;
+        line_ = line;
+        func_ = func;
+        link();
+      }
+    }
+    inline uint64_t TakeSuppressed() {
+      auto n = suppressed_;
+      suppressed_ = 0;
+      return n;
+    }
+    inline level lv() const { return lv_; }
+    inline const char *file() const { return file_; }
+    inline int line() const { return line_; }
+    inline const char *func() const { return func_; }
+    inline Filter *next() const { return next_; }
+  protected:
+    void link();
+  protected:
+    level lv_{level::max};
+    const char *file_{nullptr}, *func_{nullptr};
+    int line_{0};
+    uint64_t suppressed_{0};
+    Filter *next_{nullptr};
+  };
+  // token bucket for per call site rate limiting. allows burst records at once, then rate records per second.
+  class RateLimiter : public Filter {
+  public:
+    RateLimiter(double rate, double burst) : rate_(rate), burst_(burst), tokens_(burst), last_(clock::now()) {}
+    inline bool Allow(uint64_t &suppressed) {
+      auto now = clock::now();
+      tokens_ = std::min(burst_, tokens_ + (rate_ * (now - last_) / (1000.0 * 1000 * 1000)));
+      last_ = now;
+      if (tokens_ < 1.0) {
+        suppressed_++;
+        return false;
+      }
+      tokens_ -= 1.0;
+      suppressed = TakeSuppressed();
+      return true;
+    }
+  private:
+    double rate_, burst_, tokens_;
+    qrpc_time_t last_;
+  };
+  // emits 1 record for every n calls
+  class Sampler : public Filter {
+  public:
+    Sampler(uint64_t n) : n_(n > 0 ? n : 1) {}
+    inline bool Allow(uint64_t &suppressed) {
+      if (((count_++) % n_) != 0) {
+        suppressed_++;
+        return false;
+      }
+      suppressed = TakeSuppressed();
+      return true;
+    }
+  private:
+    uint64_t n_, count_{0};
+  };
+  // interval of report_suppressed() called by Loop
+  constexpr qrpc_time_t kSuppressedReportInterval = 10ULL * 1000 * 1000 * 1000; // 10s
+  // emits a record for each filtered call site of calling thread that has suppressed records not reported yet
+  void report_suppressed();
+  inline void trace_suppressed(
+    level lv, const std::string &file, int line, const std::string &func, uint64_t suppressed,
+    json &&j
+  ) {
+    if (suppressed > 0) {
+      if (j.is_string()) {
+        j = {
+          {"ev", std::move(j)},
+        };
+      }
+      j["_suppressed"] = suppressed;
+    }
+    log(lv, file, line, func, 0, std::move(j));
+  }
+  template<class F, class... Args>
+  inline void tracef_suppressed(
+    level lv, const char *file, int line, const char *func, uint64_t suppressed,
+    F &&fmt, const Args... args
+  ) {
+      if (is_literal_format<F>() && write_format(lv, file, line, func, suppressed, fmt, args...)) {
+        return;
+      }
+      char buffer[4096];
+      DISABLE_FORMAT_SECURITY_WARNING_PUSH
+      snprintf(buffer, sizeof(buffer), fmt, args...);
+      DISABLE_FORMAT_SECURITY_WARNING_POP
+      trace_suppressed(lv, file, line, func, suppressed, buffer);
+  }
 }
 }
 
-#define QRPC_LOG(level__, ...) { ::base::logger::tracef(::base::logger::level::level__, __FILE__, __LINE__, __func__, 0, __VA_ARGS__); }
-#define QRPC_LOGJ(level__, ...) { ::base::logger::trace(::base::logger::level::level__, __FILE__, __LINE__, __func__, 0, __VA_ARGS__); }
-#define QRPC_LOGVJ(level_value__, ...) { ::base::logger::trace(level_value__, __FILE__, __LINE__, __func__, 0, __VA_ARGS__); }
+// log macros check level before evaluating arguments, so that disabled log costs only one branch.
+// (no json record construction and no argument formatting)
+#define QRPC_LOG_ENABLED(level__) (::base::logger::is_enabled(::base::logger::level::level__))
+#define QRPC_LOG(level__, ...) { if (QRPC_LOG_ENABLED(level__)) { \
+  ::base::logger::tracef(::base::logger::level::level__, __FILE__, __LINE__, __func__, 0, __VA_ARGS__); } }
+#define QRPC_LOGJ(level__, ...) { if (QRPC_LOG_ENABLED(level__)) { \
+  ::base::logger::trace(::base::logger::level::level__, __FILE__, __LINE__, __func__, 0, __VA_ARGS__); } }
+#define QRPC_LOGVJ(level_value__, ...) { if (::base::logger::is_enabled(level_value__)) { \
+  ::base::logger::trace(level_value__, __FILE__, __LINE__, __func__, 0, __VA_ARGS__); } }
+// rate limited log for per packet diagnostics. each call site (and each thread) has its own token bucket
+// which allows rate__ records per second, with burst of same size.
+#define QRPC_LOG_FILTERED__(level__, filter_type__, filter_args__, fn__, ...) { if (QRPC_LOG_ENABLED(level__)) { \
+  static thread_local ::base::logger::filter_type__ __log_filter filter_args__; uint64_t __suppressed = 0; \
+  __log_filter.Bind(::base::logger::level::level__, __FILE__, __LINE__, __func__); \
+  if (__log_filter.Allow(__suppressed)) { \
+    ::base::logger::fn__(::base::logger::level::level__, __FILE__, __LINE__, __func__, __suppressed, __VA_ARGS__); \
+  } } }
+#define QRPC_LOG_RATELIMIT(level__, rate__, ...) \
+  QRPC_LOG_FILTERED__(level__, RateLimiter, (rate__, rate__), tracef_suppressed, __VA_ARGS__)
+#define QRPC_LOGJ_RATELIMIT(level__, rate__, ...) \
+  QRPC_LOG_FILTERED__(level__, RateLimiter, (rate__, rate__), trace_suppressed, __VA_ARGS__)
+// sampled log. emits 1 record for every n__ calls
+#define QRPC_LOG_SAMPLED(level__, n__, ...) \
+  QRPC_LOG_FILTERED__(level__, Sampler, (n__), tracef_suppressed, __VA_ARGS__)
+#define QRPC_LOGJ_SAMPLED(level__, n__, ...) \
+  QRPC_LOG_FILTERED__(level__, Sampler, (n__), trace_suppressed, __VA_ARGS__)
+// default rate for per packet diagnostics
+#define QRPC_LOG_PACKET_RATE (10)
 #if defined(VERBOSE)
-  #define QRPC_VLOG(level__, ...) { ::base::logger::tracef(::base::logger::level::level__, __FILE__, __LINE__, __func__, 0, __VA_ARGS__); } 
-  #define QRPC_VLOGJ(level__, ...) { ::base::logger::trace(::base::logger::level::level__, __FILE__, __LINE__, __func__, 0, __VA_ARGS__); } 
+  #define QRPC_VLOG(level__, ...) QRPC_LOG(level__, __VA_ARGS__)
+  #define QRPC_VLOGJ(level__, ...) QRPC_LOGJ(level__, __VA_ARGS__)
 #else
   #define QRPC_VLOG(level__, ...)
   #define QRPC_VLOGJ(level__, ...)  
@@ -161,7 +421,7 @@ namespace logger {
 
 #if !defined(TRACE)
   #if !defined(NDEBUG)
-    #define TRACE(...) { ::base::logger::tracef(::base::logger::level::trace, __FILE__, __LINE__, __func__, 0, __VA_ARGS__); }
+    #define TRACE(...) QRPC_LOG(trace, __VA_ARGS__)
   #else
     #define TRACE(...) // fprintf(stderr, __VA_ARGS__)
   #endif
@@ -169,7 +429,7 @@ namespace logger {
 
 #if !defined(TRACEJ)
   #if !defined(NDEBUG)
-    #define TRACEJ(...) { ::base::logger::trace(::base::logger::level::trace, __FILE__, __LINE__, __func__, 0, __VA_ARGS__); }
+    #define TRACEJ(...) QRPC_LOGJ(trace, __VA_ARGS__)
   #else
     #define TRACEJ(...) // fprintf(stderr, __VA_ARGS__)
   #endif
@@ -177,7 +437,7 @@ namespace logger {
 
 #if !defined(TRACK)
   #if !defined(NDEBUG) && defined(QRPC_ENABLE_TRACK)
-    #define TRACK(...) { ::base::logger::tracef(::base::logger::level::debug, __FILE__, __LINE__, __func__, 0, "track"); }
+    #define TRACK(...) QRPC_LOG(debug, "track")
   #else
     #define TRACK(...) // fprintf(stderr, __VA_ARGS__)
   #endif
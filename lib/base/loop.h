@@ -38,6 +38,11 @@ public:
       return QRPC_EALLOC;
     }
     memset(processors_, 0, sizeof(IoProcessor*) * max_nfd_);
+    // records suppressed by rate limited or sampled log sites are reported even if the site does not log again
+    timer_.Set([]() {
+      logger::report_suppressed();
+      return qrpc_time_now() + logger::kSuppressedReportInterval;
+    }, qrpc_time_now() + logger::kSuppressedReportInterval);
     return LoopImpl::Open(max_nfd_);
   }
   inline void Close() {
@@ -51,7 +56,7 @@ public:
     CheckAndGrow(fd);
     ASSERT(processors_[fd] == nullptr);
     processors_[fd] = h;
-    logger::info({{"ev","Loop::Add"}, {"fd", fd}, {"h", str::dptr(h)}});
+    QRPC_LOGJ(info, {{"ev","Loop::Add"}, {"fd", fd}, {"h", str::dptr(h)}});
     return LoopImpl::Add(fd, flags);
   }
   inline int Mod(Fd fd, uint32_t flags) {
@@ -73,7 +78,7 @@ public:
     if (r >= 0) {
       auto h = processors_[fd];
       processors_[fd] = nullptr;
-      logger::info({{"ev","Loop::Del"}, {"fd", fd}, {"h", str::dptr(h)}});
+      QRPC_LOGJ(info, {{"ev","Loop::Del"}, {"fd", fd}, {"h", str::dptr(h)}});
     } else {
       ASSERT(false);
     }
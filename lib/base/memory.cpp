@@ -1,9 +1,14 @@
 #include "base/defs.h"
+#include "base/memory.h"
 
 #if defined(QRPC_ANDROID)
 #include <malloc.h>
 #endif
 
+#if !defined(OS_WIN)
+#include <sys/mman.h>
+#endif
+
 namespace base {
 
 // borrowed from chromium source 'base/memory/aligned_memory.cpp'
@@ -42,4 +47,38 @@ void* AlignedAlloc(size_t size, size_t alignment) {
   return ptr;
 }
 
+void* HugePageAlloc(size_t size, size_t &allocated) {
+  ASSERT(size > 0U);
+#if defined(OS_WIN)
+  allocated = size;
+  return AlignedAlloc(size, kHugePageSize);
+#else
+  allocated = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  void *ptr = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+  // explicit huge pages. fails if no huge page is reserved (vm.nr_hugepages)
+  ptr = mmap(nullptr, allocated, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (ptr == MAP_FAILED) {
+    ptr = mmap(nullptr, allocated, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+      logger::die({{"ev", "mmap for huge page memory fails"},{"size", allocated},{"errno", errno}});
+    }
+#if defined(MADV_HUGEPAGE)
+    // fallback to transparent huge page. ignore error because it is just a hint
+    madvise(ptr, allocated, MADV_HUGEPAGE);
+#endif
+  }
+  return ptr;
+#endif
+}
+
+void HugePageFree(void* ptr, size_t allocated) {
+#if defined(OS_WIN)
+  AlignedFree(ptr);
+#else
+  munmap(ptr, allocated);
+#endif
+}
+
 }  // namespace base
@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #if defined(_MSC_VER)
 #include <malloc.h>
@@ -24,6 +25,62 @@ inline void AlignedFree(void* ptr) {
 #endif
 }
 
+// allocate memory backed by huge pages if possible (falls back to transparent huge page hint).
+// returned memory is page aligned and zero filled. size is rounded up to kHugePageSize and stored to allocated.
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+void* HugePageAlloc(size_t size, size_t &allocated);
+void HugePageFree(void* ptr, size_t allocated);
+
+// fixed size array of trivially constructible T on huge page memory.
+// used for large per-listener packet buffers that are touched on every syscall.
+// arrays smaller than kHugePageSize are allocated from heap (allocated_ == 0), because rounding up
+// to a huge page wastes memory more than TLB misses of such small arrays cost.
+template <typename T>
+class HugePageArray {
+public:
+  HugePageArray(size_t n) : size_(n), ptr_(nullptr), allocated_(0) {
+    if (n == 0) {
+      return;
+    }
+    if (sizeof(T) * n >= kHugePageSize) {
+      ptr_ = reinterpret_cast<T*>(HugePageAlloc(sizeof(T) * n, allocated_));
+    } else {
+      // AlignedAlloc requires alignment of multiple of pointer size
+      constexpr size_t alignment = alignof(T) > sizeof(void*) ? alignof(T) : sizeof(void*);
+      ptr_ = reinterpret_cast<T*>(AlignedAlloc(sizeof(T) * n, alignment));
+      if (ptr_ != nullptr) {
+        memset(ptr_, 0, sizeof(T) * n);
+      }
+    }
+  }
+  HugePageArray(HugePageArray&& rhs) : size_(rhs.size_), ptr_(rhs.ptr_), allocated_(rhs.allocated_) {
+    rhs.size_ = 0;
+    rhs.ptr_ = nullptr;
+    rhs.allocated_ = 0;
+  }
+  ~HugePageArray() {
+    if (ptr_ == nullptr) {
+      return;
+    }
+    if (allocated_ > 0) {
+      HugePageFree(ptr_, allocated_);
+    } else {
+      AlignedFree(ptr_);
+    }
+  }
+  HugePageArray(const HugePageArray&) = delete;
+  HugePageArray& operator=(const HugePageArray&) = delete;
+  inline size_t size() const { return size_; }
+  inline T* data() { return ptr_; }
+  inline const T* data() const { return ptr_; }
+  inline T& operator[](size_t i) { return ptr_[i]; }
+  inline const T& operator[](size_t i) const { return ptr_[i]; }
+private:
+  size_t size_;
+  T* ptr_;
+  size_t allocated_;
+};
+
 // Deleter for use with smart pointers
 //   eg. std::unique_ptr<Foo, base::AlignedMemoryDeleter> foo;
 struct AlignedMemoryDeleter {
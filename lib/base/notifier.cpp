@@ -0,0 +1,97 @@
+#include "base/notifier.h"
+#include "base/loop.h"
+#include "base/logger.h"
+
+#if defined(__ENABLE_EPOLL__)
+#include <sys/eventfd.h>
+#elif defined(__ENABLE_KQUEUE__)
+#include <sys/event.h>
+#endif
+
+namespace base {
+  int Notifier::Init(Loop &l) {
+    auto fd = fd_.load(std::memory_order_acquire);
+    if (fd == INVALID_FD) {
+    #if defined(__ENABLE_EPOLL__)
+      if ((fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        logger::error({{"ev","eventfd() fails"},{"errno",Syscall::Errno()}});
+        return QRPC_ESYSCALL;
+      }
+    #elif defined(__ENABLE_KQUEUE__)
+      if ((fd = ::kqueue()) < 0) {
+        logger::error({{"ev","notifier: kqueue() fails"},{"rv",fd},{"errno",Syscall::Errno()}});
+        return QRPC_ESYSCALL;
+      }
+      struct kevent change;
+      EV_SET(&change, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+      if (::kevent(fd, &change, 1, nullptr, 0, nullptr) != 0) {
+        logger::error({{"ev","notifier: kevent() fails"},{"errno",Syscall::Errno()}});
+        Syscall::Close(fd);
+        return QRPC_ESYSCALL;
+      }
+    #endif
+      fd_.store(fd, std::memory_order_release);
+    } else {
+      // discard notification for previous user of the fd
+      Drain();
+    }
+    notified_.store(false);
+    if (l.Add(fd, this, Loop::EV_READ) < 0) {
+      logger::error({{"ev","notifier: Loop::Add() fails"},{"fd",fd},{"errno",Syscall::Errno()}});
+      return QRPC_ESYSCALL;
+    }
+    return QRPC_OK;
+  }
+  void Notifier::Fin(Loop &l) {
+    auto fd = fd_.load(std::memory_order_acquire);
+    if (fd != INVALID_FD) {
+      l.Del(fd);
+    }
+    handlers_.clear();
+  }
+  void Notifier::Notify() {
+    // only the first notification after the loop woke up writes to fd
+    if (notified_.exchange(true)) {
+      return;
+    }
+    auto fd = fd_.load(std::memory_order_acquire);
+    if (fd == INVALID_FD) {
+      return;
+    }
+  #if defined(__ENABLE_EPOLL__)
+    uint64_t v = 1;
+    if (Syscall::Write(fd, &v, sizeof(v)) < 0 && !Syscall::IOMayBlocked(Syscall::Errno(), false)) {
+      QRPC_LOGJ(error, {{"ev","write eventfd fails"},{"fd",fd},{"errno",Syscall::Errno()}});
+    }
+  #elif defined(__ENABLE_KQUEUE__)
+    struct kevent change;
+    EV_SET(&change, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+    if (::kevent(fd, &change, 1, nullptr, 0, nullptr) != 0) {
+      QRPC_LOGJ(error, {{"ev","notifier: kevent(NOTE_TRIGGER) fails"},{"fd",fd},{"errno",Syscall::Errno()}});
+    }
+  #endif
+  }
+  void Notifier::Drain() {
+    auto fd = fd_.load(std::memory_order_acquire);
+  #if defined(__ENABLE_EPOLL__)
+    uint64_t v;
+    while (Syscall::Read(fd, &v, sizeof(v)) > 0) {}
+  #elif defined(__ENABLE_KQUEUE__)
+    Event ev[1];
+    Loop::Timeout to;
+    Loop::ToTimeout(0, to);
+    while (::kevent(fd, nullptr, 0, ev, 1, &to) > 0) {}
+  #endif
+  }
+  void Notifier::OnEvent(Fd fd, const Event &e) {
+    if (!Loop::Readable(e)) {
+      return;
+    }
+    Drain();
+    // reset before handlers run, so that notification for the item pushed while handlers running is not lost
+    notified_.store(false);
+    for (auto &h : handlers_) {
+      h();
+    }
+  }
+}
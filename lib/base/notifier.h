@@ -0,0 +1,34 @@
+#pragma once
+
+#include "base/defs.h"
+#include "base/io_processor.h"
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+namespace base {
+  class Loop;
+  // Notifier wakes up the loop of a worker thread from other threads (eventfd on linux, EVFILT_USER on kqueue).
+  // Notify() can be called from any thread. consecutive notifications before the loop processes them
+  // are merged into one wakeup, so that producers of SPSC queues can call it for every push cheaply.
+  // fd is kept open after Fin(), because other threads may still call Notify() for the worker slot.
+  class Notifier : public IoProcessor {
+  public:
+    typedef std::function<void ()> Handler;
+    Notifier() {}
+    ~Notifier() override {}
+    int Init(Loop &l);
+    void Fin(Loop &l);
+    inline void AddHandler(Handler &&h) { handlers_.push_back(std::move(h)); }
+    void Notify();
+    // implements IoProcessor
+    void OnEvent(Fd fd, const Event &e) override;
+  protected:
+    void Drain();
+  protected:
+    std::atomic<Fd> fd_{INVALID_FD};
+    std::atomic<bool> notified_{false};
+    std::vector<Handler> handlers_;
+  };
+}
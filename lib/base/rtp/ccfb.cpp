@@ -0,0 +1,141 @@
+#include "base/rtp/ccfb.h"
+
+namespace base {
+namespace rtp {
+  // NTP timestamp origin (1900-01-01) in unix time
+  static constexpr uint64_t kNtpEpochOffset = 2208988800ULL;
+  // middle 32 bits of 64 bit NTP timestamp (16.16 fixed point seconds)
+  static inline uint32_t CompactNtp(qrpc_time_t t) {
+    uint64_t sec = (t / (1000 * 1000 * 1000)) + kNtpEpochOffset;
+    uint64_t frac = ((t % (1000 * 1000 * 1000)) << 16) / (1000 * 1000 * 1000);
+    return (uint32_t)(((sec & 0xFFFF) << 16) | (frac & 0xFFFF));
+  }
+  void CongestionControlFeedback::Record(uint32_t ssrc, uint16_t seq, uint8_t ecn, qrpc_time_t arrival) {
+    switch (ecn & 0x3) {
+      case 0: stats_.not_ect++; break;
+      case 1: stats_.ect1++; break;
+      case 2: stats_.ect0++; break;
+      case 3: stats_.ce++; break;
+    }
+    auto it = streams_.find(ssrc);
+    if (it == streams_.end()) {
+      it = streams_.emplace(ssrc, StreamReports { .begin_seq = seq }).first;
+    }
+    auto &s = it->second;
+    uint16_t offset = seq - s.begin_seq;
+    if (offset >= kMaxReportsPerSsrc) {
+      if (offset >= (0x10000 - kMaxReportsPerSsrc)) {
+        // too old (reordered across report). it is reported as lost already
+        return;
+      }
+      // sequence jumped (e.g. sender restarted the stream). unreported packets are discarded and
+      // reporting restarts from this packet, otherwise all following packets are out of range forever
+      for (auto &r : s.reports) {
+        if (r.received) {
+          pending_--;
+        }
+      }
+      s.begin_seq = seq;
+      s.reports.clear();
+      offset = 0;
+    }
+    if (offset >= s.reports.size()) {
+      s.reports.resize(offset + 1);
+    }
+    auto &r = s.reports[offset];
+    if (!r.received) {
+      pending_++;
+    }
+    r.received = true;
+    r.ecn = ecn & 0x3;
+    r.arrival = arrival;
+  }
+  bool CongestionControlFeedback::Build(uint32_t sender_ssrc, qrpc_time_t now, std::vector<uint8_t> &out) {
+    last_report_ = now;
+    if (pending_ == 0) {
+      return false;
+    }
+    auto report_ts = CompactNtp(now);
+    out.clear();
+    auto put16 = [&out](uint16_t v) { out.push_back(v >> 8); out.push_back(v & 0xFF); };
+    auto put32 = [&put16](uint32_t v) { put16(v >> 16); put16(v & 0xFFFF); };
+    // common header. length is filled later
+    out.push_back(0x80 | FMT);
+    out.push_back(PT);
+    put16(0);
+    put32(sender_ssrc);
+    size_t n_streams = 0;
+    for (auto &kv : streams_) {
+      auto &s = kv.second;
+      if (s.reports.empty()) {
+        continue;
+      }
+      // room for metric blocks, after ssrc/begin_seq/num_reports (8 bytes) and report timestamp (4 bytes).
+      // rounded down to even count, so that padding never exceeds the room
+      auto room = out.size() + 12 < kMaxPacketSize ? ((kMaxPacketSize - out.size() - 12) / 2) & ~1 : 0;
+      if (room == 0) {
+        break; // rest are reported by next Build
+      }
+      auto n = std::min(s.reports.size(), room);
+      put32(kv.first);
+      put16(s.begin_seq);
+      put16(n);
+      for (size_t i = 0; i < n; i++) {
+        auto &r = s.reports[i];
+        if (!r.received) {
+          put16(0);
+          continue;
+        }
+        pending_--;
+        // arrival time offset from report timestamp, in 1/1024 sec. 0x1FFF means over-range
+        uint64_t ato = now > r.arrival ? ((now - r.arrival) * 1024) / (1000 * 1000 * 1000) : 0;
+        put16(0x8000 | (r.ecn << 13) | (ato >= 0x1FFF ? 0x1FFF : ato));
+      }
+      if ((n % 2) != 0) {
+        put16(0); // padding to 32 bit boundary
+      }
+      // next report starts with next seq of last reported one
+      s.begin_seq += n;
+      s.reports.erase(s.reports.begin(), s.reports.begin() + n);
+      n_streams++;
+    }
+    put32(report_ts);
+    // length in 32 bit words minus one
+    auto len = (out.size() / 4) - 1;
+    out[2] = len >> 8;
+    out[3] = len & 0xFF;
+    return n_streams > 0;
+  }  bool EcnRateLimiter::Record(uint8_t ecn, size_t sz, qrpc_time_t now) {
+    if (start_ == 0) {
+      start_ = now;
+    }
+    bytes_ += sz;
+    packets_++;
+    if ((ecn & 0x3) == 3) {
+      marked_++;
+    }
+    if ((now - start_) < kInterval) {
+      return false;
+    }
+    auto prev = limit_;
+    uint64_t rate = (bytes_ * 8 * 1000 * 1000 * 1000) / (now - start_);
+    alpha_ = (1 - kGain) * alpha_ + kGain * ((double)marked_ / packets_);
+    if (marked_ > 0) {
+      // reduce at most once per interval, and never raise the cap on CE
+      auto l = std::max((uint64_t)(rate * (1 - alpha_ / 2)), (uint64_t)kMinBitrate);
+      if (limit_ == 0 || l < limit_) {
+        limit_ = (uint32_t)std::min(l, (uint64_t)UINT32_MAX);
+      }
+    } else if (limit_ > 0) {
+      limit_ += kIncreaseBitrate;
+      if ((max_bitrate_ > 0 && limit_ >= max_bitrate_) || limit_ >= 2 * rate) {
+        limit_ = 0;
+      }
+    }
+    start_ = now;
+    bytes_ = 0;
+    packets_ = marked_ = 0;
+    return limit_ != prev;
+  }
+}
+}
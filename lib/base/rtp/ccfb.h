@@ -0,0 +1,77 @@
+#pragma once
+
+#include "base/defs.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace base {
+namespace rtp {
+  // builder of RTP Control Protocol (RTCP) Feedback for Congestion Control (RFC 8888, "CCFB").
+  // it reports arrival time and ECN codepoint of each received RTP packet, so that sender's
+  // congestion controller can react to CE marks (L4S) before queues overflow and packets are lost.
+  class CongestionControlFeedback {
+  public:
+    static constexpr uint8_t FMT = 11;
+    static constexpr uint8_t PT = 205; // RTPFB
+    static constexpr qrpc_time_t kReportInterval = 50 * 1000 * 1000; // 50ms
+    static constexpr size_t kMaxReportsPerSsrc = 16384; // RFC 8888 3.1
+    static constexpr size_t kMaxPacketSize = 1200; // fits in path MTU with IP/UDP/SRTP overhead
+    struct Stats {
+      uint64_t not_ect{0}, ect0{0}, ect1{0}, ce{0};
+    };
+  public:
+    CongestionControlFeedback() {}
+    inline const Stats &stats() const { return stats_; }
+    inline bool empty() const { return pending_ == 0; }
+    inline bool due(qrpc_time_t now) const { return !empty() && (now - last_report_) >= kReportInterval; }
+    inline void Remove(uint32_t ssrc) { streams_.erase(ssrc); }
+    // ecn is 2 bit ECN codepoint of IP header (Syscall::ECN_*). arrival is nanosec unix time
+    void Record(uint32_t ssrc, uint16_t seq, uint8_t ecn, qrpc_time_t arrival);
+    // build CCFB packet (up to kMaxPacketSize) into out and reset reported packets.
+    // returns false if nothing to report. call repeatedly until it returns false to report all recorded packets
+    bool Build(uint32_t sender_ssrc, qrpc_time_t now, std::vector<uint8_t> &out);
+  protected:
+    struct Report {
+      bool received{false};
+      uint8_t ecn{0};
+      qrpc_time_t arrival{0};
+    };
+    struct StreamReports {
+      uint16_t begin_seq;
+      std::vector<Report> reports; // index is seq - begin_seq
+    };
+  protected:
+    std::map<uint32_t, StreamReports> streams_;
+    qrpc_time_t last_report_{0};
+    size_t pending_{0};
+    Stats stats_;
+  };
+  // receiver side reaction to CE marks, for the peer whose congestion controller does not take CCFB.
+  // like DCTCP, it keeps EWMA of CE marked fraction of ingress RTP packets per interval, and caps incoming
+  // bitrate (advertised to the peer by REMB) to measured rate * (1 - alpha / 2) when CE is seen.
+  // the cap grows additively while no CE is seen, and is removed when it exceeds max or twice of the measured rate
+  class EcnRateLimiter {
+  public:
+    static constexpr qrpc_time_t kInterval = 100 * 1000 * 1000; // 100ms
+    static constexpr double kGain = 1.0 / 16;
+    static constexpr uint32_t kIncreaseBitrate = 50 * 1000; // per interval
+    static constexpr uint32_t kMinBitrate = 100 * 1000;
+  public:
+    // max_bitrate is the configured max incoming bitrate (0 for unlimited)
+    EcnRateLimiter(uint32_t max_bitrate) : max_bitrate_(max_bitrate) {}
+    // current cap of incoming bitrate (bps). 0 if not limited by CE marks
+    inline uint32_t limit() const { return limit_; }
+    inline double alpha() const { return alpha_; }
+    // ecn is 2 bit ECN codepoint of IP header (Syscall::ECN_*). returns true if limit() changes
+    bool Record(uint8_t ecn, size_t sz, qrpc_time_t now);
+  protected:
+    uint32_t max_bitrate_, limit_{0};
+    double alpha_{0};
+    qrpc_time_t start_{0};
+    uint64_t bytes_{0};
+    uint32_t packets_{0}, marked_{0};
+  };
+}
+}
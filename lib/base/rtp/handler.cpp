@@ -6,6 +6,7 @@
 
 #include "base/webrtc/mpatch.h"
 #include "base/rtp/parameters.h"
+#include "base/rtp/relay.h"
 
 #include <FBS/worker.h>
 #include <flatbuffers/idl.h>
@@ -448,6 +449,10 @@ namespace rtp {
 			auto &h = ConsumerFactory::HandlerFrom(c);
 			h.SendToStream(stream_label, data, len);
 		}
+		if (p != nullptr && Relay::Relayed(*this)) {
+			auto path = static_cast<const Producer *>(p)->media_path();
+			Relay::Forward(*this, Relay::SYSCALL, path, stream_label, data, len);
+		}
 	}
 	void Handler::TryRidComplement(uint32_t ssrc) {
 		auto it = ssrc_stream_recovery_map_.find(ssrc);
@@ -526,6 +531,9 @@ namespace rtp {
 			h.SendToStream(Stream::SYSCALL_NAME, data, len);
 			ConsumerFactory::OnProducerManuallyClosed(c);
 		}
+		if (Relay::Relayed(*this)) {
+			Relay::Forward(*this, Relay::UNPRODUCE, p->media_path(), "", nullptr, 0);
+		}
 		auto &fbb = GetFBB();
 		HandleRequest(fbb, FBS::Request::Method::TRANSPORT_CLOSE_PRODUCER, 
 			FBS::Transport::CreateCloseProducerRequestDirect(fbb, p->id.c_str()));
@@ -568,10 +576,70 @@ namespace rtp {
 			}
 			it->second.try_rid_complement = false;
 		}
+		if (Relay::Relayed(*this)) {
+			// forward before transport processing, because producer mangles the packet
+			Relay::Forward(*this, Relay::RTP, "", "", packet->GetData(), packet->GetSize());
+		}
+		if (ccfb_negotiated_) {
+			auto now = qrpc_time_now();
+			ccfb_.Record(ssrc, packet->GetSequenceNumber(), rx_ecn_, rx_time_ > 0 ? rx_time_ : now);
+			// sender SSRC is 0 as same as transport-cc feedback of mediasoup
+			if (ccfb_.due(now)) {
+				while (ccfb_.Build(0, now, ccfb_buffer_)) {
+					listener_.SendRtcpData(ccfb_buffer_.data(), ccfb_buffer_.size());
+				}
+			}
+		} else if (listener_.GetRtpConfig().ecn &&
+			ecn_limiter_.Record(rx_ecn_, packet->GetSize(), rx_time_ > 0 ? rx_time_ : qrpc_time_now())) {
+			// peer's controller does not see CE marks. make it slow down by REMB of transport congestion control server
+			auto limit = ecn_limiter_.limit() > 0 ? ecn_limiter_.limit() : this->maxIncomingBitrate;
+			if (this->tccServer != nullptr) {
+				this->tccServer->SetMaxIncomingBitrate(limit);
+			}
+			QRPC_LOGJ(info, {{"ev","incoming bitrate limited by CE"},{"limit",limit},{"alpha",ecn_limiter_.alpha()}});
+		}
 		RTC::Transport::ReceiveRtpPacket(packet);
 	}
+	void Handler::ReceiveRtcpPacket(RTC::RTCP::Packet* packet) {
+		if (Relay::Relayed(*this)) {
+			// sender reports are needed for proxied producers to generate consumer's sender report
+			for (auto *p = packet; p != nullptr; p = p->GetNext()) {
+				if (p->GetType() == RTC::RTCP::Type::SR) {
+					Relay::Forward(*this, Relay::RTCP, "", "", p->GetData(), p->GetSize());
+				}
+			}
+		}
+		RTC::Transport::ReceiveRtcpPacket(packet);
+	}
+	void Handler::OnConsumerSendRtpPacket(RTC::Consumer* consumer, RTC::RtpPacket* packet) {
+		auto pacer = listener_.GetPacer();
+		if (pacer != nullptr) {
+			pacer->SetEstimate(available_outgoing_bitrate());
+			auto at = pacer->Schedule(packet->GetSize());
+			if (at > 0) {
+				// transport-cc sequence number, abs-send-time and send time of transport-cc client are
+				// given when the packet departs. consumer restores the packet after return, so hold a copy
+				std::shared_ptr<RTC::RtpPacket> clone(packet->Clone());
+				pacer->Enqueue(at, packet->GetSize(), [this, id = consumer->id, clone]() {
+					// consumer may be closed while the packet is held
+					auto c = FindConsumer(id);
+					if (c != nullptr) {
+						RTC::Transport::OnConsumerSendRtpPacket(c, clone.get());
+					}
+				});
+				return;
+			}
+		}
+		RTC::Transport::OnConsumerSendRtpPacket(consumer, packet);
+	}
 	Producer *Handler::Produce(const MediaStreamConfig &p) {
 		auto producer = producer_factory_.Create(p);
+		if (producer != nullptr && p.ccfb) {
+			ccfb_negotiated_ = true;
+		}
+		if (producer != nullptr && Relay::Relayed(*this)) {
+			Relay::Produce(*this, p);
+		}
 		// auto &fbb = GetFBB();
 		// fbb.Finish(producer->FillBuffer(fbb));
 		// puts(Dump<FBS::Producer::DumpResponse>("producer", "FBS.Producer.DumpResponse", fbb).c_str());
@@ -638,6 +706,9 @@ namespace rtp {
 	void Handler::PublishStream(const std::shared_ptr<base::Stream> &stream) {
 		published_streams_[stream->label()] = stream;
 		router_.Publish(stream.get());
+		if (Relay::Relayed(*this)) {
+			Relay::Forward(*this, Relay::PUBLISH, "", stream->label(), nullptr, 0);
+		}
 	}
 	void Handler::UnpublishStream(const std::shared_ptr<base::Stream> &stream) {
 		published_streams_.erase(stream->label());
@@ -645,12 +716,18 @@ namespace rtp {
 			s->Close(QRPC_CLOSE_REASON_REMOTE);
 		}
 		router_.Unpublish(stream.get());
+		if (Relay::Relayed(*this)) {
+			Relay::Forward(*this, Relay::UNPUBLISH, "", stream->label(), nullptr, 0);
+		}
 	}
 	void Handler::EmitSubscribeStreams(const std::shared_ptr<base::Stream> &stream, const void *p, size_t sz) {
 		auto vec = router_.SubscribersFor(stream.get());
 		for (auto *s : vec) {
 			s->Send(static_cast<const char *>(p), sz);
 		}
+		if (Relay::Relayed(*this)) {
+			Relay::Forward(*this, Relay::STREAM, "", stream->label(), p, sz);
+		}
 	}
 	bool Handler::SubscribeStream(const std::string &path, const std::shared_ptr<base::Stream> &stream) {
 		auto pit = published_streams_.find(path);
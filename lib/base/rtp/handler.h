@@ -5,6 +5,8 @@
 #include "base/media.h"
 #include "base/stream.h"
 
+#include "base/rtp/ccfb.h"
+#include "base/rtp/pacer.h"
 #include "base/rtp/consumer.h"
 #include "base/rtp/parameters.h"
 #include "base/rtp/producer.h"
@@ -143,6 +145,12 @@ namespace rtp {
       size_t initial_outgoing_bitrate;
       size_t max_outgoing_bitrate, max_incoming_bitrate;
       size_t min_outgoing_bitrate;
+      // send RFC 8888 congestion control feedback (arrival time and ECN of each received RTP packet)
+      // to the peer which offers "a=rtcp-fb:* ack ccfb"
+      bool ccfb{false};
+      // limit incoming bitrate by CE marks of received RTP packets (see EcnRateLimiter),
+      // if the peer does not negotiate ccfb
+      bool ecn{false};
     };
     struct RouterListener : RTC::Router::Listener {
       RTC::WebRtcServer* OnRouterNeedWebRtcServer(
@@ -167,6 +175,8 @@ namespace rtp {
         RTC::Consumer* consumer, RTC::RtpPacket* packet, onSendCallback* cb = nullptr) = 0;
       virtual void SendRtcpPacket(RTC::RTCP::Packet* packet)                 = 0;
       virtual void SendRtcpCompoundPacket(RTC::RTCP::CompoundPacket* packet) = 0;
+      // send serialized RTCP packet which is not supported by mediasoup (eg. CCFB)
+      virtual void SendRtcpData(const uint8_t *data, size_t sz) = 0;
       virtual void SendMessage(
         RTC::DataConsumer* dataConsumer,
         const uint8_t* msg,
@@ -176,11 +186,14 @@ namespace rtp {
       virtual void SendSctpData(const uint8_t* data, size_t len) = 0;
       virtual bool GetRtpRoc(uint32_t ssrc, uint32_t &roc, MediaStreamConfig::Direction dir) = 0;
       virtual const Config &GetRtpConfig() const = 0;
+      // egress pacer of the transport. nullptr disables pacing
+      virtual Pacer *GetPacer() = 0;
     };
     typedef Listener::onSendCallback onSendCallback;
   public:
     Handler(Listener &l) : RTC::Transport(&shared(), l.rtp_id(), &router(), TransportOptions(l.GetRtpConfig())),
-      listener_(l), producer_factory_(*this), consumer_factory_(*this) {}
+      listener_(l), producer_factory_(*this), consumer_factory_(*this),
+      ecn_limiter_(l.GetRtpConfig().max_incoming_bitrate) {}
     ~Handler() override { RTC::Transport::CloseProducersAndConsumers(); }
     inline Listener &listener() { return listener_; }
     inline const std::string &rtp_id() const { return listener_.rtp_id(); }
@@ -189,6 +202,18 @@ namespace rtp {
     inline const absl::flat_hash_map<std::string, RTC::Producer*> &producers() const { return this->mapProducers; }
     inline const std::map<Media::Mid, Media::Id> mid_media_path_map() const { return mid_media_path_map_; }
     inline std::map<uint32_t, StreamRecoveryContext> &ssrc_stream_recovery_map() { return ssrc_stream_recovery_map_; }
+    // kernel arrival time of the RTP packet being received (0 if unknown). jitter/NACK logic should prefer this
+    // to the time of processing, which includes queueing delay in the event loop.
+    inline qrpc_time_t rx_time() const { return rx_time_; }
+    inline void set_rx_time(qrpc_time_t t) { rx_time_ = t; }
+    // ECN codepoint of the RTP packet being received. fed back to peer by CCFB, or limits incoming bitrate by REMB
+    inline void set_rx_ecn(uint8_t ecn) { rx_ecn_ = ecn; }
+    inline const CongestionControlFeedback::Stats &ecn_stats() const { return ccfb_.stats(); }
+    // outgoing bandwidth estimation (bps) of transport-cc/REMB. 0 if no estimation is running
+    inline uint32_t available_outgoing_bitrate() const {
+      return this->tccClient != nullptr ? this->tccClient->GetAvailableBitrate() : 0;
+    }
+    inline const std::map<std::string, std::shared_ptr<base::Stream>> &published_streams() const { return published_streams_; }
     inline int SendToStream(const std::string &path, const char *data, size_t len) {
       return listener_.SendToStream(path, data, len);
     }
@@ -275,19 +300,21 @@ namespace rtp {
     void DumpChildren(); // dump consumer and producer created by this handler
   public:
     void ReceiveRtpPacket(RTC::RtpPacket* packet);
-    void ReceiveRtcpPacket(RTC::RTCP::Packet* packet) { RTC::Transport::ReceiveRtcpPacket(packet); }
+    void ReceiveRtcpPacket(RTC::RTCP::Packet* packet);
     void DataSent(size_t len) { RTC::Transport::DataSent(len); }
     void Connected() { RTC::Transport::Connected(); }
     void Disconnected() { RTC::Transport::Disconnected(); }
   public:
     // implements RTC::Transport
-    void RecvStreamClosed(uint32_t ssrc) override { listener_.RecvStreamClosed(ssrc); }
+    void RecvStreamClosed(uint32_t ssrc) override { ccfb_.Remove(ssrc); listener_.RecvStreamClosed(ssrc); }
     void SendStreamClosed(uint32_t ssrc) override { listener_.SendStreamClosed(ssrc); }
     bool IsConnected() const override { return listener_.IsConnected(); }
     void SendRtpPacket(
       RTC::Consumer* consumer, RTC::RtpPacket* packet, onSendCallback* cb = nullptr) override {
       listener_.SendRtpPacket(consumer, packet, cb);
     }
+    // implements RTC::Consumer::Listener. packets are paced here, before RTC::Transport stamps them
+    void OnConsumerSendRtpPacket(RTC::Consumer* consumer, RTC::RtpPacket* packet) override;
     void SendRtcpPacket(RTC::RTCP::Packet* packet) override { listener_.SendRtcpPacket(packet); }
     void SendRtcpCompoundPacket(RTC::RTCP::CompoundPacket* packet) override { listener_.SendRtcpCompoundPacket(packet); }
     void SendMessage(
@@ -314,6 +341,12 @@ namespace rtp {
     std::map<Media::Id, std::shared_ptr<Media>> medias_;
     std::map<Media::Mid, std::string> mid_media_path_map_;
     std::map<uint32_t, StreamRecoveryContext> ssrc_stream_recovery_map_;
+    qrpc_time_t rx_time_{0};
+    uint8_t rx_ecn_{0};
+    bool ccfb_negotiated_{false};
+    CongestionControlFeedback ccfb_;
+    std::vector<uint8_t> ccfb_buffer_;
+    EcnRateLimiter ecn_limiter_;
   };
 }
 }
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include "base/rtp/pacer.h"
+
+namespace base {
+namespace rtp {
+  void Pacer::SetEstimate(uint64_t bps) {
+    rate_ = (uint64_t)(bps * kPacingFactor);
+    if (rate_ == 0 && !queue_.empty()) {
+      // estimation lost (eg. all consumers closed). send remaining packets right now
+      Drain(UINT64_MAX);
+    }
+  }
+  qrpc_time_t Pacer::Schedule(size_t sz) {
+    if (rate_ == 0) {
+      stats_.immediate++;
+      return 0;
+    }
+    auto now = qrpc_time_now();
+    auto at = Departure(sz, now);
+    if (at == 0) {
+      // flush queued packets first to keep packet order
+      Drain(UINT64_MAX);
+      stats_.bypassed++;
+      return 0;
+    }
+    if (at <= now && queue_.empty()) {
+      stats_.immediate++;
+      return 0;
+    }
+    return at;
+  }
+  void Pacer::Enqueue(qrpc_time_t at, size_t sz, Sender &&s) {
+    queue_.push_back({ .send = std::move(s), .sz = sz, .at = at });
+    queued_bytes_ += sz;
+    stats_.queued++;
+    if (alarm_id_ == AlarmProcessor::INVALID_ID) {
+      alarm_id_ = alarm_processor_.Set([this]() {
+        auto next = Drain(qrpc_time_now());
+        if (next == 0) {
+          alarm_id_ = AlarmProcessor::INVALID_ID;
+          return qrpc_alarm_stop_rv();
+        }
+        return next;
+      }, queue_.front().at);
+    }
+  }
+  void Pacer::Stop() {
+    if (alarm_id_ != AlarmProcessor::INVALID_ID) {
+      alarm_processor_.Cancel(alarm_id_);
+      alarm_id_ = AlarmProcessor::INVALID_ID;
+    }
+    queue_.clear();
+    queued_bytes_ = 0;
+  }
+  qrpc_time_t Pacer::Departure(size_t sz, qrpc_time_t now) {
+    auto interval = (sz * 8 * 1000 * 1000 * 1000) / rate_;
+    if (next_ + kBurstWindow < now) {
+      // idle. do not accumulate more credit than burst window
+      next_ = now - kBurstWindow;
+    } else if (next_ > now + kMaxQueueDelay) {
+      // estimation dropped sharply and backlog exceeds the bound. send this packet now and restart pacing
+      // from now, otherwise next_ stays far ahead and every following packet bypasses pacing
+      next_ = now + interval;
+      return 0;
+    }
+    auto at = std::max(next_, now);
+    next_ += interval;
+    return at;
+  }
+  qrpc_time_t Pacer::Drain(qrpc_time_t until) {
+    while (!queue_.empty() && queue_.front().at <= until) {
+      // pop before sending, so that the queue stays consistent even if sender stops the pacer
+      auto pkt = std::move(queue_.front());
+      queue_.pop_front();
+      queued_bytes_ -= pkt.sz;
+      pkt.send();
+    }
+    return queue_.empty() ? 0 : queue_.front().at;
+  }
+}
+}
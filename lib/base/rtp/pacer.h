@@ -0,0 +1,65 @@
+#pragma once
+
+#include "base/defs.h"
+#include "base/alarm.h"
+
+#include <deque>
+#include <functional>
+
+namespace base {
+namespace rtp {
+  // paces outgoing media packets at a rate derived from transport's bandwidth estimation, so that whole video frame
+  // is not sent as one burst that overflows shallow router buffers. packets are held before transport-cc sequence
+  // number and abs-send-time are stamped, and sent by alarm, so that time spent in pacer is not
+  // estimated as network delay by congestion controller.
+  class Pacer {
+  public:
+    // pacing rate relative to bandwidth estimation. same as libwebrtc, so that pacer itself does not add much latency
+    static constexpr double kPacingFactor = 2.5;
+    // credit that idle pacer accumulates, so that small packets (eg. audio) after idle period are not delayed
+    static constexpr qrpc_time_t kBurstWindow = 5 * 1000 * 1000; // 5ms
+    // packets which need to wait longer than this are sent immediately and pacing restarts from now,
+    // to bound latency and memory usage
+    static constexpr qrpc_time_t kMaxQueueDelay = 500 * 1000 * 1000; // 500ms
+    // stamps and sends one held packet
+    typedef std::function<void ()> Sender;
+    struct Stats {
+      uint64_t immediate{0}, queued{0}, bypassed{0};
+    };
+  public:
+    Pacer(AlarmProcessor &ap) : alarm_processor_(ap) {}
+    ~Pacer() { Stop(); }
+    inline uint64_t rate() const { return rate_; }
+    inline bool enabled() const { return rate_ > 0; }
+    inline size_t queued_bytes() const { return queued_bytes_; }
+    inline const Stats &stats() const { return stats_; }
+    // bps. 0 means no estimation is available, and disables pacing
+    void SetEstimate(uint64_t bps);
+    // reserve departure time of a packet with sz bytes. returns 0 if the packet should be sent now
+    // (queued packets are sent before returning, to keep packet order). otherwise caller should pass
+    // the packet to Enqueue with returned departure time.
+    qrpc_time_t Schedule(size_t sz);
+    void Enqueue(qrpc_time_t at, size_t sz, Sender &&s);
+    // cancel alarm and drop queued packets
+    void Stop();
+  protected:
+    // returns departure time of packet, or 0 if it should be sent without pacing
+    qrpc_time_t Departure(size_t sz, qrpc_time_t now);
+    // send queued packets whose departure time is before until. returns departure time of next packet or 0 if empty
+    qrpc_time_t Drain(qrpc_time_t until);
+  protected:
+    struct Packet {
+      Sender send;
+      size_t sz;
+      qrpc_time_t at;
+    };
+    AlarmProcessor &alarm_processor_;
+    uint64_t rate_{0};
+    qrpc_time_t next_{0}; // earliest departure time of next packet
+    std::deque<Packet> queue_;
+    size_t queued_bytes_{0};
+    Stats stats_;
+    AlarmProcessor::Id alarm_id_{AlarmProcessor::INVALID_ID};
+  };
+}
+}
@@ -431,6 +431,7 @@ namespace rtp {
         }
       }
     }
+    ccfb = false;
     auto rtcpfbit = section.find("rtcpFb");
     if (rtcpfbit != section.end()) {
       for (auto it = rtcpfbit->begin(); it != rtcpfbit->end(); it++) {
@@ -440,6 +441,16 @@ namespace rtp {
           ASSERT(false);
           return false;
         }
+        if (plit->get<std::string>() == "*") {
+          // wildcard feedback applies to the media section, not to a codec.
+          // only "ack ccfb" (RFC 8888) is recognized, others are ignored
+          auto tit = it->find("type"), stit = it->find("subtype");
+          if (tit != it->end() && tit->get<std::string>() == "ack" &&
+            stit != it->end() && stit->get<std::string>() == "ccfb") {
+            ccfb = true;
+          }
+          continue;
+        }
         RTC::RtpCodecParameters *c;
         try {
           auto pt = std::stoul(plit->get<std::string>());
@@ -632,6 +643,10 @@ namespace rtp {
       return sdplines;
     }
     sdplines += "a=rtcp-mux\na=rtcp-rsize\n";
+    if (ccfb && cname.empty()) {
+      // we only send CCFB for received packets, so consuming peer connection does not need it
+      sdplines += "a=rtcp-fb:* ack ccfb\n";
+    }
     if (network.port != 0 && network.ip_ver != 0) {
       sdplines += str::Format(
         "a=rtcp:%llu %s IP%llu %s\n",
@@ -108,6 +108,7 @@ namespace rtp {
     NetworkParameters network;  // affect sdp generation
     std::string rtp_proto;      // affect sdp generation
     uint32_t ssrc_seed;         // affect consumer sdp generation only
+    bool ccfb{false};           // peer offers "a=rtcp-fb:* ack ccfb" and we accept it. affect producer sdp generation only
     std::map<uint32_t, SsrcParameter> ssrcs;                  // affect producer sdp generation only
     SimulcastParameter simulcast;                             // affect producer sdp generation only
   };
@@ -0,0 +1,596 @@
+#include "base/rtp/relay.h"
+#include "base/loop.h"
+#include "base/logger.h"
+
+#include "RTC/RtpPacket.hpp"
+#include "RTC/RTCP/Packet.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace base {
+namespace rtp {
+  // proxy of the handler on another worker. it owns producers that have same parameters as origin's one,
+  // and receives RTP/RTCP packets from origin via Relay.
+  class Relay::Proxy : public Handler::Listener, public base::Connection {
+  public:
+    class ProxyStream : public Stream {
+    public:
+      ProxyStream(base::Connection &c, const Config &config) : Stream(c, config) {}
+      int OnRead(const char *p, size_t sz) override { return QRPC_OK; }
+    };
+  public:
+    Proxy(int owner, const std::string &cname, const std::string &rtp_id, const Handler::Config &c) :
+      owner_(owner), cname_(cname), rtp_id_(rtp_id), config_(c) {
+      handler_ = std::make_shared<Handler>(*this);
+    }
+    ~Proxy() override {}
+    inline int owner() const { return owner_; }
+    inline std::shared_ptr<Handler> &handler() { return handler_; }
+    // true after producers and streams which origin had on subscription are received
+    inline bool ready() const { return ready_; }
+    inline void SetReady() { ready_ = true; }
+    void Produce(const MediaStreamConfig &c) {
+      RemoveConfig(c.mid);
+      auto &slot = configs_.emplace_back(c);
+      handler_->UpdateMidMediaPathMap(slot);
+      if (handler_->Produce(slot) == nullptr) {
+        QRPC_LOGJ(error, {{"ev","fail to create proxy producer"},{"cname",cname_},{"path",c.media_path}});
+        RemoveConfig(c.mid);
+      }
+    }
+    void Unproduce(const std::string &path) {
+      auto *p = handler_->FindProducerByPath(path);
+      if (p == nullptr) {
+        QRPC_LOGJ(warn, {{"ev","proxy producer not found"},{"cname",cname_},{"path",path}});
+        return;
+      }
+      auto mid = p->GetRtpParameters().mid;
+      handler_->CloseProducer(p);
+      RemoveConfig(mid);
+    }
+    void Publish(const std::string &label) {
+      auto s = std::make_shared<ProxyStream>(*this, Stream::Config{ .label = label });
+      streams_[label] = s;
+      handler_->PublishStream(s);
+    }
+    void Unpublish(const std::string &label) {
+      auto it = streams_.find(label);
+      if (it != streams_.end()) {
+        handler_->UnpublishStream(it->second);
+        streams_.erase(it);
+      }
+    }
+    void Emit(const std::string &label, const std::string &data) {
+      auto it = streams_.find(label);
+      if (it != streams_.end()) {
+        handler_->EmitSubscribeStreams(it->second, data.data(), data.size());
+      }
+    }
+    void Shutdown() {
+      for (auto &kv : streams_) {
+        handler_->UnpublishStream(kv.second);
+      }
+      streams_.clear();
+      handler_->Close();
+    }
+  public:
+    // implements Handler::Listener
+    const std::string &rtp_id() const override { return rtp_id_; }
+    const std::string &cname() const override { return cname_; }
+    const std::map<Parameters::MediaKind, Capability> &capabilities() const override { return capabilities_; }
+    MediaStreamConfigs &media_stream_configs() override { return configs_; }
+    const std::string &FindRtpIdFrom(std::string &cname) override {
+      static std::string empty;
+      return empty;
+    }
+    const std::string GenerateMid() override { return ""; }
+    int SendToStream(const std::string &label, const char *data, size_t len) override { return QRPC_OK; }
+    void RecvStreamClosed(uint32_t ssrc) override {}
+    void SendStreamClosed(uint32_t ssrc) override {}
+    bool IsConnected() const override { return true; }
+    void SendRtpPacket(
+      RTC::Consumer* consumer, RTC::RtpPacket* packet, onSendCallback* cb = nullptr) override {
+      ASSERT(false); // proxy never has consumer
+      if (cb) {
+        (*cb)(false);
+        delete cb;
+      }
+    }
+    void SendRtcpPacket(RTC::RTCP::Packet* packet) override {
+      // feedbacks (keyframe requests, NACK for packets lost in relay etc.) are sent back to the origin peer.
+      // receiver reports are not, because origin producer generates them from what it receives
+      switch (packet->GetType()) {
+      case RTC::RTCP::Type::PSFB:
+      case RTC::RTCP::Type::RTPFB:
+        Relay::Feedback(owner_, cname_, packet->GetData(), packet->GetSize());
+        break;
+      default:
+        break;
+      }
+    }
+    void SendRtcpCompoundPacket(RTC::RTCP::CompoundPacket* packet) override {}
+    void SendRtcpData(const uint8_t *data, size_t sz) override {}
+    void SendMessage(
+      RTC::DataConsumer* dataConsumer,
+      const uint8_t* msg,
+      size_t len,
+      uint32_t ppid,
+      Handler::QueueCB* = nullptr) override { ASSERT(false); }
+    void SendSctpData(const uint8_t* data, size_t len) override { ASSERT(false); }
+    bool GetRtpRoc(uint32_t ssrc, uint32_t &roc, MediaStreamConfig::Direction dir) override { return false; }
+    const Handler::Config &GetRtpConfig() const override { return config_; }
+    Pacer *GetPacer() override { return nullptr; }
+  public:
+    // implements base::Connection. proxy streams never send anything to peer
+    void Close() override {}
+    int Send(const char *p, size_t sz) override { return QRPC_OK; }
+    int Open(Stream &s) override { return QRPC_OK; }
+    void Close(Stream &s) override {}
+    int Send(Stream &s, const char *p, size_t sz, bool binary) override { return QRPC_OK; }
+    std::shared_ptr<Stream> OpenStream(const Stream::Config &c) override { return nullptr; }
+    void ScheduleFlush(Stream &s) override {}
+  protected:
+    void RemoveConfig(const std::string &mid) {
+      configs_.erase(std::remove_if(configs_.begin(), configs_.end(), [&mid](const auto &c) {
+        return c.mid == mid;
+      }), configs_.end());
+    }
+  protected:
+    int owner_;
+    std::string cname_, rtp_id_;
+    Handler::Config config_;
+    std::shared_ptr<Handler> handler_;
+    MediaStreamConfigs configs_;
+    std::map<Parameters::MediaKind, Capability> capabilities_;
+    std::map<std::string, std::shared_ptr<Stream>> streams_;
+    bool ready_{false};
+  };
+
+  thread_local int Relay::worker_ = -1;
+  thread_local int Relay::subscriptions_ = 0;
+  thread_local uint64_t Relay::dropped_ = 0;
+  thread_local AlarmProcessor *Relay::alarm_processor_ = nullptr;
+  thread_local std::unordered_map<std::string, Relay::Origin> Relay::origins_;
+  thread_local std::unordered_map<std::string, std::shared_ptr<Relay::Proxy>> Relay::proxies_;
+  thread_local std::set<std::string> Relay::pending_;
+  thread_local std::unordered_map<std::string, Relay::Waiting> Relay::waiters_;
+  thread_local std::vector<Relay::Message *> Relay::free_;
+  thread_local uint8_t Relay::rtp_buffer_[Relay::kMaxRtpPacketSize + Relay::kRtpHeadroom];
+  std::mutex Relay::mutex_;
+  std::unordered_map<std::string, int> Relay::directory_;
+  std::atomic<Relay::Queue*> Relay::queues_[Relay::kMaxWorkers][Relay::kMaxWorkers];
+  std::atomic<Relay::Queue*> Relay::returns_[Relay::kMaxWorkers][Relay::kMaxWorkers];
+  bool Relay::workers_[Relay::kMaxWorkers];
+  Notifier Relay::notifiers_[Relay::kMaxWorkers];
+
+  void Relay::ClassInit(Loop &l) {
+    auto lock = std::lock_guard<std::mutex>(mutex_);
+    if (worker_ >= 0) {
+      return;
+    }
+    for (int i = 0; i < kMaxWorkers; i++) {
+      if (!workers_[i]) {
+        workers_[i] = true;
+        worker_ = i;
+        break;
+      }
+    }
+    if (worker_ < 0) {
+      logger::die({{"ev","too many relay workers"},{"max",kMaxWorkers}});
+    }
+    // discard messages for previous worker which had same index
+    for (int i = 0; i < kMaxWorkers; i++) {
+      for (auto qs : { queues_, returns_ }) {
+        auto q = qs[i][worker_].load(std::memory_order_acquire);
+        Message *m;
+        while (q != nullptr && q->pop(m)) {
+          delete m;
+        }
+      }
+    }
+    // queues are processed when other worker pushes messages to them, instead of polling
+    auto &n = notifiers_[worker_];
+    if (n.Init(l) < 0) {
+      logger::die({{"ev","Failed to init relay notifier"},{"worker",worker_}});
+    }
+    n.AddHandler(Poll);
+    alarm_processor_ = &l.alarm_processor();
+    QRPC_LOGJ(info, {{"ev","relay worker initialized"},{"worker",worker_}});
+  }
+  void Relay::ClassDestroy(Loop &l) {
+    if (worker_ < 0) {
+      return;
+    }
+    for (auto &kv : proxies_) {
+      Post(kv.second->owner(), NewMessage(UNSUBSCRIBE, kv.first));
+      kv.second->Shutdown();
+    }
+    proxies_.clear();
+    for (auto &kv : origins_) {
+      for (auto w : kv.second.subscribers) {
+        Post(w, NewMessage(CLOSE, kv.first));
+      }
+    }
+    origins_.clear();
+    pending_.clear();
+    for (auto &kv : waiters_) {
+      if (kv.second.alarm_id != AlarmProcessor::INVALID_ID) {
+        alarm_processor_->Cancel(kv.second.alarm_id);
+      }
+    }
+    waiters_.clear();
+    for (auto m : free_) {
+      delete m;
+    }
+    free_.clear();
+    subscriptions_ = 0;
+    notifiers_[worker_].Fin(l);
+    alarm_processor_ = nullptr;
+    auto lock = std::lock_guard<std::mutex>(mutex_);
+    for (auto it = directory_.begin(); it != directory_.end();) {
+      if (it->second == worker_) {
+        it = directory_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    workers_[worker_] = false;
+    worker_ = -1;
+  }
+  bool Relay::Post(int to, Message *m) {
+    ASSERT(to >= 0 && to < kMaxWorkers && to != worker_);
+    auto &slot = queues_[worker_][to];
+    auto q = slot.load(std::memory_order_acquire);
+    if (UNLIKELY(q == nullptr)) {
+      // only this thread creates queue for [worker_][to], so no race on creation
+      q = new Queue(kQueueSize);
+      slot.store(q, std::memory_order_release);
+    }
+    if (!q->push(std::move(m))) {
+      // receiver worker is too busy. media packets can be recovered by retransmission or keyframe request
+      dropped_++;
+      FreeMessage(m);
+      return false;
+    }
+    Notify(to);
+    return true;
+  }
+  void Relay::FreeMessage(Message *m) {
+    if (free_.size() >= kMaxFreeMessages) {
+      delete m;
+      return;
+    }
+    m->path.clear();
+    m->label.clear();
+    m->data.clear();
+    m->config.reset();
+    free_.push_back(m);
+  }
+  void Relay::Return(Message *m) {
+    // only this thread pushes to returns_[worker_][m->from]
+    auto &slot = returns_[worker_][m->from];
+    auto q = slot.load(std::memory_order_acquire);
+    if (UNLIKELY(q == nullptr)) {
+      q = new Queue(kQueueSize);
+      slot.store(q, std::memory_order_release);
+    }
+    if (!q->push(std::move(m))) {
+      delete m;
+    }
+  }
+  void Relay::Reclaim() {
+    // receivers do not notify on return. sender takes returned messages back when it needs new one
+    for (int i = 0; i < kMaxWorkers; i++) {
+      Message *m;
+      auto rq = returns_[i][worker_].load(std::memory_order_acquire);
+      while (rq != nullptr && rq->pop(m)) {
+        FreeMessage(m);
+      }
+    }
+  }
+  void Relay::Poll() {
+    Reclaim();
+    for (int i = 0; i < kMaxWorkers; i++) {
+      Message *m;
+      auto q = queues_[i][worker_].load(std::memory_order_acquire);
+      if (q == nullptr) {
+        continue;
+      }
+      while (q->pop(m)) {
+        Dispatch(*m);
+        Return(m);
+      }
+    }
+  }
+  void Relay::Advertise(const std::string &cname, const Handler::Listener *l, Resolver &&r) {
+    if (worker_ < 0) {
+      return;
+    }
+    auto it = origins_.find(cname);
+    if (it != origins_.end()) {
+      // connection with same cname re-registered. current subscribers need to re-subscribe
+      for (auto w : it->second.subscribers) {
+        Post(w, NewMessage(CLOSE, cname));
+      }
+      subscriptions_ -= it->second.subscribers.size();
+    }
+    origins_[cname] = { .listener = l, .resolver = std::move(r) };
+    auto lock = std::lock_guard<std::mutex>(mutex_);
+    directory_[cname] = worker_;
+  }
+  void Relay::Unadvertise(const std::string &cname, const Handler::Listener *l) {
+    auto it = origins_.find(cname);
+    if (it == origins_.end() || it->second.listener != l) {
+      return;
+    }
+    for (auto w : it->second.subscribers) {
+      Post(w, NewMessage(CLOSE, cname));
+    }
+    subscriptions_ -= it->second.subscribers.size();
+    origins_.erase(it);
+    auto lock = std::lock_guard<std::mutex>(mutex_);
+    auto dit = directory_.find(cname);
+    if (dit != directory_.end() && dit->second == worker_) {
+      directory_.erase(dit);
+    }
+  }
+  void Relay::Forward(
+    const Handler &h, Kind k, const std::string &path, const std::string &label, const void *p, size_t sz
+  ) {
+    auto it = origins_.find(h.cname());
+    if (it == origins_.end()) {
+      return;
+    }
+    for (auto w : it->second.subscribers) {
+      auto m = NewMessage(k, h.cname());
+      m->path = path;
+      m->label = label;
+      if (sz > 0) {
+        m->data.assign(static_cast<const char *>(p), sz);
+      }
+      Post(w, m);
+    }
+  }
+  void Relay::Produce(const Handler &h, const MediaStreamConfig &c) {
+    auto it = origins_.find(h.cname());
+    if (it == origins_.end()) {
+      return;
+    }
+    for (auto w : it->second.subscribers) {
+      auto m = NewMessage(PRODUCE, h.cname());
+      m->config = std::make_unique<MediaStreamConfig>(c);
+      Post(w, m);
+    }
+  }
+  std::shared_ptr<Handler> Relay::FindProxy(const std::string &cname) {
+    if (worker_ < 0) {
+      return nullptr;
+    }
+    auto pit = proxies_.find(cname);
+    if (pit != proxies_.end()) {
+      return pit->second->handler();
+    }
+    if (pending_.find(cname) != pending_.end()) {
+      return nullptr;
+    }
+    int owner;
+    {
+      auto lock = std::lock_guard<std::mutex>(mutex_);
+      auto dit = directory_.find(cname);
+      if (dit == directory_.end() || dit->second == worker_) {
+        return nullptr;
+      }
+      owner = dit->second;
+    }
+    QRPC_LOGJ(info, {{"ev","subscribe remote peer"},{"cname",cname},{"owner",owner},{"worker",worker_}});
+    if (Post(owner, NewMessage(SUBSCRIBE, cname))) {
+      pending_.insert(cname);
+    }
+    return nullptr;
+  }
+  bool Relay::WaitProxy(const std::string &cname, Waiter &&w) {
+    if (FindProxy(cname) != nullptr) {
+      if (proxies_[cname]->ready()) {
+        return false;
+      }
+    } else if (pending_.find(cname) == pending_.end()) {
+      // not owned by other worker, or subscription cannot be sent
+      return false;
+    }
+    auto &wt = waiters_[cname];
+    if (wt.alarm_id == AlarmProcessor::INVALID_ID) {
+      wt.alarm_id = alarm_processor_->Set([cname]() {
+        auto it = waiters_.find(cname);
+        if (it != waiters_.end()) {
+          QRPC_LOGJ(warn, {{"ev","wait proxy timeout"},{"cname",cname},{"waiters",it->second.waiters.size()}});
+          it->second.alarm_id = AlarmProcessor::INVALID_ID;
+          // let next FindProxy send subscription again
+          pending_.erase(cname);
+          Resolve(cname);
+        }
+        return qrpc_alarm_stop_rv();
+      }, qrpc_time_now() + kWaitProxyTimeout);
+    }
+    wt.waiters.push_back(std::move(w));
+    return true;
+  }
+  void Relay::Resolve(const std::string &cname) {
+    auto it = waiters_.find(cname);
+    if (it == waiters_.end()) {
+      return;
+    }
+    auto wt = std::move(it->second);
+    waiters_.erase(it);
+    if (wt.alarm_id != AlarmProcessor::INVALID_ID) {
+      alarm_processor_->Cancel(wt.alarm_id);
+    }
+    for (auto &w : wt.waiters) {
+      w();
+    }
+  }
+  void Relay::Feedback(int owner, const std::string &cname, const uint8_t *p, size_t sz) {
+    auto m = NewMessage(FEEDBACK, cname);
+    m->data.assign(reinterpret_cast<const char *>(p), sz);
+    Post(owner, m);
+  }
+  RTC::RtpPacket *Relay::ParseRtpPacket(const std::string &data) {
+    if (data.size() > kMaxRtpPacketSize) {
+      QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"ev","relayed RTP packet too large"},{"sz",data.size()}});
+      return nullptr;
+    }
+    std::memcpy(rtp_buffer_, data.data(), data.size());
+    auto *packet = RTC::RtpPacket::Parse(rtp_buffer_, data.size());
+    if (packet == nullptr) {
+      QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"ev","relayed data is not a valid RTP packet"},{"sz",data.size()}});
+    }
+    return packet;
+  }
+  void Relay::OnSubscribe(Message &m) {
+    auto it = origins_.find(m.cname);
+    auto h = it == origins_.end() ? nullptr : it->second.resolver();
+    if (h == nullptr) {
+      // peer gone or rtp not initialized yet
+      QRPC_LOGJ(info, {{"ev","subscribed peer not found"},{"cname",m.cname},{"from",m.from}});
+      Post(m.from, NewMessage(CLOSE, m.cname));
+      return;
+    }
+    auto &o = it->second;
+    o.handler = h.get();
+    if (std::find(o.subscribers.begin(), o.subscribers.end(), m.from) == o.subscribers.end()) {
+      o.subscribers.push_back(m.from);
+      subscriptions_++;
+    }
+    auto adv = NewMessage(ADVERTISE, m.cname);
+    adv->path = h->rtp_id();
+    adv->rtp_config = h->listener().GetRtpConfig();
+    Post(m.from, adv);
+    // current producers and published streams
+    for (auto &kv : h->producers()) {
+      auto *c = h->listener().media_stream_configs().FindSlot(kv.second->GetRtpParameters().mid);
+      if (c == nullptr || c->closed()) {
+        continue;
+      }
+      auto pm = NewMessage(PRODUCE, m.cname);
+      pm->config = std::make_unique<MediaStreamConfig>(*c);
+      Post(m.from, pm);
+    }
+    for (auto &kv : h->published_streams()) {
+      auto pm = NewMessage(PUBLISH, m.cname);
+      pm->label = kv.first;
+      Post(m.from, pm);
+    }
+    Post(m.from, NewMessage(READY, m.cname));
+  }
+  void Relay::OnUnsubscribe(Message &m) {
+    auto it = origins_.find(m.cname);
+    if (it == origins_.end()) {
+      return;
+    }
+    auto &subs = it->second.subscribers;
+    auto sit = std::find(subs.begin(), subs.end(), m.from);
+    if (sit != subs.end()) {
+      subs.erase(sit);
+      subscriptions_--;
+    }
+  }
+  void Relay::OnFeedback(Message &m) {
+    auto it = origins_.find(m.cname);
+    auto h = it == origins_.end() ? nullptr : it->second.resolver();
+    if (h == nullptr) {
+      return;
+    }
+    auto *packet = RTC::RTCP::Packet::Parse(reinterpret_cast<const uint8_t *>(m.data.data()), m.data.size());
+    while (packet != nullptr) {
+      h->listener().SendRtcpPacket(packet);
+      auto *prev = packet;
+      packet = packet->GetNext();
+      delete prev;
+    }
+  }
+  void Relay::Dispatch(Message &m) {
+    switch (m.kind) {
+    case SUBSCRIBE:
+      OnSubscribe(m);
+      return;
+    case UNSUBSCRIBE:
+      OnUnsubscribe(m);
+      return;
+    case FEEDBACK:
+      OnFeedback(m);
+      return;
+    case ADVERTISE: {
+      pending_.erase(m.cname);
+      auto pit = proxies_.find(m.cname);
+      if (pit != proxies_.end()) {
+        pit->second->Shutdown();
+      }
+      QRPC_LOGJ(info, {{"ev","create proxy"},{"cname",m.cname},{"owner",m.from},{"rtp_id",m.path}});
+      proxies_[m.cname] = std::make_shared<Proxy>(m.from, m.cname, m.path, m.rtp_config);
+    } return;
+    default:
+      break;
+    }
+    auto pit = proxies_.find(m.cname);
+    if (pit == proxies_.end()) {
+      if (m.kind == CLOSE) {
+        pending_.erase(m.cname);
+        Resolve(m.cname);
+      }
+      return;
+    }
+    auto &p = *pit->second;
+    if (p.owner() != m.from) {
+      return; // message from previous owner
+    }
+    switch (m.kind) {
+    case CLOSE:
+      QRPC_LOGJ(info, {{"ev","close proxy"},{"cname",m.cname},{"owner",m.from}});
+      p.Shutdown();
+      proxies_.erase(pit);
+      Resolve(m.cname);
+      break;
+    case READY:
+      p.SetReady();
+      Resolve(m.cname);
+      break;
+    case PRODUCE:
+      p.Produce(*m.config);
+      break;
+    case UNPRODUCE:
+      p.Unproduce(m.path);
+      break;
+    case PUBLISH:
+      p.Publish(m.label);
+      break;
+    case UNPUBLISH:
+      p.Unpublish(m.label);
+      break;
+    case RTP: {
+      auto *packet = ParseRtpPacket(m.data);
+      if (packet != nullptr) {
+        p.handler()->ReceiveRtpPacket(packet); // deletes packet
+      }
+    } break;
+    case RTCP: {
+      auto *packet = RTC::RTCP::Packet::Parse(reinterpret_cast<const uint8_t *>(m.data.data()), m.data.size());
+      if (packet != nullptr) {
+        p.handler()->ReceiveRtcpPacket(packet); // deletes packet
+      }
+    } break;
+    case STREAM:
+      p.Emit(m.label, m.data);
+      break;
+    case SYSCALL: {
+      auto *producer = p.handler()->FindProducerByPath(m.path);
+      if (producer != nullptr) {
+        p.handler()->SendToConsumersOf(producer, m.label, m.data.data(), m.data.size());
+      }
+    } break;
+    default:
+      ASSERT(false);
+      break;
+    }
+  }
+}
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "base/defs.h"
+#include "base/alarm.h"
+#include "base/macros.h"
+#include "base/notifier.h"
+#include "base/spsc.h"
+#include "base/syscall.h"
+#include "base/rtp/handler.h"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+
+namespace base {
+namespace rtp {
+  // Relay forwards media and data streams produced on one worker thread to other worker threads.
+  // because Handler::router_ is thread local, consumer only can consume producer on same thread.
+  // with Relay, origin worker pushes RTP/RTCP/stream messages of the producer into SPSC queue for each
+  // subscribing worker, then proxy handler on the subscribing worker re-produces them to local consumers.
+  // keyframe requests from proxied producer flows back to origin worker in same way.
+  class Relay {
+  public:
+    enum Kind : uint8_t {
+      // subscriber => origin
+      SUBSCRIBE, UNSUBSCRIBE, FEEDBACK,
+      // origin => subscriber
+      ADVERTISE, READY, CLOSE, PRODUCE, UNPRODUCE, PUBLISH, UNPUBLISH,
+      RTP, RTCP, STREAM, SYSCALL,
+    };
+    struct Message {
+      Kind kind;
+      int from;
+      std::string cname, path, label, data;
+      std::unique_ptr<MediaStreamConfig> config;
+      Handler::Config rtp_config;
+    };
+    typedef SpscQueue<Message *> Queue;
+    typedef std::function<std::shared_ptr<Handler> ()> Resolver;
+    typedef std::function<void ()> Waiter;
+    static constexpr int kMaxWorkers = 64;
+    static constexpr size_t kQueueSize = 8192;
+    static constexpr size_t kMaxFreeMessages = 8192;
+    static constexpr qrpc_time_t kWaitProxyTimeout = 3ULL * 1000 * 1000 * 1000; // 3s
+    // relayed RTP packets are received from socket on origin worker, so not larger than this
+    static constexpr size_t kMaxRtpPacketSize = Syscall::kMaxIncomingPacketSize;
+    // room for header extensions which proxy producer adds (mid, abs-send-time, transport-cc...)
+    static constexpr size_t kRtpHeadroom = 256;
+    class Proxy;
+  public:
+    static void ClassInit(Loop &l);
+    static void ClassDestroy(Loop &l);
+    static inline int worker() { return worker_; }
+    static inline uint64_t dropped() { return dropped_; }
+    // wakes up the loop of the worker when a message is posted to it. other cross worker queues
+    // (eg. webrtc::Dispatcher) share it by adding their poll handler and calling Notify()
+    static inline Notifier &notifier() { return notifiers_[worker_]; }
+    static inline void Notify(int to) { notifiers_[to].Notify(); }
+    static void Poll();
+  public: // origin side
+    static void Advertise(const std::string &cname, const Handler::Listener *l, Resolver &&r);
+    static void Unadvertise(const std::string &cname, const Handler::Listener *l);
+    static inline bool Relayed(const Handler &h) {
+      if (LIKELY(subscriptions_ <= 0)) { return false; }
+      auto it = origins_.find(h.cname());
+      return it != origins_.end() && it->second.handler == &h && !it->second.subscribers.empty();
+    }
+    static void Forward(
+      const Handler &h, Kind k, const std::string &path, const std::string &label, const void *p, size_t sz);
+    static void Produce(const Handler &h, const MediaStreamConfig &c);
+  public: // subscriber side
+    // returns proxy handler for cname which is owned by another worker.
+    // if no proxy yet, subscription request is sent to owner worker and returns nullptr.
+    static std::shared_ptr<Handler> FindProxy(const std::string &cname);
+    // if cname is owned by another worker and its proxy has not received current producers yet,
+    // w is called once it has (or owner closed it, or kWaitProxyTimeout passed) and returns true.
+    // returns false if there is nothing to wait, that is, FindProxy returns final result now.
+    static bool WaitProxy(const std::string &cname, Waiter &&w);
+    static void Feedback(int owner, const std::string &cname, const uint8_t *p, size_t sz);
+    // copies relayed RTP packet into per thread buffer with kRtpHeadroom and parses it there, because producer
+    // rewrites header extensions of the packet in place. returns nullptr if data is malformed or too large.
+    // buffer of returned packet is overwritten by next call on the same thread
+    static RTC::RtpPacket *ParseRtpPacket(const std::string &data);
+  protected:
+    struct Origin {
+      const Handler::Listener *listener;
+      Resolver resolver;
+      const Handler *handler{nullptr};
+      std::vector<int> subscribers;
+    };
+    struct Waiting {
+      AlarmProcessor::Id alarm_id{AlarmProcessor::INVALID_ID};
+      std::vector<Waiter> waiters;
+    };
+    static bool Post(int to, Message *m);
+    // messages are recycled, so that steady state relay does not allocate per packet.
+    // receiver returns processed message to the sender, then sender reuses it (and its string buffers).
+    static Message *NewMessage(Kind k, const std::string &cname) {
+      if (free_.empty()) {
+        Reclaim();
+      }
+      if (free_.empty()) {
+        return new Message { .kind = k, .from = worker_, .cname = cname };
+      }
+      auto m = free_.back();
+      free_.pop_back();
+      m->kind = k;
+      m->from = worker_;
+      m->cname = cname;
+      return m;
+    }
+    static void FreeMessage(Message *m);
+    static void Return(Message *m);
+    static void Reclaim();
+    static void Resolve(const std::string &cname);
+    static void Dispatch(Message &m);
+    static void OnSubscribe(Message &m);
+    static void OnUnsubscribe(Message &m);
+    static void OnFeedback(Message &m);
+  protected:
+    static thread_local int worker_;
+    static thread_local int subscriptions_;
+    static thread_local uint64_t dropped_;
+    static thread_local AlarmProcessor *alarm_processor_;
+    static thread_local std::unordered_map<std::string, Origin> origins_;
+    static thread_local std::unordered_map<std::string, std::shared_ptr<Proxy>> proxies_;
+    static thread_local std::set<std::string> pending_;
+    static thread_local std::unordered_map<std::string, Waiting> waiters_;
+    static thread_local std::vector<Message *> free_;
+    static thread_local uint8_t rtp_buffer_[kMaxRtpPacketSize + kRtpHeadroom];
+    static std::mutex mutex_;
+    static std::unordered_map<std::string, int> directory_; // cname => worker
+    static std::atomic<Queue*> queues_[kMaxWorkers][kMaxWorkers]; // [from][to]
+    static std::atomic<Queue*> returns_[kMaxWorkers][kMaxWorkers]; // [from][to], processed messages
+    static bool workers_[kMaxWorkers];
+    static Notifier notifiers_[kMaxWorkers];
+  };
+}
+}
@@ -94,7 +94,8 @@ namespace base {
     alarm_id_(AlarmProcessor::INVALID_ID),
     certpair_(rhs.certpair_),
     session_timeout_(rhs.session_timeout_),
-    is_listener_(rhs.is_listener_) {
+    is_listener_(rhs.is_listener_),
+    reuse_port_(rhs.reuse_port_) {
     if (rhs.alarm_id_ != AlarmProcessor::INVALID_ID) {
       rhs.loop_.alarm_processor().Cancel(rhs.alarm_id_);
       rhs.alarm_id_ = AlarmProcessor::INVALID_ID;
@@ -197,11 +198,12 @@ namespace base {
     }
     int r;
     if ((r = Syscall::SendTo(fd_, mmsg, size)) < 0) {
-      if (Syscall::IOMayBlocked(r, false)) {
+      if (Syscall::IOMayBlocked(Syscall::Errno(), false)) {
         return size; // nothing should be sent
       }
-      ASSERT(false);
-      QRPC_LOGJ(error, {{"ev", "Syscall::SendTo fails"}, {"errno", Syscall::Errno()}});
+      QRPC_LOGJ_RATELIMIT(error, QRPC_LOG_PACKET_RATE, {{"ev", "Syscall::SendTo fails"}, {"errno", Syscall::Errno()}});
+      // give up the packet that causes error
+      r = 1;
     }
     ASSERT(r <= size);
     Reset(r);
@@ -226,7 +228,7 @@ namespace base {
         if (Syscall::IOMayBlocked(Syscall::Errno(), false)) {
             return size - idx;
         }
-        QRPC_LOGJ(error, {{"ev","SendTo fails"},{"fd",fd_},{"errno",Syscall::Errno()}});
+        QRPC_LOGJ_RATELIMIT(error, QRPC_LOG_PACKET_RATE, {{"ev","SendTo fails"},{"fd",fd_},{"errno",Syscall::Errno()}});
         ASSERT(false);
         return QRPC_ESYSCALL;
       }
@@ -237,82 +239,107 @@ namespace base {
   }
 
   int UdpListener::Flush() {
-    size_t n_writebuf = write_buffers_.Allocated();
   #if defined(__QRPC_USE_RECVMMSG__)
-    mmsghdr mmsg[n_writebuf];
-    auto n_sessions = sessions_.size();
-    size_t sends[n_sessions];
-    UdpSession *sessions[n_sessions];
-    size_t count = 0, session_idx = 0;
-    for (auto kv : sessions_) {
-      auto s = dynamic_cast<UdpSession *>(kv.second);
-      auto size = s->write_vecs().size();
-      sends[session_idx] = size;
-      sessions[session_idx] = s;
-      session_idx++;
-      for (size_t idx = 0; idx < size; idx++) {
-        auto &iov = s->write_vecs()[idx];
-        auto &h = mmsg[count++].msg_hdr;
-        h.msg_name = const_cast<sockaddr *>(s->addr().sa());
-        h.msg_namelen = s->addr().salen();
-        h.msg_iov = &iov;
-        h.msg_iovlen = 1;
-        h.msg_control = nullptr;
-        h.msg_controllen = 0;
-        mmsg[count - 1].msg_len = 0;
+    // kernel rejects sendmmsg with vlen larger than UIO_MAXIOV
+    constexpr size_t kMaxSendBatch = UIO_MAXIOV;
+    size_t count = 0;
+    for (auto s : flush_sessions_) {
+      if (!s->promoted()) {
+        count += s->write_vecs().size();
       }
     }
-    size_t r;
-    if ((r = Syscall::SendTo(fd_, mmsg, count)) < 0) {
-      if (Syscall::IOMayBlocked(r, false)) {
-        return count; // nothing should be sent
+    if (write_packets_.size() < count) {
+      write_packets_.resize(count);
+    }
+    // build one message vector for all queued sessions, except promoted ones that have their own socket
+    size_t idx = 0;
+    for (auto s : flush_sessions_) {
+      if (s->promoted()) {
+        continue;
       }
-      ASSERT(false);
-      QRPC_LOGJ(error, {{"ev", "Syscall::SendTo fails"}, {"errno", Syscall::Errno()}});
-      return count;
-    }
-    if (r < count) {
-      auto remain = count - r;
-      // partially sent. reset iovs due to sent count
-      for (size_t idx = 0; idx < session_idx; idx++) {
-        auto s = sessions[idx];
-        if (sends[idx] < r) {
-          s->Reset(sends[idx]);
-          r -= sends[idx];
-        } else {
-          s->Reset(sends[idx] - r);
+      for (size_t i = 0; i < s->write_vecs().size(); i++) {
+        SetupWritePacket(idx++, *s, i, false);
+      }
+    }
+    size_t sent = 0;
+    while (sent < count) {
+      int r = Syscall::SendTo(fd_, write_packets_.data() + sent, std::min(count - sent, kMaxSendBatch));
+      if (r < 0) {
+        if (Syscall::IOMayBlocked(Syscall::Errno(), false)) {
+          // send buffer is full. give more room to it and retry remaining packets by flush task
+          stats_.tx_blocked++;
+          GrowSocketBuffer(false);
           break;
         }
+        // give up the packet that causes error, so that it does not block other sessions' packets
+        QRPC_LOGJ_RATELIMIT(error, QRPC_LOG_PACKET_RATE, {{"ev", "Syscall::SendTo fails"}, {"errno", Syscall::Errno()}});
+        r = 1;
       }
-      return remain;
-    } else {
-      // all sent
-      for (size_t idx = 0; idx < session_idx; idx++) {
-        auto s = sessions[idx];
-        s->Reset(sends[idx]);
+      sent += r;
+    }
+    // release sent buffers, and keep sessions that still have unsent packets in the queue
+    size_t remain = 0;
+    auto it = flush_sessions_.begin();
+    for (auto s : flush_sessions_) {
+      if (s->promoted()) {
+        FlushPromoted(*s);
+      } else {
+        auto n = std::min(sent, s->write_vecs().size());
+        s->Reset(n);
+        sent -= n;
+      }
+      if (s->write_vecs().empty()) {
+        s->set_flush_queued(false);
+      } else {
+        remain += s->write_vecs().size();
+        *it++ = s;
       }
-      return 0;
     }
+    flush_sessions_.erase(it, flush_sessions_.end());
+    return remain;
   #else
-    for (auto kv : sessions_) {
-      auto s = dynamic_cast<UdpSession *>(kv.second);
+    size_t remain = 0;
+    auto it = flush_sessions_.begin();
+    for (auto s : flush_sessions_) {
       int r = s->Flush();
-      if (r != 0) {
-        return n_writebuf - write_buffers_.Allocated();
+      if (r > 0) {
+        remain += r;
+        *it++ = s;
+      } else {
+        s->set_flush_queued(false);
       }
     }
-    return 0;
+    flush_sessions_.erase(it, flush_sessions_.end());
+    return remain;
   #endif
   }
 
+
   UdpListener::UdpListener(UdpListener &&rhs) :
     UdpSessionFactory(std::move(rhs)),
     fd_(rhs.fd_),
     port_(rhs.port_),
     overflow_supported_(rhs.overflow_supported_),
+    max_socket_buffer_size_(rhs.max_socket_buffer_size_),
+    min_batch_size_(rhs.min_batch_size_),
+    read_batch_size_(rhs.read_batch_size_),
+    ecn_(rhs.ecn_),
+    xdp_config_(rhs.xdp_config_),
+    xdp_(std::move(rhs.xdp_)),
+    rxq_ovfl_(rhs.rxq_ovfl_),
+    last_rcvbuf_tune_(rhs.last_rcvbuf_tune_),
+    last_sndbuf_tune_(rhs.last_sndbuf_tune_),
+    rcvbuf_capped_(rhs.rcvbuf_capped_),
+    sndbuf_capped_(rhs.sndbuf_capped_),
+    stats_(rhs.stats_),
+    rx_latency_(rhs.rx_latency_),
+    batch_fill_(rhs.batch_fill_),
+    batch_fill_avg_(rhs.batch_fill_avg_),
     sessions_(std::move(rhs.sessions_)),
-    read_packets_(batch_size_),
-    read_buffers_(batch_size_) {
+    flush_sessions_(std::move(rhs.flush_sessions_)),
+    write_packets_(std::move(rhs.write_packets_)),
+    read_packets_(std::move(rhs.read_packets_)),
+    read_buffers_(std::move(rhs.read_buffers_)) {
     rhs.fd_ = INVALID_FD;
     SetupPacket();
   }
@@ -332,52 +359,199 @@ namespace base {
     }
   }
 
-  void UdpListener::ProcessPackets(int size) {
-    int r;
+  bool UdpListener::ProcessPackets(int size, UdpSession *target) {
     auto now = qrpc_time_now();
+    bool alive = true;
+    // copy, because target might be deleted during the loop
+    Address target_addr = target != nullptr ? target->addr() : Address();
+    processing_ = true;
     for (int i = 0; i < size; i++) {
       auto &h = read_packets_[i].msg_hdr;
-      auto a = Address(h.msg_name, h.msg_namelen);
-      auto exists = sessions_.find(a);
-      // this also acts as anchor that prevents deletion of session pointer
-      // in Session::Close call
-      Session *s;
-      if (exists == sessions_.end()) {
-        // use same fd of Listener
-        s = Create(fd_, a, factory_method_);
-        ASSERT(s != nullptr);
-        logger::info({{"ev", "accept"},{"proto","udp"},{"fd",fd_},{"addr",a.str()}});
-        if ((r = s->OnConnect()) < 0) {
-          s->Close(QRPC_CLOSE_REASON_LOCAL, r);
-          continue;
+      qrpc_time_t rx_time = 0;
+      uint8_t ecn = Syscall::ECN_NOT_ECT;
+      if (Syscall::GetRxTimestamp(h, rx_time) && now > rx_time) {
+        rx_latency_.Record(now - rx_time);
+      }
+      if (Syscall::GetEcn(h, ecn) && ecn == Syscall::ECN_CE) {
+        stats_.rx_ce++;
+      }
+      auto p = reinterpret_cast<const char *>(h.msg_iov->iov_base);
+      current_hdr_ = &h;
+      // connected socket may receive packets from other peers which arrive between its bind() and connect()
+      if (target != nullptr && h.msg_namelen == target->addr().salen() &&
+        memcmp(h.msg_name, target->addr().sa(), h.msg_namelen) == 0) {
+        if (!(alive = Deliver(*target, p, read_packets_[i].msg_len, now, rx_time, ecn))) {
+          break;
         }
       } else {
-        s = exists->second;
+        ProcessPacket(Address(h.msg_name, h.msg_namelen), p, read_packets_[i].msg_len, now, rx_time, ecn);
+        // other session's packet might close whole connection including target
+        if (target != nullptr && (alive = (sessions_.find(target_addr) != sessions_.end())) == false) {
+          break;
+        }
       }
+    }
+    current_hdr_ = nullptr;
+    processing_ = false;
+    // send all buffered packets and start flush task if unsent packets remain
+    TryFlush();
+    return alive;
+  }
+
+  void UdpListener::ProcessPacket(
+    const Address &a, const char *p, size_t sz, qrpc_time_t now, qrpc_time_t rx_time, uint8_t ecn
+  ) {
+    int r;
+    auto exists = sessions_.find(a);
+    // this also acts as anchor that prevents deletion of session pointer
+    // in Session::Close call
+    Session *s;
+    if (exists == sessions_.end()) {
+      // use same fd of Listener
+      s = Create(fd_, a, factory_method_);
       ASSERT(s != nullptr);
-      if ((r = s->OnRead(
-        reinterpret_cast<const char *>(h.msg_iov->iov_base),
-        read_packets_[i].msg_len
-      )) < 0) {
+      QRPC_LOGJ(info, {{"ev", "accept"},{"proto","udp"},{"fd",fd_},{"addr",a.str()}});
+      if ((r = s->OnConnect()) < 0) {
         s->Close(QRPC_CLOSE_REASON_LOCAL, r);
-      } else {
-        dynamic_cast<UdpSession*>(s)->Touch(now);
+        return;
       }
+    } else {
+      s = exists->second;
+    }
+    ASSERT(s != nullptr);
+    Deliver(*static_cast<UdpSession*>(s), p, sz, now, rx_time, ecn);
+  }
+
+  bool UdpListener::Deliver(
+    UdpSession &s, const char *p, size_t sz, qrpc_time_t now, qrpc_time_t rx_time, uint8_t ecn
+  ) {
+    int r;
+    s.set_rx_time(rx_time);
+    s.set_rx_ecn(ecn);
+    if ((r = s.OnRead(p, sz)) < 0) {
+      s.Close(QRPC_CLOSE_REASON_LOCAL, r);
+      return false;
+    }
+    s.Touch(now);
+    return true;
+  }
+
+  void UdpListener::CheckOverflow(const struct msghdr &h) {
+    uint32_t dropped;
+    if (!overflow_supported_ || !Syscall::GetRxqOverflow(h, dropped) || dropped == rxq_ovfl_) {
+      return;
+    }
+    // counter is cumulative (and may wrap around), so take difference from last observed value
+    uint32_t delta = dropped - rxq_ovfl_;
+    rxq_ovfl_ = dropped;
+    stats_.rx_dropped += delta;
+    QRPC_LOGJ_RATELIMIT(warn, 1, {{"ev","udp packets dropped by kernel"},{"port",port_},
+      {"dropped",delta},{"total",stats_.rx_dropped},{"rcvbuf",stats_.rcvbuf},{"batch",read_batch_size_}});
+    // we cannot keep up with incoming packets. read as many packets as possible for each syscall,
+    // and give more room to receive queue
+    read_batch_size_ = batch_size_;
+    batch_fill_avg_ = batch_size_ << BATCH_FILL_AVG_SHIFT;
+    stats_.batch_size = read_batch_size_;
+    GrowSocketBuffer(true);
+  }
+
+  void UdpListener::AdaptBatchSize(int received) {
+    batch_fill_.Record(received);
+    // avg = avg * 7/8 + received * 1/8. use average of recent batches instead of last one,
+    // so that single burst or idle read does not flip batch size back and forth.
+    batch_fill_avg_ += received - (batch_fill_avg_ >> BATCH_FILL_AVG_SHIFT);
+    int avg = batch_fill_avg_ >> BATCH_FILL_AVG_SHIFT;
+    // grow immediately when batch is filled (more packets likely to be queued), shrink when recent batches
+    // are mostly unused, so that we don't need to reset whole message vector for each read on idle listener.
+    if (received >= read_batch_size_) {
+      read_batch_size_ = std::min(read_batch_size_ * 2, batch_size_);
+    } else if (avg <= (read_batch_size_ >> 2)) {
+      read_batch_size_ = std::max(read_batch_size_ >> 1, min_batch_size_);
+    }
+    stats_.batch_size = read_batch_size_;
+  }
+
+  void UdpListener::OpenXdp() {
+    auto x = std::make_unique<XdpSocket>();
+    if (x->Open(xdp_config_, port_) < 0) {
+      QRPC_LOGJ(warn, {{"ev","AF_XDP not available, continue with UDP socket"},{"port",port_},
+        {"ifname",xdp_config_.ifname}});
+      return;
+    }
+    if (loop_.Add(x->fd(), this, Loop::EV_READ) < 0) {
+      QRPC_LOGJ(error, {{"ev","Loop::Add fails for AF_XDP socket"},{"fd",x->fd()},{"port",port_}});
+      return;
+    }
+    xdp_ = std::move(x);
+  }
+
+  int UdpListener::ReadXdp() {
+    auto now = qrpc_time_now();
+    processing_ = true;
+    // packets are processed in place on UMEM frames, which are given back to kernel after the batch
+    int r = xdp_->Read(batch_size_, [this, now](const Address &a, const char *p, size_t sz, uint8_t ecn) {
+      if (ecn == Syscall::ECN_CE) {
+        stats_.rx_ce++;
+      }
+      ProcessPacket(a, p, sz, now, 0, ecn);
+    });
+    processing_ = false;
+    stats_.rx_xdp_bad_checksum = xdp_->checksum_errors();
+    if (r > 0) {
+      stats_.rx_packets += r;
+      stats_.rx_xdp += r;
+      stats_.rx_batches++;
+      batch_fill_.Record(r);
     }
-    // send all buffered packets and start flush task if unsent packets remain
     TryFlush();
+    return r;
   }
 
-  int UdpListener::Read() {
-    for (int i = 0; i < batch_size_; i++) {
+  void UdpListener::GrowSocketBuffer(bool rx) {
+    auto now = qrpc_time_now();
+    // give kernel a chance to use grown buffer before next tuning. rx and tx are tuned independently,
+    // so that tx pressure right after rx tuning (or vice versa) is not ignored
+    auto &last_tune = rx ? last_rcvbuf_tune_ : last_sndbuf_tune_;
+    if (max_socket_buffer_size_ == 0 || (now - last_tune) < qrpc_time_sec(1)) {
+      return;
+    }
+    last_tune = now;
+    int &cur = rx ? stats_.rcvbuf : stats_.sndbuf;
+    bool &capped = rx ? rcvbuf_capped_ : sndbuf_capped_;
+    // linux reports doubled value of requested size, so requesting reported size doubles actual buffer
+    if (capped || cur <= 0 || (size_t)cur / 2 >= max_socket_buffer_size_) {
+      return;
+    }
+    size_t next = std::min((size_t)cur, max_socket_buffer_size_);
+    if (!(rx ? Syscall::SetReceiveBufferSize(fd_, next) : Syscall::SetSendBufferSize(fd_, next))) {
+      return;
+    }
+    auto prev = cur;
+    cur = rx ? Syscall::GetReceiveBufferSize(fd_) : Syscall::GetSendBufferSize(fd_);
+    if (cur <= prev) {
+      // capped by net.core.rmem_max/wmem_max. stop tuning further
+      QRPC_LOGJ(warn, {{"ev","socket buffer size capped by system limit"},{"port",port_},
+        {"rx",rx},{"size",cur},{"requested",next}});
+      capped = true;
+      return;
+    }
+    QRPC_LOGJ(info, {{"ev","socket buffer size tuned"},{"port",port_},{"rx",rx},{"from",prev},{"to",cur}});
+  }
+
+  void UdpListener::PrepareRead(int count) {
+    for (int i = 0; i < count; i++) {
       auto &h = read_packets_[i].msg_hdr;
       h.msg_namelen = sizeof(read_buffers_[i].sa);
       h.msg_iov->iov_len = Syscall::kMaxIncomingPacketSize;
       h.msg_controllen = Syscall::kDefaultUdpPacketControlBufferSize;
       read_packets_[i].msg_len = 0;
     }
+  }
+
+  int UdpListener::Read() {
+    PrepareRead(read_batch_size_);
   #if defined(__QRPC_USE_RECVMMSG__)
-    int r = Syscall::RecvFrom(fd_, read_packets_.data(), batch_size_);
+    int r = Syscall::RecvFrom(fd_, read_packets_.data(), read_batch_size_);
     if (r < 0) {
       int eno = Syscall::Errno();
       if (Syscall::IOMayBlocked(eno, false)) {
@@ -386,6 +560,13 @@ namespace base {
       logger::error({{"ev", "Syscall::RecvFrom fails"}, {"errno", eno}});
       return QRPC_ESYSCALL;
     }
+    stats_.rx_packets += r;
+    stats_.rx_batches++;
+    if (r > 0) {
+      // kernel attaches latest drop counter to each packet, so checking last one is enough
+      CheckOverflow(read_packets_[r - 1].msg_hdr);
+    }
+    AdaptBatchSize(r);
     return r;
   #else
     int r = Syscall::RecvFrom(fd_, &read_packets_.data()->msg_hdr);
@@ -398,7 +579,150 @@ namespace base {
       return QRPC_ESYSCALL;
     }
     read_packets_.data()->msg_len = r;
+    stats_.rx_packets++;
+    stats_.rx_batches++;
+    CheckOverflow(read_packets_.data()->msg_hdr);
     return 1;
   #endif
   }
-}
\ No newline at end of file
+
+  void UdpListener::SetupWritePacket(
+    size_t idx, UdpSession &s, size_t vec_idx, bool connected
+  ) {
+    auto &h = write_packets_[idx].msg_hdr;
+    // connected socket should not specify destination, otherwise kernel does route lookup for it
+    h.msg_name = connected ? nullptr : const_cast<sockaddr *>(s.addr().sa());
+    h.msg_namelen = connected ? 0 : s.addr().salen();
+    h.msg_iov = &s.write_vecs()[vec_idx];
+    h.msg_iovlen = 1;
+    h.msg_control = nullptr;
+    h.msg_controllen = 0;
+    write_packets_[idx].msg_len = 0;
+  }
+
+  int UdpListener::FlushPromoted(UdpSession &s) {
+    auto count = s.write_vecs().size();
+  #if defined(__QRPC_USE_RECVMMSG__)
+    if (write_packets_.size() < count) {
+      write_packets_.resize(count);
+    }
+    for (size_t i = 0; i < count; i++) {
+      SetupWritePacket(i, s, i, true);
+    }
+    size_t sent = 0;
+    while (sent < count) {
+      int r = Syscall::SendTo(s.connected_fd(), write_packets_.data() + sent, std::min<size_t>(count - sent, UIO_MAXIOV));
+      if (r < 0) {
+        if (Syscall::IOMayBlocked(Syscall::Errno(), false)) {
+          stats_.tx_blocked++;
+          break;
+        }
+        // eg. ECONNREFUSED by ICMP port unreachable from peer. drop the packet like unconnected socket does
+        QRPC_LOGJ_RATELIMIT(error, QRPC_LOG_PACKET_RATE, {{"ev","Syscall::SendTo fails for connected socket"},
+          {"fd",s.connected_fd()},{"errno",Syscall::Errno()}});
+        r = 1;
+      }
+      sent += r;
+    }
+    s.Reset(sent);
+    return count - sent;
+  #else
+    return s.Flush();
+  #endif
+  }
+
+  bool UdpListener::PromoteSession(UdpSession &s) {
+    if (s.promoted()) {
+      return true;
+    }
+    if (!reuse_port_) {
+      QRPC_LOGJ(warn, {{"ev","session promotion needs reuse_port listener"},{"port",port_},{"addr",s.addr().str()}});
+      return false;
+    }
+    bool overflow_supported;
+    Fd fd = Syscall::CreateUDPSocket(s.addr().family(), &overflow_supported);
+    if (fd == INVALID_FD) {
+      return false;
+    }
+    // bind to the local address that peer sends packets to, if it is known from the packet being processed.
+    // otherwise kernel chooses it by route on connect()
+    sockaddr_storage local;
+    socklen_t local_len;
+    int r;
+    if (current_hdr_ != nullptr && current_hdr_->msg_namelen == s.addr().salen() &&
+      memcmp(current_hdr_->msg_name, s.addr().sa(), s.addr().salen()) == 0 &&
+      Syscall::GetPacketDestination(*current_hdr_, port_, local, local_len)) {
+      r = Syscall::SetSocketReusePort(fd) ? Syscall::Bind(fd, reinterpret_cast<sockaddr *>(&local), local_len) : QRPC_ESYSCALL;
+    } else {
+      r = Syscall::SetSocketReusePort(fd) ? Syscall::Bind(fd, port_, s.addr().family() == AF_INET6) : QRPC_ESYSCALL;
+    }
+    if (r < 0 || connect(fd, s.addr().sa(), s.addr().salen()) < 0) {
+      QRPC_LOGJ(error, {{"ev","fail to create connected socket"},{"addr",s.addr().str()},{"errno",Syscall::Errno()}});
+      Syscall::Close(fd);
+      return false;
+    }
+    if (ecn_) {
+      Syscall::SetEcn(fd, s.addr().family(), Syscall::ECN_ECT1);
+    }
+    if (loop_.Add(fd, &s, Loop::EV_READ) < 0) {
+      QRPC_LOGJ(error, {{"ev","Loop::Add fails for connected socket"},{"fd",fd},{"addr",s.addr().str()}});
+      Syscall::Close(fd);
+      return false;
+    }
+    s.set_connected_fd(fd);
+    stats_.promoted++;
+    QRPC_LOGJ(info, {{"ev","session promoted to connected socket"},{"fd",fd},{"port",port_},{"addr",s.addr().str()}});
+    return true;
+  }
+
+  void UdpListener::DemoteSession(UdpSession &s) {
+    if (!s.promoted()) {
+      return;
+    }
+    auto fd = s.connected_fd();
+    loop_.Del(fd);
+    Syscall::Close(fd);
+    // queued packets are sent from listener socket by next flush
+    s.set_connected_fd(INVALID_FD);
+    stats_.demoted++;
+    QRPC_LOGJ(info, {{"ev","session demoted from connected socket"},{"fd",fd},{"port",port_},{"addr",s.addr().str()}});
+  }
+
+  void UdpListener::OnPromotedEvent(UdpSession &s, Fd fd, const Event &e) {
+    if (!Loop::Readable(e)) {
+      return;
+    }
+    // session may be demoted (and fd number reused) while processing packets
+    while (s.connected_fd() == fd) {
+  #if defined(__QRPC_USE_RECVMMSG__)
+      PrepareRead(read_batch_size_);
+      int r = Syscall::RecvFrom(fd, read_packets_.data(), read_batch_size_);
+  #else
+      PrepareRead(1);
+      int r = Syscall::RecvFrom(fd, &read_packets_.data()->msg_hdr);
+      if (r >= 0) {
+        read_packets_.data()->msg_len = r;
+        r = 1;
+      }
+  #endif
+      if (r < 0) {
+        int eno = Syscall::Errno();
+        if (Syscall::IOMayBlocked(eno, false)) {
+          return;
+        }
+        // pending ICMP error (eg. ECONNREFUSED) is reported once, then following packets can be read
+        if (eno == ECONNREFUSED) {
+          continue;
+        }
+        QRPC_LOGJ_RATELIMIT(error, QRPC_LOG_PACKET_RATE, {{"ev","Syscall::RecvFrom fails for connected socket"},
+          {"fd",fd},{"errno",eno}});
+        return;
+      }
+      stats_.rx_packets += r;
+      stats_.rx_batches++;
+      if (!ProcessPackets(r, &s)) {
+        return; // session closed
+      }
+    }
+  }
+}
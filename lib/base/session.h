@@ -2,6 +2,14 @@
 
 #include "base/session_base.h"
 #include "base/handshaker.h"
+#include "base/buffer_pool.h"
+#include "base/fd_map.h"
+#include "base/histogram.h"
+#include "base/memory.h"
+#include "base/xdp.h"
+#include "base/zerocopy.h"
+
+#include <algorithm>
 
 namespace base {
     class TcpSessionFactory : public SessionFactory {
@@ -14,6 +22,10 @@ namespace base {
                 // default no timeout
                 return Config(NopResolver::Instance(), qrpc_time_sec(0), false, std::nullopt);
             }
+        public:
+            // writes of at least this size by TcpSession::WriteZeroCopy use MSG_ZEROCOPY (plain TCP only).
+            // pinning pages costs more than copying small buffers, so 0 (disabled) or >= 10KB is recommended
+            size_t zerocopy_threshold{0};
         };
     public:
         class TcpSession : public Session, public IoProcessor {
@@ -29,12 +41,33 @@ namespace base {
                 factory().loop().ModProcessor(fd_, newsession);
                 fd_ = INVALID_FD; // invalidate fd_ so that SessionFactory::Close will not close fd_
                 hs().MigrateTo(newsession->hs());
+                newsession->zerocopy_ = std::move(zerocopy_);
                 tcp_session_factory().UpdateSession(*newsession);
             }
             inline bool migrated() const { return fd_ == INVALID_FD && hs().migrated(); }
             inline int Write(const char *p, size_t sz) { return hs().Write(*this, p, sz); }
             inline int Writev(const char *pp[], size_t *psz, size_t sz) { return hs().Writev(*this, pp, psz, sz); }
             inline int Read(char *p, size_t sz) { return hs().Read(*this, p, sz); }
+            // same as Write, but kernel sends p without copying if it is large enough (Config::zerocopy_threshold).
+            // release is called when p is no longer referred by kernel, so p should be kept unchanged until then.
+            int WriteZeroCopy(const char *p, size_t sz, ZeroCopyTracker::Release &&release) {
+                auto zc = ZeroCopyFor(sz);
+                if (zc == nullptr) {
+                    int r = Write(p, sz);
+                    release();
+                    return r;
+                }
+                return zc->Send(fd_, p, sz, std::move(release));
+            }
+            // called before fd is closed. read remaining completions, and returns tracker if kernel still refers
+            // some buffers. then caller should keep fd open until they complete (see TcpSessionFactory::Linger)
+            std::unique_ptr<ZeroCopyTracker> FinZeroCopy() {
+                if (zerocopy_ == nullptr) {
+                    return nullptr;
+                }
+                zerocopy_->Complete(fd_);
+                return zerocopy_->pending() > 0 ? std::move(zerocopy_) : nullptr;
+            }
             // implements Session
             const char *proto() const override { return "TCP"; }
             // implements IoProcessor
@@ -50,35 +83,94 @@ namespace base {
                         return;
                     }
                 }
+                if (zerocopy_ != nullptr && Loop::Errored(e)) {
+                    zerocopy_->Complete(fd);
+                }
                 if (Loop::Readable(e)) {
+                    // buffer is owned by this event handling, because session may be deleted while reading
+                    size_t bsz = read_buffer_size_;
+                    char *buffer = BufferPool::Alloc(bsz);
                     while (true) {
-                        char buffer[4096];
-                        int sz = sizeof(buffer);
+                        int sz = bsz;
                         if ((sz = Read(buffer, sz)) < 0) {
                             break; // close may called in each handshaker
                         }
+                        size_t rsz = sz;
                         if (sz == 0 || (sz = OnRead(buffer, sz)) < 0) {
                             Close((migrated() ? QRPC_CLOSE_REASON_MIGRATED :
                                 (sz == 0 ? QRPC_CLOSE_REASON_REMOTE : QRPC_CLOSE_REASON_LOCAL)), sz);
                             break;
                         }
+                        if (AdaptReadBuffer(rsz) > bsz) {
+                            // burst is larger than buffer. continue with grown buffer
+                            BufferPool::Free(buffer, bsz);
+                            bsz = read_buffer_size_;
+                            buffer = BufferPool::Alloc(bsz);
+                        }
+                    }
+                    BufferPool::Free(buffer, bsz);
+                }
+            }
+        protected:
+            // grow read buffer when a read fills it, shrink after consecutive small reads.
+            static constexpr int SHRINK_THRESHOLD = 16;
+            inline size_t AdaptReadBuffer(size_t sz) {
+                if (sz >= read_buffer_size_) {
+                    small_reads_ = 0;
+                    if (read_buffer_size_ < BufferPool::kMaxSize) {
+                        read_buffer_size_ <<= 1;
+                    }
+                } else if (sz <= (read_buffer_size_ >> 2) && read_buffer_size_ > BufferPool::kMinSize) {
+                    if (++small_reads_ >= SHRINK_THRESHOLD) {
+                        small_reads_ = 0;
+                        read_buffer_size_ >>= 1; // takes effect from next event
                     }
+                } else {
+                    small_reads_ = 0;
+                }
+                return read_buffer_size_;
+            }
+            ZeroCopyTracker *ZeroCopyFor(size_t sz) {
+                auto threshold = tcp_session_factory().zerocopy_threshold();
+                // TLS encrypts into its own buffer, so zerocopy is meaningless
+                if (threshold == 0 || sz < threshold || zerocopy_unsupported_ ||
+                    !hs().finished() || dynamic_cast<PlainHandshaker *>(handshaker_) == nullptr) {
+                    return nullptr;
+                }
+                if (zerocopy_ == nullptr) {
+                    if (Syscall::EnableZeroCopy(fd_) < 0) {
+                        zerocopy_unsupported_ = true;
+                        return nullptr;
+                    }
+                    zerocopy_ = std::make_unique<ZeroCopyTracker>();
                 }
+                // kernel reported that it copied anyway (eg. loopback). stop paying for page pinning
+                return zerocopy_->copying() ? nullptr : zerocopy_.get();
             }
         protected:
             Handshaker *handshaker_;
+            uint32_t read_buffer_size_{BufferPool::kMinSize};
+            int small_reads_{0};
+            std::unique_ptr<ZeroCopyTracker> zerocopy_;
+            bool zerocopy_unsupported_{false};
         };
+    public:
+        // how often and how long closed socket waits for zerocopy completions (see Linger)
+        static constexpr qrpc_time_t kZeroCopyLingerInterval = 10 * 1000 * 1000; // 10ms
+        static constexpr qrpc_time_t kZeroCopyLingerTimeout = 5ULL * 1000 * 1000 * 1000; // 5s
     public:
         TcpSessionFactory(Loop &l, FactoryMethod &&m, Config c = Config::Default()) :
-            SessionFactory(l, std::move(m), c) {}
+            SessionFactory(l, std::move(m), c), zerocopy_threshold_(c.zerocopy_threshold) {}
         TcpSessionFactory(TcpSessionFactory &&rhs) :
-            SessionFactory(std::move(rhs)), sessions_(std::move(rhs.sessions_)) {
+            SessionFactory(std::move(rhs)), sessions_(std::move(rhs.sessions_)),
+            zerocopy_threshold_(rhs.zerocopy_threshold_) {
             tls_ctx_ = rhs.tls_ctx_;
             rhs.tls_ctx_ = nullptr;
         }
         ~TcpSessionFactory() override { Fin(); }
         DISALLOW_COPY_AND_ASSIGN(TcpSessionFactory);
         void Fin() { FinSessions(sessions_); }
+        inline size_t zerocopy_threshold() const { return zerocopy_threshold_; }
         // implements SessionFactory
         Session *Open(const Address &a, FactoryMethod m) override {
             Fd fd = Syscall::Connect(a.sa(), a.salen());
@@ -98,23 +190,51 @@ namespace base {
         void Close(Session &s) override {
             Fd fd = s.fd();
             if (fd != INVALID_FD) {
+                auto zc = static_cast<TcpSession &>(s).FinZeroCopy();
                 loop_.Del(fd);
-                Syscall::Close(fd);
+                if (zc != nullptr) {
+                    Linger(fd, std::move(zc));
+                } else {
+                    Syscall::Close(fd);
+                }
                 sessions_.erase(fd);
             }
         }
+        // closed fd cannot receive completions, while kernel still reads zerocopy buffers for (re)transmission.
+        // so the socket is only shut down for write (FIN is sent after queued data), and closed after all completions
+        // are received or kZeroCopyLingerTimeout passes. buffers are released only then.
+        // the alarm does not refer the factory, so that it works even after the factory is destroyed.
+        void Linger(Fd fd, std::unique_ptr<ZeroCopyTracker> &&zc) {
+            ::shutdown(fd, SHUT_WR);
+            auto now = qrpc_time_now();
+            alarm_processor_.Set([fd, zc = std::shared_ptr<ZeroCopyTracker>(std::move(zc)),
+                deadline = now + kZeroCopyLingerTimeout]() {
+                zc->Complete(fd);
+                auto now = qrpc_time_now();
+                if (zc->pending() > 0 && now < deadline) {
+                    return now + kZeroCopyLingerInterval;
+                }
+                if (zc->pending() > 0) {
+                    QRPC_LOGJ(warn, {{"ev","zerocopy completion timeout"},{"fd",fd},{"pending",zc->pending()}});
+                }
+                zc->ReleaseAll();
+                Syscall::Close(fd);
+                return qrpc_alarm_stop_rv();
+            }, now + kZeroCopyLingerInterval);
+        }
         Session *Create(int fd, const Address &a, FactoryMethod &m) override {
             auto s = m(fd, a);
-            sessions_[fd] = s;
+            sessions_.set(fd, s);
             return s;
         }
         void UpdateSession(Session &s) {
-            sessions_[s.fd()] = &s;
+            sessions_.set(s.fd(), &s);
         }
         qrpc_time_t CheckTimeout() override { return CheckSessionTimeout(sessions_); }
     protected:
         // deletion timing of Session* is severe, so we want to have full control of it.
-        std::map<Fd, Session*> sessions_;
+        FdMap<Session> sessions_;
+        size_t zerocopy_threshold_;
     };
     class TcpClient : public TcpSessionFactory {
     public:
@@ -136,23 +256,39 @@ namespace base {
     class TcpListener : public TcpSessionFactory, public IoProcessor {
     public:
         struct Config : public TcpSessionFactory::Config {
+            static constexpr int MAX_ACCEPT_PER_EVENT = 128;
             Config(Resolver &r, qrpc_time_t st, const MaybeCertPair &p = std::nullopt) :
                 TcpSessionFactory::Config(r, st, true, p) {}
             static inline Config Default() { 
                 // default no timeout
                 return Config(NopResolver::Instance(), qrpc_time_sec(0));
             }
+        public:
+            // max number of connections accepted in one iteration. rest of backlog is accepted in next loop iteration,
+            // so that connection storm does not starve other sessions. 0 means unlimited
+            int max_accept_per_event{MAX_ACCEPT_PER_EVENT};
         };
     public:
         TcpListener(Loop &l, FactoryMethod &&m, Config c = Config::Default()) : 
-            TcpSessionFactory(l, std::move(m), c) {}
+            TcpSessionFactory(l, std::move(m), c), max_accept_per_event_(c.max_accept_per_event) {}
         TcpListener(TcpListener &&rhs) : TcpSessionFactory(std::move(rhs)), 
-            fd_(rhs.fd_), port_(rhs.port_) { rhs.fd_ = INVALID_FD; }
+            fd_(rhs.fd_), port_(rhs.port_), max_accept_per_event_(rhs.max_accept_per_event_) {
+            rhs.fd_ = INVALID_FD;
+            if (rhs.accept_alarm_id_ != AlarmProcessor::INVALID_ID) {
+                // pending backlog will be accepted on next readable event
+                rhs.alarm_processor_.Cancel(rhs.accept_alarm_id_);
+                rhs.accept_alarm_id_ = AlarmProcessor::INVALID_ID;
+            }
+        }
         ~TcpListener() override { Fin(); }
         DISALLOW_COPY_AND_ASSIGN(TcpListener);
         Fd fd() const { return fd_; }
         int port() const { return port_; }
         void Fin() {
+            if (accept_alarm_id_ != AlarmProcessor::INVALID_ID) {
+                alarm_processor_.Cancel(accept_alarm_id_);
+                accept_alarm_id_ = AlarmProcessor::INVALID_ID;
+            }
             if (fd_ != INVALID_FD) {
                 loop_.Del(fd_);
                 Syscall::Close(fd_);
@@ -162,7 +298,9 @@ namespace base {
         bool Listen(int port) {
             ASSERT(fd_ == INVALID_FD);
             port_ = port;
-            if ((fd_ = Syscall::Listen(port_)) < 0) {
+            if ((fd_ = Syscall::Listen(
+                port_, false, Syscall::kDefaultSocketSendBuffer, Syscall::kDefaultSocketReceiveBuffer, reuse_port_
+            )) < 0) {
                 logger::error({{"ev","Syscall::Listen() fails"},{"port",port},{"rc",fd_},{"errno",Syscall::Errno()}});
                 return false;
             }
@@ -192,7 +330,13 @@ namespace base {
     protected:
         void Accept() {
             ASSERT(is_listener());
-            while (true) {
+            for (int n = 0; ; n++) {
+                if (max_accept_per_event_ > 0 && n >= max_accept_per_event_) {
+                    // listener fd is edge triggered, so no more readable event for remaining backlog.
+                    // schedule next accept iteration by alarm instead.
+                    ScheduleAccept();
+                    return;
+                }
                 struct sockaddr_storage sa;
                 socklen_t salen = sizeof(sa);
                 Fd afd = Syscall::Accept(fd_, sa, salen);
@@ -203,7 +347,7 @@ namespace base {
                     return;
                 }
                 auto a = Address(sa, salen);
-                logger::info({{"ev","accept"},{"proto","tcp"},{"lfd",fd_},{"fd",afd},{"a",a.str()}});
+                QRPC_LOGJ(info, {{"ev","accept"},{"proto","tcp"},{"lfd",fd_},{"fd",afd},{"a",a.str()}});
                 auto s = dynamic_cast<TcpSession *>(Create(afd, a, factory_method_));
                 int r;
                 if ((r = loop_.Add(s->fd(), s, Loop::EV_READ)) < 0) {
@@ -216,19 +360,33 @@ namespace base {
                 }
             }
         }
+        void ScheduleAccept() {
+            if (accept_alarm_id_ != AlarmProcessor::INVALID_ID) {
+                return;
+            }
+            accept_alarm_id_ = alarm_processor_.Set([this]() {
+                accept_alarm_id_ = AlarmProcessor::INVALID_ID;
+                if (fd_ != INVALID_FD) {
+                    Accept();
+                }
+                return qrpc_alarm_stop_rv();
+            }, qrpc_time_now());
+        }
     protected:
         Fd fd_{INVALID_FD};
         int port_{0};
+        int max_accept_per_event_;
+        AlarmProcessor::Id accept_alarm_id_{AlarmProcessor::INVALID_ID};
     };
     template <class S>
     class TcpListenerOf : public TcpListener {
     public:
         TcpListenerOf(Loop &l, FactoryMethod &&m, Config c = Config::Default()) :
             TcpListener(l, std::move(m), c) {}
-        TcpListenerOf(Loop &l) : TcpListener(l, [this](Fd fd, const Address &a) {
+        TcpListenerOf(Loop &l, Config c = Config::Default()) : TcpListener(l, [this](Fd fd, const Address &a) {
             static_assert(std::is_base_of<TcpSession, S>(), "S must be a descendant of TcpSession");
             return new S(*this, fd, a);
-        }) {}
+        }, c) {}
         TcpListenerOf(TcpListenerOf &&rhs) : TcpListener(std::move(rhs)) {}
         DISALLOW_COPY_AND_ASSIGN(TcpListenerOf);
     };
@@ -237,13 +395,16 @@ namespace base {
         struct Config : public SessionFactory::Config {
         #if defined(__QRPC_USE_RECVMMSG__)
             static constexpr int BATCH_SIZE = 256;
+            // same as UIO_MAXIOV. recvmmsg/sendmmsg never process more than this in one call
+            static constexpr int MAX_BATCH_SIZE = 1024;
         #else
             static constexpr int BATCH_SIZE = 1;
+            static constexpr int MAX_BATCH_SIZE = 1;
         #endif
             Config(Resolver &r, qrpc_time_t st, int mbs, bool sw, bool is_listener) :
                 SessionFactory::Config(r, st, is_listener), max_batch_size(
                 #if defined(__QRPC_USE_RECVMMSG__)
-                    mbs > 0 ? mbs : BATCH_SIZE
+                    mbs > 0 ? std::min(mbs, MAX_BATCH_SIZE) : BATCH_SIZE
                 #else
                     1
                 #endif
@@ -263,7 +424,8 @@ namespace base {
             unsigned int msg_len;
         };
         #endif
-        struct ReadPacketBuffer {
+        // cache line aligned, so that packets written by kernel in one batch do not share cache line
+        struct alignas(64) ReadPacketBuffer {
             struct iovec iov;
             char buf[Syscall::kMaxIncomingPacketSize];
             char cbuf[Syscall::kDefaultUdpPacketControlBufferSize];
@@ -282,26 +444,22 @@ namespace base {
             UdpSessionFactory &udp_session_factory() { return factory().to<UdpSessionFactory>(); }
             const UdpSessionFactory &udp_session_factory() const { return factory().to<UdpSessionFactory>(); }
             std::vector<struct iovec> &write_vecs() { return write_vecs_; }
+            // kernel arrival time of the packet currently passed to OnRead. 0 if unknown
+            inline qrpc_time_t rx_time() const { return rx_time_; }
+            inline void set_rx_time(qrpc_time_t t) { rx_time_ = t; }
+            // ECN codepoint of the packet currently passed to OnRead (Syscall::ECN_*)
+            inline uint8_t rx_ecn() const { return rx_ecn_; }
+            inline void set_rx_ecn(uint8_t ecn) { rx_ecn_ = ecn; }
             int Flush(); 
+            // release first size buffers that already sent
             void Reset(size_t size) {
-                ASSERT(size > 0);
-                if (size >= write_vecs_.size()) {
-                    for (int i = 0; i < ((int)size) - 1; i++) {
-                        struct iovec &iov = write_vecs_.back();
-                        FreeIovec(iov);
-                        write_vecs_.pop_back();
-                    }
-                    // remain first buffer for next write
-                    auto &iov = write_vecs_[0];
-                    iov.iov_len = 0;
-                } else if (size > 0) {
-                    for (size_t i = 0; i < size; i++) {
-                        struct iovec &iov = write_vecs_[i];
-                        FreeIovec(iov);
-                    }
-                    write_vecs_.erase(write_vecs_.begin(), write_vecs_.begin() + size);
+                size = std::min(size, write_vecs_.size());
+                for (size_t i = 0; i < size; i++) {
+                    struct iovec &iov = write_vecs_[i];
+                    FreeIovec(iov);
                 }
-            }            
+                write_vecs_.erase(write_vecs_.begin(), write_vecs_.begin() + size);
+            }
             // implements Session
             const char *proto() const override { return "UDP"; }
             // Send is implemented in subclass
@@ -349,6 +507,8 @@ namespace base {
             }
         private:
             std::vector<struct iovec> write_vecs_;
+            qrpc_time_t rx_time_{0};
+            uint8_t rx_ecn_{Syscall::ECN_NOT_ECT};
         };
         class Flusher {
         public:
@@ -389,6 +549,10 @@ namespace base {
             if ((fd = Syscall::CreateUDPSocket(AF_INET, overflow_supported)) < 0) {
                 return INVALID_FD;
             }
+            if (reuse_port_ && !Syscall::SetSocketReusePort(fd)) {
+                Syscall::Close(fd);
+                return INVALID_FD;
+            }
             if (Syscall::Bind(fd, port) != QRPC_OK) {
                 Syscall::Close(fd);
                 return INVALID_FD;
@@ -511,17 +675,48 @@ namespace base {
     public:
         friend class Flusher;
         struct Config : public UdpSessionFactory::Config {
+            static constexpr size_t MAX_SOCKET_BUFFER_SIZE = 16 * 1024 * 1024;
+            static constexpr int MIN_BATCH_SIZE = 8;
             Config(Resolver &r, qrpc_time_t st, int mbs, bool sw) : UdpSessionFactory::Config(r, st, mbs, sw, true) {}
             static inline Config Default() { 
                 // default no timeout
                 return Config(NopResolver::Instance(), qrpc_time_sec(0), BATCH_SIZE, false);
             }
+        public:
+            // upper bound of socket buffer auto tuning. 0 disables tuning
+            size_t max_socket_buffer_size{MAX_SOCKET_BUFFER_SIZE};
+            // lower bound of adaptive receive batch size. upper bound is max_batch_size
+            int min_batch_size{MIN_BATCH_SIZE};
+            // mark egress packets as ECT(1) (L4S capable)
+            bool ecn{false};
+            // receive packets by AF_XDP socket on xdp.ifname if it is not empty. packets are still sent by UDP socket,
+            // and if AF_XDP is not available, listener silently falls back to UDP socket only.
+            XdpSocket::Config xdp;
+        };
+        struct Stats {
+            uint64_t rx_packets{0}, rx_batches{0};
+            uint64_t rx_dropped{0}; // packets dropped by kernel because of receive queue overflow
+            uint64_t tx_blocked{0}; // number of flush which cannot send all packets because send buffer is full
+            uint64_t rx_ce{0}; // packets marked as congestion experienced
+            uint64_t rx_xdp{0}; // packets received by AF_XDP socket (included in rx_packets)
+            uint64_t rx_xdp_bad_checksum{0}; // packets dropped by AF_XDP socket because of broken UDP checksum
+            uint64_t promoted{0}, demoted{0}; // sessions moved to/from connected socket
+            int rcvbuf{0}, sndbuf{0}, batch_size{0};
         };
     public:
-        class UdpSession : public UdpSessionFactory::UdpSession {
+        class UdpSession : public UdpSessionFactory::UdpSession, public IoProcessor {
         public:
             UdpSession(UdpSessionFactory &f, Fd fd, const Address &addr) :
                 UdpSessionFactory::UdpSession(f, fd, addr) {}
+            inline bool flush_queued() const { return flush_queued_; }
+            inline void set_flush_queued(bool on) { flush_queued_ = on; }
+            UdpListener &udp_listener() { return factory().to<UdpListener>(); }
+            // own connect()ed socket, if the session is promoted by UdpListener::PromoteSession
+            inline Fd connected_fd() const { return connected_fd_; }
+            inline bool promoted() const { return connected_fd_ != INVALID_FD; }
+            inline void set_connected_fd(Fd fd) { connected_fd_ = fd; }
+            // implements IoProcessor (for connected socket)
+            void OnEvent(Fd fd, const Event &e) override { udp_listener().OnPromotedEvent(*this, fd, e); }
             // implements Session
             int Send(const char *data, size_t sz) override {
                 int r;
@@ -529,13 +724,20 @@ namespace base {
                     QRPC_LOGJ(error, {{"ev","UdpSession::Write fails"},{"fd",fd_},{"sz",sz},{"r",r}});
                     return r;
                 }
-                factory().to<UdpListener>().StartFlushTask();
+                factory().to<UdpListener>().QueueFlush(*this);
                 return r;
             }
+        private:
+            bool flush_queued_{false};
+            Fd connected_fd_{INVALID_FD};
         };
     public:
         UdpListener(Loop &l, FactoryMethod &&m, Config c = Config::Default()) :
             UdpSessionFactory(l, std::move(m), c),
+            max_socket_buffer_size_(c.max_socket_buffer_size),
+            min_batch_size_(std::min(c.min_batch_size, batch_size_)), read_batch_size_(batch_size_), ecn_(c.ecn),
+            xdp_config_(c.xdp),
+            batch_fill_avg_(min_batch_size_ << BATCH_FILL_AVG_SHIFT),
             read_packets_(batch_size_), read_buffers_(batch_size_) { Init(); }
         UdpListener(UdpListener &&rhs);
         ~UdpListener() override { Fin(); }
@@ -543,10 +745,21 @@ namespace base {
     public:
         Fd fd() const { return fd_; }
         int port() const { return port_; }
+        const Stats &stats() const { return stats_; }
+        // latency from kernel arrival to application handling of received packets (nsec)
+        const Histogram &rx_latency() const { return rx_latency_; }
+        // number of packets received by each recvmmsg call
+        const Histogram &batch_fill() const { return batch_fill_; }
+        // true if packets are received by AF_XDP socket
+        bool xdp() const { return xdp_ != nullptr; }
     public:
         void Init() { SetupPacket(); }
         void Fin() {
             FinSessions(sessions_);
+            if (xdp_ != nullptr) {
+                loop_.Del(xdp_->fd());
+                xdp_.reset();
+            }
             if (fd_ != INVALID_FD) {
                 loop_.Del(fd_);
                 Syscall::Close(fd_);
@@ -584,15 +797,63 @@ namespace base {
             } else {
                 port_ = port;
             }
+            if (ecn_ && Syscall::SetEcn(fd_, AF_INET, Syscall::ECN_ECT1) < 0) {
+                QRPC_LOGJ(warn, {{"ev","fail to enable ECN, continue without it"},{"port",port_}});
+            }
+            if (!xdp_config_.ifname.empty()) {
+                OpenXdp();
+            }
+            stats_.rcvbuf = Syscall::GetReceiveBufferSize(fd_);
+            stats_.sndbuf = Syscall::GetSendBufferSize(fd_);
+            stats_.batch_size = read_batch_size_;
             return true;
         }
         int Read();
+        int ReadXdp();
         void SetupPacket();
-        void ProcessPackets(int count);
+        // if target is given, packets are delivered to it without lookup. returns false if target is closed
+        bool ProcessPackets(int count, UdpSession *target = nullptr);
         int Flush();
+        // move long-lived session to its own UDP socket bound to same port (needs reuse_port) and connected to peer.
+        // kernel demuxes packets of the session to the socket and skips route lookup for each send.
+        bool PromoteSession(UdpSession &s);
+        // close connected socket of session (eg. on path change). packets are handled by listener socket again
+        void DemoteSession(UdpSession &s);
+        void OnPromotedEvent(UdpSession &s, Fd fd, const Event &e);
+        // process packet which is received on other socket bound to same port (see webrtc::Dispatcher)
+        void Inject(const Address &a, const char *p, size_t sz, qrpc_time_t rx_time = 0, uint8_t ecn = 0) {
+            processing_ = true;
+            ProcessPacket(a, p, sz, qrpc_time_now(), rx_time, ecn);
+            processing_ = false;
+            TryFlush();
+        }
+        // register session that has packets to send. all queued sessions are flushed by one sendmmsg call.
+        // while processing received packets, flush is deferred to the end of the batch.
+        void QueueFlush(UdpSession &s) {
+            if (!s.flush_queued()) {
+                s.set_flush_queued(true);
+                flush_sessions_.push_back(&s);
+            }
+            if (!processing_) {
+                StartFlushTask();
+            }
+        }
     protected:
         inline void TryFlush() { Flusher::Try(*this, alarm_processor()); }
         inline void StartFlushTask() { Flusher::Start(*this, alarm_processor()); }
+        void ProcessPacket(
+            const Address &a, const char *p, size_t sz, qrpc_time_t now, qrpc_time_t rx_time, uint8_t ecn);
+        // returns false if session is closed
+        bool Deliver(UdpSession &s, const char *p, size_t sz, qrpc_time_t now, qrpc_time_t rx_time, uint8_t ecn);
+        void PrepareRead(int count);
+        void SetupWritePacket(
+            size_t idx, UdpSession &s, size_t vec_idx, bool connected);
+        int FlushPromoted(UdpSession &s);
+        // receive side telemetry and tuning
+        void CheckOverflow(const struct msghdr &h);
+        void AdaptBatchSize(int received);
+        void GrowSocketBuffer(bool rx);
+        void OpenXdp();
     public:
         // implements SessionFactory
         Session *Create(int fd, const Address &a, FactoryMethod &m) override {
@@ -625,11 +886,22 @@ namespace base {
             return s;
         }
         void Close(Session &s) override {
+            auto &us = static_cast<UdpSession &>(s);
+            if (us.flush_queued()) {
+                flush_sessions_.erase(std::find(flush_sessions_.begin(), flush_sessions_.end(), &us));
+            }
+            DemoteSession(us);
             sessions_.erase(s.addr());
         }
         qrpc_time_t CheckTimeout() override { return CheckSessionTimeout(sessions_); }
         // implements IoProcessor
 		void OnEvent(Fd fd, const Event &e) override {
+            if (xdp_ != nullptr && fd == xdp_->fd()) {
+                if (Loop::Readable(e)) {
+                    while (ReadXdp() > 0) {}
+                }
+                return;
+            }
             if (Loop::Readable(e)) {
                 int r;
                 while (true) {
@@ -645,10 +917,29 @@ namespace base {
         Fd fd_{INVALID_FD};
         int port_{0};
         bool overflow_supported_{false};
+        bool processing_{false};
+        size_t max_socket_buffer_size_;
+        int min_batch_size_, read_batch_size_;
+        bool ecn_;
+        XdpSocket::Config xdp_config_;
+        std::unique_ptr<XdpSocket> xdp_;
+        uint32_t rxq_ovfl_{0}; // last value of SO_RXQ_OVFL counter
+        qrpc_time_t last_rcvbuf_tune_{0}, last_sndbuf_tune_{0};
+        bool rcvbuf_capped_{false}, sndbuf_capped_{false};
+        Stats stats_;
+        Histogram rx_latency_, batch_fill_;
+        // moving average of received packets per batch, in fixed point (BATCH_FILL_AVG_SHIFT bits fraction)
+        static constexpr int BATCH_FILL_AVG_SHIFT = 3;
+        int batch_fill_avg_;
         AlarmProcessor::Id alarm_id_{AlarmProcessor::INVALID_ID};
         std::map<Address, Session*> sessions_;
-        std::vector<mmsghdr> read_packets_;
-        std::vector<ReadPacketBuffer> read_buffers_;
+        std::vector<UdpSession*> flush_sessions_;
+        // header of the packet being processed. used to find local address of session on promotion
+        const struct msghdr *current_hdr_{nullptr};
+        std::vector<mmsghdr> write_packets_;
+        // touched by every recvmmsg call, so allocated on huge pages to reduce TLB misses
+        HugePageArray<mmsghdr> read_packets_;
+        HugePageArray<ReadPacketBuffer> read_buffers_;
     };
     class AdhocUdpListener : public UdpListener {
     public:
@@ -45,6 +45,8 @@ namespace base {
 			MaybeCertPair certpair;
             qrpc_time_t session_timeout;
             bool is_listener;
+            // set SO_REUSEPORT to listening socket, so that multiple threads can listen same port
+            bool reuse_port{false};
         };
         class Session {
         public:
@@ -200,7 +202,7 @@ namespace base {
         SessionFactory(Loop &l, FactoryMethod &&m, Config c) :
             loop_(l), resolver_(c.resolver), alarm_processor_(l.alarm_processor()),
             factory_method_(m), certpair_(c.certpair), session_timeout_(c.session_timeout), 
-            is_listener_(c.is_listener) { Init(); }
+            is_listener_(c.is_listener), reuse_port_(c.reuse_port) { Init(); }
         SessionFactory(SessionFactory &&rhs);
         virtual ~SessionFactory() { Fin(); }
         DISALLOW_COPY_AND_ASSIGN(SessionFactory);
@@ -209,6 +211,7 @@ namespace base {
         inline AlarmProcessor &alarm_processor() { return alarm_processor_; }
         inline qrpc_time_t session_timeout() const { return session_timeout_; }
         inline bool is_listener() const { return is_listener_; }
+        inline bool reuse_port() const { return reuse_port_; }
         inline bool need_tls() const { return certpair_.has_value(); }
         inline SSL_CTX *tls_ctx() const { return tls_ctx_; }
         template <class F> F &to() { return static_cast<F&>(*this); }
@@ -267,5 +270,6 @@ namespace base {
         SSL_CTX *tls_ctx_{nullptr};
         qrpc_time_t session_timeout_{0ULL};
         bool is_listener_{false};
+        bool reuse_port_{false};
     };
   } // namespace base
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "base/defs.h"
+
+#include <atomic>
+#include <memory>
+
+namespace base {
+  // bounded lock-free single producer, single consumer queue.
+  // capacity is rounded up to power of 2. push fails if queue is full.
+  template <class T>
+  class SpscQueue {
+  public:
+    static constexpr size_t kCacheLineSize = 64;
+    SpscQueue(size_t capacity) : mask_(Capacity(capacity) - 1), buffer_(new T[mask_ + 1]) {}
+    ~SpscQueue() {}
+    inline size_t capacity() const { return mask_ + 1; }
+    inline size_t size() const {
+      return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+    // called only from producer thread
+    inline bool push(T &&v) {
+      auto tail = tail_.load(std::memory_order_relaxed);
+      if ((tail - head_cache_) > mask_) {
+        head_cache_ = head_.load(std::memory_order_acquire);
+        if ((tail - head_cache_) > mask_) {
+          return false;
+        }
+      }
+      buffer_[tail & mask_] = std::move(v);
+      tail_.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+    // called only from consumer thread
+    inline bool pop(T &v) {
+      auto head = head_.load(std::memory_order_relaxed);
+      if (head == tail_cache_) {
+        tail_cache_ = tail_.load(std::memory_order_acquire);
+        if (head == tail_cache_) {
+          return false;
+        }
+      }
+      v = std::move(buffer_[head & mask_]);
+      head_.store(head + 1, std::memory_order_release);
+      return true;
+    }
+  protected:
+    static size_t Capacity(size_t n) {
+      size_t c = 1;
+      while (c < n) { c <<= 1; }
+      return c;
+    }
+  protected:
+    const size_t mask_;
+    std::unique_ptr<T[]> buffer_;
+    // separate cache lines to avoid false sharing between producer and consumer
+    alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+    size_t tail_cache_{0}; // consumer local
+    alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+    size_t head_cache_{0}; // producer local
+  };
+}
@@ -1,18 +1,305 @@
 #include "base/stream.h"
 #include "base/conn.h"
+#include "base/endian.h"
 
 namespace base {
+  // XOR p into sum from ofs. shorter one is treated as zero padded
+  static void FecXor(std::string &sum, size_t ofs, const char *p, size_t sz) {
+    if (sum.size() < ofs + sz) {
+      sum.resize(ofs + sz, 0);
+    }
+    for (size_t i = 0; i < sz; i++) {
+      sum[ofs + i] ^= p[i];
+    }
+  }
+  // XOR flags, length and payload of FEC protected message into sum
+  static void FecAccumulate(std::string &sum, uint8_t flags, const char *p, size_t sz) {
+    char header[5];
+    header[0] = static_cast<char>(flags);
+    Endian::HostToNetbytes<uint32_t>(static_cast<uint32_t>(sz), header + 1);
+    FecXor(sum, 0, header, sizeof(header));
+    FecXor(sum, sizeof(header), p, sz);
+  }
   std::string Stream::SYSCALL_NAME = "$syscall";
+  std::string Stream::COALESCE_PROTOCOL = "qrpc-coalesce";
+  std::string Stream::ZSTD_PROTOCOL = "qrpc-zstd";
+  std::string Stream::FEC_PROTOCOL = "qrpc-fec";
+  bool Stream::FindProtocol(const std::string &protocol, const std::string &name, std::string *arg) {
+    size_t start = 0;
+    while (start < protocol.length()) {
+      auto end = protocol.find(',', start);
+      if (end == std::string::npos) {
+        end = protocol.length();
+      }
+      auto token = protocol.substr(start, end - start);
+      if (token == name) {
+        return true;
+      } else if (token.length() > name.length() && token.compare(0, name.length(), name) == 0 &&
+        token[name.length()] == ':') {
+        if (arg != nullptr) {
+          *arg = token.substr(name.length() + 1);
+        }
+        return true;
+      }
+      start = end + 1;
+    }
+    return false;
+  }
+  uint8_t Stream::FecGroupSize(const std::string &protocol) {
+    std::string arg;
+    if (!FindProtocol(protocol, FEC_PROTOCOL, &arg)) {
+      return 0;
+    } else if (arg.empty()) {
+      return kFecDefaultGroupSize;
+    }
+    char *end;
+    auto n = std::strtoul(arg.c_str(), &end, 10);
+    return (*end == 0 && n >= 2 && n <= kFecMaxGroupSize) ? static_cast<uint8_t>(n) : 0;
+  }
+  bool Stream::ValidProtocol(const std::string &protocol) {
+    size_t start = 0;
+    while (start < protocol.length()) {
+      auto end = protocol.find(',', start);
+      if (end == std::string::npos) {
+        end = protocol.length();
+      }
+      auto token = protocol.substr(start, end - start);
+      if (!FindProtocol(token, COALESCE_PROTOCOL) && !FindProtocol(token, ZSTD_PROTOCOL) &&
+        FecGroupSize(token) == 0) {
+        return false;
+      }
+      start = end + 1;
+    }
+    return true;
+  }
   int Stream::Open() {
     return conn_.Open(*this);
   }
   void Stream::Close(const CloseReason &reason) {
     if (!closed()) {
+      Flush();
       close_reason_ = std::make_unique<CloseReason>(reason);
       conn_.Close(*this);
     }
   }
   int Stream::Send(const char *data, size_t sz) {
-    return conn_.Send(*this, data, sz, binary_payload());
+    // always accept one message when nothing is buffered, so that message larger than threshold can be sent
+    auto buffered = buffered_amount_ + coalesce_buffer_.size();
+    if (buffered_amount_high_ > 0 && buffered > 0 && buffered + sz > buffered_amount_high_) {
+      return QRPC_EAGAIN;
+    }
+    if (!coalescing()) {
+      return Emit(data, sz, binary_payload());
+    }
+    bool first = coalesce_buffer_.empty();
+    uint64_t h = (static_cast<uint64_t>(sz) << 1) | binary_payload_;
+    do {
+      uint8_t b = h & 0x7f;
+      h >>= 7;
+      coalesce_buffer_.push_back(static_cast<char>(h > 0 ? (b | 0x80) : b));
+    } while (h > 0);
+    coalesce_buffer_.append(data, sz);
+    if (coalesce_buffer_.size() < kCoalesceFlushSize) {
+      if (first) {
+        conn_.ScheduleFlush(*this);
+      }
+      return QRPC_OK;
+    }
+    int r = Flush();
+    if (r == QRPC_EAGAIN) {
+      // the message is already buffered, and retried by scheduled flush
+      conn_.ScheduleFlush(*this);
+      return QRPC_OK;
+    }
+    return r;
+  }
+  int Stream::Flush() {
+    int r = QRPC_OK;
+    if (!coalesce_buffer_.empty()) {
+      // keep buffer when transport is busy, so that it is retried by next flush
+      r = Emit(coalesce_buffer_.data(), coalesce_buffer_.size(), true);
+      if (r != QRPC_EAGAIN) {
+        coalesce_buffer_.clear();
+      }
+    }
+    // close partial FEC group, so that its lost message can be recovered without waiting following messages
+    if (fec_index_ > 0 && r != QRPC_EAGAIN) {
+      TransmitParity();
+    }
+    return r;
+  }
+  int Stream::Emit(const char *data, size_t sz, bool binary) {
+    if (!compressing()) {
+      return Transmit(data, sz, binary);
+    }
+    // header and payload should be one transport message
+    thread_local std::string buffer, compressed;
+    uint8_t flags = binary ? kZstdFlagBinary : 0;
+    if (sz >= zstd_min_size_ && Zstd::Compress(data, sz, zstd_dict_.get(), compressed) > 0 &&
+      compressed.size() < sz) {
+      flags |= kZstdFlagCompressed;
+      data = compressed.data();
+      sz = compressed.size();
+    }
+    buffer.assign(1, static_cast<char>(flags));
+    buffer.append(data, sz);
+    return Transmit(buffer.data(), buffer.size(), true);
+  }
+  int Stream::Transmit(const char *data, size_t sz, bool binary) {
+    if (fec_group_size_ == 0) {
+      return conn_.Send(*this, data, sz, binary);
+    }
+    thread_local std::string frame;
+    uint8_t flags = binary ? kFecFlagBinary : 0;
+    frame.resize(kFecHeaderSize);
+    frame[0] = static_cast<char>(flags);
+    Endian::HostToNetbytes<uint16_t>(fec_group_, frame.data() + 1);
+    frame[3] = static_cast<char>(fec_index_);
+    frame.append(data, sz);
+    int r;
+    if ((r = conn_.Send(*this, frame.data(), frame.size(), true)) < 0) {
+      return r;
+    }
+    FecAccumulate(fec_parity_, flags, data, sz);
+    if (++fec_index_ >= fec_group_size_) {
+      TransmitParity();
+    } else if (fec_index_ == 1 && coalesce_buffer_.empty()) {
+      // parity of the group is sent at the end of loop iteration even if the group is not filled.
+      // coalesced messages being sent means we are in Flush, which sends the parity by itself
+      conn_.ScheduleFlush(*this);
+    }
+    return r;
+  }
+  void Stream::TransmitParity() {
+    thread_local std::string frame;
+    frame.resize(kFecHeaderSize);
+    frame[0] = static_cast<char>(kFecFlagParity);
+    Endian::HostToNetbytes<uint16_t>(fec_group_, frame.data() + 1);
+    // actual size of the group, which may be smaller than fec_group_size_ when flushed
+    frame[3] = static_cast<char>(fec_index_);
+    frame.append(fec_parity_);
+    // parity is best effort. if transport is busy, the group just becomes unprotected
+    conn_.Send(*this, frame.data(), frame.size(), true);
+    fec_parity_.clear();
+    fec_index_ = 0;
+    fec_group_++;
+  }
+  int Stream::OnReceive(const char *p, size_t sz) {
+    return fec_group_size_ > 0 ? Recover(p, sz) : Inflate(p, sz);
+  }
+  int Stream::Recover(const char *p, size_t sz) {
+    if (sz < kFecHeaderSize) {
+      return QRPC_EINVAL;
+    }
+    auto flags = static_cast<uint8_t>(p[0]);
+    auto gid = Endian::NetbytesToHost<uint16_t>(p + 1);
+    auto idx = static_cast<uint8_t>(p[3]);
+    auto diff = static_cast<int16_t>(gid - fec_latest_group_);
+    if (diff > 0) {
+      fec_latest_group_ = gid;
+      for (auto it = fec_groups_.begin(); it != fec_groups_.end();) {
+        if (static_cast<uint16_t>(fec_latest_group_ - it->first) >= kFecWindow) {
+          it = fec_groups_.erase(it);
+        } else {
+          it++;
+        }
+      }
+    } else if (static_cast<uint16_t>(fec_latest_group_ - gid) >= kFecWindow) {
+      // cannot tell whether the message is already recovered. it should be stale anyway
+      return QRPC_OK;
+    }
+    auto &g = fec_groups_[gid];
+    if (g.done) {
+      return QRPC_OK;
+    }
+    if ((flags & kFecFlagParity) != 0) {
+      if (idx == 0 || idx > kFecMaxGroupSize) {
+        return QRPC_EINVAL;
+      } else if (g.parity) {
+        return QRPC_OK;
+      }
+      g.parity = true;
+      g.size = idx;
+      FecXor(g.sum, 0, p + kFecHeaderSize, sz - kFecHeaderSize);
+    } else {
+      if (idx >= kFecMaxGroupSize) {
+        return QRPC_EINVAL;
+      } else if ((g.received & (1ULL << idx)) != 0) {
+        return QRPC_OK;
+      }
+      g.received |= (1ULL << idx);
+      g.count++;
+      FecAccumulate(g.sum, flags, p + kFecHeaderSize, sz - kFecHeaderSize);
+      int r;
+      if ((r = Inflate(p + kFecHeaderSize, sz - kFecHeaderSize)) < 0) {
+        return r;
+      }
+    }
+    if (!g.parity || (g.count + 1) < g.size) {
+      return QRPC_OK;
+    }
+    g.done = true;
+    std::string sum;
+    sum.swap(g.sum);
+    if (g.count >= g.size) {
+      return QRPC_OK;
+    }
+    // exactly one message of the group is lost. sum is now flags, length and payload of it
+    auto len = sum.size() >= 5 ? Endian::NetbytesToHost<uint32_t>(sum.data() + 1) : 0;
+    if (sum.size() < 5 || len > sum.size() - 5) {
+      QRPC_LOGJ(info, {{"ev","fail to recover stream message"},{"sid",id()},{"l",label()},{"group",gid}});
+      return QRPC_EINVAL;
+    }
+    QRPC_LOGJ(debug, {{"ev","stream message recovered"},{"sid",id()},{"l",label()},{"group",gid},{"sz",len}});
+    return Inflate(sum.data() + 5, len);
+  }
+  int Stream::Inflate(const char *p, size_t sz) {
+    if (!compressing()) {
+      return Unpack(p, sz);
+    }
+    if (sz < 1) {
+      return QRPC_EINVAL;
+    }
+    auto flags = static_cast<uint8_t>(p[0]);
+    if ((flags & kZstdFlagCompressed) == 0) {
+      return Unpack(p + 1, sz - 1);
+    }
+    // OnRead may send (and compress) messages, so buffer cannot be shared with Emit
+    std::string decompressed;
+    int r;
+    if ((r = Zstd::Decompress(p + 1, sz - 1, zstd_dict_.get(), kZstdMaxMessageSize, decompressed)) < 0) {
+      QRPC_LOGJ(info, {{"ev","fail to decompress stream message"},{"sid",id()},{"l",label()},{"rc",r}});
+      return r;
+    }
+    return Unpack(decompressed.data(), decompressed.size());
+  }
+  int Stream::Unpack(const char *p, size_t sz) {
+    if (!coalescing()) {
+      return OnRead(p, sz);
+    }
+    size_t ofs = 0;
+    while (ofs < sz && !closed()) {
+      uint64_t h = 0;
+      uint8_t b;
+      int shift = 0;
+      do {
+        if (ofs >= sz || shift > 63) {
+          return QRPC_EINVAL;
+        }
+        b = static_cast<uint8_t>(p[ofs++]);
+        h |= static_cast<uint64_t>(b & 0x7f) << shift;
+        shift += 7;
+      } while ((b & 0x80) != 0);
+      auto len = h >> 1;
+      if (len > sz - ofs) {
+        return QRPC_EINVAL;
+      }
+      int r;
+      if ((r = OnRead(p + ofs, len)) < 0) {
+        return r;
+      }
+      ofs += len;
+    }
+    return QRPC_OK;
   }
 }
\ No newline at end of file
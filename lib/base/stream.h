@@ -1,41 +1,115 @@
 #pragma once
 
 #include "base/session.h"
+#include "base/zstd.h"
 
 #include "RTC/SctpDictionaries.hpp"
 
 #include <stdint.h>
 #include <functional>
+#include <map>
 
 namespace base {
   class Connection;
   class Stream {
   public:
     static std::string SYSCALL_NAME;
+    // protocol of stream is comma separated list of following extensions (eg. "qrpc-coalesce,qrpc-zstd:1").
+    // packs multiple messages into one transport message.
+    // each message is prefixed by varint of (length << 1 | binary flag)
+    static std::string COALESCE_PROTOCOL;
+    // prefixes transport messages with 1 byte header of kZstdFlag*, and compresses them with zstd if they are
+    // larger than threshold. "qrpc-zstd:<id>" uses the dictionary registered with the id on both sides.
+    // peer built without zstd refuses to open or accept the stream (resets it), so it never receives compressed messages
+    static std::string ZSTD_PROTOCOL;
+    // protects transport messages of unreliable stream with XOR parity. after every n messages of "qrpc-fec:<n>"
+    // (2..kFecMaxGroupSize, kFecDefaultGroupSize if omitted), parity message is sent so that receiver can
+    // recover one lost message of the group without waiting retransmission. overhead is 1/n.
+    // partial group is closed by parity at the end of loop iteration (Flush), so that recovery does not wait
+    // for following messages. stream must be unordered, because recovered message is delivered after later ones
+    static std::string FEC_PROTOCOL;
+    // coalesced messages are sent immediately when they reach this size, otherwise at the end of loop iteration
+    static constexpr size_t kCoalesceFlushSize = 1024;
+    static constexpr uint8_t kZstdFlagCompressed = 0x01, kZstdFlagBinary = 0x02;
+    static constexpr size_t kZstdDefaultMinSize = 32;
+    static constexpr size_t kZstdMaxMessageSize = 16 * 1024 * 1024; // limit of decompressed size
+    static constexpr size_t kFecDefaultGroupSize = 4, kFecMaxGroupSize = 64;
+    static constexpr uint8_t kFecFlagParity = 0x01, kFecFlagBinary = 0x02;
+    static constexpr size_t kFecHeaderSize = 4; // flags, group id (uint16), index in group (or group size for parity)
+    static constexpr uint16_t kFecWindow = 64; // messages of groups older than this are dropped
+    static constexpr uint16_t kDefaultPriority = 256, kDefaultWeight = 1; // "normal" of RFC 8831 6.4
     typedef struct {
       // TODO: use general stream parameter struct, instead of borrow from WebRTC
       RTC::SctpStreamParameters params;
       std::string label;
-      std::string protocol; // now not used
+      std::string protocol; // empty or list of COALESCE_PROTOCOL/ZSTD_PROTOCOL/FEC_PROTOCOL
+      // scheduling of outgoing messages. streams with higher priority are sent first (priority of DCEP,
+      // 256 is normal), and streams with same priority share bandwidth in proportion to weight.
+      // only applied by native SCTP (ConnectionFactory::Config::native_sctp). usrsctp ignores them
+      uint16_t priority{kDefaultPriority};
+      uint16_t weight{kDefaultWeight};
+      // messages are abandoned after params.maxRetransmits retransmissions or params.maxPacketLifeTime msec.
+      // params treat 0 as unlimited, so this flag is needed to request maxRetransmits = 0.
+      // maxRetransmits = 0 needs native SCTP (ConnectionFactory::Config::native_sctp), OpenStream fails on usrsctp
+      bool partially_reliable{false};
     } Config;
     typedef Session::CloseReason CloseReason;
     typedef uint16_t Id;
     typedef std::function<int (Stream &, const char *, size_t)> Handler;
   public:
     Stream(Connection &c, const Config &config, bool binary_payload = true) :
-      conn_(c), config_(config), binary_payload_(binary_payload ? 1 : 0) {}
+      conn_(c), config_(config), binary_payload_(binary_payload ? 1 : 0),
+      coalescing_(FindProtocol(config.protocol, COALESCE_PROTOCOL) ? 1 : 0),
+      compressing_(FindProtocol(config.protocol, ZSTD_PROTOCOL) ? 1 : 0),
+      fec_group_size_(FecGroupSize(config.protocol)) {}
     virtual ~Stream() {}
     const Config &config() const { return config_; }
     bool closed() const { return close_reason_ != nullptr; }
     bool reset() const { return reset_ != 0; }
     bool published() const { return published_ != 0; }
     bool binary_payload() const { return binary_payload_ != 0; }
+    bool coalescing() const { return coalescing_ != 0; }
+    bool compressing() const { return compressing_ != 0; }
+    size_t fec_group_size() const { return fec_group_size_; }
     Id id() const { return config_.params.streamId; }
     const std::string &label() const { return config_.label; }
     Connection &connection() { return conn_; }
     template <class T> const T &context() const { return *static_cast<T *>(context_); }
     template <class T> T &context() { return *static_cast<T *>(context_); }
     static inline bool IsSystem(const std::string &label) { return label[0] == '$'; }
+    // configs for OpenStream, because params cannot be initialized with designated initializer.
+    // same as maxRetransmits/maxPacketLifeTime of RTCDataChannelInit, including ordered = true by default
+    static Config UnorderedConfig(const std::string &label) {
+      Config c = { .label = label };
+      c.params.ordered = false;
+      return c;
+    }
+    static Config MaxRetransmitsConfig(const std::string &label, uint16_t max_retransmits, bool ordered = true) {
+      Config c = { .label = label, .partially_reliable = true };
+      c.params.ordered = ordered;
+      c.params.maxRetransmits = max_retransmits;
+      return c;
+    }
+    static Config MaxPacketLifeTimeConfig(const std::string &label, uint16_t lifetime_ms, bool ordered = true) {
+      Config c = { .label = label, .partially_reliable = true };
+      c.params.ordered = ordered;
+      c.params.maxPacketLifeTime = lifetime_ms;
+      return c;
+    }
+    // find extension from protocol. arg receives the part after ':' if given
+    static bool FindProtocol(const std::string &protocol, const std::string &name, std::string *arg = nullptr);
+    static bool ValidProtocol(const std::string &protocol);
+    static std::string ZstdProtocol(uint32_t dictionary_id = 0) {
+      return dictionary_id == 0 ? ZSTD_PROTOCOL : (ZSTD_PROTOCOL + ":" + std::to_string(dictionary_id));
+    }
+    static std::string FecProtocol(size_t group_size = kFecDefaultGroupSize) {
+      return FEC_PROTOCOL + ":" + std::to_string(group_size);
+    }
+    // returns 0 if protocol does not contain valid FEC_PROTOCOL
+    static uint8_t FecGroupSize(const std::string &protocol);
+    static inline bool PartiallyReliable(const Config &c) {
+      return c.partially_reliable || c.params.maxRetransmits > 0 || c.params.maxPacketLifeTime > 0;
+    }
   public:
     virtual int Open();
     virtual void Close(const CloseReason &reason);
@@ -52,21 +126,84 @@ namespace base {
     virtual int OnConnect() { return QRPC_OK; }
     virtual void OnShutdown() {}
     virtual int OnRead(const char *p, size_t sz) = 0;
+    // called by connection for each transport message. recovers lost messages, decompresses and
+    // unpacks coalesced messages, then calls OnRead for each
+    int OnReceive(const char *p, size_t sz);
+    // send coalesced messages and parity of partial FEC group now
+    int Flush();
+    // buffered amount dropped to low threshold or below (like RTCDataChannel.onbufferedamountlow)
+    virtual void OnBufferedAmountLow() {}
     template <class T> void SetContext(T *t) { context_ = t;}
     void SetReset() { reset_ = 1; }
     void SetPublished(bool on) { published_ = (on ? 1 : 0); }
+    // only updates config. use Connection::SetStreamPriority to apply it to the transport
+    void SetPriority(uint16_t priority, uint16_t weight) {
+      config_.priority = priority;
+      config_.weight = weight;
+    }
+    // called by connection for compressing stream. dictionary is nullptr if protocol does not specify it
+    void SetZstdDictionary(std::shared_ptr<const ZstdDictionary> dict, size_t min_size = kZstdDefaultMinSize) {
+      zstd_dict_ = dict;
+      zstd_min_size_ = min_size;
+    }
+  public:
+    // bytes passed to Send but not yet acknowledged by peer (or abandoned)
+    size_t buffered_amount() const { return buffered_amount_; }
+    size_t buffered_amount_low_threshold() const { return buffered_amount_low_; }
+    size_t buffered_amount_high_threshold() const { return buffered_amount_high_; }
+    // Send returns QRPC_EAGAIN while buffered amount would exceed high. 0 means unlimited (default).
+    // application should wait for OnBufferedAmountLow before sending again
+    void SetBufferedAmountThreshold(size_t low, size_t high) {
+      buffered_amount_low_ = low;
+      buffered_amount_high_ = high;
+    }
+    // called by connection when transport reports buffered amount of the stream
+    void UpdateBufferedAmount(size_t amount) {
+      auto prev = buffered_amount_;
+      buffered_amount_ = amount;
+      if (prev > buffered_amount_low_ && amount <= buffered_amount_low_ && !closed()) {
+        OnBufferedAmountLow();
+      }
+    }
+  protected:
+    // send one transport message, compressing it if needed
+    int Emit(const char *data, size_t sz, bool binary);
+    // send compressed message, adding FEC header and parity if needed
+    int Transmit(const char *data, size_t sz, bool binary);
+    void TransmitParity();
+    int Recover(const char *p, size_t sz);
+    int Inflate(const char *p, size_t sz);
+    int Unpack(const char *p, size_t sz);
+  protected:
+    // receiving state of FEC group. sum is XOR of received messages (and parity), each of which is
+    // prefixed by flags and 4 bytes length, so that lost one can be restored from it
+    struct FecGroup {
+      uint64_t received{0};
+      uint8_t count{0}, size{0};
+      bool parity{false}, done{false};
+      std::string sum;
+    };
   protected:
     Connection &conn_;
     Config config_;
     void *context_{nullptr};
     std::unique_ptr<CloseReason> close_reason_;
-    uint8_t binary_payload_, reset_{0}, published_{0};
+    size_t buffered_amount_{0}, buffered_amount_low_{0}, buffered_amount_high_{0};
+    std::string coalesce_buffer_;
+    std::shared_ptr<const ZstdDictionary> zstd_dict_;
+    size_t zstd_min_size_{kZstdDefaultMinSize};
+    std::string fec_parity_;
+    std::map<uint16_t, FecGroup> fec_groups_;
+    uint16_t fec_group_{0}, fec_latest_group_{0};
+    uint8_t fec_index_{0};
+    uint8_t binary_payload_, coalescing_, compressing_, fec_group_size_, reset_{0}, published_{0};
   };
   typedef std::function<std::shared_ptr<Stream> (const Stream::Config &, Connection &)> StreamFactory;
   class AdhocStream : public Stream {
   public:
     typedef std::function<int (Stream &)> ConnectHandler;
     typedef std::function<void (Stream &, const CloseReason &)> ShutdownHandler;
+    typedef std::function<void (Stream &)> BufferedAmountLowHandler;
   public:
     AdhocStream(Connection &c, const Config &config, Handler &&h) :
       Stream(c, config, false), read_handler_(std::move(h)), connect_handler_(Nop()), shutdown_handler_(Nop()) {}
@@ -76,6 +213,12 @@ namespace base {
     int OnRead(const char *p, size_t sz) override { return read_handler_(*this, p, sz); }
     int OnConnect() override { return connect_handler_(*this); }
     void OnShutdown() override { return shutdown_handler_(*this, *close_reason_); }
+    void OnBufferedAmountLow() override {
+      if (buffered_amount_low_handler_ != nullptr) {
+        buffered_amount_low_handler_(*this);
+      }
+    }
+    void SetBufferedAmountLowHandler(BufferedAmountLowHandler &&h) { buffered_amount_low_handler_ = std::move(h); }
   protected:
     struct Nop {
       int operator()(Stream &) { return QRPC_OK; }
@@ -86,5 +229,6 @@ namespace base {
     Handler read_handler_;
     ConnectHandler connect_handler_;
     ShutdownHandler shutdown_handler_;
+    BufferedAmountLowHandler buffered_amount_low_handler_;
   };
 }
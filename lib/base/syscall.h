@@ -24,6 +24,7 @@
 #include <mach-o/dyld.h>
 #elif OS_LINUX
 #include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #elif OS_WINDOWS
 #include <windows.h>
 #endif
@@ -259,6 +260,47 @@ public:
     return QRPC_OK;
   }
 
+  // ECN codepoints (lower 2 bits of IPv4 TOS / IPv6 traffic class)
+  static constexpr uint8_t ECN_NOT_ECT = 0x0;
+  static constexpr uint8_t ECN_ECT1 = 0x1;
+  static constexpr uint8_t ECN_ECT0 = 0x2;
+  static constexpr uint8_t ECN_CE = 0x3;
+  // mark all packets sent from the socket with ecn codepoint
+  static int SetEcn(Fd fd, int address_family, uint8_t ecn) {
+    int tos = ecn & 0x3;
+    if (address_family == AF_INET6 &&
+      setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos)) != 0) {
+      logger::error({{"ev","Failed to set ECN on ipv6 socket"},{"fd",fd},{"errno",Errno()}});
+      return QRPC_ESYSCALL;
+    }
+    // for ipv6 dual stack socket, ipv4 mapped packets use IP_TOS
+    if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) != 0 && address_family == AF_INET) {
+      logger::error({{"ev","Failed to set ECN on ipv4 socket"},{"fd",fd},{"errno",Errno()}});
+      return QRPC_ESYSCALL;
+    }
+    return QRPC_OK;
+  }
+  // read ECN codepoint from IP_TOS/IPV6_TCLASS control message (enabled by EnableRecevingECN).
+  // returns false if no such message.
+  static bool GetEcn(const struct msghdr &h, uint8_t &ecn) {
+    for (auto c = CMSG_FIRSTHDR(&h); c != nullptr; c = CMSG_NXTHDR(const_cast<struct msghdr *>(&h), c)) {
+      if (c->cmsg_level == IPPROTO_IP && (c->cmsg_type == IP_TOS
+  #if defined(IP_RECVTOS)
+        || c->cmsg_type == IP_RECVTOS // macOS uses IP_RECVTOS as cmsg type
+  #endif
+      )) {
+        ecn = (*reinterpret_cast<const uint8_t *>(CMSG_DATA(c))) & 0x3;
+        return true;
+      } else if (c->cmsg_level == IPPROTO_IPV6 && c->cmsg_type == IPV6_TCLASS) {
+        int tclass;
+        memcpy(&tclass, CMSG_DATA(c), sizeof(tclass));
+        ecn = tclass & 0x3;
+        return true;
+      }
+    }
+    return false;
+  }
+
   static int EnableReceivingTimestamp(int fd) {
 #if defined(SO_TIMESTAMPING) && defined(SOF_TIMESTAMPING_RX_SOFTWARE)
     int timestamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
@@ -286,8 +328,22 @@ public:
     return true;
   }
 
+  static bool SetSocketReusePort(int fd) {
+    int yes = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&yes, sizeof(yes)) != 0) {
+        logger::error({{"ev", "setsockopt(SO_REUSEPORT) failed"},{"errno", Errno()}});
+        return false;
+    }
+    return true;
+  }
+
   static Fd Accept(Fd listener_fd, struct sockaddr_storage &sa, socklen_t &salen, bool in6 = false) {
+#if OS_LINUX
+    // accepted socket does not inherit O_NONBLOCK on linux. set flags atomically to save extra fcntl calls
+    return accept4(listener_fd, reinterpret_cast<struct sockaddr *>(&sa), &salen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     return accept(listener_fd, reinterpret_cast<struct sockaddr *>(&sa), &salen);
+#endif
   }
   static Fd Accept(Fd listener_fd, Address &a, bool in6 = false);
   // if caller omit port, OS will allocate available port number
@@ -300,6 +356,13 @@ public:
     }
     return QRPC_OK;
   }
+  static int Bind(Fd fd, const sockaddr *sa, socklen_t salen) {
+    if (bind(fd, sa, salen) < 0) {
+      logger::error({{"ev", "bind() fails"},{"errno", Errno()},{"salen", salen}});
+      return QRPC_ESYSCALL;
+    }
+    return QRPC_OK;
+  }
 
   static Fd Connect(
     const sockaddr *sa, socklen_t salen, bool in6 = false,
@@ -344,7 +407,8 @@ public:
   static Fd Listen(
     int port, bool in6 = false,
     int send_buffer_size = kDefaultSocketSendBuffer,
-    int recv_buffer_size = kDefaultSocketReceiveBuffer
+    int recv_buffer_size = kDefaultSocketReceiveBuffer,
+    bool reuse_port = false
   ) {
     constexpr int MAX_BACKLOG = 128;
     int fd = socket(in6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
@@ -380,6 +444,11 @@ public:
       return INVALID_FD;
     }
 
+    if (reuse_port && !SetSocketReusePort(fd)) {
+      Close(fd);
+      return INVALID_FD;
+    }
+
     if (Bind(fd, port, in6) != QRPC_OK) {
       Close(fd);
       return INVALID_FD;
@@ -401,6 +470,131 @@ public:
     }
     return true;
   }
+  // returns actual buffer size, which linux reports doubled value of requested (for bookkeeping overhead).
+  // negative value on error.
+  static int GetReceiveBufferSize(int fd) {
+    int size;
+    socklen_t len = sizeof(size);
+    if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len) != 0) {
+      return QRPC_ESYSCALL;
+    }
+    return size;
+  }
+  static int GetSendBufferSize(int fd) {
+    int size;
+    socklen_t len = sizeof(size);
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &len) != 0) {
+      return QRPC_ESYSCALL;
+    }
+    return size;
+  }
+  // read software receive timestamp (SCM_TIMESTAMPING, enabled by EnableReceivingTimestamp) in nanosec.
+  // it uses CLOCK_REALTIME, same as qrpc_time_now(). returns false if no such message.
+  static bool GetRxTimestamp(const struct msghdr &h, qrpc_time_t &ts) {
+#if defined(SO_TIMESTAMPING) && defined(SCM_TIMESTAMPING)
+    for (auto c = CMSG_FIRSTHDR(&h); c != nullptr; c = CMSG_NXTHDR(const_cast<struct msghdr *>(&h), c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+        // struct scm_timestamping. ts[0] is software timestamp, ts[2] is raw hardware timestamp
+        struct timespec tss[3];
+        memcpy(tss, CMSG_DATA(c), sizeof(tss));
+        if (tss[0].tv_sec == 0 && tss[0].tv_nsec == 0) {
+          return false;
+        }
+        ts = ((qrpc_time_t)tss[0].tv_sec) * 1000 * 1000 * 1000 + tss[0].tv_nsec;
+        return true;
+      }
+    }
+#endif
+    return false;
+  }
+  // MSG_ZEROCOPY: kernel pins user pages of the send buffer instead of copying them, and reports when
+  // it no longer refers them via socket error queue. each successful zerocopy send is numbered from 0 per socket.
+#if defined(OS_LINUX) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  static int EnableZeroCopy(Fd fd) {
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+      logger::error({{"ev","Failed to enable SO_ZEROCOPY"},{"fd",fd},{"errno",Errno()}});
+      return QRPC_ESYSCALL;
+    }
+    return QRPC_OK;
+  }
+  static inline int SendZeroCopy(Fd fd, const void *p, qrpc_size_t sz) {
+    return send(fd, p, sz, MSG_ZEROCOPY);
+  }
+  // read one notification from error queue. completion is returned as [lo, hi], and copied becomes true
+  // if kernel fell back to copy (eg. loopback or NIC without scatter-gather). other notification gives lo > hi.
+  // returns 1 if read, 0 if queue is empty
+  static int ReadZeroCopyCompletion(Fd fd, uint32_t &lo, uint32_t &hi, bool &copied) {
+    char cbuf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr h = {};
+    h.msg_control = cbuf;
+    h.msg_controllen = sizeof(cbuf);
+    if (recvmsg(fd, &h, MSG_ERRQUEUE) < 0) {
+      return IOMayBlocked(Errno(), false) ? 0 : QRPC_ESYSCALL;
+    }
+    for (auto c = CMSG_FIRSTHDR(&h); c != nullptr; c = CMSG_NXTHDR(&h, c)) {
+      if (!((c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) ||
+        (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      struct sock_extended_err ee;
+      memcpy(&ee, CMSG_DATA(c), sizeof(ee));
+      if (ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      lo = ee.ee_info;
+      hi = ee.ee_data;
+      copied = (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+      return 1;
+    }
+    lo = 1;
+    hi = 0;
+    return 1;
+  }
+#else
+  static int EnableZeroCopy(Fd fd) { return QRPC_ENOTSUPPORT; }
+  static inline int SendZeroCopy(Fd fd, const void *p, qrpc_size_t sz) { return QRPC_ENOTSUPPORT; }
+  static int ReadZeroCopyCompletion(Fd fd, uint32_t &lo, uint32_t &hi, bool &copied) { return 0; }
+#endif
+  // read destination address of received packet from IP_PKTINFO/IPV6_PKTINFO control message
+  // (enabled by EnableReceivingSelfIp), with port. returns false if no such message.
+  static bool GetPacketDestination(const struct msghdr &h, int port, sockaddr_storage &sa, socklen_t &salen) {
+    for (auto c = CMSG_FIRSTHDR(&h); c != nullptr; c = CMSG_NXTHDR(const_cast<struct msghdr *>(&h), c)) {
+      if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO) {
+        struct in_pktinfo info;
+        memcpy(&info, CMSG_DATA(c), sizeof(info));
+        auto sin = reinterpret_cast<sockaddr_in *>(&sa);
+        memset(sin, 0, sizeof(*sin));
+        sin->sin_family = AF_INET;
+        sin->sin_addr = info.ipi_addr;
+        sin->sin_port = htons(port);
+        salen = sizeof(*sin);
+        return true;
+      } else if (c->cmsg_level == IPPROTO_IPV6 && c->cmsg_type == IPV6_PKTINFO) {
+        struct in6_pktinfo info;
+        memcpy(&info, CMSG_DATA(c), sizeof(info));
+        auto sin6 = reinterpret_cast<sockaddr_in6 *>(&sa);
+        memset(sin6, 0, sizeof(*sin6));
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = info.ipi6_addr;
+        sin6->sin6_port = htons(port);
+        salen = sizeof(*sin6);
+        return true;
+      }
+    }
+    return false;
+  }
+  // read SO_RXQ_OVFL control message, which carries total number of packets
+  // dropped by the socket since its creation. returns false if no such message.
+  static bool GetRxqOverflow(const struct msghdr &h, uint32_t &dropped) {
+    for (auto c = CMSG_FIRSTHDR(&h); c != nullptr; c = CMSG_NXTHDR(const_cast<struct msghdr *>(&h), c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+        memcpy(&dropped, CMSG_DATA(c), sizeof(dropped));
+        return true;
+      }
+    }
+    return false;
+  }
   static int CreateUDPSocket(
     int address_family, bool* overflow_supported,
     int send_buffer_size = kDefaultSocketSendBuffer,
@@ -1,9 +1,12 @@
 #include "base/defs.h"
 #include "base/crypto.h"
+#include "base/endian.h"
 #include "base/webrtc.h"
 #include "base/webrtc/sctp.h"
 #include "base/webrtc/dcep.h"
 #include "base/webrtc/sdp.h"
+#include "base/webrtc/dispatcher.h"
+#include "base/rtp/relay.h"
 
 #include "common.hpp"
 #include "handles/TimerHandle.hpp"
@@ -24,6 +27,7 @@
 #include <srtp.h>
 
 #include <algorithm>
+#include <string_view>
 
 namespace base {
 namespace webrtc {
@@ -47,7 +51,7 @@ int ConnectionFactory::Init() {
   if ((r = GlobalInit()) < 0) {
     return r;
   }
-  if ((r = ThreadInit(alarm_processor())) < 0) {
+  if ((r = ThreadInit(loop())) < 0) {
     return r;
   }
   if ((r = config_.Derive()) < 0) {
@@ -58,11 +62,12 @@ int ConnectionFactory::Init() {
 void ConnectionFactory::Fin() {
   connections_.clear();
   cnmap_.clear();
+  addrmaps_.clear();
   if (alarm_id_ != AlarmProcessor::INVALID_ID) {
     alarm_processor().Cancel(alarm_id_);
     alarm_id_ = AlarmProcessor::INVALID_ID;
   }
-  ThreadFin(alarm_processor());
+  ThreadFin(loop());
   GlobalFin();
 }
 void ConnectionFactory::CloseConnection(Connection &c) {
@@ -70,36 +75,89 @@ void ConnectionFactory::CloseConnection(Connection &c) {
   c.Fin(); // cleanup resources if not yet but c itself does not freed
   cnmap_.erase(c.cname());
   connections_.erase(c.ufrag());
+  rtp::Relay::Unadvertise(c.cname(), &c);
+  UncacheAddrs(c);
   // c might be freed here (if all reference from shared_ptr is released)
 }
-static inline ConnectionFactory::IceUFrag GetLocalIceUFragFrom(RTC::StunPacket& packet) {
-  TRACK();
-
-  // Here we inspect the USERNAME attribute of a received STUN request and
-  // extract its remote usernameFragment (the one given to our IceServer as
-  // local usernameFragment) which is the first value in the attribute value
-  // before the ":" symbol.
-
-  const auto& username  = packet.GetUsername();
-  const size_t colonPos = username.find(':');
-
-  // If no colon is found just return the whole USERNAME attribute anyway.
-  if (colonPos == std::string::npos) {
-    return username;
+void ConnectionFactory::UncacheAddrs(Connection &c, const Session *keep) {
+  for (auto it = c.addrs_.begin(); it != c.addrs_.end();) {
+    if (keep != nullptr && it->first == &keep->factory() && it->second == keep->addr()) {
+      it++;
+      continue;
+    }
+    auto mit = addrmaps_.find(it->first);
+    if (mit != addrmaps_.end()) {
+      auto ait = mit->second.find(it->second);
+      // address might be already taken by other connection
+      if (ait != mit->second.end() && (ait->second.expired() || ait->second.lock().get() == &c)) {
+        mit->second.erase(ait);
+      }
+    }
+    it = c.addrs_.erase(it);
   }
-
-  return username.substr(0, colonPos);
+}
+// extract local usernameFragment from STUN USERNAME attribute without parsing whole RTC::StunPacket.
+// USERNAME is "local_ufrag:remote_ufrag", and returned ufrag points inside of p.
+// returns false if p is not well-formed STUN message, ufrag becomes empty if no USERNAME attribute.
+static inline bool PeekLocalIceUFragFrom(const uint8_t *p, size_t sz, std::string_view &ufrag) {
+  // https://datatracker.ietf.org/doc/html/rfc5389#section-6
+  static constexpr size_t kHeaderSize = 20;
+  static constexpr uint16_t kUsername = 0x0006;
+  ufrag = std::string_view();
+  if (sz < kHeaderSize || (p[0] & 0xc0) != 0) {
+    return false;
+  }
+  size_t len = (static_cast<size_t>(p[2]) << 8) | p[3];
+  if ((len & 0x3) != 0 || (kHeaderSize + len) > sz) {
+    return false;
+  }
+  const uint8_t *a = p + kHeaderSize, *end = a + len;
+  while ((a + 4) <= end) {
+    uint16_t type = (static_cast<uint16_t>(a[0]) << 8) | a[1];
+    size_t alen = (static_cast<size_t>(a[2]) << 8) | a[3];
+    if ((a + 4 + alen) > end) {
+      return false;
+    }
+    if (type == kUsername) {
+      auto username = std::string_view(reinterpret_cast<const char *>(a + 4), alen);
+      // If no colon is found just return the whole USERNAME attribute anyway.
+      ufrag = username.substr(0, username.find(':'));
+      return true;
+    }
+    a += 4 + ((alen + 3) & ~static_cast<size_t>(0x3)); // attributes are padded to 4 byte boundary
+  }
+  return true;
 }
 std::shared_ptr<ConnectionFactory::Connection>
-ConnectionFactory::FindFromStunRequest(const uint8_t *p, size_t sz) {
-  auto packet = std::unique_ptr<RTC::StunPacket>(RTC::StunPacket::Parse(p, sz));
-  if (packet == nullptr) {
-    QRPC_LOG(warn, "ignoring wrong STUN packet received");
+ConnectionFactory::FindFromStunRequest(
+  const SessionFactory &listener, const Address &a,
+  const uint8_t *p, size_t sz, std::unique_ptr<RTC::StunPacket> &packet
+) {
+  std::string_view ufrag;
+  // only STUN request can bind new session to connection. other packets are rejected by
+  // IceServer::IsValidSession anyway, because new session is not known to IceServer yet
+  if (!RTC::StunPacket::IsStun(p, sz) || !PeekLocalIceUFragFrom(p, sz, ufrag)) {
+    QRPC_LOG_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, "ignoring wrong STUN packet received");
     return nullptr;
   }
-  QRPC_LOGJ(info, {{"ev","STUN packet received"},{"username",packet->GetUsername()}})
-  // try to match the local ICE username fragment.
-  auto key = GetLocalIceUFragFrom(*packet);
+  // fast path: STUN request from 4-tuple already authenticated for the connection (eg. session is
+  // re-created after timeout). IceServer::ProcessStunPacket authenticates it later, so skip parsing here.
+  // if the request says different ufrag (ICE restart, or other peer reuses same address), fallback to ufrag lookup
+  auto &addrmap = addrmaps_[&listener];
+  auto ait = addrmap.find(a);
+  if (ait != addrmap.end()) {
+    auto c = ait->second.lock();
+    if (c == nullptr || c->closed()) {
+      addrmap.erase(ait);
+    } else if (ufrag.empty() || ufrag == c->ufrag()) {
+      // empty ufrag: binding response for client connection
+      return c;
+    }
+  }
+  // reuse buffer to prevent allocation for each lookup
+  thread_local IceUFrag key;
+  key.assign(ufrag.data(), ufrag.size());
+  QRPC_LOGJ(info, {{"ev","STUN packet received"},{"ufrag",key}})
   // stun binding response from server does not contains username fragment
   // usually client session created with Connection object, no FindFromStunRequest call needed.
   // but when client give up one endpoint in SDP and using next one, packet from old endpoint might be received.
@@ -108,21 +166,58 @@ ConnectionFactory::FindFromStunRequest(const uint8_t *p, size_t sz) {
   ASSERT(!key.empty() || is_client());
   auto it = connections_.find(key);
   if (it == this->connections_.end()) {
-    logger::warn({
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {
       {"ev","ignoring received STUN packet with unknown remote ICE usernameFragment"},
       {"ufrag",key}
     });
     //ASSERT(false);
     return nullptr;
-    // validate packet is properly authorized    
+  }
+  // fully parse the packet only after candidate connection is found
+  packet.reset(RTC::StunPacket::Parse(p, sz));
+  if (packet == nullptr) {
+    QRPC_LOG_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, "ignoring wrong STUN packet received");
+    return nullptr;
   } else if (!it->second->ice_server().ValidatePacket(*packet)) {
-    logger::warn({
+    // validate packet is properly authorized
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {
       {"ev","ignoring received STUN packet that does not have proper token or not binding request"},
       {"ufrag",key}
     });
     return nullptr;
   }
-  return it->second;
+  auto &c = it->second;
+  auto &entry = addrmap[a];
+  if (entry.lock() != c) {
+    entry = c;
+    c->addrs_.emplace_back(&listener, a);
+  }
+  return c;
+}
+int ConnectionFactory::FindOwnerWorker(const uint8_t *p, size_t sz) const {
+  std::string_view ufrag;
+  if (!config_.reuse_port || is_client() || !RTC::StunPacket::IsStun(p, sz) || !PeekLocalIceUFragFrom(p, sz, ufrag)) {
+    return -1;
+  }
+  auto w = Dispatcher::WorkerFromUFrag(ufrag);
+  return (w >= 0 && w != rtp::Relay::worker()) ? w : -1;
+}
+int ConnectionFactory::RegisterZstdDictionary(uint32_t id, const std::string &data, int level) {
+  if (id == 0 || data.empty()) {
+    return QRPC_EINVAL;
+  }
+  if (!Zstd::Available()) {
+    logger::error({{"ev","zstd not available"},{"dict",id}});
+    return QRPC_EDEPS;
+  }
+  auto dict = std::make_shared<const ZstdDictionary>(id, data, level);
+  if (!dict->valid()) {
+    logger::error({{"ev","fail to digest zstd dictionary"},{"dict",id},{"sz",data.size()}});
+    return QRPC_EINVAL;
+  }
+  // connections that already opened stream with previous one keep using it
+  zstd_dictionaries_[id] = dict;
+  return QRPC_OK;
 }
 void ConnectionFactory::RegisterCname(
   const std::string &cname, std::shared_ptr<Connection> &c) {
@@ -141,6 +236,11 @@ void ConnectionFactory::RegisterCname(
   }
   QRPC_LOGJ(info, {{"ev","register connection"},{"ufrag",c->ufrag()},{"cname",cname},{"ptr",str::dptr(c.get())}});
   cnmap_[cname] = c;
+  // let other workers able to consume streams of the connection
+  rtp::Relay::Advertise(cname, c.get(), [w = std::weak_ptr<Connection>(c)]() {
+    auto c = w.lock();
+    return c == nullptr ? nullptr : c->rtp_handler_;
+  });
   auto newcit = cnmap_.find(cname);
   QRPC_LOGJ(info, {{ "ev", "new connection registered" }, { "ptr", str::dptr(newcit->second.get()) },{"now",newcit->second->ufrag()}});
   if (prev_exists) {
@@ -153,6 +253,11 @@ std::shared_ptr<rtp::Handler>
 ConnectionFactory::FindHandler(const std::string &cname) {
   auto it = cnmap_.find(cname);
   if (it == cnmap_.end()) {
+    // peer might be connected to another worker thread
+    auto h = rtp::Relay::FindProxy(cname);
+    if (h != nullptr) {
+      return h;
+    }
     // TODO: now it targets peer that connected to the node. to scale, we have to be able to watch remote peer
     // this should be achieved like following:
     // 1. create kind of 'proxy connection' that acts like rtp::Handler::Listener
@@ -189,10 +294,11 @@ static void srtp_logger(srtp_log_level_t level,
                         void *data) {
   QRPC_LOGJ(info,{{"ev","srtp log"},{"level",level},{"msg",msg}});
 }
-int ConnectionFactory::ThreadInit(AlarmProcessor &a) {
+int ConnectionFactory::ThreadInit(Loop &l) {
   if (g_thread_ref_count_ > 0) {
     return QRPC_OK;
   }
+  auto &a = l.alarm_processor();
   // setup RTC::Timer and UnixStreamSocket, Logger, rtp::Parameters
   ::TimerHandle::SetTimerProc(
     [&a](const ::TimerHandle::Handler &h, uint64_t start_at) {
@@ -208,7 +314,8 @@ int ConnectionFactory::ThreadInit(AlarmProcessor &a) {
       return a.Cancel(id);
     }
   );
-  SctpSender::ClassInit(a);
+  rtp::Relay::ClassInit(l);
+  Dispatcher::ClassInit();
   g_thread_ref_count_++;
   return QRPC_OK;
 }
@@ -275,12 +382,15 @@ int ConnectionFactory::GlobalInit() {
 		return QRPC_EDEPS;
 	}
 }
-void ConnectionFactory::ThreadFin(AlarmProcessor &a) {
+void ConnectionFactory::ThreadFin(Loop &l) {
   g_thread_ref_count_--;
   if (g_thread_ref_count_ > 0) {
     return;
   }
+  auto &a = l.alarm_processor();
   SctpSender::ClassDestroy(a);
+  Dispatcher::ClassDestroy();
+  rtp::Relay::ClassDestroy(l);
   ::TimerHandle::SetTimerProc([](const ::TimerHandle::Handler &, uint64_t) {
     return AlarmProcessor::INVALID_ID;
   }, [](uint64_t) {
@@ -337,6 +447,11 @@ int ConnectionFactory::Config::Derive() {
   if (fingerprint.length() <= 0) {
     logger::die({{"ev","no fingerprint for algorithm"},{"algo", fingerprint_algorithm}});
   }
+  if (ecn) {
+    // ECN marks are useful only when they are fed back to peer, or limit incoming bitrate
+    rtp.ccfb = true;
+    rtp.ecn = true;
+  }
   if (ip.length() <= 0) {
     for (auto &a : Syscall::GetIfAddrs()) {
       if (in6 == (a.family() == AF_INET6)) {
@@ -365,17 +480,20 @@ int ConnectionFactory::Config::Derive() {
 template <class PS>
 int ConnectionFactory::TcpSessionTmpl<PS>::OnRead(const char *p, size_t sz) {
   auto up = reinterpret_cast<const uint8_t *>(p);
+  std::unique_ptr<RTC::StunPacket> stun;
   if (connection_ == nullptr) {
-    connection_ = connection_factory().FindFromStunRequest(up, sz);
+    connection_ = connection_factory().FindFromStunRequest(PS::factory(), PS::addr(), up, sz, stun);
     if (connection_ == nullptr) {
-      QRPC_LOGJ(info, {{"ev","fail to find connection from stun request"}});
+      QRPC_LOGJ_RATELIMIT(info, QRPC_LOG_PACKET_RATE, {{"ev","fail to find connection from stun request"}});
       return QRPC_EINVAL;
     }
   } else if (connection_->closed()) {
     QRPC_LOGJ(info, {{"ev","parent connection closed, remove the session"},{"from",PS::addr().str()}});
     return QRPC_EGOAWAY;
   }
-  return connection_->OnPacketReceived(this, up, sz);
+  connection_->set_rx_time(0); // no per packet timestamp and ECN for stream socket
+  connection_->set_rx_ecn(0);
+  return connection_->OnPacketReceived(this, up, sz, stun.get());
 }
 template <class PS>
 qrpc_time_t ConnectionFactory::TcpSessionTmpl<PS>::OnShutdown() {
@@ -387,15 +505,27 @@ qrpc_time_t ConnectionFactory::TcpSessionTmpl<PS>::OnShutdown() {
 template <class PS>
 int ConnectionFactory::UdpSessionTmpl<PS>::OnRead(const char *p, size_t sz) {
   auto up = reinterpret_cast<const uint8_t *>(p);
+  std::unique_ptr<RTC::StunPacket> stun;
   if (connection_ == nullptr) {
-    connection_ = connection_factory().FindFromStunRequest(up, sz);
+    if (redirect_ < 0) {
+      redirect_ = connection_factory().FindOwnerWorker(up, sz);
+    }
+    if (redirect_ >= 0) {
+      // this 4-tuple is owned by other worker. hand over all packets of it to the owner.
+      // dropped packet is treated as same as packet loss, so session is kept
+      Dispatcher::Redirect(redirect_, PS::factory().template to<UdpListener>().port(), PS::addr(), p, sz, PS::rx_time(), PS::rx_ecn());
+      return QRPC_OK;
+    }
+    connection_ = connection_factory().FindFromStunRequest(PS::factory(), PS::addr(), up, sz, stun);
     if (connection_ == nullptr) {
-      QRPC_LOGJ(info, {{"ev","fail to find connection from stun request"}});
+      QRPC_LOGJ_RATELIMIT(info, QRPC_LOG_PACKET_RATE, {{"ev","fail to find connection from stun request"}});
       return QRPC_EINVAL;
     }
   }
   // UdpSession is not closed because fd is shared among multiple sessions
-  return connection_->OnPacketReceived(this, up, sz);
+  connection_->set_rx_time(PS::rx_time());
+  connection_->set_rx_ecn(PS::rx_ecn());
+  return connection_->OnPacketReceived(this, up, sz, stun.get());
 }
 template <class PS>
 qrpc_time_t ConnectionFactory::UdpSessionTmpl<PS>::OnShutdown() {
@@ -557,6 +687,25 @@ int ConnectionFactory::SyscallStream::OnRead(const char *p, size_t sz) {
             }
           }
           auto path = pit->second.get<std::string>();
+          // peer on another worker becomes consumable after its producers are relayed. park the request until then
+          if (!resumed_ && c.factory().WaitHandler(path.substr(0, path.find('/')),
+            [wc = std::weak_ptr<Connection>(c.factory().FindFromUfrag(c.ufrag())), sid = id(), pl]() {
+              auto c = wc.lock();
+              if (c == nullptr) {
+                return;
+              }
+              auto sit = c->streams().find(sid);
+              auto s = sit == c->streams().end() ? nullptr : std::dynamic_pointer_cast<SyscallStream>(sit->second);
+              if (s == nullptr) {
+                return;
+              }
+              s->resumed_ = true;
+              s->OnRead(pl.data(), pl.size());
+              s->resumed_ = false;
+            })) {
+            QRPC_LOGJ(info, {{"ev","consume waits for remote peer"},{"path",path}});
+            return QRPC_OK;
+          }
           std::string sdp;
           std::map<std::string,rtp::Consumer*> created_consumers;
           if (!c.PrepareConsume(path, options_map, sync, sdp, created_consumers)) {
@@ -611,6 +760,45 @@ int ConnectionFactory::SyscallStream::OnRead(const char *p, size_t sz) {
             RAISE("fail to close media:" + sdp_or_error);
           }
           Call("close_media_ack",msgid,{{"paths",closed_paths},{"sdp",sdp_or_error}});
+        } else if (fn == "stream_priority") {
+          const auto sit = args.find("sid");
+          if (sit == args.end()) {
+            RAISE("no value for key 'sid'");
+          }
+          const auto sid = sit->second.get<Stream::Id>();
+          auto s = c.streams().find(sid);
+          if (s == c.streams().end()) {
+            RAISE("no such stream:" + std::to_string(sid));
+          }
+          auto priority = s->second->config().priority;
+          auto weight = s->second->config().weight;
+          const auto pit = args.find("priority");
+          if (pit != args.end()) {
+            priority = pit->second.get<uint16_t>();
+          }
+          const auto wit = args.find("weight");
+          if (wit != args.end()) {
+            weight = wit->second.get<uint16_t>();
+          }
+          if (c.SetStreamPriority(sid, priority, weight) < 0) {
+            RAISE("fail to set stream priority");
+          }
+          Call("stream_priority_ack",msgid,{});
+        } else if (fn == "zstd_dictionary") {
+          const auto iit = args.find("id");
+          if (iit == args.end()) {
+            RAISE("no value for key 'id'");
+          }
+          auto dict = c.factory().FindZstdDictionary(iit->second.get<uint32_t>());
+          if (dict == nullptr) {
+            RAISE("zstd dictionary not registered");
+          }
+          const auto &data = dict->data();
+          std::string encoded(base64::buffsize(data.size()), 0);
+          auto elen = base64::encode(reinterpret_cast<const uint8_t *>(data.data()), data.size(),
+            encoded.data(), encoded.size());
+          encoded.resize(elen);
+          Call("zstd_dictionary_ack",msgid,{{"id",dict->id()},{"data",encoded}});
         } else {
           RAISE("syscall is not supported");
         }
@@ -650,6 +838,9 @@ void ConnectionFactory::Connection::InitRTP() {
       rtp_handler_->UpdateByCapability(kv.second);
     }
   }
+  if (pacer_ == nullptr && factory().config().pacing) {
+    pacer_ = std::make_unique<rtp::Pacer>(factory().alarm_processor());
+  }
 }
 bool ConnectionFactory::Connection::PrepareConsume(
   const std::string &media_path, 
@@ -838,7 +1029,9 @@ int ConnectionFactory::Connection::Init(std::string &ufrag, std::string &pwd) {
     logger::warn({{"ev","already init"}});
     return QRPC_OK;
   }
-  ufrag = random::word(32);
+  // prefix worker index so that the thread which receives STUN request can find owner of the connection
+  auto prefix = Dispatcher::UFragPrefix(rtp::Relay::worker());
+  ufrag = prefix + random::word(32 - prefix.length());
   pwd = random::word(32);
   // create ICE server
   ice_server_.reset(new IceServer(this, ufrag, pwd, factory().config().consent_check_interval));
@@ -854,15 +1047,18 @@ int ConnectionFactory::Connection::Init(std::string &ufrag, std::string &pwd) {
     return QRPC_EALLOC;
   }
   // create SCTP association
-  sctp_association_.reset(
-    new RTC::SctpAssociation(
-      this, 
-      factory().config().max_outgoing_stream_size,
-      factory().config().initial_incoming_stream_size,
-      factory().config().send_buffer_size,
-      factory().config().send_buffer_size,
-      true)
-  );
+  auto &c = factory().config();
+  if (c.native_sctp) {
+    sctp_association_.reset(new NativeSctpTransport(*this, factory().alarm_processor(), {
+      // streams are created on demand, so accept as many incoming streams as peer wants
+      .os = (uint16_t)std::min(c.max_outgoing_stream_size, (size_t)0xFFFF), .mis = 0xFFFF,
+      .send_buffer_size = c.send_buffer_size, .max_message_size = c.send_buffer_size,
+    }));
+  } else {
+    // SctpSender (and its poll alarm) is set up when the thread creates first usrsctp association
+    sctp_association_.reset(new UsrSctpTransport(*this, factory().alarm_processor(),
+      c.max_outgoing_stream_size, c.initial_incoming_stream_size, c.send_buffer_size));
+  }
   if (sctp_association_ == nullptr) {
     logger::die({{"ev","fail to create SCTP association"}});
     return QRPC_EALLOC;
@@ -918,14 +1114,39 @@ std::shared_ptr<Stream> ConnectionFactory::Connection::NewStream(
     ASSERT(false);
     return nullptr;
   }
+  std::string dict_id;
+  std::shared_ptr<const ZstdDictionary> dict;
+  if (Stream::FindProtocol(c.protocol, Stream::ZSTD_PROTOCOL, &dict_id)) {
+    // zstd framing cannot be negotiated by DCEP, so the side built without zstd refuses the stream
+    // instead of receiving compressed messages that it cannot decode
+    if (!Zstd::Available()) {
+      logger::error({{"ev","zstd stream requested but built without zstd"},{"sid",c.params.streamId},{"p",c.protocol}});
+      return nullptr;
+    }
+  }
+  if (Stream::FecGroupSize(c.protocol) > 0 && c.params.ordered) {
+    // recovered message arrives after later messages of its group, which ordered stream must not allow
+    logger::error({{"ev","fec stream should be unordered"},{"sid",c.params.streamId},{"p",c.protocol}});
+    return nullptr;
+  }
+  if (!dict_id.empty()) {
+    if ((dict = factory().FindZstdDictionary(std::strtoul(dict_id.c_str(), nullptr, 10))) == nullptr) {
+      logger::error({{"ev","zstd dictionary not registered"},{"sid",c.params.streamId},{"dict",dict_id}});
+      return nullptr;
+    }
+  }
   auto s = sf(c, *this);
   if (s == nullptr) {
     logger::error({{"ev","fail to create stream"},{"sid",c.params.streamId}});
     ASSERT(false);
     return nullptr;
   }
-  logger::info({{"ev","new stream created"},{"sid",s->id()},{"l",s->label()}});
+  logger::info({{"ev","new stream created"},{"sid",s->id()},{"l",s->label()},{"p",c.protocol}});
   streams_[s->id()] = s;
+  sctp_association_->SetStreamPriority(s->id(), c.priority, c.weight);
+  if (s->compressing()) {
+    s->SetZstdDictionary(dict, factory().config().zstd_min_size);
+  }
   return s;
 }
 StreamFactory ConnectionFactory::Connection::DefaultStreamFactory() {
@@ -949,6 +1170,11 @@ std::shared_ptr<Stream> ConnectionFactory::Connection::OpenStream(
   const Stream::Config &c, const StreamFactory &sf
 ) {
   int r;
+  if (!sctp_association_->SupportsReliability(c)) {
+    // otherwise messages expected to be dropped on loss are retransmitted forever
+    logger::error({{"ev","maxRetransmits = 0 is not supported by usrsctp, use native_sctp"},{"l",c.label}});
+    return nullptr;
+  }
   size_t cnt = 0;
   do {
     // auto allocate
@@ -1011,6 +1237,9 @@ void ConnectionFactory::Connection::Fin() {
   if (rtp_handler_ != nullptr) {
     rtp_handler_->Disconnected();
   }
+  if (pacer_ != nullptr) {
+    pacer_->Stop();
+  }
   for (auto s = streams_.begin(); s != streams_.end();) {
     auto cur = s++;
     (*cur).second->OnShutdown();
@@ -1162,11 +1391,13 @@ void ConnectionFactory::Connection::OnUdpSessionShutdown(Session *s) {
   ice_server_->RemoveSession(s);
 }
 
-int ConnectionFactory::Connection::OnPacketReceived(Session *session, const uint8_t *p, size_t sz) {
+int ConnectionFactory::Connection::OnPacketReceived(
+  Session *session, const uint8_t *p, size_t sz, RTC::StunPacket *stun
+) {
   // Check if it's STUN.
   Touch(qrpc_time_now());
-  if (RTC::StunPacket::IsStun(p, sz)) {
-    return OnStunDataReceived(session, p, sz);
+  if (stun != nullptr || RTC::StunPacket::IsStun(p, sz)) {
+    return OnStunDataReceived(session, p, sz, stun);
   } else if (RTC::DtlsTransport::IsDtls(p, sz)) { // Check if it's DTLS.
     return OnDtlsDataReceived(session, p, sz);
   } else if (RTC::RTCP::Packet::IsRtcp(p, sz)) { // Check if it's RTCP.
@@ -1174,17 +1405,24 @@ int ConnectionFactory::Connection::OnPacketReceived(Session *session, const uint
   } else if (RTC::RtpPacket::IsRtp(p, sz)) { // Check if it's RTP.
     return OnRtpDataReceived(session, p, sz);
   } else {
-    logger::warn({
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {
       {"ev","ignoring received packet of unknown type"},
       {"payload",str::HexDump(p, std::min((size_t)16, sz))}
     });
     return QRPC_OK;
   }
 }
-int ConnectionFactory::Connection::OnStunDataReceived(Session *session, const uint8_t *p, size_t sz) {
+int ConnectionFactory::Connection::OnStunDataReceived(
+  Session *session, const uint8_t *p, size_t sz, RTC::StunPacket *stun
+) {
+  if (stun != nullptr) {
+    // already parsed by ConnectionFactory::FindFromStunRequest
+    ice_server_->ProcessStunPacket(stun, session);
+    return QRPC_OK;
+  }
   RTC::StunPacket* packet = RTC::StunPacket::Parse(p, sz);
   if (packet == nullptr) {
-    logger::warn({{"ev","ignoring wrong STUN packet received"},{"proto","stun"}});
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"ev","ignoring wrong STUN packet received"},{"proto","stun"}});
     return QRPC_OK;
   }
   ice_server_->ProcessStunPacket(packet, session);
@@ -1195,7 +1433,7 @@ int ConnectionFactory::Connection::OnDtlsDataReceived(Session *session, const ui
   TRACK();
   // Ensure it comes from a valid tuple.
   if (!ice_server_->IsValidSession(session)) {
-    logger::warn({{"ev","ignoring DTLS data coming from an invalid session"},{"proto","dtls"}});
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"ev","ignoring DTLS data coming from an invalid session"},{"proto","dtls"}});
     return QRPC_OK;
   }
   // Trick for clients performing aggressive ICE regardless we are ICE-Lite.
@@ -1207,7 +1445,7 @@ int ConnectionFactory::Connection::OnDtlsDataReceived(Session *session, const ui
     // logger::debug({{"ev","DTLS data received, passing it to the DTLS transport"},{"proto","dtls"}});
     dtls_transport_->ProcessDtlsData(p, sz);
   } else {
-    logger::warn({
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {
       {"ev","ignoring received DTLS data by invalid state"},{"proto","dtls"},
       {"state",dtls_transport_->GetState()}
     });
@@ -1219,7 +1457,7 @@ void ConnectionFactory::Connection::TryParseRtcpPacket(const uint8_t *p, size_t
   // Decrypt the SRTCP packet.
   auto decrypted = srtp_recv_->DecryptSrtcp(const_cast<uint8_t *>(p), &sz);
   if (!decrypted) {
-    QRPC_LOGJ(warn, {{"proto","srtcp"},
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","srtcp"},
       {"ev","received data is not a valid RTP packet"},
       {"decrypted",decrypted},{"len",sz},
       {"pl",str::HexDump(p, std::min((size_t)32, sz))}});
@@ -1228,7 +1466,7 @@ void ConnectionFactory::Connection::TryParseRtcpPacket(const uint8_t *p, size_t
   }
   RTC::RTCP::Packet* packet = RTC::RTCP::Packet::Parse(p, sz);
   if (packet == nullptr) {
-    logger::warn({{"proto","srtcp"},
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","srtcp"},
       {"ev","received data is not a valid RTCP compound or single packet"},
       {"pl",str::HexDump(p, std::min((size_t)32, sz))}});
     return;
@@ -1241,17 +1479,17 @@ int ConnectionFactory::Connection::OnRtcpDataReceived(Session *session, const ui
   TRACK();
   // Ensure DTLS is connected.
   if (dtls_transport_->GetState() != RTC::DtlsTransport::DtlsState::CONNECTED) {
-    logger::debug({{"ev","ignoring RTCP packet while DTLS not connected"},{"proto","dtls,rtcp"}});
+    QRPC_LOGJ(debug, {{"ev","ignoring RTCP packet while DTLS not connected"},{"proto","dtls,rtcp"}});
     return QRPC_OK;
   }
   // Ensure there is receiving SRTP session.
   if (srtp_recv_ == nullptr) {
-    logger::debug({{"proto","srtp"},{"ev","ignoring RTCP packet due to non receiving SRTP session"}});
+    QRPC_LOGJ(debug, {{"proto","srtp"},{"ev","ignoring RTCP packet due to non receiving SRTP session"}});
     return QRPC_OK;
   }
   // Ensure it comes from a valid tuple.
   if (!ice_server_->IsValidSession(session)) {
-    logger::warn({{"proto","rtcp"},{"ev","ignoring RTCP packet coming from an invalid tuple"}});
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","rtcp"},{"ev","ignoring RTCP packet coming from an invalid tuple"}});
     return QRPC_OK;
   }
   // Decrypt the SRTCP packet.
@@ -1262,67 +1500,69 @@ void ConnectionFactory::Connection::TryParseRtpPacket(const uint8_t *p, size_t s
   // Decrypt the SRTP packet.
   auto decrypted = this->srtp_recv_->DecryptSrtp(const_cast<uint8_t*>(p), &sz);
   if (!decrypted) {
-    // if roc exists, set it to corresponding stream and retry decryption
-    auto *packet = RTC::RtpPacket::Parse(p, sz);
-    auto ssrc = packet->GetSsrc();
+    // if roc exists, set it to corresponding stream and retry decryption.
+    // RTP header is not encrypted, so read fields directly from it instead of allocating RtpPacket.
+    // (OnRtpDataReceived ensures packet is RTP, which has at least 12 byte header)
+    auto ssrc = Endian::NetbytesToHost<uint32_t>(p + 8);
+    auto seq = Endian::NetbytesToHost<uint16_t>(p + 2);
+    auto payload_type = p[1] & 0x7f;
     auto rit = rtp_handler_->ssrc_stream_recovery_map().find(ssrc);
     if (rit == rtp_handler_->ssrc_stream_recovery_map().end()) {
-      QRPC_LOGJ(warn, {{"ev","RTP packet received, but decryption fails (no recovery info)"},
+      QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"ev","RTP packet received, but decryption fails (no recovery info)"},
         {"proto","srtp"},{"ssrc",ssrc},
-        {"payloadType",packet->GetPayloadType()},{"seq",packet->GetSequenceNumber()}
+        {"payloadType",payload_type},{"seq",seq}
       });
-      delete packet;
       return;
     }
     auto roc = rit->second.rtp_roc;
-    QRPC_LOGJ(warn, {{"ev","try recovery RTP stream context"},
-      {"proto","srtp"},{"ssrc",ssrc},{"roc",roc},{"seq",packet->GetSequenceNumber()}
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"ev","try recovery RTP stream context"},
+      {"proto","srtp"},{"ssrc",ssrc},{"roc",roc},{"seq",seq}
     });
     // after adding stream, we can set roc to the stream, then decryption should be ok
     if (!this->srtp_recv_->SetRoc(ssrc, roc, srtp_remote_key_, srtp_crypto_suite_)) {
-      QRPC_LOGJ(warn, {{"ev","RTP packet received, but decryption fails (set roc fails)"},
-        {"proto","srtp"},{"ssrc",ssrc},{"roc",roc},{"seq",packet->GetSequenceNumber()}
+      QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"ev","RTP packet received, but decryption fails (set roc fails)"},
+        {"proto","srtp"},{"ssrc",ssrc},{"roc",roc},{"seq",seq}
       });
-      delete packet;
       return;
     }
     if (!this->srtp_recv_->DecryptSrtp(const_cast<uint8_t*>(p), &sz)) {
-      QRPC_LOGJ(warn, {
+      QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {
         {"ev","RTP packet received, but decryption fails (retry fails)"},
-        {"proto","srtp"},{"ssrc",packet->GetSsrc()},{"roc",roc},
-        {"payloadType",packet->GetPayloadType()},{"seq",packet->GetSequenceNumber()}
+        {"proto","srtp"},{"ssrc",ssrc},{"roc",roc},
+        {"payloadType",payload_type},{"seq",seq}
       });
       // encryption back to work as usual after a few times reach here (eg. firefox), so remove assertion
       // ASSERT(false);
     }
-    delete packet;
   }
   auto *packet = RTC::RtpPacket::Parse(p, sz);
   if (packet == nullptr) {
-    QRPC_LOGJ(warn, {{"proto","rtcp"},
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","rtcp"},
       {"ev","received data is not a valid RTP packet"},
       {"decrypted",decrypted},{"len",sz},
       {"pl",str::HexDump(p, std::min((size_t)32, sz))}});
     ASSERT(false);
     return;
   }
+  rtp_handler_->set_rx_time(rx_time_);
+  rtp_handler_->set_rx_ecn(rx_ecn_);
   rtp_handler_->ReceiveRtpPacket(packet); // deletes packet
 }
 int ConnectionFactory::Connection::OnRtpDataReceived(Session *session, const uint8_t *p, size_t sz) {
   TRACK();
   // Ensure DTLS is connected.
   if (dtls_transport_->GetState() != RTC::DtlsTransport::DtlsState::CONNECTED) {
-    logger::debug({{"ev","ignoring RTCP packet while DTLS not connected"},{"proto","dtls,rtcp"}});
+    QRPC_LOGJ(debug, {{"ev","ignoring RTCP packet while DTLS not connected"},{"proto","dtls,rtcp"}});
     return QRPC_OK;
   }
   // Ensure there is receiving SRTP session.
   if (srtp_recv_ == nullptr) {
-    logger::debug({{"proto","srtp"},{"ev","ignoring RTCP packet due to non receiving SRTP session"}});
+    QRPC_LOGJ(debug, {{"proto","srtp"},{"ev","ignoring RTCP packet due to non receiving SRTP session"}});
     return QRPC_OK;
   }
   // Ensure it comes from a valid tuple.
   if (!ice_server_->IsValidSession(session)) {
-    logger::warn({{"proto","rtcp"},{"ev","ignoring RTCP packet coming from an invalid tuple"}});
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","rtcp"},{"ev","ignoring RTCP packet coming from an invalid tuple"}});
     return QRPC_OK;
   }
   // parse
@@ -1338,13 +1578,60 @@ int ConnectionFactory::Connection::Send(Stream &s, const char *p, size_t sz, boo
   PPID ppid = binary ? 
     (sz > 0 ? PPID::BINARY : PPID::BINARY_EMPTY) : 
     (sz > 0 ? PPID::STRING : PPID::STRING_EMPTY);
-  sctp_association_->SendSctpMessage(s.config().params, reinterpret_cast<const uint8_t *>(p), sz, ppid);
+  int r;
+  if ((r = sctp_association_->SendSctpMessage(
+    s.config(), reinterpret_cast<const uint8_t *>(p), sz, ppid)) < 0) {
+    return r;
+  }
+  s.UpdateBufferedAmount(sctp_association_->GetStreamBufferedAmount(s.id()));
   return QRPC_OK;
 }
+void ConnectionFactory::Connection::ScheduleFlush(Stream &s) {
+  flush_streams_.insert(s.id());
+  if (flush_alarm_id_ == AlarmProcessor::INVALID_ID) {
+    // timer is polled after io events of current loop iteration are processed
+    flush_alarm_id_ = factory().alarm_processor().Set([this]() { return FlushStreams(); }, qrpc_time_now());
+  }
+}
+qrpc_time_t ConnectionFactory::Connection::FlushStreams() {
+  std::set<Stream::Id> sids;
+  sids.swap(flush_streams_);
+  for (auto sid : sids) {
+    auto it = streams_.find(sid);
+    if (it == streams_.end()) {
+      continue; // closed
+    }
+    // hold a reference, because closing the stream below erases it from streams_
+    auto s = it->second;
+    auto r = s->Flush();
+    if (r == QRPC_EAGAIN) {
+      flush_streams_.insert(sid);
+    } else if (r < 0) {
+      // coalesced messages are already accepted by Send, so losing them silently breaks the stream.
+      // close it to let both sides know
+      QRPC_LOGJ(warn, {{"ev","fail to flush coalesced messages"},{"sid",sid},{"label",s->label()},{"r",r}});
+      s->Close(QRPC_CLOSE_REASON_LOCAL, r, "fail to flush coalesced messages");
+    }
+  }
+  if (flush_streams_.empty()) {
+    flush_alarm_id_ = AlarmProcessor::INVALID_ID;
+    return qrpc_alarm_stop_rv();
+  }
+  // send buffer is full, or messages are sent during flush
+  return qrpc_time_now() + qrpc_time_msec(5);
+}
+int ConnectionFactory::Connection::SetStreamPriority(Stream::Id sid, uint16_t priority, uint16_t weight) {
+  auto it = streams_.find(sid);
+  if (it == streams_.end()) {
+    return QRPC_EINVAL;
+  }
+  it->second->SetPriority(priority, weight);
+  return sctp_association_->SetStreamPriority(sid, priority, weight);
+}
 int ConnectionFactory::Connection::Send(const char *p, size_t sz) {
   auto *session = ice_server_->GetSelectedSession();
   if (session == nullptr) {
-    logger::warn({{"proto","raw"},{"ev","no selected tuple set, cannot send raw packet"}});
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","raw"},{"ev","no selected tuple set, cannot send raw packet"}});
     return QRPC_EINVAL;
   }
   return session->Send(p, sz);
@@ -1368,7 +1655,7 @@ int ConnectionFactory::Connection::Open(Stream &s) {
   DcepRequest req(c);
   uint8_t buff[req.PayloadSize()];
   if ((r = sctp_association_->SendSctpMessage(
-      s.config().params, req.ToPaylod(buff, sizeof(buff)), req.PayloadSize(), PPID::WEBRTC_DCEP
+      DcepMessageConfig(s.id()), req.ToPaylod(buff, sizeof(buff)), req.PayloadSize(), PPID::WEBRTC_DCEP
   )) < 0) {
     logger::error({{"proto","sctp"},{"ev","fail to send DCEP OPEN"},{"stream_id",s.id()},{"rv",r}});
     return QRPC_EALLOC;
@@ -1391,6 +1678,8 @@ void ConnectionFactory::Connection::OnIceServerLocalUsernameFragmentAdded(
   // and OnIceServerLocalUsernameFragmentAdded is called from WebRtcTransport::ctor
   // thus, if mediasoup creates WebRtcTransport, it will be added to the map automatically
   // but it is too implicit. I rather prefer to add it manualy, in NewConnection
+  // on ICE restart, 4-tuples authenticated with old ufrag should go through ufrag lookup again
+  factory_.UncacheAddrs(*this);
 }
 void ConnectionFactory::Connection::OnIceServerLocalUsernameFragmentRemoved(
   const IceServer *iceServer, const std::string& usernameFragment) {
@@ -1411,7 +1700,22 @@ void ConnectionFactory::Connection::OnIceServerSessionRemoved(
 void ConnectionFactory::Connection::OnIceServerSelectedSession(
   const IceServer *iceServer, Session *session) {
   TRACK();
-  // just notify the app
+  // tuples other than selected one are stale (eg. NAT rebinding). selected one stays cached
+  factory().UncacheAddrs(*this, session);
+  if (factory().config().connected_udp) {
+    // selected session gets connected socket, and previously selected one (path change) goes back to listener socket
+    for (auto s : ice_server_->GetSessions()) {
+      auto us = dynamic_cast<UdpListener::UdpSession *>(s);
+      if (us == nullptr) {
+        continue;
+      }
+      if (s == session) {
+        us->udp_listener().PromoteSession(*us);
+      } else {
+        us->udp_listener().DemoteSession(*us);
+      }
+    }
+  }
   // use OnIceServerSelectedTuple to search mediasoup's example
 }
 void ConnectionFactory::Connection::OnIceServerConnected(const IceServer *iceServer) {
@@ -1511,7 +1815,7 @@ void ConnectionFactory::Connection::OnDtlsTransportSendData(
   TRACK();
   auto *session = ice_server_->GetSelectedSession();
   if (session == nullptr) {
-    logger::warn({{"proto","dtls"},{"ev","no selected tuple set, cannot send DTLS packet"}});
+    QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","dtls"},{"ev","no selected tuple set, cannot send DTLS packet"}});
     return;
   }
   // logger::info({{"ev","send dtls packet"},{"sz",len},{"to",session->addr().str()}});
@@ -1559,7 +1863,7 @@ void ConnectionFactory::Connection::OnSctpAssociationSendData(
   RTC::SctpAssociation* sctpAssociation, const uint8_t* data, size_t len) {
   TRACK();
   if (!connected()) {
-		logger::warn({{"proto","sctp"},{"ev","DTLS not connected, cannot send SCTP data"},
+		QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","sctp"},{"ev","DTLS not connected, cannot send SCTP data"},
       {"dtls_state",dtls_transport_->GetState()}});
     return;
   }
@@ -1597,16 +1901,23 @@ void ConnectionFactory::Connection::OnSctpWebRtcDataChannelControlDataReceived(
       return;
     }
     auto c = req->ToMediaStreamConfig();
+    if (!sctp_association_->SupportsReliability(c)) {
+      // peer expects the stream to be unreliable, but refusing it breaks the peer's data channel
+      QRPC_LOGJ(warn, {{"ev","maxRetransmits = 0 is not supported by usrsctp, stream is sent reliably"},
+        {"sid",streamId},{"l",c.label}});
+    }
     auto s = NewStream(c, DefaultStreamFactory());
     if (s == nullptr) {
       logger::error({{"proto","sctp"},{"ev","fail to create stream"},{"stream_id",streamId}});
+      // reset the stream so that opener closes it, instead of waiting DATA_CHANNEL_ACK forever
+      sctp_association_->DataConsumerClosed(streamId);
       return;
     }
     // send dcep ack
     DcepResponse ack;
     uint8_t buff[ack.PayloadSize()];
-    if ((r = sctpAssociation->SendSctpMessage(
-        s->config().params, ack.ToPaylod(buff, sizeof(buff)), ack.PayloadSize(), PPID::WEBRTC_DCEP
+    if ((r = sctp_association_->SendSctpMessage(
+        DcepMessageConfig(streamId), ack.ToPaylod(buff, sizeof(buff)), ack.PayloadSize(), PPID::WEBRTC_DCEP
     )) < 0) {
       logger::error({{"proto","sctp"},{"ev","fail to send DCEP ACK"},{"stream_id",streamId},{"rc",r}});
       s->Close(QRPC_CLOSE_REASON_LOCAL, r, "fail to send DCEP ACK");
@@ -1636,7 +1947,7 @@ void ConnectionFactory::Connection::OnSctpAssociationMessageReceived(
     return;
   }
   int r;
-  if ((r = it->second->OnRead(reinterpret_cast<const char *>(msg), len)) < 0) {
+  if ((r = it->second->OnReceive(reinterpret_cast<const char *>(msg), len)) < 0) {
     logger::info({{"ev", "application close stream"},{"sid",streamId},{"rc",r}});
     it->second->Close(QRPC_CLOSE_REASON_LOCAL, r, "stream closed by application OnRead");
   }
@@ -1645,6 +1956,16 @@ void ConnectionFactory::Connection::OnSctpAssociationBufferedAmount(
   RTC::SctpAssociation* sctpAssociation, uint32_t len) {
   TRACK();
 }
+// implements SctpTransport::Listener
+void ConnectionFactory::Connection::OnSctpStreamBufferedAmount(uint16_t sid, size_t amount) {
+  auto it = streams_.find(sid);
+  if (it == streams_.end()) {
+    return; // already closed
+  }
+  // keep stream alive, because OnBufferedAmountLow may close it
+  auto s = it->second;
+  s->UpdateBufferedAmount(amount);
+}
 
 // implements rtp::Handler::Listener
 const std::string &ConnectionFactory::Connection::FindRtpIdFrom(std::string &cname) {
@@ -1713,7 +2034,7 @@ void ConnectionFactory::Connection::SendRtpPacket(
 
   // Ensure there is sending SRTP session.
   if (!srtp_send_) {
-    logger::warn("ignoring RTP packet due to non sending SRTP session");
+    QRPC_LOG_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, "ignoring RTP packet due to non sending SRTP session");
     if (cb) {
       (*cb)(false);
       delete cb;
@@ -1760,6 +2081,20 @@ void ConnectionFactory::Connection::SendRtcpPacket(RTC::RTCP::Packet* packet) {
 		// Increase send transmission.
 		rtp_handler_->DataSent(sz);
 }
+void ConnectionFactory::Connection::SendRtcpData(const uint8_t *data, size_t sz) {
+  if (!IsConnected()) {
+    return;
+  }
+  if (!this->srtp_send_) {
+    QRPC_LOG_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, "ignoring RTCP data due to non sending SRTP session");
+    return;
+  }
+  if (!this->srtp_send_->EncryptRtcp(&data, &sz)) {
+    return;
+  }
+  this->ice_server_->GetSelectedSession()->Send(reinterpret_cast<const char *>(data), sz);
+  rtp_handler_->DataSent(sz);
+}
 void ConnectionFactory::Connection::SendRtcpCompoundPacket(RTC::RTCP::CompoundPacket* packet) {
     MS_TRACE();
 		if (!IsConnected()) {
@@ -2199,11 +2534,18 @@ int Listener::Setup(const std::vector<Port> &ports) {
         return QRPC_ENOTSUPPORT;
     }
   }
+  if (config_.reuse_port) {
+    // register after all ports are created, because udp_ports_ might be re-allocated
+    for (auto &p : udp_ports_) {
+      Dispatcher::Register(p);
+    }
+  }
   return QRPC_OK;
 }
 void Listener::Fin() {
   for (auto it = udp_ports_.begin(); it != udp_ports_.end();) {
     auto p = it++;
+    Dispatcher::Unregister(*p);
     (*p).Fin();
   }
   for (auto it = tcp_ports_.begin(); it != tcp_ports_.end();) {
@@ -7,7 +7,10 @@
 #include "base/media.h"
 #include "base/webrtc/ice.h"
 #include "base/rtp/handler.h"
+#include "base/rtp/pacer.h"
+#include "base/rtp/relay.h"
 #include "base/webrtc/candidate.h"
+#include "base/webrtc/sctp.h"
 // this need to declare after ice.h to prevent from IceServer.hpp being used
 
 // TODO: if enabling srtp, this also need to be replaced with homebrew version
@@ -15,7 +18,10 @@
 #include "RTC/SrtpSession.hpp"
 #include "RTC/RTCP/Packet.hpp"
 
+#include <map>
 #include <mutex>
+#include <set>
+#include <unordered_map>
 
 namespace base {
 namespace webrtc {
@@ -59,6 +65,7 @@ namespace webrtc {
       qrpc_time_t OnShutdown() override;
     protected:
       std::shared_ptr<Connection> connection_;
+      int redirect_{-1}; // worker index which owns this 4-tuple, if it is not this thread
     };
     typedef UdpSessionTmpl<UdpClient::UdpSession> UdpClientSession;
     typedef UdpSessionTmpl<UdpListener::UdpSession> UdpListenerSession;
@@ -73,6 +80,8 @@ namespace webrtc {
       int Call(const char *fn, uint32_t msgid, const json &j, logger::level llv = logger::level::info);
       int Call(const char *fn, const json &j);
       int Call(const char *fn);
+    protected:
+      bool resumed_{false}; // true while processing request parked by ConnectionFactory::WaitHandler
     };
     class SubscriberStream : public Stream {
     public:
@@ -116,7 +125,7 @@ namespace webrtc {
     class Connection : public base::Connection, 
                        public IceServer::Listener,
                        public RTC::DtlsTransport::Listener,
-                       public RTC::SctpAssociation::Listener,
+                       public SctpTransport::Listener,
                        public rtp::Handler::Listener {
     public:
       friend class ConnectionFactory;
@@ -140,6 +149,9 @@ namespace webrtc {
         if (alarm_id_ != AlarmProcessor::INVALID_ID) {
           factory_.alarm_processor().Cancel(alarm_id_);
         }
+        if (flush_alarm_id_ != AlarmProcessor::INVALID_ID) {
+          factory_.alarm_processor().Cancel(flush_alarm_id_);
+        }
       }
     public:
       // implements base::Connection
@@ -151,6 +163,10 @@ namespace webrtc {
       std::shared_ptr<Stream> OpenStream(const Stream::Config &c) override {
         return OpenStream(c, factory().stream_factory());
       }
+      void ScheduleFlush(Stream &s) override;
+      // change scheduling of outgoing messages of the stream (see Stream::Config::priority).
+      // QRPC_ENOTSUPPORT if the transport is usrsctp
+      int SetStreamPriority(Stream::Id sid, uint16_t priority, uint16_t weight);
     public: // callbacks
       virtual int OnConnect() { return QRPC_OK; }
       virtual qrpc_time_t OnShutdown() { return 0; }
@@ -165,6 +181,8 @@ namespace webrtc {
       inline RTC::DtlsTransport &dtls_transport() { return *dtls_transport_.get(); }
       inline rtp::Handler &rtp_handler() { return *rtp_handler_.get(); }
       inline bool rtp_enabled() const { return rtp_handler_ != nullptr; }
+      inline const rtp::Pacer *pacer() const { return pacer_.get(); }
+      inline const std::map<Stream::Id, std::shared_ptr<Stream>> &streams() const { return streams_; }
       // for now, qrpc server initiates dtls transport because safari does not initiate it
       // even if we specify "setup: passive" in SDP of whip response
       inline bool is_client() const { return dtls_role_ == RTC::DtlsTransport::Role::SERVER; }
@@ -182,6 +200,10 @@ namespace webrtc {
       void InitRTP();
       void Fin();
       void Touch(qrpc_time_t now) { last_active_ = now; }
+      // kernel arrival time of the packet being processed. 0 if unknown
+      inline qrpc_time_t rx_time() const { return rx_time_; }
+      inline void set_rx_time(qrpc_time_t t) { rx_time_ = t; }
+      inline void set_rx_ecn(uint8_t ecn) { rx_ecn_ = ecn; }
       // first calling prepare consume to setup connection for consumer, then client connect to the connection, Consume starts actual rtp packet transfer
       bool PrepareConsume(
         const std::string &media_path, 
@@ -204,14 +226,15 @@ namespace webrtc {
       std::shared_ptr<Stream> NewStream(const Stream::Config &c, const StreamFactory &sf);
       std::shared_ptr<Stream> OpenStream(const Stream::Config &c, const StreamFactory &sf);
       StreamFactory DefaultStreamFactory();
+      qrpc_time_t FlushStreams();
       bool Timeout(qrpc_time_t now, qrpc_time_t timeout, qrpc_time_t &next_check) const {
         return Session::CheckTimeout(last_active_, now, timeout, next_check);
       }
     public:
-      // entry point of all incoming packets
-      int OnPacketReceived(Session *session, const uint8_t *p, size_t sz);
+      // entry point of all incoming packets. stun is given if p is already parsed as STUN packet
+      int OnPacketReceived(Session *session, const uint8_t *p, size_t sz, RTC::StunPacket *stun = nullptr);
       // protocol handlers
-      int OnStunDataReceived(Session *session, const uint8_t *p, size_t sz);
+      int OnStunDataReceived(Session *session, const uint8_t *p, size_t sz, RTC::StunPacket *stun = nullptr);
       int OnDtlsDataReceived(Session *session, const uint8_t *p, size_t sz);
       int OnRtcpDataReceived(Session *session, const uint8_t *p, size_t sz);
       int OnRtpDataReceived(Session *session, const uint8_t *p, size_t sz);      
@@ -280,6 +303,8 @@ namespace webrtc {
 			  size_t len, uint32_t ppid) override;
 			void OnSctpAssociationBufferedAmount(
 			  RTC::SctpAssociation* sctpAssociation, uint32_t len) override;
+      // implements SctpTransport::Listener
+      void OnSctpStreamBufferedAmount(uint16_t sid, size_t amount) override;
 
       // implements rtp::Handler::Listener
       const std::string &rtp_id() const override { return ufrag(); }
@@ -300,6 +325,7 @@ namespace webrtc {
         RTC::Consumer* consumer, RTC::RtpPacket* packet, onSendCallback* cb = nullptr) override;
       void SendRtcpPacket(RTC::RTCP::Packet* packet) override;
       void SendRtcpCompoundPacket(RTC::RTCP::CompoundPacket* packet) override;
+      void SendRtcpData(const uint8_t *data, size_t sz) override;
       void SendMessage(
         RTC::DataConsumer* dataConsumer,
         const uint8_t* msg,
@@ -308,26 +334,32 @@ namespace webrtc {
         rtp::Handler::QueueCB* = nullptr) override { ASSERT(false); }
       void SendSctpData(const uint8_t* data, size_t len) override { ASSERT(false); }
       const rtp::Handler::Config &GetRtpConfig() const override { return factory().config().rtp; }
+      rtp::Pacer *GetPacer() override { return pacer_.get(); }
       bool GetRtpRoc(uint32_t ssrc, uint32_t &roc, rtp::MediaStreamConfig::Direction dir) override;
     protected:
       ConnectionFactory &factory_;
-      qrpc_time_t last_active_, start_shutdown_{0};
+      qrpc_time_t last_active_, start_shutdown_{0}, rx_time_{0};
+      uint8_t rx_ecn_{0};
       std::unique_ptr<IceServer> ice_server_; // ICE
       std::unique_ptr<IceProber> ice_prober_; // ICE(client)
       RTC::DtlsTransport::Role dtls_role_;
       std::unique_ptr<RTC::DtlsTransport> dtls_transport_; // DTLS
-      std::unique_ptr<RTC::SctpAssociation> sctp_association_; // SCTP
+      std::unique_ptr<SctpTransport> sctp_association_; // SCTP (usrsctp or SctpEngine)
       std::unique_ptr<RTC::SrtpSession> srtp_send_, srtp_recv_; // SRTP
       std::string srtp_remote_key_;
       RTC::SrtpSession::CryptoSuite srtp_crypto_suite_{RTC::SrtpSession::CryptoSuite::AES_CM_128_HMAC_SHA1_80};
       std::shared_ptr<rtp::Handler> rtp_handler_; // RTP, RTCP
+      std::unique_ptr<rtp::Pacer> pacer_; // egress pacing of RTP
       std::map<Stream::Id, std::shared_ptr<Stream>> streams_;
       std::shared_ptr<SyscallStream> syscall_;
       IdFactory<Stream::Id> stream_id_factory_;
       AlarmProcessor::Id alarm_id_{AlarmProcessor::INVALID_ID};
+      std::set<Stream::Id> flush_streams_; // streams which have coalesced messages or partial FEC group to send
+      AlarmProcessor::Id flush_alarm_id_{AlarmProcessor::INVALID_ID};
       std::string cname_;
       std::map<rtp::Parameters::MediaKind, rtp::Capability> capabilities_;
       rtp::MediaStreamConfigs media_stream_configs_; // stream configs with keeping creation order
+      std::vector<std::pair<const SessionFactory *, Address>> addrs_; // 4-tuples registered to ConnectionFactory::addrmaps_
       uint32_t mid_seed_{0};
       bool sctp_connected_{false}, closed_{false};
     };
@@ -350,6 +382,26 @@ namespace webrtc {
       qrpc_time_t connection_timeout, consent_check_interval;
       std::string fingerprint_algorithm;
       bool in6{false};
+      // listen ports with SO_REUSEPORT, so that per-thread listeners can share same ports.
+      // packets for connection of other thread are redirected by webrtc::Dispatcher.
+      bool reuse_port{false};
+      // report ECN marks of ingress RTP packets to peer by RFC 8888 congestion control feedback, or limit
+      // incoming bitrate by them if peer does not take it (enables rtp.ccfb and rtp.ecn).
+      // egress packets stay Not-ECT, see udp_listener_config
+      bool ecn{false};
+      // pace egress RTP packets of each connection by its bandwidth estimation. packets are held by timer
+      // before transport-cc stamps them
+      bool pacing{false};
+      // promote selected ICE UDP session to its own connect()ed socket that shares the port by SO_REUSEPORT,
+      // so that kernel demultiplexes its packets. demoted again when ICE selects another session
+      bool connected_udp{false};
+      // send large HTTP response bodies with MSG_ZEROCOPY (see TcpSessionFactory::Config::zerocopy_threshold)
+      size_t zerocopy_threshold{0};
+      // run data channel SCTP with SctpEngine on the loop of each connection, instead of usrsctp.
+      // usrsctp still handles connections of the factory if false, and it does not support stream priority
+      bool native_sctp{false};
+      // messages of streams with Stream::ZSTD_PROTOCOL smaller than this are sent without compression
+      size_t zstd_min_size{Stream::kZstdDefaultMinSize};
       Resolver &resolver{NopResolver::Instance()};
       
       // might be derived from above config values
@@ -381,10 +433,23 @@ namespace webrtc {
     const std::string &fingerprint() const { return config_.fingerprint; }
     const std::string &fingerprint_algorithm() const { return config_.fingerprint_algorithm; }
     const UdpListener::Config udp_listener_config() const {
-      return UdpListener::Config(config_.resolver, config_.session_timeout, config_.udp_batch_size, false);
+      auto c = UdpListener::Config(config_.resolver, config_.session_timeout, config_.udp_batch_size, false);
+      c.reuse_port = config_.reuse_port || config_.connected_udp;
+      // CE marks are taken only for incoming bitrate (rtp.ecn). transport-cc controller of mediasoup for outgoing
+      // bitrate does not take CCFB from peer, so marking egress as ECT(1) only invites marks which nobody reacts to
+      c.ecn = false;
+      return c;
+    }
+    const TcpListener::Config tcp_listener_config() const {
+      auto c = TcpListener::Config::Default();
+      c.reuse_port = config_.reuse_port;
+      return c;
     }
     const TcpListener::Config http_listener_config() const {
-      return TcpListener::Config(config_.resolver, config_.http_timeout, config_.certpair);
+      auto c = TcpListener::Config(config_.resolver, config_.http_timeout, config_.certpair);
+      c.reuse_port = config_.reuse_port;
+      c.zerocopy_threshold = config_.zerocopy_threshold;
+      return c;
     }
   public:
     virtual bool is_client() const = 0;
@@ -394,8 +459,30 @@ namespace webrtc {
     void Fin();
     int Start(const std::vector<Port> &ports);
     std::shared_ptr<rtp::Handler> FindHandler(const std::string &cname);
+    // if the peer is connected to another worker and its producers are not relayed to this worker yet,
+    // cb is called once they are (or the peer turns out to be unavailable) and returns true.
+    // otherwise returns false, and FindHandler gives final result now.
+    bool WaitHandler(const std::string &cname, rtp::Relay::Waiter &&cb) {
+      return cnmap_.find(cname) == cnmap_.end() && rtp::Relay::WaitProxy(cname, std::move(cb));
+    }
     std::shared_ptr<Connection> FindFromUfrag(const IceUFrag &ufrag);
-    std::shared_ptr<Connection> FindFromStunRequest(const uint8_t *p, size_t sz);
+    // packet is set if p is parsed to find the connection, so that caller does not need to parse it again.
+    // listener is the session factory which received p from a
+    std::shared_ptr<Connection> FindFromStunRequest(
+      const SessionFactory &listener, const Address &a,
+      const uint8_t *p, size_t sz, std::unique_ptr<RTC::StunPacket> &packet);
+    // drop 4-tuple cache entries of the connection, except the one of keep (if not nullptr)
+    void UncacheAddrs(Connection &c, const Session *keep = nullptr);
+    // returns index of worker thread that owns the connection for STUN request, if it is not this thread.
+    // otherwise returns -1.
+    int FindOwnerWorker(const uint8_t *p, size_t sz) const;
+    // register zstd dictionary used by streams opened with Stream::ZstdProtocol(id). id should not be 0.
+    // peer needs same dictionary. TS client fetches it by "zstd_dictionary" syscall
+    int RegisterZstdDictionary(uint32_t id, const std::string &data, int level = Zstd::kDefaultLevel);
+    std::shared_ptr<const ZstdDictionary> FindZstdDictionary(uint32_t id) const {
+      auto it = zstd_dictionaries_.find(id);
+      return it != zstd_dictionaries_.end() ? it->second : nullptr;
+    }
     void ScheduleClose(Connection &c) {
       if (c.closed_) { return; }
       c.closed_ = true;
@@ -445,14 +532,19 @@ namespace webrtc {
     AlarmProcessor::Id alarm_id_{AlarmProcessor::INVALID_ID};
     FactoryMethod factory_method_;
     StreamFactory stream_factory_;
-    std::map<IceUFrag, std::shared_ptr<Connection>> connections_;
+    std::unordered_map<IceUFrag, std::shared_ptr<Connection>> connections_;
     std::map<std::string, std::shared_ptr<Connection>> cnmap_;
+    // listener => remote address => connection, registered after STUN request from the 4-tuple is authenticated.
+    // entries of the connection are dropped when its selected tuple changes or ICE restarts
+    typedef std::unordered_map<Address, std::weak_ptr<Connection>, std::hash<std::string>> AddrMap;
+    std::map<const SessionFactory *, AddrMap> addrmaps_;
+    std::map<uint32_t, std::shared_ptr<const ZstdDictionary>> zstd_dictionaries_;
   private:
     static int32_t g_ref_count_;
     static thread_local int32_t g_thread_ref_count_;
     static std::mutex g_ref_sync_mutex_;
-    static int ThreadInit(AlarmProcessor &a);
-    static void ThreadFin(AlarmProcessor &a);
+    static int ThreadInit(Loop &l);
+    static void ThreadFin(Loop &l);
     static int GlobalInit();
     static void GlobalFin();
   };
@@ -585,7 +677,7 @@ namespace webrtc {
     typedef TcpListenerOf<TcpSession> TcpPortBase;
     class TcpPort : public TcpPortBase {
     public:
-      TcpPort(ConnectionFactory &cf) : TcpPortBase(cf.loop()), cf_(cf) {}
+      TcpPort(ConnectionFactory &cf) : TcpPortBase(cf.loop(), cf.tcp_listener_config()), cf_(cf) {}
       ConnectionFactory &connection_factory() { return cf_; }
     private:
       ConnectionFactory &cf_;
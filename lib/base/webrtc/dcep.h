@@ -42,6 +42,14 @@ namespace webrtc {
     DATA_CHANNEL_PARTIAL_RELIABLE_TIMED_UNORDERED = 0x82
   };
   typedef base::Stream Stream;
+  // DCEP messages are sent reliable and ordered, regardless of the channel type
+  // https://www.rfc-editor.org/rfc/rfc8832.html#section-6
+  inline Stream::Config DcepMessageConfig(uint16_t stream_id) {
+    Stream::Config c;
+    c.params.streamId = stream_id;
+    c.params.ordered = true;
+    return c;
+  }
   class DcepRequest : public Stream::Config {
   public:
     // https://www.rfc-editor.org/rfc/rfc8832.html#name-data_channel_open-message
@@ -54,17 +62,16 @@ namespace webrtc {
       uint16_t protocol_length;
     } Header;
   public:
-    DcepRequest(
-      const Stream::Config &c, uint16_t prio = 256
-    ) : Stream::Config(c), channel_type(ToChannelType(c)), priority(prio) {}
+    DcepRequest(const Stream::Config &c) : Stream::Config(c), channel_type(ToChannelType(c)) {}
     DcepRequest() : Stream::Config() {}
     inline const Stream::Config &ToMediaStreamConfig() const { return *this; }
   public:
     static DcepChannelType ToChannelType(const Stream::Config &c) {
+      auto partial = Stream::PartiallyReliable(c);
       if (c.params.ordered) {
         if (c.params.maxPacketLifeTime != 0) {
           return DATA_CHANNEL_PARTIAL_RELIABLE_TIMED;
-        } else if (c.params.maxRetransmits != 0) {
+        } else if (partial) {
           return DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT;
         } else {
           return DATA_CHANNEL_RELIABLE;
@@ -72,7 +79,7 @@ namespace webrtc {
       } else {
         if (c.params.maxPacketLifeTime != 0) {
           return DATA_CHANNEL_PARTIAL_RELIABLE_TIMED_UNORDERED;
-        } else if (c.params.maxRetransmits != 0) {
+        } else if (partial) {
           return DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT_UNORDERED;
         } else {
           return DATA_CHANNEL_RELIABLE_UNORDERED;
@@ -98,12 +105,15 @@ namespace webrtc {
       r->params.ordered = (r->channel_type & 0x80) == 0;
       switch (r->channel_type & 0x7f) {
         case DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT:
+          // maxRetransmits = 0 (no retransmission) is valid here
           r->params.maxPacketLifeTime = 0;
-          r->params.maxRetransmits = rp;
+          r->params.maxRetransmits = std::min<uint32_t>(rp, UINT16_MAX);
+          r->partially_reliable = true;
           break;
         case DATA_CHANNEL_PARTIAL_RELIABLE_TIMED:
-          r->params.maxPacketLifeTime = rp;
+          r->params.maxPacketLifeTime = std::min<uint32_t>(rp, UINT16_MAX);
           r->params.maxRetransmits = 0;
+          r->partially_reliable = true;
           break;
         default:
           r->params.maxPacketLifeTime = 0;
@@ -118,8 +128,10 @@ namespace webrtc {
       }
       if (h->protocol_length > 0) {
         r->protocol.assign(reinterpret_cast<const char *>(p) + sizeof(Header) + llen, plen);
-        logger::error({{"ev","invalid dcep packet"},{"reason", "protocol field of dcep request is not supported"},{"proto",r->protocol}});
-        return nullptr;
+        if (!Stream::ValidProtocol(r->protocol)) {
+          logger::error({{"ev","invalid dcep packet"},{"reason", "protocol field of dcep request is not supported"},{"proto",r->protocol}});
+          return nullptr;
+        }
       }
       return r;
     }
@@ -161,7 +173,6 @@ namespace webrtc {
   private:
     DcepMessageType msg_type{DATA_CHANNEL_OPEN};
     DcepChannelType channel_type{DATA_CHANNEL_RELIABLE};
-    uint16_t priority{256};
   };
   class DcepResponse {
   public:
@@ -0,0 +1,168 @@
+#include "base/webrtc/dispatcher.h"
+#include "base/logger.h"
+
+namespace base {
+namespace webrtc {
+  thread_local uint64_t Dispatcher::dropped_ = 0;
+  thread_local bool Dispatcher::initialized_ = false;
+  thread_local std::unordered_map<int, UdpListener*> Dispatcher::listeners_;
+  thread_local std::vector<Dispatcher::Packet *> Dispatcher::free_;
+  std::atomic<Dispatcher::Queue*> Dispatcher::queues_[Dispatcher::kMaxWorkers][Dispatcher::kMaxWorkers];
+  std::atomic<Dispatcher::Queue*> Dispatcher::returns_[Dispatcher::kMaxWorkers][Dispatcher::kMaxWorkers];
+
+  void Dispatcher::ClassInit() {
+    // worker index is assigned by rtp::Relay::ClassInit
+    auto w = rtp::Relay::worker();
+    if (initialized_ || w < 0) {
+      return;
+    }
+    // discard packets for previous worker which had same index
+    for (int i = 0; i < kMaxWorkers; i++) {
+      for (auto qs : { queues_, returns_ }) {
+        auto q = qs[i][w].load(std::memory_order_acquire);
+        Packet *pkt;
+        while (q != nullptr && q->pop(pkt)) {
+          delete pkt;
+        }
+      }
+    }
+    // share wakeup with rtp::Relay, so that a worker has single fd for cross worker queues
+    rtp::Relay::notifier().AddHandler(Poll);
+    initialized_ = true;
+  }
+  void Dispatcher::ClassDestroy() {
+    if (!initialized_) {
+      return;
+    }
+    listeners_.clear();
+    for (auto pkt : free_) {
+      delete pkt;
+    }
+    free_.clear();
+    // handler is removed by rtp::Relay::ClassDestroy
+    initialized_ = false;
+  }
+  void Dispatcher::Reclaim() {
+    // owner does not notify on return. sender takes returned packets back when it needs new one
+    auto w = rtp::Relay::worker();
+    for (int i = 0; i < kMaxWorkers; i++) {
+      Packet *pkt;
+      auto rq = returns_[i][w].load(std::memory_order_acquire);
+      while (rq != nullptr && rq->pop(pkt)) {
+        FreePacket(pkt);
+      }
+    }
+  }
+  void Dispatcher::Poll() {
+    auto w = rtp::Relay::worker();
+    Reclaim();
+    for (int i = 0; i < kMaxWorkers; i++) {
+      Packet *pkt;
+      auto q = queues_[i][w].load(std::memory_order_acquire);
+      if (q == nullptr) {
+        continue;
+      }
+      while (q->pop(pkt)) {
+        auto it = listeners_.find(pkt->port);
+        if (it != listeners_.end()) {
+          it->second->Inject(pkt->addr, pkt->data.data(), pkt->data.size(), pkt->rx_time, pkt->ecn);
+        } else {
+          QRPC_LOGJ(warn, {{"ev","no listener for redirected packet"},{"port",pkt->port},{"from",i}});
+        }
+        Return(pkt);
+      }
+    }
+  }
+  std::string Dispatcher::UFragPrefix(int worker) {
+    static const char hex[] = "0123456789abcdef";
+    if (worker < 0 || worker >= kMaxWorkers) {
+      return "";
+    }
+    return std::string({ hex[(worker >> 4) & 0xf], hex[worker & 0xf] });
+  }
+  int Dispatcher::WorkerFromUFrag(std::string_view ufrag) {
+    if (ufrag.size() < kUFragPrefixLength) {
+      return -1;
+    }
+    int w = 0;
+    for (size_t i = 0; i < kUFragPrefixLength; i++) {
+      char c = ufrag[i];
+      if (c >= '0' && c <= '9') {
+        w = (w << 4) | (c - '0');
+      } else if (c >= 'a' && c <= 'f') {
+        w = (w << 4) | (c - 'a' + 10);
+      } else {
+        return -1;
+      }
+    }
+    return w < kMaxWorkers ? w : -1;
+  }
+  void Dispatcher::Register(UdpListener &l) {
+    listeners_[l.port()] = &l;
+  }
+  void Dispatcher::Unregister(UdpListener &l) {
+    auto it = listeners_.find(l.port());
+    if (it != listeners_.end() && it->second == &l) {
+      listeners_.erase(it);
+    }
+  }
+  bool Dispatcher::Redirect(
+    int to, int port, const Address &a, const char *p, size_t sz, qrpc_time_t rx_time, uint8_t ecn
+  ) {
+    auto w = rtp::Relay::worker();
+    ASSERT(to >= 0 && to < kMaxWorkers && to != w);
+    auto &slot = queues_[w][to];
+    auto q = slot.load(std::memory_order_acquire);
+    if (UNLIKELY(q == nullptr)) {
+      // only this thread creates queue for [w][to], so no race on creation
+      q = new Queue(kQueueSize);
+      slot.store(q, std::memory_order_release);
+    }
+    auto pkt = NewPacket();
+    pkt->from = w;
+    pkt->port = port;
+    pkt->rx_time = rx_time;
+    pkt->ecn = ecn;
+    pkt->addr = a;
+    pkt->data.assign(p, sz);
+    if (!q->push(std::move(pkt))) {
+      // owner worker is too busy. same as packet loss on the wire
+      dropped_++;
+      FreePacket(pkt);
+      return false;
+    }
+    rtp::Relay::Notify(to);
+    return true;
+  }
+  Dispatcher::Packet *Dispatcher::NewPacket() {
+    if (free_.empty()) {
+      Reclaim();
+    }
+    if (free_.empty()) {
+      return new Packet();
+    }
+    auto pkt = free_.back();
+    free_.pop_back();
+    return pkt;
+  }
+  void Dispatcher::FreePacket(Packet *pkt) {
+    if (free_.size() >= kMaxFreePackets) {
+      delete pkt;
+      return;
+    }
+    free_.push_back(pkt);
+  }
+  void Dispatcher::Return(Packet *pkt) {
+    // only this thread pushes to returns_[worker][pkt->from]
+    auto &slot = returns_[rtp::Relay::worker()][pkt->from];
+    auto q = slot.load(std::memory_order_acquire);
+    if (UNLIKELY(q == nullptr)) {
+      q = new Queue(kQueueSize);
+      slot.store(q, std::memory_order_release);
+    }
+    if (!q->push(std::move(pkt))) {
+      delete pkt;
+    }
+  }
+}
+}
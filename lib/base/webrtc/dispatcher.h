@@ -0,0 +1,64 @@
+#pragma once
+
+#include "base/address.h"
+#include "base/defs.h"
+#include "base/session.h"
+#include "base/spsc.h"
+#include "base/rtp/relay.h"
+
+#include <atomic>
+#include <string_view>
+#include <unordered_map>
+
+namespace base {
+namespace webrtc {
+  // Dispatcher routes UDP packets between worker threads which listen same port with SO_REUSEPORT.
+  // kernel distributes packets by hash of 4-tuple, so STUN binding request might reach a worker
+  // which does not own the connection. because local ICE ufrag is prefixed with owner worker index,
+  // receiving worker can find owner from the first STUN request and forwards it and all subsequent packets
+  // of same 4-tuple to the owner. owner injects them into its own UdpListener for same port,
+  // and replies from its own socket (bound to same port, so peer observes no difference).
+  class Dispatcher {
+  public:
+    struct Packet {
+      int from, port;
+      qrpc_time_t rx_time;
+      uint8_t ecn;
+      Address addr;
+      std::string data;
+    };
+    typedef SpscQueue<Packet *> Queue;
+    static constexpr int kMaxWorkers = rtp::Relay::kMaxWorkers;
+    static constexpr size_t kQueueSize = 8192;
+    static constexpr size_t kMaxFreePackets = 8192;
+    static constexpr size_t kUFragPrefixLength = 2;
+  public:
+    // should be called after rtp::Relay::ClassInit. queues are processed on wakeup by rtp::Relay::notifier()
+    static void ClassInit();
+    static void ClassDestroy();
+    static inline uint64_t dropped() { return dropped_; }
+    static void Poll();
+    // ufrag helpers. worker index is encoded as 2 hex digits at the head of ufrag
+    static std::string UFragPrefix(int worker);
+    static int WorkerFromUFrag(std::string_view ufrag);
+    // register/unregister listener that receives injected packets for its port
+    static void Register(UdpListener &l);
+    static void Unregister(UdpListener &l);
+    static bool Redirect(
+      int to, int port, const Address &a, const char *p, size_t sz, qrpc_time_t rx_time, uint8_t ecn);
+  protected:
+    // packets are returned to sender after injected and reused, same as rtp::Relay's message.
+    static Packet *NewPacket();
+    static void FreePacket(Packet *pkt);
+    static void Return(Packet *pkt);
+    static void Reclaim();
+  protected:
+    static thread_local uint64_t dropped_;
+    static thread_local bool initialized_;
+    static thread_local std::unordered_map<int, UdpListener*> listeners_; // port => listener
+    static thread_local std::vector<Packet *> free_;
+    static std::atomic<Queue*> queues_[kMaxWorkers][kMaxWorkers]; // [from][to]
+    static std::atomic<Queue*> returns_[kMaxWorkers][kMaxWorkers]; // [from][to], injected packets
+  };
+}
+}
@@ -69,13 +69,14 @@
 #endif
 
 // MS_WARN_TAG
+// mediasoup warns mostly for each malformed or unexpected packet, so rate limited per call site
 #if defined(MS_WARN_TAG)
 	#undef MS_WARN_TAG
 #endif
 #define MS_WARN_TAG(tag, ...) \
   do \
   { \
-    QRPC_LOG(warn, __VA_ARGS__); \
+    QRPC_LOG_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, __VA_ARGS__); \
   } \
   while (false)
 
@@ -87,7 +88,7 @@
 	#define MS_WARN_2TAGS(tag1, tag2, ...) \
 		do \
 		{ \
-			QRPC_LOG(warn, __VA_ARGS__); \
+			QRPC_LOG_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, __VA_ARGS__); \
 		} \
 		while (false)
 #else
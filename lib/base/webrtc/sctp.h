@@ -3,12 +3,17 @@
 #include "base/defs.h"
 #include "base/alarm.h"
 #include "base/syscall.h"
+#include "base/webrtc/dcep.h"
+#include "base/webrtc/sctp_engine.h"
 
 #include "RTC/SctpAssociation.hpp"
 #include "DepUsrSCTP.hpp"
 #include "moodycamel/concurrentqueue.h"
 
+#include <deque>
+#include <map>
 #include <mutex>
+#include <set>
 
 namespace base {
   class AlarmProcessor;
@@ -83,4 +88,205 @@ namespace base {
       }
     }
   };
-}
\ No newline at end of file
+namespace webrtc {
+  // SCTP association used by webrtc::ConnectionFactory::Connection. events are reported to
+  // RTC::SctpAssociation::Listener for both implementations
+  class SctpTransport {
+  public:
+    class Listener : public RTC::SctpAssociation::Listener {
+    public:
+      // buffered amount of outgoing stream decreased
+      virtual void OnSctpStreamBufferedAmount(uint16_t sid, size_t amount) = 0;
+    };
+  public:
+    virtual ~SctpTransport() {}
+    virtual void TransportConnected() = 0;
+    virtual void ProcessSctpData(const uint8_t *data, size_t len) = 0;
+    virtual int SendSctpMessage(const Stream::Config &c, const uint8_t *msg, size_t len, uint32_t ppid) = 0;
+    // false if messages of the stream would be sent with other reliability than c requests
+    virtual bool SupportsReliability(const Stream::Config &c) const = 0;
+    virtual void HandleDataConsumer(uint16_t sid) = 0;
+    virtual void DataConsumerClosed(uint16_t sid) = 0;
+    virtual size_t GetSctpBufferedAmount() const = 0;
+    virtual size_t GetStreamBufferedAmount(uint16_t sid) const = 0;
+    // returns QRPC_ENOTSUPPORT if the implementation cannot schedule streams as requested
+    virtual int SetStreamPriority(uint16_t sid, uint16_t priority, uint16_t weight) = 0;
+  };
+  // usrsctp, via mediasoup's SctpAssociation. packets are sent from usrsctp thread, and relayed by SctpSender.
+  // usrsctp only reports buffered amount of whole association. it is attributed to streams in the order
+  // messages are sent, so per stream amount is an approximation when multiple streams are congested.
+  class UsrSctpTransport : public SctpTransport, public RTC::SctpAssociation::Listener {
+  public:
+    UsrSctpTransport(SctpTransport::Listener &l, AlarmProcessor &a,
+      size_t os, size_t mis, size_t send_buffer_size) : listener_(l) {
+      // thread id is encoded into association address, so sender should be initialized first
+      SctpSender::ClassInit(a);
+      association_.reset(new RTC::SctpAssociation(this, os, mis, send_buffer_size, send_buffer_size, true));
+    }
+    // implements SctpTransport
+    void TransportConnected() override { association_->TransportConnected(); }
+    void ProcessSctpData(const uint8_t *data, size_t len) override { association_->ProcessSctpData(data, len); }
+    // SctpAssociation treats maxRetransmits = 0 as reliable, so such stream is sent reliably.
+    // OpenStream refuses it by SupportsReliability, but peer may still open one
+    int SendSctpMessage(const Stream::Config &c, const uint8_t *msg, size_t len, uint32_t ppid) override {
+      int r = association_->SendSctpMessage(c.params, msg, len, ppid);
+      if (r >= 0) {
+        sent_.push_back({ c.params.streamId, len });
+        stream_buffered_[c.params.streamId] += len;
+        buffered_ += len;
+      }
+      return r;
+    }
+    bool SupportsReliability(const Stream::Config &c) const override {
+      return !c.partially_reliable || c.params.maxRetransmits > 0 || c.params.maxPacketLifeTime > 0;
+    }
+    void HandleDataConsumer(uint16_t sid) override { association_->HandleDataConsumer(sid); }
+    void DataConsumerClosed(uint16_t sid) override { association_->DataConsumerClosed(sid); }
+    size_t GetSctpBufferedAmount() const override { return association_->GetSctpBufferedAmount(); }
+    size_t GetStreamBufferedAmount(uint16_t sid) const override {
+      auto it = stream_buffered_.find(sid);
+      return it != stream_buffered_.end() ? it->second : 0;
+    }
+    // SctpAssociation does not expose its usrsctp socket, so SCTP_PLUGGABLE_SS/SCTP_SS_VALUE cannot be set and
+    // streams are always scheduled by usrsctp default. default priority and weight are accepted silently
+    int SetStreamPriority(uint16_t sid, uint16_t priority, uint16_t weight) override {
+      if (priority == Stream::kDefaultPriority && weight == Stream::kDefaultWeight) {
+        return QRPC_OK;
+      }
+      QRPC_LOGJ(warn, {{"proto","sctp"},{"ev","stream priority is not supported by usrsctp, use native_sctp"},
+        {"sid",sid},{"priority",priority},{"weight",weight}});
+      return QRPC_ENOTSUPPORT;
+    }
+    // implements RTC::SctpAssociation::Listener
+    void OnSctpAssociationConnecting(RTC::SctpAssociation *a) override { listener_.OnSctpAssociationConnecting(a); }
+    void OnSctpAssociationConnected(RTC::SctpAssociation *a) override { listener_.OnSctpAssociationConnected(a); }
+    void OnSctpAssociationFailed(RTC::SctpAssociation *a) override { listener_.OnSctpAssociationFailed(a); }
+    void OnSctpAssociationClosed(RTC::SctpAssociation *a) override { listener_.OnSctpAssociationClosed(a); }
+    void OnSctpAssociationSendData(RTC::SctpAssociation *a, const uint8_t *data, size_t len) override {
+      listener_.OnSctpAssociationSendData(a, data, len);
+    }
+    void OnSctpStreamReset(RTC::SctpAssociation *a, uint16_t sid) override {
+      listener_.OnSctpStreamReset(a, sid);
+    }
+    void OnSctpWebRtcDataChannelControlDataReceived(
+      RTC::SctpAssociation *a, uint16_t sid, const uint8_t *msg, size_t len) override {
+      listener_.OnSctpWebRtcDataChannelControlDataReceived(a, sid, msg, len);
+    }
+    void OnSctpAssociationMessageReceived(
+      RTC::SctpAssociation *a, uint16_t sid, const uint8_t *msg, size_t len, uint32_t ppid) override {
+      listener_.OnSctpAssociationMessageReceived(a, sid, msg, len, ppid);
+    }
+    void OnSctpAssociationBufferedAmount(RTC::SctpAssociation *a, uint32_t len) override {
+      // increase is reported during SendSctpMessage, before the message is recorded in sent_
+      if (len < buffered_) {
+        Drain(buffered_ - len);
+      }
+      listener_.OnSctpAssociationBufferedAmount(a, len);
+    }
+  protected:
+    void Drain(size_t sz) {
+      std::set<uint16_t> sids;
+      while (sz > 0 && !sent_.empty()) {
+        auto &s = sent_.front();
+        auto n = std::min(sz, s.len);
+        s.len -= n;
+        sz -= n;
+        buffered_ -= n;
+        stream_buffered_[s.sid] -= n;
+        sids.insert(s.sid);
+        if (s.len == 0) {
+          sent_.pop_front();
+        }
+      }
+      for (auto sid : sids) {
+        auto it = stream_buffered_.find(sid);
+        auto amount = it->second;
+        if (amount == 0) {
+          stream_buffered_.erase(it);
+        }
+        listener_.OnSctpStreamBufferedAmount(sid, amount);
+      }
+    }
+  protected:
+    struct Sent {
+      uint16_t sid;
+      size_t len;
+    };
+    SctpTransport::Listener &listener_;
+    std::unique_ptr<RTC::SctpAssociation> association_;
+    std::deque<Sent> sent_;
+    std::map<uint16_t, size_t> stream_buffered_;
+    size_t buffered_{0};
+  };
+  // SctpEngine, which runs on the loop of the connection. listener callbacks receive nullptr as association,
+  // because there is no RTC::SctpAssociation instance
+  class NativeSctpTransport : public SctpTransport, public SctpEngine::Listener {
+  public:
+    NativeSctpTransport(SctpTransport::Listener &l, AlarmProcessor &a, const SctpEngine::Config &c) :
+      listener_(l), engine_(*this, a, c) {}
+    inline const SctpEngine &engine() const { return engine_; }
+    // implements SctpTransport
+    void TransportConnected() override {
+      listener_.OnSctpAssociationConnecting(nullptr);
+      engine_.Connect();
+    }
+    void ProcessSctpData(const uint8_t *data, size_t len) override { engine_.Receive(data, len); }
+    int SendSctpMessage(const Stream::Config &c, const uint8_t *msg, size_t len, uint32_t ppid) override {
+      SctpEngine::SendOptions o;
+      o.ordered = c.params.ordered;
+      if (Stream::PartiallyReliable(c)) {
+        // DCEP allows only one of them
+        if (c.params.maxPacketLifeTime > 0) {
+          o.lifetime = qrpc_time_msec(c.params.maxPacketLifeTime);
+        } else {
+          o.max_retransmits = c.params.maxRetransmits;
+        }
+      }
+      return engine_.Send(c.params.streamId, ppid, msg, len, o);
+    }
+    bool SupportsReliability(const Stream::Config &) const override { return true; }
+    void HandleDataConsumer(uint16_t) override {} // engine creates stream state on demand
+    void DataConsumerClosed(uint16_t sid) override { engine_.ResetStream(sid); }
+    size_t GetSctpBufferedAmount() const override { return engine_.buffered_amount(); }
+    size_t GetStreamBufferedAmount(uint16_t sid) const override { return engine_.stream_buffered_amount(sid); }
+    int SetStreamPriority(uint16_t sid, uint16_t priority, uint16_t weight) override {
+      engine_.SetStreamPriority(sid, priority, weight);
+      return QRPC_OK;
+    }
+    // implements SctpEngine::Listener
+    void OnSctpEngineSendPacket(const uint8_t *p, size_t sz) override {
+      listener_.OnSctpAssociationSendData(nullptr, p, sz);
+    }
+    void OnSctpEngineConnected() override { listener_.OnSctpAssociationConnected(nullptr); }
+    void OnSctpEngineClosed(bool failed) override {
+      if (failed) {
+        listener_.OnSctpAssociationFailed(nullptr);
+      } else {
+        listener_.OnSctpAssociationClosed(nullptr);
+      }
+    }
+    void OnSctpEngineMessage(uint16_t sid, uint32_t ppid, const uint8_t *p, size_t sz) override {
+      switch (ppid) {
+        case PPID::WEBRTC_DCEP:
+          listener_.OnSctpWebRtcDataChannelControlDataReceived(nullptr, sid, p, sz);
+          break;
+        case PPID::STRING_EMPTY:
+        case PPID::BINARY_EMPTY:
+          // payload is a placeholder byte (RFC 8831 6.6)
+          listener_.OnSctpAssociationMessageReceived(nullptr, sid, p, 0, ppid);
+          break;
+        default:
+          listener_.OnSctpAssociationMessageReceived(nullptr, sid, p, sz, ppid);
+          break;
+      }
+    }
+    void OnSctpEngineStreamReset(uint16_t sid) override { listener_.OnSctpStreamReset(nullptr, sid); }
+    void OnSctpEngineBufferedAmount(uint16_t sid, size_t amount) override {
+      listener_.OnSctpStreamBufferedAmount(sid, amount);
+    }
+  protected:
+    SctpTransport::Listener &listener_;
+    SctpEngine engine_;
+  };
+}
+}
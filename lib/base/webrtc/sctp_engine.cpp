@@ -0,0 +1,1396 @@
+#include "base/webrtc/sctp_engine.h"
+#include "base/crypto.h"
+#include "base/endian.h"
+#include "base/logger.h"
+
+#include <algorithm>
+#include <array>
+
+namespace base {
+namespace webrtc {
+  enum ChunkType : uint8_t {
+    DATA = 0, INIT = 1, INIT_ACK = 2, SACK = 3, HEARTBEAT = 4, HEARTBEAT_ACK = 5, ABORT = 6,
+    SHUTDOWN = 7, SHUTDOWN_ACK = 8, ERROR = 9, COOKIE_ECHO = 10, COOKIE_ACK = 11, SHUTDOWN_COMPLETE = 14,
+    IDATA = 64, RECONFIG = 130, FORWARD_TSN = 192, IFORWARD_TSN = 194,
+  };
+  enum ParamType : uint16_t {
+    STATE_COOKIE = 7, OUTGOING_RESET_REQUEST = 13, INCOMING_RESET_REQUEST = 14, RECONFIG_RESPONSE = 16,
+    SUPPORTED_EXTENSIONS = 0x8008, FORWARD_TSN_SUPPORTED = 0xC000,
+  };
+  enum ReconfigResult : uint32_t {
+    RESULT_PERFORMED = 1, RESULT_DENIED = 2, RESULT_BAD_SEQ = 5, RESULT_IN_PROGRESS = 6,
+  };
+  static constexpr size_t kCommonHeaderSize = 12;
+  static constexpr size_t kMaxPayloadSize = SctpEngine::kMtu - kCommonHeaderSize - 4 - 16; // I-DATA header
+  static constexpr uint32_t kCookieMagic = 0x71727063; // "qrpc"
+  static constexpr size_t kCookieSize = 32;
+  static constexpr size_t kMaxGapBlocks = 64;
+  static constexpr size_t kMaxDuplicates = 16;
+  static constexpr uint8_t CAP_FORWARD_TSN = 0x01, CAP_IDATA = 0x02, CAP_RECONFIG = 0x04;
+
+  static inline uint16_t Get16(const uint8_t *p) { return Endian::NetbytesToHost<uint16_t>(p); }
+  static inline uint32_t Get32(const uint8_t *p) { return Endian::NetbytesToHost<uint32_t>(p); }
+  static inline void Put16(std::vector<uint8_t> &b, uint16_t v) { b.push_back(v >> 8); b.push_back(v & 0xFF); }
+  static inline void Put32(std::vector<uint8_t> &b, uint32_t v) { Put16(b, v >> 16); Put16(b, v & 0xFFFF); }
+  static inline size_t Pad4(size_t sz) { return (sz + 3) & ~((size_t)3); }
+  static inline bool TsnAfter(uint32_t a, uint32_t b) { return (int32_t)(a - b) > 0; }
+  // CRC32c (Castagnoli), which SCTP uses as checksum (RFC 9260 appendix A)
+  static const std::array<uint32_t, 256> kCrc32cTable = []() {
+    std::array<uint32_t, 256> t;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? ((c >> 1) ^ 0x82F63B78) : (c >> 1);
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+  static inline uint32_t Crc32c(uint32_t crc, const uint8_t *p, size_t sz) {
+    for (size_t i = 0; i < sz; i++) {
+      crc = kCrc32cTable[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+  }
+  // checksum field is treated as zero. result is stored in little endian, unlike other fields
+  static uint32_t Checksum(const uint8_t *p, size_t sz) {
+    static const uint8_t zero[4] = {0, 0, 0, 0};
+    uint32_t crc = Crc32c(0xFFFFFFFF, p, 8);
+    crc = Crc32c(crc, zero, 4);
+    return ~Crc32c(crc, p + kCommonHeaderSize, sz - kCommonHeaderSize);
+  }
+
+  SctpEngine::SctpEngine(Listener &l, AlarmProcessor &ap, const Config &c) :
+    listener_(l), alarm_processor_(ap), config_(c) {
+    do {
+      my_tag_ = random::gen32();
+    } while (my_tag_ == 0);
+    my_initial_tsn_ = random::gen32();
+    next_tsn_ = my_initial_tsn_;
+    cum_ack_ = adv_peer_ack_ = my_initial_tsn_ - 1;
+    reconfig_seq_ = my_initial_tsn_;
+    cwnd_ = std::min(4 * kMtu, std::max(2 * kMtu, (size_t)4380));
+    ssthresh_ = kMaxRwnd;
+    packet_.reserve(kMtu);
+  }
+  SctpEngine::~SctpEngine() {
+    if (alarm_id_ != AlarmProcessor::INVALID_ID) {
+      alarm_processor_.Cancel(alarm_id_);
+    }
+  }
+  void SctpEngine::Connect() {
+    if (state_ != CLOSED || closed_) {
+      return;
+    }
+    state_ = COOKIE_WAIT;
+    init_retransmits_ = 0;
+    BuildInit(false, 0, "");
+    t3_at_ = qrpc_time_now() + rto_;
+    Schedule(t3_at_);
+  }
+  void SctpEngine::Close() {
+    if (closed_) {
+      return;
+    }
+    if (state_ == ESTABLISHED || state_ == COOKIE_ECHOED) {
+      BeginPacket(peer_tag_);
+      AppendChunk(ABORT, 0, nullptr, 0);
+      SendPacket();
+    }
+    state_ = CLOSED;
+    closed_ = true;
+    if (alarm_id_ != AlarmProcessor::INVALID_ID && !in_timer_) {
+      alarm_processor_.Cancel(alarm_id_);
+      alarm_id_ = AlarmProcessor::INVALID_ID;
+    }
+  }
+  int SctpEngine::Send(uint16_t sid, uint32_t ppid, const uint8_t *p, size_t sz, const SendOptions &o) {
+    if (closed_) {
+      return QRPC_EGOAWAY;
+    }
+    if (sz > config_.max_message_size || sid >= config_.os || (established() && sid >= peer_mis_)) {
+      QRPC_LOGJ(error, {{"proto","sctp"},{"ev","invalid message"},{"sid",sid},{"sz",sz},{"peer_mis",peer_mis_}});
+      return QRPC_EINVAL;
+    }
+    if (buffered_ + sz > config_.send_buffer_size) {
+      return QRPC_EAGAIN;
+    }
+    auto &s = out_streams_[sid];
+    if (s.queue.empty() && s.vtime < vclock_) {
+      s.vtime = vclock_; // idle stream does not save its share
+    }
+    s.queue.push_back({
+      .id = next_message_id_++, .ppid = ppid,
+      // DATA chunk cannot be empty. receiver knows the message is empty by PPID (RFC 8831 6.6)
+      .data = sz > 0 ? std::string(reinterpret_cast<const char *>(p), sz) : std::string(1, '\0'),
+      .ordered = o.ordered, .max_retransmits = o.max_retransmits,
+      .expire_at = o.lifetime > 0 ? qrpc_time_now() + o.lifetime : 0,
+    });
+    buffered_ += s.queue.back().data.size();
+    s.buffered += s.queue.back().data.size();
+    if (established()) {
+      Flush();
+      Schedule(NextDeadline());
+    }
+    return QRPC_OK;
+  }
+  void SctpEngine::SetStreamPriority(uint16_t sid, uint16_t priority, uint16_t weight) {
+    auto &s = out_streams_[sid];
+    s.priority = priority;
+    s.weight = std::max(weight, (uint16_t)1);
+  }
+  void SctpEngine::ResetStream(uint16_t sid) {
+    auto &s = out_streams_[sid];
+    if (s.reset_requested || closed_) {
+      return;
+    }
+    s.reset_requested = true;
+    s.closing = true;
+    reset_pending_.push_back(sid);
+    if (established()) {
+      Flush();
+      Schedule(NextDeadline());
+    }
+  }
+
+  // receive
+  void SctpEngine::Receive(const uint8_t *p, size_t sz) {
+    if (closed_ || sz < kCommonHeaderSize + 4) {
+      return;
+    }
+    uint32_t checksum = (uint32_t)p[8] | ((uint32_t)p[9] << 8) | ((uint32_t)p[10] << 16) | ((uint32_t)p[11] << 24);
+    if (checksum != Checksum(p, sz)) {
+      stats_.checksum_errors++;
+      QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","sctp"},{"ev","checksum error"},{"sz",sz}});
+      return;
+    }
+    stats_.rx_packets++;
+    auto vtag = Get32(p + 4);
+    auto first_type = p[kCommonHeaderSize];
+    auto first_flags = p[kCommonHeaderSize + 1];
+    if (first_type == INIT) {
+      if (vtag != 0) {
+        return;
+      }
+    } else if (vtag != my_tag_) {
+      // T bit: sender had no TCB, and reflects our tag as peer's one
+      bool reflected = (first_type == ABORT || first_type == SHUTDOWN_COMPLETE) && (first_flags & 0x01) != 0;
+      if (!reflected || vtag != peer_tag_) {
+        QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","sctp"},{"ev","invalid verification tag"},
+          {"vtag",vtag},{"type",first_type}});
+        return;
+      }
+    }
+    bool data_received = false;
+    size_t off = kCommonHeaderSize;
+    while (off + 4 <= sz) {
+      auto type = p[off], flags = p[off + 1];
+      size_t len = Get16(p + off + 2);
+      if (len < 4 || off + len > sz) {
+        QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","sctp"},{"ev","invalid chunk length"},{"len",len}});
+        break;
+      }
+      stats_.rx_chunks++;
+      data_received = data_received || type == DATA || type == IDATA;
+      if (!HandleChunk(type, flags, p + off + 4, len - 4)) {
+        break;
+      }
+      off += Pad4(len);
+    }
+    if (data_received && !closed_) {
+      // RFC 9260 6.2: acknowledge at least every second packet, otherwise by delayed ack timer
+      if (sack_now_ || ++unacked_packets_ >= 2) {
+        sack_now_ = true;
+      } else if (sack_at_ == 0) {
+        sack_at_ = qrpc_time_now() + kDelayedAckTimeout;
+      }
+    }
+    Flush();
+    Schedule(NextDeadline());
+    Notify();
+  }
+  bool SctpEngine::HandleChunk(uint8_t type, uint8_t flags, const uint8_t *p, size_t sz) {
+    switch (type) {
+      case DATA:
+      case IDATA:
+        if (state_ != ESTABLISHED) {
+          return false;
+        }
+        HandleData(flags, p, sz, type == IDATA);
+        break;
+      case INIT:
+        HandleInit(p, sz);
+        return false; // INIT should not be bundled
+      case INIT_ACK:
+        HandleInitAck(p, sz);
+        return false;
+      case COOKIE_ECHO:
+        HandleCookieEcho(p, sz);
+        break;
+      case COOKIE_ACK:
+        if (state_ == COOKIE_ECHOED) {
+          Establish();
+        }
+        break;
+      case SACK:
+        if (state_ == ESTABLISHED) {
+          HandleSack(p, sz);
+        }
+        break;
+      case FORWARD_TSN:
+      case IFORWARD_TSN:
+        if (state_ == ESTABLISHED) {
+          HandleForwardTsn(p, sz, type == IFORWARD_TSN);
+        }
+        break;
+      case RECONFIG:
+        if (state_ == ESTABLISHED) {
+          HandleReconfig(p, sz);
+        }
+        break;
+      case HEARTBEAT:
+        if (state_ == ESTABLISHED) {
+          // echo back heartbeat info parameter as is
+          heartbeat_acks_.emplace_back(reinterpret_cast<const char *>(p), sz);
+        }
+        break;
+      case HEARTBEAT_ACK:
+        break;
+      case ABORT:
+        QRPC_LOGJ(info, {{"proto","sctp"},{"ev","association aborted by peer"}});
+        Terminate(false);
+        return false;
+      case SHUTDOWN:
+        // peer has no more data to send. it is sent when peer closes whole connection, so just answer and close
+        BeginPacket(peer_tag_);
+        AppendChunk(SHUTDOWN_ACK, 0, nullptr, 0);
+        SendPacket();
+        Terminate(false);
+        return false;
+      case SHUTDOWN_ACK:
+        BeginPacket(peer_tag_);
+        AppendChunk(SHUTDOWN_COMPLETE, 0, nullptr, 0);
+        SendPacket();
+        Terminate(false);
+        return false;
+      case SHUTDOWN_COMPLETE:
+        Terminate(false);
+        return false;
+      case ERROR:
+        QRPC_LOGJ(warn, {{"proto","sctp"},{"ev","operation error reported"},
+          {"cause",sz >= 2 ? Get16(p) : 0}});
+        break;
+      default:
+        // RFC 9260 3.2: highest bit tells whether to skip unknown chunk or stop processing the packet
+        QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","sctp"},{"ev","unknown chunk"},{"type",type}});
+        return (type & 0x80) != 0;
+    }
+    return true;
+  }
+  uint8_t SctpEngine::ParseParams(const uint8_t *p, size_t sz, std::string *cookie) {
+    uint8_t caps = 0;
+    size_t off = 0;
+    while (off + 4 <= sz) {
+      auto type = Get16(p + off);
+      size_t len = Get16(p + off + 2);
+      if (len < 4 || off + len > sz) {
+        break;
+      }
+      switch (type) {
+        case STATE_COOKIE:
+          if (cookie != nullptr) {
+            cookie->assign(reinterpret_cast<const char *>(p + off + 4), len - 4);
+          }
+          break;
+        case FORWARD_TSN_SUPPORTED:
+          caps |= CAP_FORWARD_TSN;
+          break;
+        case SUPPORTED_EXTENSIONS:
+          for (size_t i = 4; i < len; i++) {
+            switch (p[off + i]) {
+              case FORWARD_TSN: caps |= CAP_FORWARD_TSN; break;
+              case IDATA: caps |= CAP_IDATA; break;
+              case RECONFIG: caps |= CAP_RECONFIG; break;
+            }
+          }
+          break;
+      }
+      off += Pad4(len);
+    }
+    return caps;
+  }
+  void SctpEngine::HandleInit(const uint8_t *p, size_t sz) {
+    if (sz < 16) {
+      return;
+    }
+    if (state_ == ESTABLISHED) {
+      // peer restart is not supported. peer is expected to create new DTLS connection instead
+      QRPC_LOGJ(warn, {{"proto","sctp"},{"ev","INIT received on established association, ignored"}});
+      return;
+    }
+    auto init_tag = Get32(p);
+    if (init_tag == 0) {
+      return;
+    }
+    auto caps = ParseParams(p + 16, sz - 16, nullptr);
+    // stateless cookie (RFC 9260 5.1.3). integrity is protected by DTLS, so cookie is not signed.
+    // same tag and initial TSN as our INIT are used, so that INIT collision converges to one association
+    std::vector<uint8_t> cookie;
+    Put32(cookie, kCookieMagic);
+    Put32(cookie, my_tag_);
+    Put32(cookie, init_tag);
+    Put32(cookie, my_initial_tsn_);
+    Put32(cookie, Get32(p + 12)); // peer initial TSN
+    Put32(cookie, Get32(p + 4)); // peer a_rwnd
+    Put16(cookie, Get16(p + 8)); // peer OS
+    Put16(cookie, Get16(p + 10)); // peer MIS
+    cookie.push_back(caps);
+    cookie.resize(kCookieSize, 0);
+    BuildInit(true, init_tag, std::string(cookie.begin(), cookie.end()));
+  }
+  void SctpEngine::HandleInitAck(const uint8_t *p, size_t sz) {
+    if (state_ != COOKIE_WAIT || sz < 16) {
+      return;
+    }
+    peer_tag_ = Get32(p);
+    peer_rwnd_ = Get32(p + 4);
+    peer_os_ = Get16(p + 8);
+    peer_mis_ = Get16(p + 10);
+    peer_initial_tsn_ = Get32(p + 12);
+    peer_caps_ = ParseParams(p + 16, sz - 16, &cookie_);
+    if (peer_tag_ == 0 || cookie_.empty()) {
+      QRPC_LOGJ(error, {{"proto","sctp"},{"ev","invalid INIT ACK"},{"tag",peer_tag_},{"cookie",cookie_.size()}});
+      return;
+    }
+    state_ = COOKIE_ECHOED;
+    init_retransmits_ = 0;
+    SendCookieEcho();
+    t3_at_ = qrpc_time_now() + rto_;
+  }
+  void SctpEngine::HandleCookieEcho(const uint8_t *p, size_t sz) {
+    if (sz < kCookieSize || Get32(p) != kCookieMagic || Get32(p + 4) != my_tag_) {
+      QRPC_LOGJ(warn, {{"proto","sctp"},{"ev","invalid cookie"},{"sz",sz}});
+      return;
+    }
+    auto peer_tag = Get32(p + 8);
+    if (state_ == ESTABLISHED) {
+      if (peer_tag == peer_tag_) {
+        cookie_ack_pending_ = true; // our COOKIE ACK is lost
+      }
+      return;
+    }
+    if (Get32(p + 12) != my_initial_tsn_) {
+      return;
+    }
+    peer_tag_ = peer_tag;
+    peer_initial_tsn_ = Get32(p + 16);
+    peer_rwnd_ = Get32(p + 20);
+    peer_os_ = Get16(p + 24);
+    peer_mis_ = Get16(p + 26);
+    peer_caps_ = p[28];
+    cookie_ack_pending_ = true;
+    Establish();
+  }
+  void SctpEngine::Establish() {
+    state_ = ESTABLISHED;
+    t3_at_ = 0;
+    error_count_ = 0;
+    idata_ = (peer_caps_ & CAP_IDATA) != 0; // RFC 8260 2.2: I-DATA must be used if both support it
+    peer_cum_tsn_ = peer_initial_tsn_ - 1;
+    connected_pending_ = true;
+    QRPC_LOGJ(info, {{"proto","sctp"},{"ev","association established"},{"idata",idata_},
+      {"peer_os",peer_os_},{"peer_mis",peer_mis_},{"peer_caps",peer_caps_}});
+  }
+  bool SctpEngine::Received(uint32_t tsn) {
+    if (!TsnAfter(tsn, peer_cum_tsn_) || received_.find(tsn) != received_.end()) {
+      duplicates_.push_back(tsn);
+      stats_.duplicates++;
+      sack_now_ = true;
+      return false;
+    }
+    if (tsn != peer_cum_tsn_ + 1) {
+      sack_now_ = true; // report gap immediately, for sender's fast retransmit
+    }
+    received_[tsn] = true;
+    AdvanceCumTsn();
+    return true;
+  }
+  void SctpEngine::AdvanceCumTsn() {
+    while (!received_.empty()) {
+      auto it = received_.begin();
+      if (TsnAfter(it->first, peer_cum_tsn_ + 1)) {
+        break;
+      }
+      if (it->first == peer_cum_tsn_ + 1) {
+        peer_cum_tsn_++;
+      }
+      received_.erase(it);
+    }
+  }
+  void SctpEngine::HandleData(uint8_t flags, const uint8_t *p, size_t sz, bool idata) {
+    size_t hsz = idata ? 16 : 12;
+    if (sz <= hsz || idata != idata_) {
+      QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","sctp"},{"ev","invalid data chunk"},
+        {"sz",sz},{"idata",idata}});
+      return;
+    }
+    auto tsn = Get32(p);
+    if ((flags & FLAG_IMMEDIATE) != 0) {
+      sack_now_ = true;
+    }
+    // every chunk carries at least one byte, so sender which respects our window never sends TSN beyond it.
+    // such TSN only grows gap ack blocks and received_ without bound
+    if (TsnAfter(tsn, peer_cum_tsn_ + kMaxRwnd)) {
+      QRPC_LOGJ_RATELIMIT(warn, QRPC_LOG_PACKET_RATE, {{"proto","sctp"},{"ev","tsn beyond receive window"},
+        {"tsn",tsn},{"cum_tsn",peer_cum_tsn_}});
+      return;
+    }
+    if (rx_buffered_ + (sz - hsz) > kMaxRwnd && tsn != peer_cum_tsn_ + 1) {
+      return; // no room. drop without acknowledging, sender will retransmit it
+    }
+    if (!Received(tsn)) {
+      return;
+    }
+    Fragment f;
+    f.sid = Get16(p + 4);
+    f.flags = flags;
+    if (idata) {
+      f.ssn = Get32(p + 8);
+      // PPID is carried only in first fragment, others carry fragment sequence number instead
+      f.fsn = (flags & FLAG_BEGIN) ? 0 : Get32(p + 12);
+      f.ppid = (flags & FLAG_BEGIN) ? Get32(p + 12) : 0;
+    } else {
+      f.ssn = Get16(p + 6);
+      f.fsn = 0;
+      f.ppid = Get32(p + 8);
+    }
+    f.payload.assign(reinterpret_cast<const char *>(p + hsz), sz - hsz);
+    Reassemble(std::move(f), tsn);
+    ApplyIncomingReset();
+  }
+  void SctpEngine::Reassemble(Fragment &&f, uint32_t tsn) {
+    bool ordered = (f.flags & FLAG_UNORDERED) == 0;
+    // charged until the message is given to listener (or dropped), even if it is complete in one chunk
+    rx_buffered_ += f.payload.size();
+    if ((f.flags & (FLAG_BEGIN | FLAG_END)) == (FLAG_BEGIN | FLAG_END)) {
+      Deliver(f.sid, ordered, f.ssn, { .ppid = f.ppid, .data = std::move(f.payload) });
+      return;
+    }
+    if (idata_) {
+      auto &s = in_streams_[f.sid];
+      auto &frags = (ordered ? s.ifrags : s.iufrags)[f.ssn];
+      auto sid = f.sid;
+      auto mid = f.ssn;
+      frags[f.fsn] = std::move(f);
+      // complete if it has first and last fragment, and every fragment between them
+      auto first = frags.begin();
+      auto last = frags.rbegin();
+      if (first->first != 0 || (first->second.flags & FLAG_BEGIN) == 0 ||
+        (last->second.flags & FLAG_END) == 0 || frags.size() != (size_t)last->first + 1) {
+        return;
+      }
+      InMessage m = { .ppid = first->second.ppid };
+      for (auto &kv : frags) {
+        m.data.append(kv.second.payload);
+      }
+      (ordered ? s.ifrags : s.iufrags).erase(mid);
+      Deliver(sid, ordered, mid, std::move(m));
+      return;
+    }
+    // DATA fragments of a message have consecutive TSNs
+    frags_[tsn] = std::move(f);
+    auto begin = tsn, end = tsn;
+    while ((frags_[begin].flags & FLAG_BEGIN) == 0) {
+      if (frags_.find(begin - 1) == frags_.end()) {
+        return;
+      }
+      begin--;
+    }
+    while ((frags_[end].flags & FLAG_END) == 0) {
+      if (frags_.find(end + 1) == frags_.end()) {
+        return;
+      }
+      end++;
+    }
+    auto &head = frags_[begin];
+    auto sid = head.sid;
+    auto ssn = head.ssn;
+    InMessage m = { .ppid = head.ppid };
+    for (auto t = begin; ; t++) {
+      auto it = frags_.find(t);
+      m.data.append(it->second.payload);
+      frags_.erase(it);
+      if (t == end) {
+        break;
+      }
+    }
+    Deliver(sid, ordered, ssn, std::move(m));
+  }
+  uint32_t SctpEngine::Unwrap(const InStream &s, uint32_t ssn) const {
+    if (idata_) {
+      return ssn;
+    }
+    // 16 bit SSN of DATA is extended to 32 bit around next expected one
+    return s.next_ssn + (int16_t)((uint16_t)ssn - (uint16_t)s.next_ssn);
+  }
+  void SctpEngine::Deliver(uint16_t sid, bool ordered, uint32_t ssn, InMessage &&m) {
+    if (!ordered) {
+      deliveries_.emplace_back(sid, std::move(m));
+      return;
+    }
+    auto &s = in_streams_[sid];
+    ssn = Unwrap(s, ssn);
+    if (TsnAfter(s.next_ssn, ssn)) {
+      rx_buffered_ -= m.data.size();
+      return; // already delivered or skipped
+    }
+    if (ssn != s.next_ssn) {
+      s.ordered[ssn] = std::move(m);
+      return;
+    }
+    deliveries_.emplace_back(sid, std::move(m));
+    s.next_ssn++;
+    DeliverOrdered(sid, s);
+  }
+  void SctpEngine::DeliverOrdered(uint16_t sid, InStream &s) {
+    while (!s.ordered.empty() && s.ordered.begin()->first == s.next_ssn) {
+      auto it = s.ordered.begin();
+      deliveries_.emplace_back(sid, std::move(it->second));
+      s.ordered.erase(it);
+      s.next_ssn++;
+    }
+  }
+  void SctpEngine::SkipTo(uint16_t sid, bool unordered, uint32_t ssn) {
+    auto &s = in_streams_[sid];
+    auto &ifrags = unordered ? s.iufrags : s.ifrags;
+    // drop partially received messages which sender abandoned
+    while (!ifrags.empty() && !TsnAfter(ifrags.begin()->first, ssn)) {
+      for (auto &kv : ifrags.begin()->second) {
+        rx_buffered_ -= kv.second.payload.size();
+      }
+      ifrags.erase(ifrags.begin());
+    }
+    if (unordered) {
+      return;
+    }
+    ssn = Unwrap(s, ssn);
+    if (TsnAfter(s.next_ssn, ssn)) {
+      return;
+    }
+    // messages before skipped one are delivered, even if some of them are lost (RFC 3758 3.6)
+    while (!s.ordered.empty() && !TsnAfter(s.ordered.begin()->first, ssn)) {
+      auto it = s.ordered.begin();
+      deliveries_.emplace_back(sid, std::move(it->second));
+      s.ordered.erase(it);
+    }
+    s.next_ssn = ssn + 1;
+    DeliverOrdered(sid, s);
+  }
+  void SctpEngine::HandleForwardTsn(const uint8_t *p, size_t sz, bool iforward) {
+    if (sz < 4) {
+      return;
+    }
+    auto new_cum = Get32(p);
+    sack_now_ = true;
+    if (!TsnAfter(new_cum, peer_cum_tsn_)) {
+      return;
+    }
+    peer_cum_tsn_ = new_cum;
+    AdvanceCumTsn();
+    while (!frags_.empty() && !TsnAfter(frags_.begin()->first, new_cum)) {
+      rx_buffered_ -= frags_.begin()->second.payload.size();
+      frags_.erase(frags_.begin());
+    }
+    if (iforward) {
+      for (size_t off = 4; off + 8 <= sz; off += 8) {
+        SkipTo(Get16(p + off), (Get16(p + off + 2) & 0x01) != 0, Get32(p + off + 4));
+      }
+    } else {
+      for (size_t off = 4; off + 4 <= sz; off += 4) {
+        SkipTo(Get16(p + off), false, Get16(p + off + 2));
+      }
+    }
+    ApplyIncomingReset();
+  }
+  void SctpEngine::HandleSack(const uint8_t *p, size_t sz) {
+    if (sz < 12) {
+      return;
+    }
+    auto cum = Get32(p);
+    auto a_rwnd = Get32(p + 4);
+    auto ngaps = Get16(p + 8);
+    if (TsnAfter(cum_ack_, cum) || TsnAfter(cum, next_tsn_ - 1) || sz < 12 + (size_t)ngaps * 4) {
+      return; // stale or invalid
+    }
+    auto now = qrpc_time_now();
+    size_t acked_bytes = 0;
+    qrpc_time_t rtt = 0;
+    bool progress = TsnAfter(cum, cum_ack_);
+    // cumulative ack
+    while (!inflight_.empty() && !TsnAfter(inflight_.front().tsn, cum)) {
+      auto &c = inflight_.front();
+      if (Counted(c)) {
+        flight_size_ -= c.payload.size();
+      }
+      if (!c.abandoned) {
+        if (!c.acked) {
+          acked_bytes += c.payload.size();
+          if (c.transmissions == 1) {
+            rtt = now - c.sent_at; // Karn's algorithm: only chunks never retransmitted
+          }
+        }
+        Release(c.sid, c.payload.size());
+      }
+      inflight_.pop_front();
+    }
+    cum_ack_ = cum;
+    if (TsnAfter(cum_ack_, adv_peer_ack_)) {
+      adv_peer_ack_ = cum_ack_;
+    }
+    // gap ack blocks
+    uint32_t highest_newly_acked = cum_ack_;
+    for (size_t i = 0; i < ngaps; i++) {
+      uint16_t start = Get16(p + 12 + i * 4), end = Get16(p + 12 + i * 4 + 2);
+      for (uint32_t off = start; off <= end && off > 0; off++) {
+        size_t idx = off - 1; // inflight_ begins at cum_ack_ + 1
+        if (idx >= inflight_.size()) {
+          break;
+        }
+        auto &c = inflight_[idx];
+        if (c.acked) {
+          continue;
+        }
+        if (Counted(c)) {
+          flight_size_ -= c.payload.size();
+        }
+        c.acked = true;
+        c.retransmit = false;
+        if (!c.abandoned) {
+          acked_bytes += c.payload.size();
+        }
+        highest_newly_acked = c.tsn;
+      }
+    }
+    // miss indications (RFC 9260 7.2.4). chunks below newly acked one are likely lost
+    bool fast = false;
+    for (auto &c : inflight_) {
+      if (!TsnAfter(highest_newly_acked, c.tsn)) {
+        break;
+      }
+      if (c.acked || c.abandoned || c.retransmit || c.fast_retransmitted) {
+        continue;
+      }
+      if (++c.misses >= kFastRetransmitThreshold) {
+        MarkRetransmit(c);
+        c.fast_retransmitted = true;
+        stats_.fast_retransmits++;
+        fast = true;
+      }
+    }
+    if (fast_recovery_ && !TsnAfter(fast_recovery_exit_, cum_ack_)) {
+      fast_recovery_ = false;
+    }
+    if (fast && !fast_recovery_) {
+      ssthresh_ = std::max(cwnd_ / 2, 4 * kMtu);
+      cwnd_ = ssthresh_;
+      partial_bytes_acked_ = 0;
+      fast_recovery_ = true;
+      fast_recovery_exit_ = next_tsn_ - 1;
+      fast_retransmit_now_ = true;
+    }
+    // congestion window (RFC 9260 7.2.1, 7.2.2)
+    if (progress && !fast_recovery_) {
+      if (cwnd_ <= ssthresh_) {
+        cwnd_ += std::min(acked_bytes, kMtu);
+      } else if ((partial_bytes_acked_ += acked_bytes) >= cwnd_) {
+        partial_bytes_acked_ -= cwnd_;
+        cwnd_ += kMtu;
+      }
+    }
+    if (rtt > 0) {
+      UpdateRto(rtt);
+    }
+    peer_rwnd_ = a_rwnd > flight_size_ ? a_rwnd - flight_size_ : 0;
+    if ((peer_caps_ & CAP_FORWARD_TSN) != 0) {
+      AdvancePeerAckPoint();
+    }
+    // FORWARD-TSN is not counted in flight size, but should be retransmitted by T3 until peer acks it
+    // (RFC 3758 3.5 C3), otherwise lost one stalls peer's reassembly forever
+    auto forward_tsn_outstanding = TsnAfter(adv_peer_ack_, cum_ack_);
+    if (progress) {
+      error_count_ = 0;
+      t3_at_ = (flight_size_ > 0 || forward_tsn_outstanding) ? now + rto_ : 0;
+    } else if (flight_size_ == 0 && !HasRetransmit() && !forward_tsn_outstanding) {
+      t3_at_ = 0;
+    }
+  }
+  void SctpEngine::HandleReconfig(const uint8_t *p, size_t sz) {
+    size_t off = 0;
+    while (off + 4 <= sz) {
+      auto type = Get16(p + off);
+      size_t len = Get16(p + off + 2);
+      if (len < 4 || off + len > sz) {
+        break;
+      }
+      auto b = p + off + 4;
+      switch (type) {
+        case OUTGOING_RESET_REQUEST:
+          if (len >= 16) {
+            std::vector<uint16_t> sids;
+            for (size_t i = 16; i + 2 <= len; i += 2) {
+              sids.push_back(Get16(p + off + i));
+            }
+            HandleIncomingReset(Get32(b), Get32(b + 8), sids);
+          }
+          break;
+        case INCOMING_RESET_REQUEST:
+          // data channel peers only reset their outgoing streams
+          if (len >= 8) {
+            reconfig_responses_.emplace_back(Get32(b), RESULT_DENIED);
+          }
+          break;
+        case RECONFIG_RESPONSE:
+          if (len >= 12 && reset_inflight_ != nullptr && Get32(b) == reset_inflight_->seq) {
+            auto result = Get32(b + 4);
+            if (result == RESULT_IN_PROGRESS) {
+              break; // retransmitted by timer
+            }
+            if (result <= RESULT_PERFORMED) {
+              for (auto sid : reset_inflight_->sids) {
+                auto &s = out_streams_[sid];
+                s.next_ssn = 0;
+                s.next_mid = s.next_umid = 0;
+                s.reset_requested = false;
+              }
+            } else {
+              QRPC_LOGJ(error, {{"proto","sctp"},{"ev","stream reset failed"},{"result",result}});
+            }
+            reset_inflight_.reset();
+            reconfig_at_ = 0;
+          }
+          break;
+      }
+      off += Pad4(len);
+    }
+  }
+  void SctpEngine::HandleIncomingReset(uint32_t seq, uint32_t last_tsn, const std::vector<uint16_t> &sids) {
+    if (peer_reconfig_seen_ && seq == peer_reconfig_seq_) {
+      // retransmitted request. answer again, unless it is still waiting for data
+      reconfig_responses_.emplace_back(seq, incoming_reset_ != nullptr ? RESULT_IN_PROGRESS : RESULT_PERFORMED);
+      return;
+    }
+    if (peer_reconfig_seen_ && seq != peer_reconfig_seq_ + 1) {
+      reconfig_responses_.emplace_back(seq, RESULT_BAD_SEQ);
+      return;
+    }
+    peer_reconfig_seen_ = true;
+    peer_reconfig_seq_ = seq;
+    incoming_reset_.reset(new ResetRequest { .seq = seq, .last_tsn = last_tsn, .sids = sids });
+    ApplyIncomingReset();
+  }
+  void SctpEngine::ApplyIncomingReset() {
+    // RFC 6525 5.2.2: streams are reset after all data sent before the request is received
+    if (incoming_reset_ == nullptr || TsnAfter(incoming_reset_->last_tsn, peer_cum_tsn_)) {
+      return;
+    }
+    auto sids = std::move(incoming_reset_->sids);
+    if (sids.empty()) {
+      for (auto &kv : in_streams_) {
+        sids.push_back(kv.first);
+      }
+    }
+    for (auto sid : sids) {
+      auto it = in_streams_.find(sid);
+      if (it != in_streams_.end()) {
+        for (auto &kv : it->second.ordered) {
+          rx_buffered_ -= kv.second.data.size();
+        }
+        for (auto *m : { &it->second.ifrags, &it->second.iufrags }) {
+          for (auto &mkv : *m) {
+            for (auto &kv : mkv.second) {
+              rx_buffered_ -= kv.second.payload.size();
+            }
+          }
+        }
+        in_streams_.erase(it);
+      }
+      reset_notifications_.push_back(sid);
+      // closing data channel resets both direction (RFC 8831 6.7). if we closed it first, peer is answering
+      auto &os = out_streams_[sid];
+      if (os.closing) {
+        os.closing = false;
+      } else if (!os.reset_requested) {
+        os.reset_requested = true;
+        reset_pending_.push_back(sid);
+      }
+    }
+    reconfig_responses_.emplace_back(incoming_reset_->seq, RESULT_PERFORMED);
+    incoming_reset_.reset();
+  }
+
+  // send
+  void SctpEngine::BeginPacket(uint32_t vtag) {
+    packet_.clear();
+    Put16(packet_, kPort);
+    Put16(packet_, kPort);
+    Put32(packet_, vtag);
+    Put32(packet_, 0); // checksum
+  }
+  void SctpEngine::AppendChunk(uint8_t type, uint8_t flags, const uint8_t *h, size_t hsz, const uint8_t *p, size_t psz) {
+    size_t len = 4 + hsz + psz;
+    if (packet_.size() + len > kMtu && packet_.size() > kCommonHeaderSize) {
+      auto vtag = Get32(packet_.data() + 4);
+      SendPacket();
+      BeginPacket(vtag);
+    }
+    packet_.push_back(type);
+    packet_.push_back(flags);
+    Put16(packet_, len);
+    packet_.insert(packet_.end(), h, h + hsz);
+    if (psz > 0) {
+      packet_.insert(packet_.end(), p, p + psz);
+    }
+    packet_.resize(Pad4(packet_.size()), 0);
+    stats_.tx_chunks++;
+  }
+  void SctpEngine::SendPacket() {
+    if (packet_.size() <= kCommonHeaderSize) {
+      return;
+    }
+    auto crc = Checksum(packet_.data(), packet_.size());
+    packet_[8] = crc & 0xFF;
+    packet_[9] = (crc >> 8) & 0xFF;
+    packet_[10] = (crc >> 16) & 0xFF;
+    packet_[11] = (crc >> 24) & 0xFF;
+    stats_.tx_packets++;
+    listener_.OnSctpEngineSendPacket(packet_.data(), packet_.size());
+    packet_.resize(kCommonHeaderSize);
+  }
+  void SctpEngine::BuildInit(bool ack, uint32_t vtag, const std::string &cookie) {
+    std::vector<uint8_t> b;
+    Put32(b, my_tag_);
+    Put32(b, kMaxRwnd);
+    Put16(b, config_.os);
+    Put16(b, config_.mis);
+    Put32(b, my_initial_tsn_);
+    if (ack) {
+      Put16(b, STATE_COOKIE);
+      Put16(b, 4 + cookie.size());
+      b.insert(b.end(), cookie.begin(), cookie.end());
+      b.resize(Pad4(b.size()), 0);
+    }
+    Put16(b, FORWARD_TSN_SUPPORTED);
+    Put16(b, 4);
+    const uint8_t exts[] = { RECONFIG, FORWARD_TSN, IDATA, IFORWARD_TSN };
+    Put16(b, SUPPORTED_EXTENSIONS);
+    Put16(b, 4 + sizeof(exts));
+    b.insert(b.end(), exts, exts + sizeof(exts));
+    BeginPacket(vtag);
+    AppendChunk(ack ? INIT_ACK : INIT, 0, b.data(), b.size());
+    SendPacket();
+  }
+  void SctpEngine::SendCookieEcho() {
+    BeginPacket(peer_tag_);
+    AppendChunk(COOKIE_ECHO, 0, reinterpret_cast<const uint8_t *>(cookie_.data()), cookie_.size());
+    SendPacket();
+  }
+  void SctpEngine::BuildSack() {
+    std::vector<uint8_t> b;
+    Put32(b, peer_cum_tsn_);
+    Put32(b, rx_buffered_ < kMaxRwnd ? kMaxRwnd - rx_buffered_ : 0);
+    std::vector<std::pair<uint16_t, uint16_t>> gaps;
+    for (auto &kv : received_) {
+      uint32_t off = kv.first - peer_cum_tsn_;
+      if (off > 0xFFFF) {
+        break;
+      }
+      if (!gaps.empty() && (uint32_t)gaps.back().second + 1 == off) {
+        gaps.back().second = off;
+      } else if (gaps.size() < kMaxGapBlocks) {
+        gaps.emplace_back(off, off);
+      } else {
+        break;
+      }
+    }
+    auto ndups = std::min(duplicates_.size(), kMaxDuplicates);
+    Put16(b, gaps.size());
+    Put16(b, ndups);
+    for (auto &g : gaps) {
+      Put16(b, g.first);
+      Put16(b, g.second);
+    }
+    for (size_t i = 0; i < ndups; i++) {
+      Put32(b, duplicates_[i]);
+    }
+    duplicates_.clear();
+    AppendChunk(SACK, 0, b.data(), b.size());
+    sack_now_ = false;
+    sack_at_ = 0;
+    unacked_packets_ = 0;
+  }
+  void SctpEngine::BuildForwardTsn() {
+    forward_tsn_pending_ = false;
+    if (!TsnAfter(adv_peer_ack_, cum_ack_)) {
+      return;
+    }
+    // latest abandoned SSN (MID) of each stream, so that receiver stops waiting for them
+    std::map<std::pair<uint16_t, bool>, uint32_t> skips;
+    for (auto &c : inflight_) {
+      if (TsnAfter(c.tsn, adv_peer_ack_)) {
+        break;
+      }
+      bool unordered = (c.flags & FLAG_UNORDERED) != 0;
+      if (!c.abandoned || (unordered && !idata_)) {
+        continue;
+      }
+      auto key = std::make_pair(c.sid, unordered);
+      auto it = skips.find(key);
+      if (it == skips.end()) {
+        skips[key] = c.ssn;
+      } else if (idata_ ? TsnAfter(c.ssn, it->second) : (int16_t)((uint16_t)c.ssn - (uint16_t)it->second) > 0) {
+        it->second = c.ssn;
+      }
+    }
+    std::vector<uint8_t> b;
+    Put32(b, adv_peer_ack_);
+    for (auto &kv : skips) {
+      Put16(b, kv.first.first);
+      if (idata_) {
+        Put16(b, kv.first.second ? 1 : 0);
+        Put32(b, kv.second);
+      } else {
+        Put16(b, kv.second);
+      }
+    }
+    AppendChunk(idata_ ? IFORWARD_TSN : FORWARD_TSN, 0, b.data(), b.size());
+  }
+  void SctpEngine::BuildReconfig(bool send_request) {
+    std::vector<uint8_t> b;
+    for (auto &r : reconfig_responses_) {
+      Put16(b, RECONFIG_RESPONSE);
+      Put16(b, 12);
+      Put32(b, r.first);
+      Put32(b, r.second);
+    }
+    reconfig_responses_.clear();
+    if (send_request && reset_inflight_ != nullptr) {
+      auto &r = *reset_inflight_;
+      Put16(b, OUTGOING_RESET_REQUEST);
+      Put16(b, 16 + r.sids.size() * 2);
+      Put32(b, r.seq);
+      Put32(b, peer_reconfig_seq_); // last response sequence number we sent
+      Put32(b, r.last_tsn);
+      for (auto sid : r.sids) {
+        Put16(b, sid);
+      }
+      b.resize(Pad4(b.size()), 0);
+    }
+    if (!b.empty()) {
+      AppendChunk(RECONFIG, 0, b.data(), b.size());
+    }
+  }
+  bool SctpEngine::StartReset() {
+    if (reset_inflight_ != nullptr || reset_pending_.empty()) {
+      return false;
+    }
+    // stream is reset after all messages queued before are sent
+    std::vector<uint16_t> ready;
+    auto it = reset_pending_.begin();
+    for (auto sid : reset_pending_) {
+      if (out_streams_[sid].queue.empty()) {
+        ready.push_back(sid);
+      } else {
+        *it++ = sid;
+      }
+    }
+    reset_pending_.erase(it, reset_pending_.end());
+    if (ready.empty()) {
+      return false;
+    }
+    if ((peer_caps_ & CAP_RECONFIG) == 0) {
+      QRPC_LOGJ(warn, {{"proto","sctp"},{"ev","peer does not support stream reset"}});
+      for (auto sid : ready) {
+        out_streams_[sid].reset_requested = false;
+      }
+      return false;
+    }
+    reset_inflight_.reset(new ResetRequest { .seq = reconfig_seq_++, .last_tsn = next_tsn_ - 1, .sids = ready });
+    reconfig_retransmits_ = 0;
+    return true;
+  }
+  SctpEngine::OutStream *SctpEngine::NextStream(uint16_t &sid) {
+    if (partial_sid_ >= 0) {
+      // with DATA, fragments of a message need consecutive TSNs, so the message is finished first
+      auto &s = out_streams_[partial_sid_];
+      if (!s.queue.empty()) {
+        sid = partial_sid_;
+        return &s;
+      }
+      partial_sid_ = -1;
+    }
+    // strict priority between levels, and weighted fair queueing in same level (RFC 8260 3.4, 3.6)
+    OutStream *next = nullptr;
+    for (auto &kv : out_streams_) {
+      auto &s = kv.second;
+      if (s.queue.empty()) {
+        continue;
+      }
+      if (next == nullptr || s.priority > next->priority || (s.priority == next->priority && s.vtime < next->vtime)) {
+        next = &s;
+        sid = kv.first;
+      }
+    }
+    return next;
+  }
+  bool SctpEngine::NextChunk(Chunk &c) {
+    uint16_t sid;
+    OutStream *ps;
+    while ((ps = NextStream(sid)) != nullptr) {
+      auto &s = *ps;
+      auto &m = s.queue.front();
+      if (m.offset == 0) {
+        if (m.expire_at > 0 && m.expire_at <= qrpc_time_now()) {
+          // expired before sending. SSN is not assigned yet, so just drop it
+          Release(sid, m.data.size());
+          stats_.abandoned++;
+          s.queue.pop_front();
+          continue;
+        }
+        m.ssn = idata_ ? (m.ordered ? s.next_mid++ : s.next_umid++) : (m.ordered ? s.next_ssn++ : 0);
+      }
+      auto sz = std::min(kMaxPayloadSize, m.data.size() - m.offset);
+      c.sid = sid;
+      c.ssn = m.ssn;
+      c.fsn = m.fsn++;
+      c.ppid = m.ppid;
+      c.flags = (m.offset == 0 ? FLAG_BEGIN : 0) | (m.offset + sz == m.data.size() ? FLAG_END : 0) |
+        (m.ordered ? 0 : FLAG_UNORDERED);
+      c.payload.assign(m.data, m.offset, sz);
+      c.message_id = m.id;
+      c.max_retransmits = m.max_retransmits;
+      c.expire_at = m.expire_at;
+      c.misses = 0;
+      c.acked = c.retransmit = c.fast_retransmitted = c.abandoned = false;
+      m.offset += sz;
+      bool done = m.offset == m.data.size();
+      if (done) {
+        s.queue.pop_front();
+      }
+      // with I-DATA, each fragment is scheduled separately, so large message does not block other streams
+      partial_sid_ = (idata_ || done) ? -1 : sid;
+      vclock_ = s.vtime;
+      s.vtime += (sz * kWeightScale) / s.weight;
+      return true;
+    }
+    return false;
+  }
+  void SctpEngine::AppendData(const Chunk &c) {
+    uint8_t h[16];
+    size_t hsz;
+    Endian::HostToNetbytes(c.tsn, h);
+    Endian::HostToNetbytes(c.sid, h + 4);
+    if (idata_) {
+      Endian::HostToNetbytes((uint16_t)0, h + 6);
+      Endian::HostToNetbytes(c.ssn, h + 8);
+      Endian::HostToNetbytes((c.flags & FLAG_BEGIN) ? c.ppid : c.fsn, h + 12);
+      hsz = 16;
+    } else {
+      Endian::HostToNetbytes((uint16_t)c.ssn, h + 6);
+      Endian::HostToNetbytes(c.ppid, h + 8);
+      hsz = 12;
+    }
+    AppendChunk(idata_ ? IDATA : DATA, c.flags, h, hsz,
+      reinterpret_cast<const uint8_t *>(c.payload.data()), c.payload.size());
+  }
+  void SctpEngine::Flush() {
+    if (state_ != ESTABLISHED) {
+      return;
+    }
+    auto now = qrpc_time_now();
+    BeginPacket(peer_tag_);
+    if (cookie_ack_pending_) {
+      AppendChunk(COOKIE_ACK, 0, nullptr, 0);
+      cookie_ack_pending_ = false;
+    }
+    for (auto &hb : heartbeat_acks_) {
+      AppendChunk(HEARTBEAT_ACK, 0, reinterpret_cast<const uint8_t *>(hb.data()), hb.size());
+    }
+    heartbeat_acks_.clear();
+    if (sack_now_) {
+      BuildSack();
+    }
+    if (forward_tsn_pending_) {
+      BuildForwardTsn();
+    }
+    bool request = StartReset() || (reconfig_at_ > 0 && reconfig_at_ <= now);
+    BuildReconfig(request);
+    // retransmission. fast retransmit sends one packet regardless of cwnd (RFC 9260 7.2.4)
+    size_t limit = fast_retransmit_now_ ? flight_size_ + (kMtu - kCommonHeaderSize) : cwnd_;
+    fast_retransmit_now_ = false;
+    for (auto &c : inflight_) {
+      if (!c.retransmit) {
+        continue;
+      }
+      if (Abandonable(c, now)) {
+        AbandonMessage(c.message_id);
+        continue;
+      }
+      if (flight_size_ >= limit) {
+        break;
+      }
+      c.retransmit = false;
+      c.transmissions++;
+      c.sent_at = now;
+      c.misses = 0;
+      flight_size_ += c.payload.size();
+      stats_.retransmits++;
+      AppendData(c);
+    }
+    // new data
+    Chunk c;
+    while (flight_size_ < cwnd_ && (peer_rwnd_ > 0 || flight_size_ == 0) && NextChunk(c)) {
+      c.tsn = next_tsn_++;
+      c.sent_at = now;
+      c.transmissions = 1;
+      flight_size_ += c.payload.size();
+      peer_rwnd_ -= std::min<uint32_t>(peer_rwnd_, c.payload.size());
+      inflight_.push_back(std::move(c));
+      AppendData(inflight_.back());
+    }
+    if (forward_tsn_pending_) {
+      BuildForwardTsn(); // abandoned while building retransmission
+    }
+    if (!request && StartReset()) {
+      // last messages of the streams to reset are just sent
+      BuildReconfig(request = true);
+    }
+    SendPacket();
+    if (request) {
+      reconfig_at_ = now + rto_;
+    }
+    if (t3_at_ == 0 && (flight_size_ > 0 || TsnAfter(adv_peer_ack_, cum_ack_))) {
+      t3_at_ = now + rto_;
+    }
+  }
+  void SctpEngine::Release(uint16_t sid, size_t sz) {
+    buffered_ -= sz;
+    out_streams_[sid].buffered -= sz;
+    buffered_changed_.insert(sid);
+  }
+  bool SctpEngine::Abandonable(const Chunk &c, qrpc_time_t now) const {
+    if ((peer_caps_ & CAP_FORWARD_TSN) == 0) {
+      return false;
+    }
+    return (c.expire_at > 0 && c.expire_at <= now) ||
+      (c.max_retransmits >= 0 && c.transmissions > c.max_retransmits);
+  }
+  void SctpEngine::MarkRetransmit(Chunk &c) {
+    if (Counted(c)) {
+      flight_size_ -= c.payload.size();
+    }
+    c.retransmit = true;
+  }
+  bool SctpEngine::HasRetransmit() const {
+    for (auto &c : inflight_) {
+      if (c.retransmit) {
+        return true;
+      }
+    }
+    return false;
+  }
+  void SctpEngine::AbandonMessage(uint64_t message_id) {
+    for (auto &c : inflight_) {
+      if (c.message_id != message_id || c.abandoned) {
+        continue;
+      }
+      if (Counted(c)) {
+        flight_size_ -= c.payload.size();
+      }
+      c.abandoned = true;
+      c.retransmit = false;
+      Release(c.sid, c.payload.size());
+    }
+    // rest of partially sent message is never sent
+    for (auto &kv : out_streams_) {
+      auto &q = kv.second.queue;
+      if (!q.empty() && q.front().id == message_id) {
+        if (partial_sid_ == kv.first) {
+          partial_sid_ = -1;
+        }
+        Release(kv.first, q.front().data.size() - q.front().offset);
+        q.pop_front();
+        break;
+      }
+    }
+    stats_.abandoned++;
+    AdvancePeerAckPoint();
+  }
+  void SctpEngine::AdvancePeerAckPoint() {
+    for (auto &c : inflight_) {
+      if (!TsnAfter(c.tsn, adv_peer_ack_)) {
+        continue;
+      }
+      if (!c.abandoned || c.tsn != adv_peer_ack_ + 1) {
+        break;
+      }
+      adv_peer_ack_ = c.tsn;
+    }
+    if (TsnAfter(adv_peer_ack_, cum_ack_)) {
+      forward_tsn_pending_ = true;
+    }
+  }
+  void SctpEngine::UpdateRto(qrpc_time_t rtt) {
+    // RFC 6298
+    if (srtt_ == 0) {
+      srtt_ = rtt;
+      rttvar_ = rtt / 2;
+    } else {
+      auto diff = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+      rttvar_ = (3 * rttvar_ + diff) / 4;
+      srtt_ = (7 * srtt_ + rtt) / 8;
+    }
+    rto_ = std::min(std::max(srtt_ + 4 * rttvar_, kRtoMin), kRtoMax);
+  }
+
+  // timer
+  qrpc_time_t SctpEngine::NextDeadline() const {
+    qrpc_time_t next = 0;
+    for (auto t : { t3_at_, sack_at_, reconfig_at_ }) {
+      if (t > 0 && (next == 0 || t < next)) {
+        next = t;
+      }
+    }
+    return next;
+  }
+  void SctpEngine::Schedule(qrpc_time_t at) {
+    if (at == 0 || in_timer_ || closed_) {
+      return; // timer callback returns next deadline by itself
+    }
+    if (alarm_id_ != AlarmProcessor::INVALID_ID) {
+      if (alarm_at_ <= at) {
+        return;
+      }
+      alarm_processor_.Cancel(alarm_id_);
+    }
+    alarm_at_ = at;
+    alarm_id_ = alarm_processor_.Set([this]() {
+      // callbacks may add deadlines. they are covered by the return value, not by another alarm
+      in_timer_ = true;
+      OnTimer(qrpc_time_now());
+      Notify();
+      in_timer_ = false;
+      auto next = closed_ ? 0 : NextDeadline();
+      if (next == 0) {
+        alarm_id_ = AlarmProcessor::INVALID_ID;
+        return qrpc_alarm_stop_rv();
+      }
+      alarm_at_ = next;
+      return next;
+    }, at);
+  }
+  void SctpEngine::OnTimer(qrpc_time_t now) {
+    if (t3_at_ > 0 && t3_at_ <= now) {
+      rto_ = std::min(rto_ * 2, kRtoMax);
+      if (state_ == COOKIE_WAIT || state_ == COOKIE_ECHOED) {
+        // T1-init, T1-cookie
+        if (++init_retransmits_ > kMaxInitRetransmits) {
+          QRPC_LOGJ(error, {{"proto","sctp"},{"ev","association setup timeout"},{"state",state_}});
+          Terminate(true);
+          return;
+        }
+        if (state_ == COOKIE_WAIT) {
+          BuildInit(false, 0, "");
+        } else {
+          SendCookieEcho();
+        }
+        t3_at_ = now + rto_;
+      } else if (state_ == ESTABLISHED) {
+        // T3-rtx (RFC 9260 6.3.3)
+        stats_.t3_expires++;
+        if (++error_count_ > kMaxAssociationRetransmits) {
+          QRPC_LOGJ(error, {{"proto","sctp"},{"ev","peer does not respond"},{"rto",rto_}});
+          Terminate(true);
+          return;
+        }
+        ssthresh_ = std::max(cwnd_ / 2, 4 * kMtu);
+        cwnd_ = kMtu;
+        partial_bytes_acked_ = 0;
+        fast_recovery_ = false;
+        for (auto &c : inflight_) {
+          if (!c.acked && !c.abandoned) {
+            MarkRetransmit(c);
+          }
+        }
+        if (TsnAfter(adv_peer_ack_, cum_ack_)) {
+          forward_tsn_pending_ = true;
+        }
+        t3_at_ = 0;
+        Flush();
+      }
+    }
+    if (sack_at_ > 0 && sack_at_ <= now) {
+      sack_now_ = true;
+      Flush();
+    }
+    if (reconfig_at_ > 0 && reconfig_at_ <= now) {
+      // RFC 6525 5.1.1: give up like T3-rtx, also when peer keeps answering "in progress"
+      if (++reconfig_retransmits_ > kMaxAssociationRetransmits) {
+        QRPC_LOGJ(error, {{"proto","sctp"},{"ev","stream reset request timeout"},{"seq",reconfig_seq_ - 1}});
+        Terminate(true);
+        return;
+      }
+      Flush(); // retransmit reset request
+    }
+  }
+  void SctpEngine::Terminate(bool failed) {
+    if (closed_) {
+      return;
+    }
+    state_ = CLOSED;
+    closed_ = true;
+    closed_pending_ = true;
+    failed_ = failed;
+    t3_at_ = sack_at_ = reconfig_at_ = 0;
+  }
+  void SctpEngine::Notify() {
+    // callbacks may send messages or reset streams, so they are called after all state changes are done
+    if (connected_pending_) {
+      connected_pending_ = false;
+      listener_.OnSctpEngineConnected();
+      if (!out_streams_.empty()) {
+        Flush(); // messages queued before association is established
+        Schedule(NextDeadline());
+      }
+    }
+    if (!deliveries_.empty()) {
+      std::vector<std::pair<uint16_t, InMessage>> deliveries;
+      deliveries.swap(deliveries_);
+      for (auto &d : deliveries) {
+        rx_buffered_ -= d.second.data.size();
+        listener_.OnSctpEngineMessage(d.first, d.second.ppid,
+          reinterpret_cast<const uint8_t *>(d.second.data.data()), d.second.data.size());
+      }
+    }
+    if (!reset_notifications_.empty()) {
+      std::vector<uint16_t> sids;
+      sids.swap(reset_notifications_);
+      for (auto sid : sids) {
+        listener_.OnSctpEngineStreamReset(sid);
+      }
+      Flush(); // send our outgoing reset
+      Schedule(NextDeadline());
+    }
+    if (!buffered_changed_.empty()) {
+      std::set<uint16_t> sids;
+      sids.swap(buffered_changed_);
+      for (auto sid : sids) {
+        listener_.OnSctpEngineBufferedAmount(sid, stream_buffered_amount(sid));
+      }
+    }
+    if (closed_pending_) {
+      closed_pending_ = false;
+      listener_.OnSctpEngineClosed(failed_);
+    }
+  }
+}
+}
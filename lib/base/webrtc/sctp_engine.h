@@ -0,0 +1,274 @@
+#pragma once
+
+#include "base/defs.h"
+#include "base/alarm.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace base {
+namespace webrtc {
+  // single threaded SCTP for WebRTC data channel profile (RFC 8831, RFC 8261), which runs on owner's loop.
+  // packets are carried by DTLS, so there is no multihoming, no address parameter and no chunk authentication.
+  // supports DATA/I-DATA (RFC 8260), SACK, FORWARD-TSN/I-FORWARD-TSN (RFC 3758) and stream reset (RFC 6525).
+  // path liveness is checked by ICE consent, so this does not send HEARTBEAT (but answers peer's one).
+  class SctpEngine {
+  public:
+    static constexpr uint16_t kPort = 5000; // RFC 8841 default sctp-port
+    static constexpr size_t kMtu = 1200; // SCTP packet size, which fits in DTLS record over IPv6 path
+    static constexpr uint32_t kMaxRwnd = 1024 * 1024;
+    static constexpr qrpc_time_t kRtoInitial = 1000 * 1000 * 1000; // 1s
+    static constexpr qrpc_time_t kRtoMin = 200 * 1000 * 1000; // 200ms
+    static constexpr qrpc_time_t kRtoMax = 10ULL * 1000 * 1000 * 1000; // 10s
+    static constexpr qrpc_time_t kDelayedAckTimeout = 200 * 1000 * 1000; // 200ms
+    static constexpr int kMaxInitRetransmits = 8;
+    static constexpr int kMaxAssociationRetransmits = 10;
+    static constexpr int kFastRetransmitThreshold = 3;
+    static constexpr uint16_t kDefaultPriority = 256; // "normal" of RFC 8831 6.4
+    enum State {
+      CLOSED, COOKIE_WAIT, COOKIE_ECHOED, ESTABLISHED,
+    };
+    struct Config {
+      uint16_t os, mis; // number of outgoing/incoming streams
+      size_t send_buffer_size; // max bytes of queued and inflight messages
+      size_t max_message_size;
+    };
+    struct SendOptions {
+      bool ordered{true};
+      int32_t max_retransmits{-1}; // negative means unlimited. 0 means never retransmitted
+      qrpc_time_t lifetime{0}; // 0 means unlimited
+    };
+    // callbacks are called after incoming packet or timer is processed. engine must not be destroyed in them
+    class Listener {
+    public:
+      virtual ~Listener() {}
+      virtual void OnSctpEngineSendPacket(const uint8_t *p, size_t sz) = 0;
+      virtual void OnSctpEngineConnected() = 0;
+      // failed is true if peer does not respond, false if peer aborts or shuts down association
+      virtual void OnSctpEngineClosed(bool failed) = 0;
+      virtual void OnSctpEngineMessage(uint16_t sid, uint32_t ppid, const uint8_t *p, size_t sz) = 0;
+      // peer reset its outgoing stream (closed data channel). our outgoing stream is also reset (RFC 8831 6.7)
+      virtual void OnSctpEngineStreamReset(uint16_t sid) = 0;
+      // buffered amount of outgoing stream decreased by acknowledgement or abandonment
+      virtual void OnSctpEngineBufferedAmount(uint16_t sid, size_t amount) = 0;
+    };
+    struct Stats {
+      uint64_t tx_packets{0}, rx_packets{0}, tx_chunks{0}, rx_chunks{0};
+      uint64_t retransmits{0}, fast_retransmits{0}, t3_expires{0}, abandoned{0}, duplicates{0};
+      uint64_t checksum_errors{0};
+    };
+  public:
+    SctpEngine(Listener &l, AlarmProcessor &ap, const Config &c);
+    ~SctpEngine();
+    inline State state() const { return state_; }
+    inline bool established() const { return state_ == ESTABLISHED; }
+    inline size_t buffered_amount() const { return buffered_; }
+    inline size_t stream_buffered_amount(uint16_t sid) const {
+      auto it = out_streams_.find(sid);
+      return it != out_streams_.end() ? it->second.buffered : 0;
+    }
+    // bytes received but not yet given to listener (fragments, and messages waiting for former ones)
+    inline size_t received_amount() const { return rx_buffered_; }
+    inline bool idata() const { return idata_; }
+    inline const Stats &stats() const { return stats_; }
+    // DTLS is connected. send INIT (both side do it, collision is resolved as RFC 9260 5.2.1)
+    void Connect();
+    // send ABORT and stop all timers
+    void Close();
+    void Receive(const uint8_t *p, size_t sz);
+    int Send(uint16_t sid, uint32_t ppid, const uint8_t *p, size_t sz, const SendOptions &o);
+    // reset outgoing stream after all queued messages of it are sent
+    void ResetStream(uint16_t sid);
+    // streams with higher priority are sent first. streams with same priority share bandwidth by weight
+    void SetStreamPriority(uint16_t sid, uint16_t priority, uint16_t weight);
+  protected:
+    static constexpr uint64_t kWeightScale = 1 << 16;
+    static constexpr uint8_t FLAG_END = 0x01, FLAG_BEGIN = 0x02, FLAG_UNORDERED = 0x04, FLAG_IMMEDIATE = 0x08;
+    struct TsnLess {
+      inline bool operator()(uint32_t a, uint32_t b) const { return (int32_t)(a - b) < 0; }
+    };
+    struct OutMessage {
+      uint64_t id;
+      uint32_t ppid;
+      std::string data;
+      size_t offset{0}; // bytes already fragmented into chunks
+      uint32_t ssn{0}; // SSN (DATA) or MID (I-DATA), assigned when first fragment is sent
+      uint32_t fsn{0};
+      bool ordered;
+      int32_t max_retransmits;
+      qrpc_time_t expire_at;
+    };
+    struct OutStream {
+      std::deque<OutMessage> queue;
+      size_t buffered{0}; // bytes of queued and unacknowledged messages
+      uint16_t priority{kDefaultPriority}, weight{1};
+      uint64_t vtime{0}; // virtual time of weighted fair queueing, which advances by sent bytes / weight
+      uint16_t next_ssn{0};
+      uint32_t next_mid{0}, next_umid{0};
+      bool reset_requested{false};
+      bool closing{false}; // we reset it first, so peer's reset is an answer
+    };
+    struct Chunk {
+      uint32_t tsn;
+      uint16_t sid;
+      uint32_t ssn; // SSN or MID
+      uint32_t fsn;
+      uint32_t ppid;
+      uint8_t flags;
+      std::string payload;
+      uint64_t message_id;
+      int32_t max_retransmits;
+      qrpc_time_t expire_at;
+      qrpc_time_t sent_at{0};
+      uint16_t transmissions{0};
+      uint8_t misses{0};
+      bool acked{false}, retransmit{false}, fast_retransmitted{false}, abandoned{false};
+    };
+    struct Fragment {
+      uint16_t sid;
+      uint32_t ssn; // SSN or MID
+      uint32_t fsn; // FSN of I-DATA
+      uint32_t ppid;
+      uint8_t flags;
+      std::string payload;
+    };
+    struct InMessage {
+      uint32_t ppid;
+      std::string data;
+    };
+    struct InStream {
+      uint32_t next_ssn{0}; // next SSN (or MID) to deliver
+      std::map<uint32_t, InMessage, TsnLess> ordered; // reassembled but waiting for former messages
+      // I-DATA fragments of each message. key is MID
+      std::map<uint32_t, std::map<uint32_t, Fragment>, TsnLess> ifrags, iufrags;
+    };
+    struct ResetRequest {
+      uint32_t seq;
+      uint32_t last_tsn;
+      std::vector<uint16_t> sids;
+    };
+  protected:
+    // receive
+    bool HandleChunk(uint8_t type, uint8_t flags, const uint8_t *p, size_t sz);
+    void HandleInit(const uint8_t *p, size_t sz);
+    void HandleInitAck(const uint8_t *p, size_t sz);
+    void HandleCookieEcho(const uint8_t *p, size_t sz);
+    void HandleData(uint8_t flags, const uint8_t *p, size_t sz, bool idata);
+    void HandleSack(const uint8_t *p, size_t sz);
+    void HandleForwardTsn(const uint8_t *p, size_t sz, bool iforward);
+    void HandleReconfig(const uint8_t *p, size_t sz);
+    void HandleIncomingReset(uint32_t seq, uint32_t last_tsn, const std::vector<uint16_t> &sids);
+    // returns CAP_* bits of peer. cookie is stored if given and found
+    uint8_t ParseParams(const uint8_t *p, size_t sz, std::string *cookie);
+    void Establish();
+    bool Received(uint32_t tsn);
+    void AdvanceCumTsn();
+    void Reassemble(Fragment &&f, uint32_t tsn);
+    uint32_t Unwrap(const InStream &s, uint32_t ssn) const;
+    void Deliver(uint16_t sid, bool ordered, uint32_t ssn, InMessage &&m);
+    void DeliverOrdered(uint16_t sid, InStream &s);
+    void SkipTo(uint16_t sid, bool unordered, uint32_t ssn);
+    void ApplyIncomingReset();
+    // send
+    void Flush();
+    void BeginPacket(uint32_t vtag);
+    // packet being built is sent and new one is started if the chunk does not fit
+    void AppendChunk(uint8_t type, uint8_t flags, const uint8_t *h, size_t hsz,
+      const uint8_t *p = nullptr, size_t psz = 0);
+    void AppendData(const Chunk &c);
+    void SendPacket();
+    void BuildInit(bool ack, uint32_t vtag, const std::string &cookie);
+    void SendCookieEcho();
+    void BuildSack();
+    void BuildForwardTsn();
+    void BuildReconfig(bool send_request);
+    bool StartReset();
+    OutStream *NextStream(uint16_t &sid);
+    bool NextChunk(Chunk &c);
+    // chunk is counted in flight size
+    inline bool Counted(const Chunk &c) const { return !c.acked && !c.retransmit && !c.abandoned; }
+    bool Abandonable(const Chunk &c, qrpc_time_t now) const;
+    void MarkRetransmit(Chunk &c);
+    // bytes of the stream are acknowledged or abandoned
+    void Release(uint16_t sid, size_t sz);
+    bool HasRetransmit() const;
+    void AbandonMessage(uint64_t message_id);
+    void AdvancePeerAckPoint();
+    void UpdateRto(qrpc_time_t rtt);
+    // timer
+    qrpc_time_t NextDeadline() const;
+    void Schedule(qrpc_time_t at);
+    void OnTimer(qrpc_time_t now);
+    void Terminate(bool failed);
+    // call listener for events recorded during processing
+    void Notify();
+  protected:
+    Listener &listener_;
+    AlarmProcessor &alarm_processor_;
+    Config config_;
+    State state_{CLOSED};
+    Stats stats_;
+    bool closed_{false}, failed_{false};
+    bool connected_pending_{false}, closed_pending_{false};
+    std::set<uint16_t> buffered_changed_; // streams whose buffered amount decreased
+    // association
+    uint32_t my_tag_, peer_tag_{0};
+    uint32_t my_initial_tsn_, peer_initial_tsn_{0};
+    uint16_t peer_os_{0}, peer_mis_{0};
+    uint8_t peer_caps_{0};
+    bool idata_{false};
+    std::string cookie_; // cookie to echo
+    int init_retransmits_{0}, error_count_{0};
+    bool cookie_ack_pending_{false};
+    std::vector<std::string> heartbeat_acks_;
+    // send side
+    std::map<uint16_t, OutStream> out_streams_;
+    int32_t partial_sid_{-1}; // stream whose message is partially sent with DATA
+    uint64_t vclock_{0}; // virtual time of the last scheduled stream
+    uint64_t next_message_id_{0};
+    uint32_t next_tsn_;
+    uint32_t cum_ack_; // last TSN acked cumulatively by peer
+    uint32_t adv_peer_ack_; // Advanced.Peer.Ack.Point (RFC 3758)
+    std::deque<Chunk> inflight_; // TSN cum_ack_ + 1 ...
+    size_t buffered_{0}, flight_size_{0};
+    size_t cwnd_, ssthresh_, partial_bytes_acked_{0};
+    uint32_t peer_rwnd_{kMaxRwnd};
+    bool fast_recovery_{false}, fast_retransmit_now_{false};
+    uint32_t fast_recovery_exit_{0};
+    qrpc_time_t srtt_{0}, rttvar_{0}, rto_{kRtoInitial};
+    qrpc_time_t t3_at_{0}; // retransmission timer (T1 during association setup)
+    bool forward_tsn_pending_{false};
+    // stream reset
+    std::vector<uint16_t> reset_pending_; // outgoing streams to be reset
+    std::unique_ptr<ResetRequest> reset_inflight_;
+    uint32_t reconfig_seq_;
+    qrpc_time_t reconfig_at_{0};
+    int reconfig_retransmits_{0};
+    std::unique_ptr<ResetRequest> incoming_reset_; // waiting for cumulative TSN to reach last_tsn
+    uint32_t peer_reconfig_seq_{0};
+    bool peer_reconfig_seen_{false};
+    std::vector<std::pair<uint32_t, uint32_t>> reconfig_responses_; // request seq, result
+    // receive side
+    uint32_t peer_cum_tsn_{0};
+    std::map<uint32_t, bool, TsnLess> received_; // TSNs above peer_cum_tsn_ (for gap ack blocks)
+    std::map<uint32_t, Fragment, TsnLess> frags_; // DATA fragments by TSN
+    std::map<uint16_t, InStream> in_streams_;
+    std::vector<uint32_t> duplicates_;
+    std::vector<std::pair<uint16_t, InMessage>> deliveries_; // delivered after whole packet is processed
+    std::vector<uint16_t> reset_notifications_;
+    size_t rx_buffered_{0}; // charged for every chunk until its message is delivered or dropped
+    int unacked_packets_{0};
+    bool sack_now_{false};
+    qrpc_time_t sack_at_{0};
+    // outgoing packet being built
+    std::vector<uint8_t> packet_;
+    AlarmProcessor::Id alarm_id_{AlarmProcessor::INVALID_ID};
+    qrpc_time_t alarm_at_{0};
+    bool in_timer_{false};
+  };
+}
+}
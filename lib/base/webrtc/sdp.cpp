@@ -311,6 +311,8 @@ a=msid-semantic: WMS
       if (!params.Parse(section, cap, errmsg, rid_scalability_mode_map)) { // mid is overwritten by value from peer
         return false;
       }
+      // accept CCFB only if we are configured to send it
+      params.ccfb = params.ccfb && c.GetRtpConfig().ccfb;
       auto pit = mid_path_map.find(params.mid); // mid_path_map is also from peer, so can find element by peer mid
       if (pit == mid_path_map.end()) {
         errmsg = "find label from mid = " + params.mid;
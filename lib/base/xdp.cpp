@@ -0,0 +1,437 @@
+#include "base/xdp.h"
+#include "base/memory.h"
+
+#if defined(OS_LINUX)
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(OS_LINUX) && defined(XDP_USE_NEED_WAKEUP) && defined(__NR_bpf)
+#define __QRPC_USE_XDP__
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#endif
+
+#include <map>
+#include <mutex>
+
+namespace base {
+#if defined(__QRPC_USE_XDP__)
+  static constexpr size_t kEthHeaderSize = 14;
+  static constexpr size_t kIpv4HeaderSize = 20; // XDP program only redirects packets without IP options
+  static constexpr size_t kUdpHeaderSize = 8;
+  static constexpr size_t kHeaderSize = kEthHeaderSize + kIpv4HeaderSize + kUdpHeaderSize;
+
+  static inline int Bpf(int cmd, union bpf_attr &attr) {
+    return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+  }
+  // bpf instruction builders. linux/filter.h that provides macros for them is not exported to userspace
+  static inline struct bpf_insn Insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    struct bpf_insn i;
+    i.code = code;
+    i.dst_reg = dst;
+    i.src_reg = src;
+    i.off = off;
+    i.imm = imm;
+    return i;
+  }
+  static inline struct bpf_insn LdxMem(uint8_t size, uint8_t dst, uint8_t src, int16_t off) {
+    return Insn(BPF_LDX | BPF_MEM | size, dst, src, off, 0);
+  }
+  static inline struct bpf_insn Alu64Imm(uint8_t op, uint8_t dst, int32_t imm) {
+    return Insn(BPF_ALU64 | op | BPF_K, dst, 0, 0, imm);
+  }
+  static inline struct bpf_insn MovReg(uint8_t dst, uint8_t src) {
+    return Insn(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0);
+  }
+  // ones' complement sum of 16 bit big endian words
+  static inline uint32_t Sum16(const uint8_t *p, size_t len, uint32_t sum) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+      sum += (p[i] << 8) | p[i + 1];
+    }
+    if ((len % 2) != 0) {
+      sum += p[len - 1] << 8;
+    }
+    return sum;
+  }
+  static bool ValidUdpChecksum(const uint8_t *ip, const uint8_t *udp, uint16_t ulen) {
+    if (udp[6] == 0 && udp[7] == 0) {
+      return true; // checksum is optional for IPv4
+    }
+    // pseudo header (source and destination address, protocol, UDP length) and UDP header and payload
+    auto sum = Sum16(ip + 12, 8, IPPROTO_UDP + ulen);
+    sum = Sum16(udp, ulen, sum);
+    while ((sum >> 16) != 0) {
+      sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return sum == 0xFFFF;
+  }
+  // IPv4 addresses of the interface, in network byte order
+  static std::vector<uint32_t> InterfaceAddresses(const std::string &ifname) {
+    std::vector<uint32_t> addrs;
+    struct ifaddrs *ifa;
+    if (getifaddrs(&ifa) != 0) {
+      return addrs;
+    }
+    for (auto i = ifa; i != nullptr; i = i->ifa_next) {
+      if (i->ifa_addr != nullptr && i->ifa_addr->sa_family == AF_INET && ifname == i->ifa_name) {
+        addrs.push_back(reinterpret_cast<struct sockaddr_in *>(i->ifa_addr)->sin_addr.s_addr);
+      }
+    }
+    freeifaddrs(ifa);
+    return addrs;
+  }
+  // programs are attached per (ifindex, port), and shared by listeners of worker threads
+  static std::mutex g_programs_mutex;
+  static std::map<std::pair<int, int>, std::weak_ptr<void>> g_programs;
+
+  int XdpSocket::Open(const Config &c, int port) {
+    int ifindex = if_nametoindex(c.ifname.c_str());
+    if (ifindex == 0) {
+      logger::error({{"ev","XdpSocket: interface not found"},{"ifname",c.ifname},{"errno",Syscall::Errno()}});
+      return QRPC_EINVAL;
+    }
+    if ((fd_ = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0)) < 0) {
+      logger::warn({{"ev","XdpSocket: AF_XDP not supported"},{"errno",Syscall::Errno()}});
+      return QRPC_ENOTSUPPORT;
+    }
+    int r;
+    if ((r = SetupUmem(c.frame_count)) < 0 || (r = AttachProgram(ifindex, c, port)) < 0) {
+      Close();
+      return r;
+    }
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = queue_id_;
+    // generic XDP cannot do zero copy
+    sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | (skb_mode_ ? XDP_COPY : 0);
+    if (bind(fd_, reinterpret_cast<struct sockaddr *>(&sxdp), sizeof(sxdp)) < 0) {
+      logger::warn({{"ev","XdpSocket: bind fails"},{"ifname",c.ifname},{"queue",queue_id_},{"errno",Syscall::Errno()}});
+      Close();
+      return QRPC_ENOTSUPPORT;
+    }
+    // registering socket to xskmap starts redirection. until then, packets are passed to kernel.
+    // closing the socket removes it from xskmap
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    uint32_t key = queue_id_, value = fd_;
+    attr.map_fd = program_->map_fd;
+    attr.key = reinterpret_cast<uint64_t>(&key);
+    attr.value = reinterpret_cast<uint64_t>(&value);
+    if (Bpf(BPF_MAP_UPDATE_ELEM, attr) < 0) {
+      logger::error({{"ev","XdpSocket: fail to update xskmap"},{"errno",Syscall::Errno()}});
+      Close();
+      return QRPC_ESYSCALL;
+    }
+    logger::info({{"ev","XdpSocket opened"},{"ifname",c.ifname},{"queue",queue_id_},{"port",port},
+      {"mode",skb_mode_ ? "skb" : "drv"},{"frames",c.frame_count}});
+    return QRPC_OK;
+  }
+
+  void XdpSocket::Close() {
+    for (auto r : {&rx_, &fill_, &comp_}) {
+      if (r->map != nullptr) {
+        munmap(r->map, r->map_size);
+        *r = Ring();
+      }
+    }
+    if (fd_ != INVALID_FD) {
+      ::close(fd_);
+      fd_ = INVALID_FD;
+    }
+    // after the socket is closed, so that the program never redirects to it
+    DetachProgram();
+    if (umem_ != nullptr) {
+      HugePageFree(umem_, umem_size_);
+      umem_ = nullptr;
+    }
+    free_frames_.clear();
+  }
+
+  int XdpSocket::AttachProgram(int ifindex, const Config &c, int port) {
+    std::lock_guard<std::mutex> lock(g_programs_mutex);
+    auto &slot = g_programs[std::make_pair(ifindex, port)];
+    auto program = std::static_pointer_cast<Program>(slot.lock());
+    if (program == nullptr) {
+      auto addrs = InterfaceAddresses(c.ifname);
+      if (addrs.empty()) {
+        logger::warn({{"ev","XdpSocket: interface has no IPv4 address"},{"ifname",c.ifname}});
+        return QRPC_ENOTSUPPORT;
+      }
+      program = std::make_shared<Program>();
+      int r;
+      if ((r = program->Load(ifindex, port, addrs, c.skb_mode)) < 0) {
+        return r;
+      }
+      slot = program;
+    }
+    auto queue_id = c.queue_id;
+    if (queue_id < 0) {
+      for (queue_id = 0; program->queues.find(queue_id) != program->queues.end(); queue_id++) {}
+    }
+    if (queue_id >= kMaxQueues || program->queues.find(queue_id) != program->queues.end()) {
+      logger::error({{"ev","XdpSocket: queue is not available"},{"ifname",c.ifname},{"queue",queue_id},
+        {"max",kMaxQueues}});
+      return QRPC_EINVAL;
+    }
+    program->queues.insert(queue_id);
+    program_ = program;
+    queue_id_ = queue_id;
+    skb_mode_ = program->skb_mode;
+    return QRPC_OK;
+  }
+
+  void XdpSocket::DetachProgram() {
+    if (program_ == nullptr) {
+      return;
+    }
+    // release under the lock, so that next AttachProgram does not try to attach again before the last one detaches
+    std::lock_guard<std::mutex> lock(g_programs_mutex);
+    program_->queues.erase(queue_id_);
+    program_.reset();
+    queue_id_ = -1;
+  }
+
+  int XdpSocket::Read(int max, const Handler &h) {
+    auto cons = *rx_.consumer;
+    auto avail = __atomic_load_n(rx_.producer, __ATOMIC_ACQUIRE) - cons;
+    int n = std::min<uint32_t>(avail, max);
+    auto descs = reinterpret_cast<const struct xdp_desc *>(rx_.ring);
+    for (int i = 0; i < n; i++) {
+      auto &d = descs[(cons + i) & rx_.mask];
+      auto p = reinterpret_cast<const uint8_t *>(umem_) + d.addr;
+      free_frames_.push_back(d.addr & ~((uint64_t)kFrameSize - 1));
+      if (d.len < kHeaderSize) {
+        continue;
+      }
+      auto ip = p + kEthHeaderSize;
+      auto udp = ip + kIpv4HeaderSize;
+      uint16_t tot_len = (ip[2] << 8) | ip[3], ulen = (udp[4] << 8) | udp[5];
+      if (ulen < kUdpHeaderSize || (kIpv4HeaderSize + ulen) > tot_len || (kEthHeaderSize + tot_len) > d.len) {
+        continue;
+      }
+      if (!ValidUdpChecksum(ip, udp, ulen)) {
+        checksum_errors_++;
+        continue;
+      }
+      struct sockaddr_in sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sin_family = AF_INET;
+      memcpy(&sa.sin_addr, ip + 12, sizeof(sa.sin_addr));
+      memcpy(&sa.sin_port, udp, sizeof(sa.sin_port));
+      h(Address(&sa, sizeof(sa)), reinterpret_cast<const char *>(udp + kUdpHeaderSize), ulen - kUdpHeaderSize,
+        ip[1] & 0x3);
+    }
+    __atomic_store_n(rx_.consumer, cons + n, __ATOMIC_RELEASE);
+    Refill();
+    return n;
+  }
+
+  int XdpSocket::SetupUmem(uint32_t frame_count) {
+    ASSERT((frame_count & (frame_count - 1)) == 0);
+    size_t len = (size_t)frame_count * kFrameSize;
+    umem_ = HugePageAlloc(len, umem_size_);
+    struct xdp_umem_reg mr;
+    memset(&mr, 0, sizeof(mr));
+    mr.addr = reinterpret_cast<uint64_t>(umem_);
+    mr.len = len;
+    mr.chunk_size = kFrameSize;
+    mr.headroom = 0;
+    if (setsockopt(fd_, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0) {
+      logger::warn({{"ev","XdpSocket: fail to register umem"},{"len",len},{"errno",Syscall::Errno()}});
+      return QRPC_ENOTSUPPORT;
+    }
+    // tx ring is not used, but kernel requires completion ring for each umem
+    if (setsockopt(fd_, SOL_XDP, XDP_UMEM_FILL_RING, &frame_count, sizeof(frame_count)) < 0 ||
+      setsockopt(fd_, SOL_XDP, XDP_UMEM_COMPLETION_RING, &frame_count, sizeof(frame_count)) < 0 ||
+      setsockopt(fd_, SOL_XDP, XDP_RX_RING, &frame_count, sizeof(frame_count)) < 0) {
+      logger::error({{"ev","XdpSocket: fail to set ring size"},{"size",frame_count},{"errno",Syscall::Errno()}});
+      return QRPC_ESYSCALL;
+    }
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(fd_, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+      logger::error({{"ev","XdpSocket: fail to get ring offsets"},{"errno",Syscall::Errno()}});
+      return QRPC_ESYSCALL;
+    }
+    int r;
+    if ((r = MapRing(fill_, XDP_UMEM_PGOFF_FILL_RING, off.fr.desc, off.fr.producer, off.fr.consumer, off.fr.flags,
+      sizeof(uint64_t), frame_count)) < 0 ||
+      (r = MapRing(comp_, XDP_UMEM_PGOFF_COMPLETION_RING, off.cr.desc, off.cr.producer, off.cr.consumer, off.cr.flags,
+      sizeof(uint64_t), frame_count)) < 0 ||
+      (r = MapRing(rx_, XDP_PGOFF_RX_RING, off.rx.desc, off.rx.producer, off.rx.consumer, off.rx.flags,
+      sizeof(struct xdp_desc), frame_count)) < 0) {
+      return r;
+    }
+    // fill ring has room for all frames, so that kernel can use all of them for received packets
+    free_frames_.reserve(frame_count);
+    for (uint32_t i = 0; i < frame_count; i++) {
+      free_frames_.push_back((uint64_t)i * kFrameSize);
+    }
+    Refill();
+    return QRPC_OK;
+  }
+
+  int XdpSocket::MapRing(Ring &r, uint64_t pgoff, size_t desc_off, size_t prod_off, size_t cons_off, size_t flags_off,
+    size_t desc_size, uint32_t size) {
+    r.map_size = desc_off + desc_size * size;
+    r.map = mmap(nullptr, r.map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, pgoff);
+    if (r.map == MAP_FAILED) {
+      logger::error({{"ev","XdpSocket: fail to map ring"},{"pgoff",pgoff},{"errno",Syscall::Errno()}});
+      r.map = nullptr;
+      return QRPC_ESYSCALL;
+    }
+    auto base = reinterpret_cast<uint8_t *>(r.map);
+    r.producer = reinterpret_cast<uint32_t *>(base + prod_off);
+    r.consumer = reinterpret_cast<uint32_t *>(base + cons_off);
+    r.flags = reinterpret_cast<uint32_t *>(base + flags_off);
+    r.ring = base + desc_off;
+    r.size = size;
+    r.mask = size - 1;
+    return QRPC_OK;
+  }
+
+  XdpSocket::Program::~Program() {
+    // closing link detaches XDP program from interface
+    for (auto pfd : {&link_fd, &prog_fd, &map_fd}) {
+      if (*pfd >= 0) {
+        ::close(*pfd);
+        *pfd = -1;
+      }
+    }
+  }
+
+  int XdpSocket::Program::Load(int ifindex, int port, const std::vector<uint32_t> &addrs, bool skb) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = kMaxQueues;
+    if ((map_fd = Bpf(BPF_MAP_CREATE, attr)) < 0) {
+      logger::warn({{"ev","XdpSocket: fail to create xskmap"},{"errno",Syscall::Errno()}});
+      return QRPC_ENOTSUPPORT;
+    }
+    // if (ipv4 udp without options and fragments, destined to port and one of addrs)
+    //   return bpf_redirect_map(xskmap, rx_queue, XDP_PASS)
+    // else return XDP_PASS
+    std::vector<struct bpf_insn> prog;
+    std::vector<size_t> jumps_to_pass, jumps_to_redirect;
+    auto jne = [&prog, &jumps_to_pass](uint8_t reg, int32_t imm) {
+      jumps_to_pass.push_back(prog.size());
+      prog.push_back(Insn(BPF_JMP | BPF_JNE | BPF_K, reg, 0, 0, imm));
+    };
+    prog.push_back(MovReg(BPF_REG_6, BPF_REG_1));
+    prog.push_back(LdxMem(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data)));
+    prog.push_back(LdxMem(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end)));
+    prog.push_back(MovReg(BPF_REG_4, BPF_REG_2));
+    prog.push_back(Alu64Imm(BPF_ADD, BPF_REG_4, kHeaderSize));
+    jumps_to_pass.push_back(prog.size());
+    prog.push_back(Insn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0));
+    // loaded values are in network byte order, so compare them with htons-ed constants
+    prog.push_back(LdxMem(BPF_H, BPF_REG_5, BPF_REG_2, 12)); // ethertype
+    jne(BPF_REG_5, htons(0x0800));
+    prog.push_back(LdxMem(BPF_B, BPF_REG_5, BPF_REG_2, kEthHeaderSize)); // version and ihl
+    jne(BPF_REG_5, 0x45);
+    prog.push_back(LdxMem(BPF_B, BPF_REG_5, BPF_REG_2, kEthHeaderSize + 9)); // protocol
+    jne(BPF_REG_5, IPPROTO_UDP);
+    prog.push_back(LdxMem(BPF_H, BPF_REG_5, BPF_REG_2, kEthHeaderSize + 6)); // flags and fragment offset
+    prog.push_back(Alu64Imm(BPF_AND, BPF_REG_5, htons(0x3FFF)));
+    jne(BPF_REG_5, 0);
+    prog.push_back(LdxMem(BPF_H, BPF_REG_5, BPF_REG_2, kEthHeaderSize + kIpv4HeaderSize + 2)); // dst port
+    jne(BPF_REG_5, htons(port));
+    // other destination (eg. forwarded packets, or other listener bound to the same port on other interface)
+    // should go through kernel. compared as 32 bit, because immediate is sign extended for 64 bit comparison
+    prog.push_back(LdxMem(BPF_W, BPF_REG_5, BPF_REG_2, kEthHeaderSize + 16)); // dst address
+    for (auto a : addrs) {
+      jumps_to_redirect.push_back(prog.size());
+      prog.push_back(Insn(BPF_JMP32 | BPF_JEQ | BPF_K, BPF_REG_5, 0, 0, static_cast<int32_t>(a)));
+    }
+    jumps_to_pass.push_back(prog.size());
+    prog.push_back(Insn(BPF_JMP | BPF_JA, 0, 0, 0, 0));
+    auto redirect = prog.size();
+    prog.push_back(LdxMem(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index)));
+    prog.push_back(Insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd));
+    prog.push_back(Insn(0, 0, 0, 0, 0));
+    // lower bits of flags are returned when no socket is registered for the queue
+    prog.push_back(Alu64Imm(BPF_MOV, BPF_REG_3, XDP_PASS));
+    prog.push_back(Insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    prog.push_back(Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    auto pass = prog.size();
+    prog.push_back(Alu64Imm(BPF_MOV, BPF_REG_0, XDP_PASS));
+    prog.push_back(Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    for (auto idx : jumps_to_pass) {
+      prog[idx].off = pass - (idx + 1);
+    }
+    for (auto idx : jumps_to_redirect) {
+      prog[idx].off = redirect - (idx + 1);
+    }
+    static const char license[] = "Dual MIT/GPL";
+    char log[4096] = {0};
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = reinterpret_cast<uint64_t>(prog.data());
+    attr.insn_cnt = prog.size();
+    attr.license = reinterpret_cast<uint64_t>(license);
+    attr.log_buf = reinterpret_cast<uint64_t>(log);
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    if ((prog_fd = Bpf(BPF_PROG_LOAD, attr)) < 0) {
+      logger::warn({{"ev","XdpSocket: fail to load program"},{"errno",Syscall::Errno()},{"log",log}});
+      return QRPC_ENOTSUPPORT;
+    }
+    // try native mode first, because it is much faster than generic (skb) mode if driver supports it
+    for (auto flags : {XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE}) {
+      if (skb && flags != XDP_FLAGS_SKB_MODE) {
+        continue;
+      }
+      memset(&attr, 0, sizeof(attr));
+      attr.link_create.prog_fd = prog_fd;
+      attr.link_create.target_ifindex = ifindex;
+      attr.link_create.attach_type = BPF_XDP;
+      attr.link_create.flags = flags;
+      if ((link_fd = Bpf(BPF_LINK_CREATE, attr)) >= 0) {
+        skb_mode = (flags == XDP_FLAGS_SKB_MODE);
+        return QRPC_OK;
+      }
+    }
+    logger::warn({{"ev","XdpSocket: fail to attach program"},{"ifindex",ifindex},{"errno",Syscall::Errno()}});
+    return QRPC_ENOTSUPPORT;
+  }
+
+  void XdpSocket::Refill() {
+    auto prod = *fill_.producer;
+    auto space = fill_.size - (prod - __atomic_load_n(fill_.consumer, __ATOMIC_ACQUIRE));
+    auto n = std::min<size_t>(space, free_frames_.size());
+    auto addrs = reinterpret_cast<uint64_t *>(fill_.ring);
+    for (size_t i = 0; i < n; i++) {
+      addrs[(prod + i) & fill_.mask] = free_frames_.back();
+      free_frames_.pop_back();
+    }
+    __atomic_store_n(fill_.producer, prod + n, __ATOMIC_RELEASE);
+    if (n > 0 && (__atomic_load_n(fill_.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)) {
+      // driver waits for this to resume receiving with new frames
+      recvfrom(fd_, nullptr, 0, MSG_DONTWAIT, nullptr, nullptr);
+    }
+  }
+#else
+  int XdpSocket::Open(const Config &c, int port) {
+    logger::warn({{"ev","XdpSocket: AF_XDP not supported on this platform"}});
+    return QRPC_ENOTSUPPORT;
+  }
+  void XdpSocket::Close() {}
+  int XdpSocket::Read(int max, const Handler &h) { return 0; }
+#endif
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "base/defs.h"
+#include "base/address.h"
+#include "base/syscall.h"
+
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace base {
+  // AF_XDP socket which receives UDP packets for one port directly from NIC queue, bypassing kernel network stack.
+  // XDP program redirects IPv4 UDP packets destined to the port and IPv4 addresses of the interface into UMEM frames,
+  // and passes every other packet (including packets of the port that arrive at NIC queues without XDP socket)
+  // to kernel as usual. the program is attached once per interface and port, and shared by sockets of every queue.
+  // only receive side is implemented. packets are sent with normal UDP socket bound to the same port,
+  // which needs neither neighbor resolution nor routing in userspace.
+  class XdpSocket {
+  public:
+    static constexpr uint32_t kDefaultFrameCount = 4096;
+    static constexpr uint32_t kFrameSize = 2048; // XDP_UMEM_MIN_CHUNK_SIZE
+    static constexpr int kMaxQueues = 64; // size of xskmap
+    struct Config {
+      std::string ifname;
+      // NIC queue to receive. -1 takes the lowest queue which no other socket of the same interface and port uses,
+      // that is, the index of the worker when each worker thread opens one listener.
+      int queue_id{-1};
+      uint32_t frame_count{kDefaultFrameCount}; // should be power of 2
+      // attach XDP program in generic (skb) mode. works with any NIC (including veth) but copies each packet.
+      // if false, native (driver) mode is tried first, then generic mode.
+      bool skb_mode{false};
+    };
+    // payload of UDP datagram, which is valid only during the callback
+    typedef std::function<void (const Address &a, const char *p, size_t sz, uint8_t ecn)> Handler;
+  public:
+    XdpSocket() {}
+    ~XdpSocket() { Close(); }
+    DISALLOW_COPY_AND_ASSIGN(XdpSocket);
+    inline Fd fd() const { return fd_; }
+    inline bool skb_mode() const { return skb_mode_; }
+    inline int queue_id() const { return queue_id_; }
+    // packets dropped because of broken UDP checksum. kernel has not verified them, because they bypass its stack
+    inline uint64_t checksum_errors() const { return checksum_errors_; }
+    // returns QRPC_ENOTSUPPORT if kernel or NIC does not support AF_XDP. caller should fallback to socket path
+    int Open(const Config &c, int port);
+    void Close();
+    // process at most max packets received. returns number of packets processed
+    int Read(int max, const Handler &h);
+  protected:
+    struct Ring {
+      uint32_t *producer{nullptr}, *consumer{nullptr}, *flags{nullptr};
+      void *ring{nullptr};
+      void *map{nullptr};
+      size_t map_size{0};
+      uint32_t size{0}, mask{0};
+    };
+    int SetupUmem(uint32_t frame_count);
+    int MapRing(Ring &r, uint64_t pgoff, size_t desc_off, size_t prod_off, size_t cons_off, size_t flags_off,
+      size_t desc_size, uint32_t size);
+    void Refill();
+  protected:
+    // XDP program and xskmap shared by sockets of the same interface and port
+    struct Program {
+      int map_fd{-1}, prog_fd{-1}, link_fd{-1};
+      bool skb_mode{false};
+      std::set<int> queues; // queues which have socket
+      ~Program();
+      int Load(int ifindex, int port, const std::vector<uint32_t> &addrs, bool skb_mode);
+    };
+    // returns shared program for the interface and port, and reserves queue_id_ in it
+    int AttachProgram(int ifindex, const Config &c, int port);
+    void DetachProgram();
+  protected:
+    Fd fd_{INVALID_FD};
+    std::shared_ptr<Program> program_;
+    int queue_id_{-1};
+    bool skb_mode_{false};
+    uint64_t checksum_errors_{0};
+    void *umem_{nullptr};
+    size_t umem_size_{0};
+    Ring rx_, fill_, comp_;
+    std::vector<uint64_t> free_frames_; // frames which are not in fill ring yet
+  };
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "base/defs.h"
+#include "base/syscall.h"
+
+#include <deque>
+#include <functional>
+
+namespace base {
+  // tracks buffers sent with MSG_ZEROCOPY until kernel reports their completion on socket error queue.
+  // completions of TCP are reported in order (and squashed into ranges), so pending buffers form a FIFO.
+  class ZeroCopyTracker {
+  public:
+    // called when kernel no longer refers the buffer, so that caller can free or reuse it
+    typedef std::function<void ()> Release;
+    struct Stats {
+      uint64_t sends{0}; // number of zerocopy send syscalls
+      uint64_t completions{0}; // number of released buffers
+      uint64_t copied{0}; // completions which kernel had to copy anyway
+    };
+  public:
+    ZeroCopyTracker() {}
+    ~ZeroCopyTracker() { ReleaseAll(); }
+    DISALLOW_COPY_AND_ASSIGN(ZeroCopyTracker);
+    inline const Stats &stats() const { return stats_; }
+    inline size_t pending() const { return pending_.size(); }
+    // kernel copied last completed send (eg. over loopback). zerocopy only costs extra in that case
+    inline bool copying() const { return copying_; }
+    // send as much of p as socket buffer accepts, like Syscall::Write. release is called after kernel completes
+    // all of the sent part, or immediately if nothing is sent. caller should keep p unchanged until then.
+    int Send(Fd fd, const char *p, size_t sz, Release &&release) {
+      size_t sent = 0;
+      while (sent < sz) {
+        int r = Syscall::SendZeroCopy(fd, p + sent, sz - sent);
+        if (r <= 0) {
+          if (sent == 0) {
+            release();
+            return r;
+          }
+          break;
+        }
+        // kernel numbers only sends which actually queue data
+        next_id_++;
+        stats_.sends++;
+        sent += r;
+      }
+      pending_.push_back({ next_id_ - 1, std::move(release) });
+      return sent;
+    }
+    // drain completion notifications of fd and release completed buffers. returns number of released buffers
+    int Complete(Fd fd) {
+      int released = 0;
+      uint32_t lo, hi;
+      bool copied;
+      int r;
+      while ((r = Syscall::ReadZeroCopyCompletion(fd, lo, hi, copied)) > 0) {
+        if ((int32_t)(hi - lo) < 0) {
+          continue; // not a zerocopy completion
+        }
+        copying_ = copied;
+        // wrap-around safe comparison of send numbers
+        while (!pending_.empty() && (int32_t)(hi - pending_.front().id) >= 0) {
+          auto release = std::move(pending_.front().release);
+          pending_.pop_front();
+          stats_.completions++;
+          if (copied) {
+            stats_.copied++;
+          }
+          release();
+          released++;
+        }
+      }
+      return released;
+    }
+    // release buffers without waiting completions. kernel keeps the pages pinned by itself, so this is memory safe,
+    // but data which is not sent yet may carry reused content. so only for the case that completions never come
+    // (eg. TcpSessionFactory gives up lingering of closed socket)
+    void ReleaseAll() {
+      while (!pending_.empty()) {
+        auto release = std::move(pending_.front().release);
+        pending_.pop_front();
+        release();
+      }
+    }
+  protected:
+    struct Pending {
+      uint32_t id; // send number of the last send of the buffer
+      Release release;
+    };
+    std::deque<Pending> pending_;
+    uint32_t next_id_{0};
+    bool copying_{false};
+    Stats stats_;
+  };
+}
@@ -0,0 +1,86 @@
+#include "base/zstd.h"
+#include "base/logger.h"
+
+#if defined(__QRPC_ENABLE_ZSTD__)
+#define __QRPC_USE_ZSTD__
+#include <zstd.h>
+#endif
+
+namespace base {
+#if defined(__QRPC_USE_ZSTD__)
+  struct ZstdContexts {
+    ZSTD_CCtx *cctx{ZSTD_createCCtx()};
+    ZSTD_DCtx *dctx{ZSTD_createDCtx()};
+    ~ZstdContexts() {
+      ZSTD_freeCCtx(cctx);
+      ZSTD_freeDCtx(dctx);
+    }
+  };
+  static thread_local ZstdContexts g_contexts;
+
+  ZstdDictionary::ZstdDictionary(uint32_t id, const std::string &data, int level) :
+    id_(id), data_(data), level_(level) {
+    cdict_ = ZSTD_createCDict(data_.data(), data_.size(), level_);
+    ddict_ = ZSTD_createDDict(data_.data(), data_.size());
+  }
+  ZstdDictionary::~ZstdDictionary() {
+    ZSTD_freeCDict(static_cast<ZSTD_CDict *>(cdict_));
+    ZSTD_freeDDict(static_cast<ZSTD_DDict *>(ddict_));
+  }
+  bool Zstd::Available() {
+    return true;
+  }
+  int Zstd::Compress(const char *p, size_t sz, const ZstdDictionary *dict, std::string &out) {
+    auto cctx = g_contexts.cctx;
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    if (dict != nullptr) {
+      ZSTD_CCtx_refCDict(cctx, static_cast<const ZSTD_CDict *>(dict->cdict()));
+    } else {
+      ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, kDefaultLevel);
+    }
+    // both sides know the dictionary. saves 4 bytes, which matters for small messages
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_dictIDFlag, 0);
+    out.resize(ZSTD_compressBound(sz));
+    auto r = ZSTD_compress2(cctx, out.data(), out.size(), p, sz);
+    if (ZSTD_isError(r)) {
+      QRPC_LOGJ(error, {{"ev","zstd compress failure"},{"sz",sz},{"err",ZSTD_getErrorName(r)}});
+      return QRPC_EDEPS;
+    }
+    out.resize(r);
+    return static_cast<int>(r);
+  }
+  int Zstd::Decompress(const char *p, size_t sz, const ZstdDictionary *dict, size_t max_size, std::string &out) {
+    // compressor always writes content size, so that buffer can be allocated safely
+    auto csz = ZSTD_getFrameContentSize(p, sz);
+    if (csz == ZSTD_CONTENTSIZE_ERROR || csz == ZSTD_CONTENTSIZE_UNKNOWN) {
+      return QRPC_EINVAL;
+    } else if (csz > max_size) {
+      return QRPC_ESIZE;
+    }
+    out.resize(csz);
+    auto r = dict != nullptr ?
+      ZSTD_decompress_usingDDict(g_contexts.dctx, out.data(), out.size(), p, sz,
+        static_cast<const ZSTD_DDict *>(dict->ddict())) :
+      ZSTD_decompressDCtx(g_contexts.dctx, out.data(), out.size(), p, sz);
+    if (ZSTD_isError(r)) {
+      QRPC_LOGJ(info, {{"ev","zstd decompress failure"},{"sz",sz},{"err",ZSTD_getErrorName(r)}});
+      return QRPC_EINVAL;
+    }
+    out.resize(r);
+    return static_cast<int>(r);
+  }
+#else
+  ZstdDictionary::ZstdDictionary(uint32_t id, const std::string &data, int level) :
+    id_(id), data_(data), level_(level) {}
+  ZstdDictionary::~ZstdDictionary() {}
+  bool Zstd::Available() {
+    return false;
+  }
+  int Zstd::Compress(const char *p, size_t sz, const ZstdDictionary *dict, std::string &out) {
+    return QRPC_ENOTSUPPORT;
+  }
+  int Zstd::Decompress(const char *p, size_t sz, const ZstdDictionary *dict, size_t max_size, std::string &out) {
+    return QRPC_ENOTSUPPORT;
+  }
+#endif
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "base/defs.h"
+
+#include <memory>
+#include <string>
+
+namespace base {
+  // pre-trained (or raw content) zstd dictionary, digested once for compression and decompression.
+  // immutable after creation, so that it can be shared among streams and threads
+  class ZstdDictionary {
+  public:
+    ZstdDictionary(uint32_t id, const std::string &data, int level);
+    ~ZstdDictionary();
+    DISALLOW_COPY_AND_ASSIGN(ZstdDictionary);
+    inline uint32_t id() const { return id_; }
+    inline const std::string &data() const { return data_; }
+    inline int level() const { return level_; }
+    inline bool valid() const { return cdict_ != nullptr && ddict_ != nullptr; }
+    inline const void *cdict() const { return cdict_; }
+    inline const void *ddict() const { return ddict_; }
+  protected:
+    uint32_t id_;
+    std::string data_;
+    int level_;
+    void *cdict_{nullptr}, *ddict_{nullptr}; // ZSTD_CDict, ZSTD_DDict
+  };
+  // zstd compression with per-thread contexts. if built without zstd, Available() returns false and
+  // other methods return QRPC_ENOTSUPPORT
+  class Zstd {
+  public:
+    static constexpr int kDefaultLevel = 3;
+    static bool Available();
+    // replaces out with compressed frame of p. returns compressed size or negative error
+    static int Compress(const char *p, size_t sz, const ZstdDictionary *dict, std::string &out);
+    // replaces out with decompressed content of frame p. frames whose content size is unknown or larger than
+    // max_size are rejected. returns decompressed size or negative error
+    static int Decompress(const char *p, size_t sz, const ZstdDictionary *dict, size_t max_size, std::string &out);
+  };
+}
@@ -6,6 +6,8 @@
 #include "base/webrtc.h"
 #include "base/string.h"
 #include "base/webrtc/sdp.h"
+#include "base/webrtc/sctp_engine.h"
+#include "base/rtp/relay.h"
 #include "json.hpp"
 
 using json = nlohmann::json;
@@ -17,10 +19,16 @@ struct Test3StreamContext {
 struct TestStreamContext {
     std::vector<std::string> texts;
 };
+// messages sent within one loop iteration and echoed back by server
+struct EchoStreamContext {
+    static constexpr uint64_t kMessages = 3;
+    std::vector<uint64_t> counts;
+};
 bool test_webrtc_client(Loop &l, Resolver &r) {
     std::string error_msg = "";
     TestStreamContext testctx = { .texts = {"aaaa", "bbbb", "cccc"} };
     Test3StreamContext test3ctx;
+    EchoStreamContext coalescectx, fecctx;
     int closed = 0;
     bool secure = false;
     const int MAX_RECONNECT = 2;
@@ -39,12 +47,18 @@ bool test_webrtc_client(Loop &l, Resolver &r) {
         .connection_timeout = qrpc_time_sec(60),
         .consent_check_interval = qrpc_time_sec(10),
         .fingerprint_algorithm = "sha-256",
+        .native_sctp = std::getenv("QRPC_E2E_NATIVE_SCTP") != nullptr,
         .resolver = r,
         .certpair = secure ? std::optional(CertificatePair::Default()) : std::nullopt,
     }, [](base::webrtc::ConnectionFactory::Connection &c) {
         logger::info({{"ev","webrtc connected"}});
         c.OpenStream({.label = "test"});
-        c.OpenStream({.label = "test3"});
+        c.OpenStream({.label = "coalesce", .protocol = Stream::COALESCE_PROTOCOL});
+        c.OpenStream(Stream::MaxRetransmitsConfig("test3", 3, true));
+        // FEC recovers messages out of order, so it requires unordered stream
+        auto fec = Stream::UnorderedConfig("fec");
+        fec.protocol = Stream::FecProtocol();
+        c.OpenStream(fec);
         return QRPC_OK;
     }, [&closed, &error_msg](base::webrtc::ConnectionFactory::Connection &) {
         logger::info({{"ev","webrtc closed"}});
@@ -82,6 +96,32 @@ bool test_webrtc_client(Loop &l, Resolver &r) {
             auto count = resp["count"].get<uint64_t>();
             s.context<Test3StreamContext>().count = count + 1;
             s.Send({{"count", s.context<Test3StreamContext>().count}});
+        } else if (s.label() == "coalesce") {
+            // coalesced messages should be delivered one by one, in order
+            auto &ctx = s.context<EchoStreamContext>();
+            auto count = resp["count"].get<uint64_t>();
+            if (count != ctx.counts.size()) {
+                error_msg = ("coalesce stream count wrong: [" + std::to_string(count) +
+                    "] should be [" + std::to_string(ctx.counts.size()) + "]");
+                return QRPC_EINVAL;
+            }
+            ctx.counts.push_back(count);
+            if (ctx.counts.size() >= EchoStreamContext::kMessages) {
+                s.Close(QRPC_CLOSE_REASON_LOCAL);
+            }
+        } else if (s.label() == "fec") {
+            // unordered, but each message should be delivered exactly once
+            auto &ctx = s.context<EchoStreamContext>();
+            auto count = resp["count"].get<uint64_t>();
+            if (count >= EchoStreamContext::kMessages ||
+                std::find(ctx.counts.begin(), ctx.counts.end(), count) != ctx.counts.end()) {
+                error_msg = ("fec stream count wrong or duplicated: [" + std::to_string(count) + "]");
+                return QRPC_EINVAL;
+            }
+            ctx.counts.push_back(count);
+            if (ctx.counts.size() >= EchoStreamContext::kMessages) {
+                s.Close(QRPC_CLOSE_REASON_LOCAL);
+            }
         } else if (s.label() == "recv") {
             auto msg = resp["msg"].get<std::string>();
             if (msg != "byebye") {
@@ -91,7 +131,7 @@ bool test_webrtc_client(Loop &l, Resolver &r) {
             s.connection().Close();
         }
         return QRPC_OK;
-    }, [&closed, &testctx, &test3ctx](Stream &s) -> int {
+    }, [&closed, &testctx, &test3ctx, &coalescectx, &fecctx](Stream &s) -> int {
         logger::info({{"ev","stream opened"},{"l",s.label()},{"sid",s.id()}});
         if (s.label() == "test") {
             s.SetContext(&testctx);
@@ -101,6 +141,17 @@ bool test_webrtc_client(Loop &l, Resolver &r) {
         } else if (s.label() == "test3") {
             s.SetContext(&test3ctx);
             return s.Send({{"count", 0}});
+        } else if (s.label() == "coalesce" || s.label() == "fec") {
+            auto &ctx = s.label() == "fec" ? fecctx : coalescectx;
+            ctx.counts.clear();
+            s.SetContext(&ctx);
+            for (uint64_t i = 0; i < EchoStreamContext::kMessages; i++) {
+                int r;
+                if ((r = s.Send({{"count", i}})) < 0) {
+                    return r;
+                }
+            }
+            return QRPC_OK;
         } else if (s.label() == "recv") {
             return s.Send({{"die", closed < MAX_RECONNECT}});
         }
@@ -116,6 +167,11 @@ bool test_webrtc_client(Loop &l, Resolver &r) {
                 logger::error({{"ev","invalid count"},{"count", s.context<Test3StreamContext>().count}});
                 error_msg = ("test3.onclose count should be 2");
             }
+        } else if (s.label() == "coalesce" || s.label() == "fec") {
+            if (s.context<EchoStreamContext>().counts.size() != EchoStreamContext::kMessages) {
+                logger::error({{"ev","invalid count"},{"l",s.label()},{"counts", s.context<EchoStreamContext>().counts}});
+                error_msg = (s.label() + ".onclose all messages should be echoed");
+            }
         } else if (s.label() == "recv") {
         }
         return QRPC_OK;
@@ -346,6 +402,315 @@ bool test_address() {
     return true;
 }
 
+// passes transport messages of a stream to peer stream, dropping the ones whose sequence is in drops.
+// like webrtc connection, scheduled flush is deferred until Poll (end of loop iteration)
+class LossyConnection : public Connection {
+public:
+    std::shared_ptr<Stream> peer;
+    std::set<size_t> drops;
+    size_t sent{0};
+    std::vector<Stream *> flushes;
+public:
+    void Close() override {}
+    int Send(const char *, size_t) override { return QRPC_OK; }
+    int Open(Stream &) override { return QRPC_OK; }
+    void Close(Stream &) override {}
+    int Send(Stream &, const char *p, size_t sz, bool) override {
+        if (drops.find(sent++) != drops.end()) {
+            return QRPC_OK;
+        }
+        return peer->OnReceive(p, sz);
+    }
+    std::shared_ptr<Stream> OpenStream(const Stream::Config &) override { return nullptr; }
+    void ScheduleFlush(Stream &s) override { flushes.push_back(&s); }
+    void Poll() {
+        auto flushes = std::move(this->flushes);
+        for (auto s : flushes) {
+            s->Flush();
+        }
+    }
+};
+bool test_stream_fec() {
+    auto c = Stream::UnorderedConfig("fec");
+    c.protocol = Stream::FecProtocol(4);
+    LossyConnection sconn, rconn;
+    std::vector<std::string> received;
+    auto sender = std::make_shared<AdhocStream>(sconn, c, [](Stream &, const char *, size_t) { return QRPC_OK; });
+    sconn.peer = std::make_shared<AdhocStream>(rconn, c, [&received](Stream &, const char *p, size_t sz) {
+        received.emplace_back(p, sz);
+        return QRPC_OK;
+    });
+    // 6 messages of different length. transport sequence is m0-m3 (0-3), parity (4), m4-m5 (5-6) and
+    // parity of the partial group (7) sent by flush. m1 and m5 are lost
+    std::vector<std::string> sent;
+    for (int i = 0; i < 6; i++) {
+        sent.push_back("m" + std::to_string(i) + std::string(i * 7, 'a' + i));
+    }
+    sconn.drops = {1, 6};
+    for (auto &m : sent) {
+        if (sender->Send(m.data(), m.size()) < 0) {
+            DIE("fail to send fec stream message");
+        }
+    }
+    if (received.size() != 5 || received[3] != sent[1]) {
+        logger::error({{"ev","wrong fec recovery"},{"received",received}});
+        DIE("lost message of full group should be recovered by its parity");
+    }
+    sconn.Poll();
+    if (sconn.sent != 8) {
+        logger::error({{"ev","wrong fec transport messages"},{"sent",sconn.sent}});
+        DIE("parity of partial group should be sent at the end of loop iteration");
+    }
+    if (received.size() != 6 || received[5] != sent[5]) {
+        logger::error({{"ev","wrong fec recovery"},{"received",received}});
+        DIE("lost message of partial group should be recovered by flushed parity");
+    }
+    // nothing is delivered twice even if all messages arrive
+    sconn.drops.clear();
+    sender->Send(sent[0].data(), sent[0].size());
+    sconn.Poll();
+    if (received.size() != 7 || received[6] != sent[0]) {
+        DIE("fec stream should deliver message exactly once");
+    }
+    return true;
+}
+
+// RTP packet relayed to other worker, with one byte header extension (id 1) and payload of given size
+std::string relayed_rtp_packet(size_t payload_size) {
+    std::string p = {
+        '\x90', 96, 0, 1, 0, 0, 0, 1, 0x12, 0x34, 0x56, 0x78, // V=2, X=1, PT=96, seq=1, ts=1, ssrc
+        '\xbe', '\xde', 0, 1, 0x10, '\xaa', 0, 0, // one byte header extension, 1 word
+    };
+    for (size_t i = 0; i < payload_size; i++) {
+        p.push_back(static_cast<char>(i & 0xff));
+    }
+    return p;
+}
+bool test_relay_rtp_packet() {
+    // largest packet relayed, and proxy producer adds extensions as it does for consumers (mid, abs-send-time...).
+    // with asan, writing beyond the parse buffer aborts here
+    auto data = relayed_rtp_packet(rtp::Relay::kMaxRtpPacketSize - 20);
+    auto *packet = rtp::Relay::ParseRtpPacket(data);
+    if (packet == nullptr) {
+        DIE("fail to parse relayed RTP packet");
+    }
+    auto size = packet->GetSize();
+    uint8_t mid[16], abs_send_time[3] = {1, 2, 3}, twcc[2] = {4, 5}, abs_capture_time[16];
+    std::memset(mid, 'm', sizeof(mid));
+    std::memset(abs_capture_time, 'c', sizeof(abs_capture_time));
+    packet->SetExtensions(2, {
+        RTC::RtpPacket::GenericExtension(1, sizeof(mid), mid),
+        RTC::RtpPacket::GenericExtension(2, sizeof(abs_send_time), abs_send_time),
+        RTC::RtpPacket::GenericExtension(3, sizeof(twcc), twcc),
+        RTC::RtpPacket::GenericExtension(4, sizeof(abs_capture_time), abs_capture_time),
+    });
+    if (packet->GetSize() <= size || packet->GetSize() > data.size() + rtp::Relay::kRtpHeadroom) {
+        logger::error({{"ev","wrong relayed RTP packet size"},{"before",size},{"after",packet->GetSize()}});
+        DIE("header extensions of relayed RTP packet should grow within headroom");
+    }
+    if (packet->GetPayloadLength() != data.size() - 20 ||
+        std::memcmp(packet->GetPayload(), data.data() + 20, data.size() - 20) != 0) {
+        DIE("payload of relayed RTP packet should be kept after extensions grow");
+    }
+    delete packet;
+    // malformed or truncated packets are dropped
+    auto ext_overrun = relayed_rtp_packet(0);
+    ext_overrun[15] = 8; // extension length beyond the end
+    for (auto &bad : {data.substr(0, 8), ext_overrun, relayed_rtp_packet(rtp::Relay::kMaxRtpPacketSize)}) {
+        if ((packet = rtp::Relay::ParseRtpPacket(bad)) != nullptr) {
+            delete packet;
+            logger::error({{"ev","invalid relayed RTP packet accepted"},{"sz",bad.size()}});
+            DIE("malformed or oversized relayed RTP packet should be dropped");
+        }
+    }
+    return true;
+}
+
+bool test_ecn_rate_limiter() {
+    rtp::EcnRateLimiter l(0);
+    qrpc_time_t now = 1;
+    // 1000 byte packets every 1ms = 8Mbps. mark 1/4 of packets as CE
+    auto feed = [&l, &now](int n_packets, int ce_every) {
+        bool changed = false;
+        for (int i = 0; i < n_packets; i++) {
+            now += 1000 * 1000;
+            auto ecn = (ce_every > 0 && (i % ce_every) == 0) ? Syscall::ECN_CE : Syscall::ECN_ECT1;
+            changed = l.Record(ecn, 1000, now) || changed;
+        }
+        return changed;
+    };
+    if (feed(1000, 0) || l.limit() != 0) {
+        DIE("incoming bitrate should not be limited without CE marks");
+    }
+    if (!feed(100, 4) || l.limit() == 0 || l.limit() >= 8 * 1000 * 1000 ||
+        l.limit() < rtp::EcnRateLimiter::kMinBitrate) {
+        logger::error({{"ev","wrong limit"},{"limit",l.limit()},{"alpha",l.alpha()}});
+        DIE("incoming bitrate should be limited below measured rate by CE marks");
+    }
+    auto limit = l.limit();
+    if (feed(1000, 4) && l.limit() > limit) {
+        DIE("limit should not grow while CE marks are seen");
+    }
+    // limit is removed after it grows beyond twice of the measured rate without CE marks
+    feed(100 * 1000, 0);
+    if (l.limit() != 0) {
+        logger::error({{"ev","limit remains"},{"limit",l.limit()}});
+        DIE("limit should be removed after CE marks disappear");
+    }
+    return true;
+}
+
+// one side of two SctpEngines connected in process. sent packets are held in wire,
+// so that test can drop or reorder them before Exchange delivers them to peer
+class SctpTestPeer : public webrtc::SctpEngine::Listener {
+public:
+    SctpTestPeer(Loop &l) : engine(*this, l.alarm_processor(), {
+        .os = 16, .mis = 16, .send_buffer_size = 1024 * 1024, .max_message_size = 256 * 1024 }) {}
+    void OnSctpEngineSendPacket(const uint8_t *p, size_t sz) override {
+        wire.emplace_back(reinterpret_cast<const char *>(p), sz);
+    }
+    void OnSctpEngineConnected() override { connected = true; }
+    void OnSctpEngineClosed(bool f) override { closed = true; failed = f; }
+    void OnSctpEngineMessage(uint16_t sid, uint32_t ppid, const uint8_t *p, size_t sz) override {
+        messages[sid].emplace_back(reinterpret_cast<const char *>(p), sz);
+    }
+    void OnSctpEngineStreamReset(uint16_t sid) override { resets.push_back(sid); }
+    void OnSctpEngineBufferedAmount(uint16_t sid, size_t amount) override {}
+    void Receive(const std::string &packet) {
+        engine.Receive(reinterpret_cast<const uint8_t *>(packet.data()), packet.size());
+    }
+    int Send(uint16_t sid, const std::string &m, const webrtc::SctpEngine::SendOptions &o = {}) {
+        return engine.Send(sid, 51, reinterpret_cast<const uint8_t *>(m.data()), m.size(), o);
+    }
+public:
+    webrtc::SctpEngine engine;
+    std::vector<std::string> wire;
+    std::map<uint16_t, std::vector<std::string>> messages;
+    std::vector<uint16_t> resets;
+    bool connected{false}, closed{false}, failed{false};
+};
+// deliver packets of both peers (packets from a are given to drop, and lost if it returns true)
+// and run timers, until done returns true. returns false on timeout
+bool sctp_exchange(Loop &l, SctpTestPeer &a, SctpTestPeer &b, const std::function<bool()> &done,
+    const std::function<bool(const std::string &)> &drop = nullptr) {
+    auto timeout = qrpc_time_now() + qrpc_time_sec(30);
+    while (!done()) {
+        if (qrpc_time_now() > timeout) {
+            return false;
+        }
+        std::vector<std::string> from_a, from_b;
+        from_a.swap(a.wire);
+        from_b.swap(b.wire);
+        for (auto &p : from_a) {
+            if (drop == nullptr || !drop(p)) {
+                b.Receive(p);
+            }
+        }
+        for (auto &p : from_b) {
+            a.Receive(p);
+        }
+        l.Poll();
+    }
+    return true;
+}
+// SCTP checksum (CRC32c, stored in little endian) for crafted packets
+void sctp_set_checksum(std::string &p) {
+    std::memset(&p[8], 0, 4);
+    uint32_t crc = 0xFFFFFFFF;
+    for (auto c : p) {
+        crc ^= static_cast<uint8_t>(c);
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? ((crc >> 1) ^ 0x82F63B78) : (crc >> 1);
+        }
+    }
+    crc = ~crc;
+    for (int i = 0; i < 4; i++) {
+        p[8 + i] = static_cast<char>((crc >> (8 * i)) & 0xFF);
+    }
+}
+bool test_sctp_engine(Loop &l) {
+    SctpTestPeer a(l), b(l);
+    a.engine.Connect();
+    b.engine.Connect();
+    if (!sctp_exchange(l, a, b, [&]() { return a.connected && b.connected; })) {
+        DIE("sctp engines should be connected");
+    }
+    // loss and reordering: 2nd packet is lost and others arrive in reverse order. multi chunk messages are
+    // reassembled and delivered in order after retransmission
+    std::vector<std::string> sent;
+    for (int i = 0; i < 8; i++) {
+        sent.push_back(std::to_string(i) + std::string(3000, 'a' + i));
+        a.Send(1, sent.back());
+    }
+    auto held = std::move(a.wire);
+    a.wire.clear();
+    held.erase(held.begin() + 1);
+    std::reverse(held.begin(), held.end());
+    for (auto &p : held) {
+        b.Receive(p);
+    }
+    if (!sctp_exchange(l, a, b, [&]() { return b.messages[1].size() >= sent.size(); })) {
+        DIE("lost sctp packet should be retransmitted");
+    }
+    if (b.messages[1] != sent) {
+        DIE("sctp messages should be delivered in order after loss and reordering");
+    }
+    // FORWARD-TSN: messages never retransmitted are lost, and later message of the stream is delivered
+    webrtc::SctpEngine::SendOptions pr = { .max_retransmits = 0 };
+    for (int i = 0; i < 3; i++) {
+        a.Send(2, std::string(100, 'p'), pr);
+    }
+    a.wire.clear();
+    a.Send(2, "end");
+    if (!sctp_exchange(l, a, b, [&]() { return !b.messages[2].empty() && a.engine.buffered_amount() == 0; })) {
+        DIE("abandoned sctp messages should be skipped by FORWARD-TSN");
+    }
+    if (b.messages[2] != std::vector<std::string>{"end"} || a.engine.stats().abandoned != 3) {
+        logger::error({{"ev","wrong partial reliability"},{"messages",b.messages[2]},{"abandoned",a.engine.stats().abandoned}});
+        DIE("only reliable sctp message should be delivered");
+    }
+    // TSN beyond receive window is dropped, even if it completes an unordered message
+    a.Send(3, "window", { .ordered = false });
+    auto packet = a.wire.back();
+    a.wire.clear();
+    auto beyond = packet;
+    size_t chunk = 12, tsn_off = chunk + 4;
+    if (beyond[chunk] != 0 && beyond[chunk] != 64) {
+        DIE("sctp packet should start with DATA or I-DATA chunk");
+    }
+    auto tsn = Endian::NetbytesToHost<uint32_t>(reinterpret_cast<const uint8_t *>(&beyond[tsn_off]));
+    Endian::HostToNetbytes<uint32_t>(tsn + webrtc::SctpEngine::kMaxRwnd + 1, reinterpret_cast<uint8_t *>(&beyond[tsn_off]));
+    sctp_set_checksum(beyond);
+    b.Receive(beyond);
+    if (!b.messages[3].empty() || b.engine.received_amount() != 0) {
+        DIE("sctp data beyond receive window should be dropped");
+    }
+    b.Receive(packet);
+    if (b.messages[3] != std::vector<std::string>{"window"}) {
+        DIE("sctp data within receive window should be delivered");
+    }
+    // stream reset is answered by peer's reset, and the stream can be used again
+    a.engine.ResetStream(1);
+    if (!sctp_exchange(l, a, b, [&]() { return !a.resets.empty() && !b.resets.empty(); })) {
+        DIE("sctp stream should be reset on both side");
+    }
+    b.messages[1].clear();
+    a.Send(1, "again");
+    if (!sctp_exchange(l, a, b, [&]() { return !b.messages[1].empty(); }) || b.messages[1][0] != "again") {
+        DIE("sctp stream should be reused after reset");
+    }
+    if (a.engine.received_amount() != 0 || b.engine.received_amount() != 0) {
+        logger::error({{"ev","received bytes remain"},{"a",a.engine.received_amount()},{"b",b.engine.received_amount()}});
+        DIE("all received sctp bytes should be released after delivery");
+    }
+    // reset request which never reaches peer is given up, and association fails
+    a.engine.ResetStream(2);
+    if (!sctp_exchange(l, a, b, [&]() { return a.closed; }, [](const std::string &) { return true; }) || !a.failed) {
+        DIE("unanswered sctp stream reset should fail association");
+    }
+    return true;
+}
+
 bool test_sdp() {
 auto ffsdp = R"sdp(
 v=0
@@ -689,6 +1054,22 @@ int main(int argc, char *argv[]) {
     if (!test_sdp()) {
         return 1;
     }
+    TRACE("======== test_relay_rtp_packet ========");
+    if (!test_relay_rtp_packet()) {
+        return 1;
+    }
+    TRACE("======== test_ecn_rate_limiter ========");
+    if (!test_ecn_rate_limiter()) {
+        return 1;
+    }
+    TRACE("======== test_sctp_engine ========");
+    if (!test_sctp_engine(l)) {
+        return 1;
+    }
+    TRACE("======== test_stream_fec ========");
+    if (!test_stream_fec()) {
+        return 1;
+    }
     TRACE("======== test_webrtc_client ========");
     if (!test_webrtc_client(l, ares)) {
         return 1;
@@ -0,0 +1,39 @@
+#!/bin/bash
+CWD=$(cd $(dirname ${BASH_SOURCE[0]}) && pwd)
+# data channel interop test of native SCTP engine (ConnectionFactory::Config::native_sctp) over loopback.
+# e2e_client_native runs its webrtc tests against e2e_server, for each combination of SCTP implementations.
+# usage: sctp.sh [path to e2e_server] [path to e2e_client_native]
+set -eo pipefail
+
+BIN=${CWD}/../../../bazel-bin/lib/tests/e2e
+SERVER=${1:-${BIN}/server/e2e_server}
+CLIENT=${2:-${BIN}/client/e2e_client_native}
+
+cleanup() {
+  if [ -n "${SERVER_PID}" ]; then
+    kill ${SERVER_PID} || true
+    wait ${SERVER_PID} 2>/dev/null || true
+    SERVER_PID=
+  fi
+}
+trap cleanup EXIT
+
+# server client
+for combo in "usrsctp native" "native usrsctp" "native native"; do
+  set -- ${combo}
+  LOG=${CWD}/sctp-server-$1-$2.log
+  echo "server:$1 client:$2..."
+  if [ "$1" = "native" ]; then
+    QRPC_E2E_NATIVE_SCTP=1 RSC_ROOT=${CWD}/server ${SERVER} > ${LOG} 2>&1 &
+  else
+    RSC_ROOT=${CWD}/server ${SERVER} > ${LOG} 2>&1 &
+  fi
+  SERVER_PID=$!
+  sleep 2
+  if [ "$2" = "native" ]; then
+    QRPC_E2E_NATIVE_SCTP=1 ${CLIENT}
+  else
+    ${CLIENT}
+  fi
+  cleanup
+done
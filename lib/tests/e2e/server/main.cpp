@@ -118,6 +118,8 @@ int main(int argc, char *argv[]) {
         .connection_timeout = qrpc_time_sec(60),
         .consent_check_interval = qrpc_time_sec(10),
         .fingerprint_algorithm = "sha-256",
+        .zerocopy_threshold = 16 * 1024,
+        .native_sctp = std::getenv("QRPC_E2E_NATIVE_SCTP") != nullptr,
         .certpair = secure ? std::optional(CertificatePair::Default()) : std::nullopt,
     }, [](Stream &s, const char *p, size_t sz) {
         auto pl = std::string(p, sz);
@@ -144,6 +146,8 @@ int main(int argc, char *argv[]) {
                 } else {
                     return s.Send({{"count", count}});
                 }
+            } else if (s.label() == "coalesce" || s.label() == "fec") {
+                return s.Send(std::move(req)); // echo
             } else if (s.label() == "recv") {
                 auto die = req["die"].get<bool>();
                 if (die) {
@@ -212,7 +216,8 @@ int main(int argc, char *argv[]) {
             {.key = "Content-Type", .val = ctypes[m[2].str()].c_str()},
             {.key = "Content-Length", .val = flen.c_str()}
         };
-        s.Respond(HRC_OK, h, 2, file.get(), filesz);
+        // file buffer is released after kernel completes sending it
+        s.Respond(HRC_OK, h, 2, std::shared_ptr<const char[]>(std::move(file)), filesz);
         return nullptr;
     }).
     Route(std::regex("/test"), [](HttpSession &s, std::cmatch &) {
@@ -246,11 +251,18 @@ int main(int argc, char *argv[]) {
     if (!w.Listen(8888, 11111)) {
         DIE("fail to listen webrtc");
     }
+    auto udp_config = AdhocUdpListener::Config(NopResolver::Instance(), qrpc_time_sec(5), 1, true);
+    // receive echo packets by AF_XDP socket in generic mode (see xdp.sh)
+    auto xdp_ifname = std::getenv("QRPC_E2E_XDP_IFNAME");
+    if (xdp_ifname != nullptr) {
+        udp_config.xdp.ifname = xdp_ifname;
+        udp_config.xdp.skb_mode = true;
+    }
     AdhocUdpListener us(l, [](AdhocUdpSession &s, const char *p, size_t sz) {
         // echo udp
         logger::info({{"ev","recv packet"},{"a",s.addr().str()},{"pl", std::string(p, sz)}});
         return s.Send(p, sz);
-    }, AdhocUdpListener::Config(NopResolver::Instance(), qrpc_time_sec(5), 1, true));
+    }, udp_config);
     if (!us.Listen(9999)) {
         DIE("fail to listen on UDP");
     }
@@ -0,0 +1,53 @@
+#!/bin/bash
+CWD=$(cd $(dirname ${BASH_SOURCE[0]}) && pwd)
+# AF_XDP receive path test. needs root (for netns, veth and bpf) but no special NIC:
+# e2e_server runs in a network namespace and receives packets from veth pair by generic (skb) mode XDP.
+# usage: sudo xdp.sh [path to e2e_server]
+set -eo pipefail
+
+SERVER=${1:-${CWD}/../../../bazel-bin/lib/tests/e2e/server/e2e_server}
+NS=qrpc-xdp
+LOG=${CWD}/xdp-server.log
+
+cleanup() {
+  if [ -n "${SERVER_PID}" ]; then
+    kill ${SERVER_PID} || true
+  fi
+  ip link del qxdp0 2>/dev/null || true
+  ip netns del ${NS} 2>/dev/null || true
+}
+trap cleanup EXIT
+
+ip netns add ${NS}
+ip link add qxdp0 type veth peer name qxdp1
+ip link set qxdp1 netns ${NS}
+ip addr add 10.254.0.1/24 dev qxdp0
+ip link set qxdp0 up
+ip netns exec ${NS} ip addr add 10.254.0.2/24 dev qxdp1
+ip netns exec ${NS} ip link set qxdp1 up
+ip netns exec ${NS} ip link set lo up
+
+ip netns exec ${NS} env QRPC_E2E_XDP_IFNAME=qxdp1 RSC_ROOT=${CWD}/server ${SERVER} > ${LOG} 2>&1 &
+SERVER_PID=$!
+sleep 2
+if ! grep -q "XdpSocket opened" ${LOG}; then
+  echo "AF_XDP socket is not opened: see ${LOG}"
+  exit 1
+fi
+
+# payloads larger than MTU are fragmented. they are passed to kernel by XDP program
+# and received by UDP socket, which also checks fallback path
+for i in {0..16}; do
+  len=$((2 << i))
+  echo "send ${len} bytes payload..."
+  randstr=$(openssl rand -base64 ${len} | paste -d' ' -s - | tr -d ' ')
+  command=${randstr:0:${len}}
+  response=$(echo -n "$command" | nc -uc -w 1 10.254.0.2 9999)
+  if [ "$command" != "$response" ]; then
+    path=${CWD}/xdp-error-${len}.txt
+    echo "${command}" > ${path}
+    echo "${response}" >> ${path}
+    echo "Unexpected response: see ${path}"
+    exit 1
+  fi
+done
@@ -6,6 +6,10 @@ import type {
 import { promisify } from './types.js';
 import { QRPCTrack } from './track.js';
 import { QRPCMedia } from './media.js';
+import { QRPCCoalescer } from './coalesce.js';
+import { QRPCZstd } from './zstd.js';
+import { QRPCFec } from './fec.js';
+import type { QRPCZstdDecoder } from './zstd.js';
 
 export class QRPClient {
   static readonly SYSCALL_STREAM = "$syscall";
@@ -40,6 +44,9 @@ export class QRPClient {
   public onopen?: () => any;
   public onclose?: () => number;
   public onstream?: (c: RTCDataChannel) => QRPCStreamHandler;
+  // decompressor for streams compressed by server (eg. { decompress: fzstd.decompress })
+  public zstd?: QRPCZstdDecoder;
+  public zstdDictionaries: { [id: number]: Promise<Uint8Array> } = {};
 
   constructor(url: string, cname?: string) {
     this.url = url;
@@ -138,9 +145,11 @@ export class QRPClient {
     } else if (
       data.fn == "resume_ack" || data.fn == "pause_ack" || data.fn == "close_ack" ||
       data.fn == "sync_ack" || data.fn == "ping_ack" || data.fn == "publish_stream_ack" ||
-      data.fn == "remote_answer_ack"
+      data.fn == "remote_answer_ack" || data.fn == "stream_priority_ack"
     ) {
       promise.resolve();
+    } else if (data.fn == "zstd_dictionary_ack") {
+      promise.resolve(Uint8Array.from(atob(data.args.data), (c) => c.charCodeAt(0)));
     } else {
       console.log("unknown syscall", data);
     }
@@ -168,6 +177,7 @@ export class QRPClient {
     this.syscallStream = null;
     this.timer = null;
     this.sdpQueue = [];
+    this.zstdDictionaries = {};
   }
 
   initIce(): void {
@@ -898,11 +908,35 @@ export class QRPClient {
     if (this.streams[path]) {
       return this.streams[path];
     }
-    const s = this.pc!.createDataChannel(path, params as RTCDataChannelInit);
+    const s = this.pc!.createDataChannel(path, this.#dataChannelInit(params));
     this.#setupStream(s, params);
     return s;
   }
 
+  // ordered/maxRetransmits/maxPacketLifeTime are sent to server with DCEP, and applied to both directions
+  #dataChannelInit(params: QRPCStreamParams): RTCDataChannelInit {
+    const { ordered, maxRetransmits, maxPacketLifeTime, negotiated, id } = params;
+    if (maxRetransmits !== undefined && maxPacketLifeTime !== undefined) {
+      throw new Error("maxRetransmits and maxPacketLifeTime cannot be specified together");
+    }
+    if (params.fec && ordered !== false) {
+      throw new Error("fec stream should be unordered (ordered: false)");
+    }
+    if (params.compress && !this.zstd) {
+      throw new Error("QRPClient.zstd is mandatory for compressed stream");
+    }
+    const extensions = [];
+    if (params.coalesce) { extensions.push(QRPCCoalescer.PROTOCOL); }
+    if (params.compress) {
+      extensions.push(QRPCZstd.protocol(params.compress === true ? 0 : params.compress.dictionary));
+    }
+    if (params.fec) {
+      extensions.push(QRPCFec.protocol(params.fec === true ? 0 : params.fec.groupSize));
+    }
+    const protocol = extensions.length > 0 ? extensions.join(",") : params.protocol;
+    return { ordered, maxRetransmits, maxPacketLifeTime, protocol, negotiated, id };
+  }
+
   closeStream(path: string): void {
     const s = this.streams[path];
     if (!s) {
@@ -925,11 +959,45 @@ export class QRPClient {
     });
   }
 
+  #zstdDictionary(id: number): Promise<Uint8Array> {
+    if (!this.zstdDictionaries[id]) {
+      this.zstdDictionaries[id] = this.syscall("zstd_dictionary", {id});
+    }
+    return this.zstdDictionaries[id];
+  }
+
   #setupStream(s: RTCDataChannel, h: QRPCStreamParams): void {
     const path = s.label;
     const { onopen, onclose, onmessage, onerror } = h;
-    s.onopen = (onopen && (async (event) => {
+    // stream opened with coalesce, compress or fec (by either side). application keeps using send/onmessage
+    // per message. sent messages are coalesced, then framed for zstd, then protected by fec
+    const extensions = s.protocol.split(",");
+    const fecGroupSize = QRPCFec.groupSize(s.protocol);
+    const fec = fecGroupSize > 0 ? new QRPCFec(s, fecGroupSize) : null;
+    if (fec) {
+      (s as any).send = fec.push.bind(fec);
+    }
+    const dictId = QRPCZstd.dictionaryId(s.protocol);
+    if (dictId !== null) {
+      const send = s.send.bind(s);
+      s.binaryType = "arraybuffer";
+      (s as any).send = (data: string | ArrayBuffer | ArrayBufferView) => send(QRPCZstd.encode(data));
+    }
+    const dictionary = dictId ? this.#zstdDictionary(dictId) : undefined;
+    const coalescer = extensions.includes(QRPCCoalescer.PROTOCOL) ? new QRPCCoalescer(s) : null;
+    if (coalescer) {
+      (s as any).send = coalescer.push.bind(coalescer);
+    }
+    const prepare = async () => {
+      coalescer?.flush();
+      await dictionary;
       if (h.publish) { await this.syscall("publish_stream",{path}); }
+      if (h.schedule && s.id !== null) {
+        await this.syscall("stream_priority",{sid: s.id, ...h.schedule});
+      }
+    };
+    s.onopen = (onopen && (async (event) => {
+      await prepare();
       const ctx = await promisify(onopen(s, event));
       if (ctx === false || ctx === null) {
         console.log(`close stream by application path=${path}`);
@@ -939,7 +1007,7 @@ export class QRPClient {
         (s as any).context = ctx;
       }
     })) || (async (event) => {
-      if (h.publish) { await this.syscall("publish_stream",{path}); }
+      await prepare();
     });
     s.onclose = (onclose && ((event) => {
       onclose(s, event);
@@ -953,7 +1021,23 @@ export class QRPClient {
     })) || ((event) => {
       delete this.streams[path];
     });
-    s.onmessage = (event) => onmessage(s, event);
+    const unpack = (coalescer && ((event: MessageEvent, data: ArrayBuffer) => {
+      for (const d of QRPCCoalescer.decode(data)) {
+        onmessage(s, new MessageEvent("message", { data: d }));
+      }
+    })) || ((event: MessageEvent, data: string | ArrayBuffer) => {
+      onmessage(s, data === event.data ? event : new MessageEvent("message", { data }));
+    });
+    const inflate = (dictId !== null && (async (event: MessageEvent, data: string | ArrayBuffer) => {
+      // already resolved dictionary keeps order of messages
+      const dict = dictionary && await dictionary;
+      unpack(event, QRPCZstd.decode(data as ArrayBuffer, this.zstd, dict, coalescer !== null) as ArrayBuffer);
+    })) || ((event: MessageEvent, data: string | ArrayBuffer) => unpack(event, data as ArrayBuffer));
+    s.onmessage = (fec && ((event) => {
+      for (const data of fec.decode(event.data)) {
+        inflate(event, data);
+      }
+    })) || ((event) => inflate(event, event.data));
     this.streams[path] = s;
   }
 }
@@ -0,0 +1,93 @@
+// packs multiple messages into one data channel message, compatible with base::Stream::COALESCE_PROTOCOL.
+// each message is prefixed by varint of (length << 1 | binary flag)
+export class QRPCCoalescer {
+  static readonly PROTOCOL = "qrpc-coalesce";
+  static readonly FLUSH_SIZE = 1024;
+
+  private readonly stream: RTCDataChannel;
+  private readonly send: (data: ArrayBuffer) => void;
+  private chunks: Uint8Array[] = [];
+  private size: number = 0;
+  private static readonly encoder = new TextEncoder();
+  private static readonly decoder = new TextDecoder();
+
+  constructor(stream: RTCDataChannel) {
+    this.stream = stream;
+    const send = stream.send.bind(stream);
+    this.send = (data: ArrayBuffer) => send(data);
+    stream.binaryType = "arraybuffer";
+  }
+
+  // messages are sent when they reach FLUSH_SIZE, or after current task finishes
+  push(data: string | ArrayBuffer | ArrayBufferView): void {
+    let payload: Uint8Array, binary: number;
+    if (typeof data === "string") {
+      payload = QRPCCoalescer.encoder.encode(data);
+      binary = 0;
+    } else if (data instanceof ArrayBuffer) {
+      payload = new Uint8Array(data);
+      binary = 1;
+    } else if (ArrayBuffer.isView(data)) {
+      payload = new Uint8Array(data.buffer, data.byteOffset, data.byteLength);
+      binary = 1;
+    } else {
+      throw new Error("unsupported data type for coalescing stream");
+    }
+    const header: number[] = [];
+    // length can exceed 32bit range of bitwise operators
+    let h = payload.byteLength * 2 + binary;
+    while (h >= 0x80) {
+      header.push((h % 0x80) | 0x80);
+      h = Math.floor(h / 0x80);
+    }
+    header.push(h);
+    const first = this.size === 0;
+    this.chunks.push(new Uint8Array(header), payload.slice());
+    this.size += header.length + payload.byteLength;
+    if (this.size >= QRPCCoalescer.FLUSH_SIZE) {
+      this.flush();
+    } else if (first) {
+      queueMicrotask(() => this.flush());
+    }
+  }
+
+  flush(): void {
+    if (this.size === 0 || this.stream.readyState !== "open") {
+      return;
+    }
+    const buffer = new Uint8Array(this.size);
+    let ofs = 0;
+    for (const c of this.chunks) {
+      buffer.set(c, ofs);
+      ofs += c.byteLength;
+    }
+    this.chunks = [];
+    this.size = 0;
+    this.send(buffer.buffer);
+  }
+
+  static decode(data: ArrayBuffer): (string | ArrayBuffer)[] {
+    const bytes = new Uint8Array(data);
+    const messages: (string | ArrayBuffer)[] = [];
+    let ofs = 0;
+    while (ofs < bytes.byteLength) {
+      let h = 0, mul = 1, b;
+      do {
+        if (ofs >= bytes.byteLength) {
+          throw new Error("truncated coalesced message header");
+        }
+        b = bytes[ofs++];
+        h += (b & 0x7f) * mul;
+        mul *= 0x80;
+      } while (b & 0x80);
+      const len = Math.floor(h / 2);
+      if (ofs + len > bytes.byteLength) {
+        throw new Error("truncated coalesced message");
+      }
+      const payload = bytes.subarray(ofs, ofs + len);
+      messages.push((h % 2) ? payload.slice().buffer : QRPCCoalescer.decoder.decode(payload));
+      ofs += len;
+    }
+    return messages;
+  }
+}
@@ -0,0 +1,191 @@
+// XOR parity over groups of messages, compatible with base::Stream::FEC_PROTOCOL.
+// each message is prefixed by flags, group id (uint16) and index in group. after every groupSize messages,
+// parity message (XOR of flags, uint32 length and payload of each message) follows, so that one lost
+// message of the group can be recovered. partial group is closed by parity after current task finishes.
+// stream must be unordered, because recovered message is delivered after later ones
+interface QRPCFecGroup {
+  received: Set<number>;
+  size: number;
+  parity: boolean;
+  done: boolean;
+  sum: Uint8Array;
+}
+
+export class QRPCFec {
+  static readonly PROTOCOL = "qrpc-fec";
+  static readonly DEFAULT_GROUP_SIZE = 4;
+  static readonly MAX_GROUP_SIZE = 64;
+  static readonly FLAG_PARITY = 0x01;
+  static readonly FLAG_BINARY = 0x02;
+  static readonly HEADER_SIZE = 4;
+  static readonly WINDOW = 64;
+
+  private readonly stream: RTCDataChannel;
+  private readonly send: (data: ArrayBuffer) => void;
+  private readonly groupSize: number;
+  private group: number = 0;
+  private index: number = 0;
+  private parity: Uint8Array = new Uint8Array(0);
+  private groups: Map<number, QRPCFecGroup> = new Map();
+  private latestGroup: number = 0;
+  private static readonly encoder = new TextEncoder();
+  private static readonly decoder = new TextDecoder();
+
+  constructor(stream: RTCDataChannel, groupSize: number) {
+    this.stream = stream;
+    const send = stream.send.bind(stream);
+    this.send = (data: ArrayBuffer) => send(data);
+    this.groupSize = groupSize;
+    stream.binaryType = "arraybuffer";
+  }
+
+  static protocol(groupSize?: number): string {
+    return `${QRPCFec.PROTOCOL}:${groupSize || QRPCFec.DEFAULT_GROUP_SIZE}`;
+  }
+
+  // returns group size if protocol contains valid fec, otherwise 0
+  static groupSize(protocol: string): number {
+    for (const e of protocol.split(",")) {
+      if (e === QRPCFec.PROTOCOL) {
+        return QRPCFec.DEFAULT_GROUP_SIZE;
+      } else if (e.startsWith(`${QRPCFec.PROTOCOL}:`)) {
+        const n = Number(e.substring(QRPCFec.PROTOCOL.length + 1));
+        return (Number.isInteger(n) && n >= 2 && n <= QRPCFec.MAX_GROUP_SIZE) ? n : 0;
+      }
+    }
+    return 0;
+  }
+
+  // XOR p into sum from ofs. returns sum, which is extended with zeros if p is longer
+  private static xor(sum: Uint8Array, ofs: number, p: Uint8Array): Uint8Array {
+    if (sum.byteLength < ofs + p.byteLength) {
+      const extended = new Uint8Array(ofs + p.byteLength);
+      extended.set(sum);
+      sum = extended;
+    }
+    for (let i = 0; i < p.byteLength; i++) {
+      sum[ofs + i] ^= p[i];
+    }
+    return sum;
+  }
+
+  private static accumulate(sum: Uint8Array, flags: number, p: Uint8Array): Uint8Array {
+    const header = new Uint8Array(5);
+    header[0] = flags;
+    new DataView(header.buffer).setUint32(1, p.byteLength);
+    return QRPCFec.xor(QRPCFec.xor(sum, 0, header), 5, p);
+  }
+
+  private frame(flags: number, index: number, payload: Uint8Array): ArrayBuffer {
+    const buffer = new Uint8Array(QRPCFec.HEADER_SIZE + payload.byteLength);
+    buffer[0] = flags;
+    new DataView(buffer.buffer).setUint16(1, this.group);
+    buffer[3] = index;
+    buffer.set(payload, QRPCFec.HEADER_SIZE);
+    return buffer.buffer;
+  }
+
+  push(data: string | ArrayBuffer | ArrayBufferView): void {
+    let payload: Uint8Array, flags: number;
+    if (typeof data === "string") {
+      payload = QRPCFec.encoder.encode(data);
+      flags = 0;
+    } else if (data instanceof ArrayBuffer) {
+      payload = new Uint8Array(data);
+      flags = QRPCFec.FLAG_BINARY;
+    } else if (ArrayBuffer.isView(data)) {
+      payload = new Uint8Array(data.buffer, data.byteOffset, data.byteLength);
+      flags = QRPCFec.FLAG_BINARY;
+    } else {
+      throw new Error("unsupported data type for fec stream");
+    }
+    this.send(this.frame(flags, this.index, payload));
+    this.parity = QRPCFec.accumulate(this.parity, flags, payload);
+    if (++this.index >= this.groupSize) {
+      this.flush();
+    } else if (this.index === 1) {
+      queueMicrotask(() => this.flush());
+    }
+  }
+
+  // sends parity of current group, even if it is not filled. index of parity is actual size of the group
+  flush(): void {
+    if (this.index === 0 || this.stream.readyState !== "open") {
+      return;
+    }
+    this.send(this.frame(QRPCFec.FLAG_PARITY, this.index, this.parity));
+    this.parity = new Uint8Array(0);
+    this.index = 0;
+    this.group = (this.group + 1) & 0xffff;
+  }
+
+  // returns received message and recovered one (if any)
+  decode(data: ArrayBuffer): (string | ArrayBuffer)[] {
+    const bytes = new Uint8Array(data);
+    if (bytes.byteLength < QRPCFec.HEADER_SIZE) {
+      throw new Error("truncated fec message header");
+    }
+    const flags = bytes[0];
+    const gid = new DataView(data).getUint16(1);
+    const index = bytes[3];
+    const payload = bytes.subarray(QRPCFec.HEADER_SIZE);
+    const diff = (gid - this.latestGroup) & 0xffff;
+    if (diff > 0 && diff < 0x8000) {
+      this.latestGroup = gid;
+      for (const id of this.groups.keys()) {
+        if (((this.latestGroup - id) & 0xffff) >= QRPCFec.WINDOW) {
+          this.groups.delete(id);
+        }
+      }
+    } else if (((this.latestGroup - gid) & 0xffff) >= QRPCFec.WINDOW) {
+      // cannot tell whether the message is already recovered. it should be stale anyway
+      return [];
+    }
+    let g = this.groups.get(gid);
+    if (!g) {
+      g = { received: new Set(), size: 0, parity: false, done: false, sum: new Uint8Array(0) };
+      this.groups.set(gid, g);
+    }
+    if (g.done) {
+      return [];
+    }
+    const messages: (string | ArrayBuffer)[] = [];
+    if (flags & QRPCFec.FLAG_PARITY) {
+      if (index === 0 || index > QRPCFec.MAX_GROUP_SIZE) {
+        throw new Error(`invalid fec group size ${index}`);
+      } else if (g.parity) {
+        return [];
+      }
+      g.parity = true;
+      g.size = index;
+      g.sum = QRPCFec.xor(g.sum, 0, payload);
+    } else {
+      if (g.received.has(index)) {
+        return [];
+      }
+      g.received.add(index);
+      g.sum = QRPCFec.accumulate(g.sum, flags, payload);
+      messages.push(QRPCFec.message(flags, payload));
+    }
+    if (!g.parity || g.received.size + 1 < g.size) {
+      return messages;
+    }
+    g.done = true;
+    const sum = g.sum;
+    g.sum = new Uint8Array(0);
+    if (g.received.size >= g.size) {
+      return messages;
+    }
+    // exactly one message of the group is lost. sum is now flags, length and payload of it
+    const len = sum.byteLength >= 5 ? new DataView(sum.buffer, sum.byteOffset).getUint32(1) : 0;
+    if (sum.byteLength < 5 || len > sum.byteLength - 5) {
+      throw new Error(`fail to recover fec message of group ${gid}`);
+    }
+    messages.push(QRPCFec.message(sum[0], sum.subarray(5, 5 + len)));
+    return messages;
+  }
+
+  private static message(flags: number, payload: Uint8Array): string | ArrayBuffer {
+    return (flags & QRPCFec.FLAG_BINARY) ? payload.slice().buffer : QRPCFec.decoder.decode(payload);
+  }
+}
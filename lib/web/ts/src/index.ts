@@ -3,9 +3,13 @@
 export { QRPClient } from './client.js';
 export { QRPCTrack } from './track.js';
 export { QRPCMedia } from './media.js';
+export { QRPCCoalescer } from './coalesce.js';
+export { QRPCZstd, QRPCZstdDecoder } from './zstd.js';
+export { QRPCFec } from './fec.js';
 export { 
   QRPCStreamHandler, 
   QRPCStreamParams,
+  QRPCStreamSchedule,
   QRPCMediaInitOptions,
   QRPCMediaSenderHandler,
   QRPCMediaSenderParams,
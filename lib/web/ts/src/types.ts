@@ -47,8 +47,27 @@ export interface QRPCStreamHandler {
   onmessage: (stream: RTCDataChannel, event: MessageEvent) => MayAwaitable<void>;
 }
 
+// scheduling of messages sent by server on the stream. streams with higher priority are sent first
+// (256 is normal), and streams with same priority share bandwidth in proportion to weight
+export interface QRPCStreamSchedule {
+  priority?: number;
+  weight?: number;
+}
+
+// ordered: false with maxRetransmits (0 means never retransmitted) or maxPacketLifeTime (msec)
+// makes the stream partially reliable, for data which becomes stale soon (eg. game state, telemetry)
 export type QRPCStreamParams = QRPCStreamHandler & RTCDataChannelInit & {
   publish?: boolean;
+  schedule?: QRPCStreamSchedule;
+  // pack small messages sent in the same task into one data channel message. both sides see
+  // each message as usual. useful for streams which send many tiny updates at once
+  coalesce?: boolean;
+  // messages from server are compressed with zstd, optionally with dictionary registered to server
+  // by ConnectionFactory::RegisterZstdDictionary. QRPClient.zstd should be set to decompress them
+  compress?: boolean | { dictionary: number };
+  // send parity after every groupSize messages (4 by default), so that one lost message per group is
+  // recovered without retransmission. for unordered (ordered: false) and partially reliable streams
+  fec?: boolean | { groupSize: number };
 }
 
 export interface QRPCSyscallArgs {
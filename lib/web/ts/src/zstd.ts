@@ -0,0 +1,70 @@
+// framing of streams compressed with zstd, compatible with base::Stream::ZSTD_PROTOCOL.
+// each message is prefixed by 1 byte flags. messages from client are sent without compression,
+// messages from server are decompressed by QRPCZstdDecoder supplied by application
+export interface QRPCZstdDecoder {
+  // should return synchronously, so that order of messages is kept
+  decompress(data: Uint8Array, dictionary?: Uint8Array): Uint8Array;
+}
+
+export class QRPCZstd {
+  static readonly PROTOCOL = "qrpc-zstd";
+  static readonly FLAG_COMPRESSED = 0x01;
+  static readonly FLAG_BINARY = 0x02;
+
+  private static readonly encoder = new TextEncoder();
+  private static readonly decoder = new TextDecoder();
+
+  static protocol(dictionary?: number): string {
+    return dictionary ? `${QRPCZstd.PROTOCOL}:${dictionary}` : QRPCZstd.PROTOCOL;
+  }
+
+  // returns dictionary id (0 for no dictionary) if protocol contains zstd, otherwise null
+  static dictionaryId(protocol: string): number | null {
+    for (const e of protocol.split(",")) {
+      if (e === QRPCZstd.PROTOCOL) {
+        return 0;
+      } else if (e.startsWith(`${QRPCZstd.PROTOCOL}:`)) {
+        return Number(e.substring(QRPCZstd.PROTOCOL.length + 1));
+      }
+    }
+    return null;
+  }
+
+  static encode(data: string | ArrayBuffer | ArrayBufferView): ArrayBuffer {
+    let payload: Uint8Array, flags: number;
+    if (typeof data === "string") {
+      payload = QRPCZstd.encoder.encode(data);
+      flags = 0;
+    } else if (data instanceof ArrayBuffer) {
+      payload = new Uint8Array(data);
+      flags = QRPCZstd.FLAG_BINARY;
+    } else if (ArrayBuffer.isView(data)) {
+      payload = new Uint8Array(data.buffer, data.byteOffset, data.byteLength);
+      flags = QRPCZstd.FLAG_BINARY;
+    } else {
+      throw new Error("unsupported data type for zstd stream");
+    }
+    const buffer = new Uint8Array(payload.byteLength + 1);
+    buffer[0] = flags;
+    buffer.set(payload, 1);
+    return buffer.buffer;
+  }
+
+  // raw returns ArrayBuffer regardless of binary flag (used for coalesced messages)
+  static decode(
+    data: ArrayBuffer, decoder?: QRPCZstdDecoder, dictionary?: Uint8Array, raw?: boolean
+  ): string | ArrayBuffer {
+    const bytes = new Uint8Array(data);
+    if (bytes.byteLength < 1) {
+      throw new Error("empty zstd stream message");
+    }
+    let payload = bytes.subarray(1);
+    if (bytes[0] & QRPCZstd.FLAG_COMPRESSED) {
+      if (!decoder) {
+        throw new Error("compressed message received, but no zstd decoder is set to QRPClient.zstd");
+      }
+      payload = decoder.decompress(payload, dictionary);
+    }
+    return (raw || (bytes[0] & QRPCZstd.FLAG_BINARY)) ? payload.slice().buffer : QRPCZstd.decoder.decode(payload);
+  }
+}